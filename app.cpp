@@ -8,6 +8,8 @@
 #include <shlobj.h>
 #include <Shlwapi.h>
 #include <gdiplus.h>
+#include <wincodec.h>
+#include <d2d1_3.h>
 #include <string>
 #include <vector>
 #include <thread>
@@ -17,26 +19,92 @@
 #include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <coroutine>
+#include <functional>
+#include <deque>
+#include <condition_variable>
+#include <algorithm>
+#include <memory_resource>
+#include <string_view>
+#include <array>
+#include <bit>
+#include <intrin.h>
 #include <resource.h>
+#include "usage.h"
+#include "thread_pool.h"
+#include "job.h"
+#include "completion_queue.h"
+#include "scoped_arena.h"
+#include "layout.h"
+#include "pixel_kernels.h"
+#include "png_filter.h"
+#include "color_lut.h"
+#include "loupe_tiles.h"
+#include "stats_text.h"
 
 #pragma comment(lib, "gdiplus.lib")
 #pragma comment(lib, "comctl32.lib")
 #pragma comment(lib, "shell32.lib")
 #pragma comment(lib, "ole32.lib")
 #pragma comment(lib, "Shlwapi.lib")
+#pragma comment(lib, "windowscodecs.lib")
+#pragma comment(lib, "d2d1.lib")
 
 using namespace Gdiplus;
 namespace fs = std::filesystem;
 
+// What the panel shows of an image: the oriented image scaled to
+// width x height, of which the clipW x clipH rect at (clipX, clipY) is visible.
+struct DisplayTarget
+{
+	UINT width = 0;
+	UINT height = 0;
+	INT clipX = 0;
+	INT clipY = 0;
+	UINT clipW = 0;
+	UINT clipH = 0;
+	bool linearLight = false;
+	bool sharpen = false;
+	ToneAdjust tone;
+
+	bool operator==(const DisplayTarget&) const = default;
+};
+
+struct SvgImage;
+struct Animation;
+struct TilePyramid;
+
+// A cache entry is immutable once published; updates publish a new entry.
 struct CacheInfo
 {
-	CacheInfo(const std::shared_ptr<Bitmap>& bmp, const FILETIME& fileTime)
-	{
-		bitmap = bmp;
-		lastWriteTime = fileTime;
-	}
-	std::shared_ptr<Bitmap> bitmap;
-	FILETIME lastWriteTime;
+	std::shared_ptr<Bitmap> bitmap;          // what gets drawn (null if decoding failed)
+	std::shared_ptr<PixelBuffer> pixels;     // backing store of bitmap (for 16-bit, its source; for animations, the first frame)
+	std::shared_ptr<Bitmap> scaled;          // visible part, oriented and scaled for the panel, or null
+	std::shared_ptr<PixelBuffer> scaledPixels;
+	DisplayTarget scaledFor;                 // what scaled was rendered for
+	FILETIME lastWriteTime = {};
+	ULONGLONG fileSize = 0;
+	std::wstring created = L"-";
+	std::wstring modified = L"-";
+	GUID rawFormat = {};
+	std::wstring type = L"-";
+	std::wstring exifDate = L"-";
+	UINT width = 0;
+	UINT height = 0;
+	UINT bpp = 0;
+	UINT frameCount = 1;
+	int orientation = 1;
+	UINT cropGridW = 1;                      // crop origins snap to this grid in stored pixels;
+	UINT cropGridH = 1;                      // the MCU size for JPEGs that crop losslessly
+	std::shared_ptr<const ColorLut> colorLut; // to the display's colors, null if none needed
+	std::shared_ptr<const std::vector<BYTE>> icc; // embedded profile colorLut comes from, null if none
+	std::shared_ptr<const SvgImage> svg;     // vector source, drawn afresh for each display target
+	std::shared_ptr<const Animation> animation; // frames played over pixels, null for still images
+	std::shared_ptr<const TilePyramid> pyramid; // tiles on disk instead of pixels, for very large images seen before
+	bool preview = false;                    // pixels are a reduced decode, shown until the full one lands
+	double decodeMs = 0;                     // what this entry cost, for the stats overlay
+	double scaleMs = 0;
+	double sharpenMs = 0;
 };
 
 static ULONG_PTR g_gdiplusToken;
@@ -44,26 +112,38 @@ static HWND g_hMain = nullptr;
 static HWND g_hNext, g_hPrev, g_hOpenPS, g_hOpenPN, g_hShowInExplorer, g_hToggle100, g_hToggleRec, g_hRotate, g_hCopy, g_hDelete, g_hInfo;
 static HWND g_hPanel;
 static HWND g_hChangeRoot = nullptr;
+static HWND g_hSlider = nullptr; // position in the list
 static HINSTANCE g_hInst;
 static wchar_t g_rootPath[MAX_PATH] = { 0 };
 static std::atomic<bool> g_recursive{ false };
 static std::vector<fs::path> g_files;
 static std::mutex g_filesMutex;
 static std::atomic<int> g_index{ 0 };
-static std::map<std::wstring, std::shared_ptr<CacheInfo>> g_cache;
+static std::map<std::wstring, std::shared_ptr<CacheInfo>, std::less<>> g_cache;
 static std::mutex g_cacheMutex;
 static std::atomic<DWORD> g_zoom{ 2 };
-static std::atomic<bool> g_loading{ false };
-static std::atomic<bool> g_stopThreads{ false };
-static int g_frameIndex = 0;
+static std::atomic<bool> g_linearLight{ false }; // resample in linear light
+static ToneAdjust g_tone;                          // for 16-bit images
+static bool g_sharpen = false;                     // unsharp mask after downscaling
+static bool g_showStats = false;
+static std::atomic<int> g_panelW{ 0 }; // physical pixels
+static std::atomic<int> g_panelH{ 0 };
+static UINT g_dpi = 96;                 // of the monitor the window is on
+static HFONT g_uiFont = nullptr;
+static const UINT WM_APP_PIPELINE = WM_APP + 1;
 static bool g_isInitialized = false;
 
+// 96-DPI layout units to physical pixels
+static int Px(int v) { return MulDiv(v, (int)g_dpi, 96); }
+
 // helpers
 static inline bool has_ext(const fs::path& p)
 {
 	auto e = p.extension().wstring();
 	for (auto& c : e) c = towlower(c);
-	return e == L".jpg" || e == L".jpeg" || e == L".png" || e == L".bmp" || e == L".ico" || e == L".gif";
+	return e == L".jpg" || e == L".jpeg" || e == L".png" || e == L".bmp" || e == L".ico" || e == L".gif" ||
+		e == L".webp" || e == L".avif" || e == L".jxl" || // through WIC, see DecodeWithWic
+		e == L".svg";
 }
 
 static CLSID GetEncoderClsid(const WCHAR* format)
@@ -88,6 +168,15 @@ static CLSID GetEncoderClsid(const WCHAR* format)
 	return CLSID();
 }
 
+// encoder for writing a file back in the format it was read in
+static CLSID EncoderForRawFormat(const GUID& rf)
+{
+	if (rf == ImageFormatPNG) return GetEncoderClsid(L"image/png");
+	if (rf == ImageFormatBMP) return GetEncoderClsid(L"image/bmp");
+	if (rf == ImageFormatGIF) return GetEncoderClsid(L"image/gif");
+	return GetEncoderClsid(L"image/jpeg");
+}
+
 static std::wstring RawFormatToType(const GUID& g)
 {
 	// commonly-used GUIDs
@@ -99,61 +188,118 @@ static std::wstring RawFormatToType(const GUID& g)
 	return L"Unknown";
 }
 
-static void EnumFiles()
+static std::vector<fs::path> ListImages(const fs::path& dir, bool recursive)
 {
+	UsageScope usage(Subsystem::Scan);
 	std::vector<fs::path> files;
 	try
 	{
-		if (g_recursive)
+		if (recursive)
 		{
-			for (auto& p : fs::recursive_directory_iterator(g_rootPath, fs::directory_options::skip_permission_denied))
+			for (auto& p : fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied))
 			{
 				if (p.is_regular_file() && has_ext(p.path())) files.push_back(p.path());
 			}
 		}
 		else
 		{
-			for (auto& p : fs::directory_iterator(g_rootPath))
+			for (auto& p : fs::directory_iterator(dir))
 			{
 				if (p.is_regular_file() && has_ext(p.path())) files.push_back(p.path());
 			}
 		}
 	}
 	catch (...) {}
+	return files;
+}
+
+// Change notification for a listed folder; the wait callback queues a rescan.
+struct FolderWatch
+{
+	~FolderWatch()
+	{
+		if (wait) UnregisterWaitEx(wait, INVALID_HANDLE_VALUE); // waits for a running callback
+		if (change != INVALID_HANDLE_VALUE) FindCloseChangeNotification(change);
+	}
+
+	fs::path dir;
+	HANDLE change = INVALID_HANDLE_VALUE;
+	HANDLE wait = nullptr;
+	std::atomic<bool> queued{ false }; // a rescan is pending
+};
+
+// Non-recursive listings of the root and the folders next to it, kept
+// current in the background (see ScanSiblingFolders).
+struct FolderListing
+{
+	std::vector<fs::path> files;
+	std::unique_ptr<FolderWatch> watch;
+};
+
+static std::map<std::wstring, FolderListing, std::less<>> g_folders; // by FolderKey
+static std::vector<fs::path> g_siblings; // every folder next to the root, sorted, root included
+static std::mutex g_foldersMutex;
+
+// folders compare case-insensitively and without a trailing separator
+static std::wstring FolderKey(const fs::path& dir)
+{
+	std::wstring k = dir.lexically_normal().wstring();
+	while (k.size() > 3 && (k.back() == L'\\' || k.back() == L'/')) k.pop_back();
+	CharLowerBuffW(k.data(), (DWORD)k.size());
+	return k;
+}
+
+// warm: take the root's background listing if there is one, e.g. when
+// switching folders; after edits made here the folder is read again.
+static void EnumFiles(bool warm = false)
+{
+	std::vector<fs::path> files;
+	bool listed = false;
+	if (warm && !g_recursive)
+	{
+		std::lock_guard<std::mutex> lk(g_foldersMutex);
+		auto it = g_folders.find(FolderKey(g_rootPath));
+		if (it != g_folders.end())
+		{
+			files = it->second.files;
+			listed = true;
+		}
+	}
+	if (!listed) files = ListImages(g_rootPath, g_recursive);
 	std::lock_guard<std::mutex> lk(g_filesMutex);
 	g_files = move(files);
 	if (g_files.empty()) g_index = 0;
 	else if (g_index >= (int)g_files.size()) g_index = 0;
 }
 
-static std::wstring GetPropertyString(Bitmap* img, PROPID id)
+static std::wstring GetPropertyString(Bitmap* img, PROPID id, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
 {
 	// returns raw property item as string or "-" if not present
 	UINT len = img->GetPropertyItemSize(id);
 	if (!len) return L"-";
-	std::vector<BYTE> buf(len);
+	std::pmr::vector<BYTE> buf(len, mr);
 	PropertyItem* pi = (PropertyItem*)buf.data();
 	img->GetPropertyItem(id, len, pi);
 	// handle some common types (ascii)
 	if (pi->type == PropertyTagTypeASCII)
 	{
-		std::string s((char*)pi->value, pi->length);
-		// convert
-		int sz = MultiByteToWideChar(CP_ACP, 0, s.c_str(), -1, nullptr, 0);
+		// convert straight from the property, without the trailing \0
+		const char* s = (const char*)pi->value;
+		int n = (int)strnlen(s, pi->length);
+		if (!n) return L"-";
+		int sz = MultiByteToWideChar(CP_ACP, 0, s, n, nullptr, 0);
 		std::wstring ws(sz, 0);
-		MultiByteToWideChar(CP_ACP, 0, s.c_str(), -1, &ws[0], sz);
-		// remove trailing \0 extra
-		if (!ws.empty() && ws.back() == '\0') ws.pop_back();
+		MultiByteToWideChar(CP_ACP, 0, s, n, &ws[0], sz);
 		return ws.empty() ? L"-" : ws;
 	}
 	return L"-";
 }
 
-static int GetExifOrientation(Bitmap* img)
+static int GetExifOrientation(Bitmap* img, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
 {
 	UINT len = img->GetPropertyItemSize(PropertyTagOrientation);
 	if (!len) return 1;
-	std::vector<BYTE> buf(len);
+	std::pmr::vector<BYTE> buf(len, mr);
 	PropertyItem* pi = (PropertyItem*)buf.data();
 	if (img->GetPropertyItem(PropertyTagOrientation, len, pi) != Ok) return 1;
 	if (pi->type == PropertyTagTypeShort)
@@ -163,41 +309,38 @@ static int GetExifOrientation(Bitmap* img)
 	return 1;
 }
 
-static void SetExifOrientation(const std::wstring& file, int val)
+// the embedded ICC profile, empty if there is none
+static std::vector<BYTE> GetIccProfile(Bitmap* img, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
 {
-	// load image, set orientation property item and save to temp then replace file
-	Bitmap* img = Bitmap::FromFile(file.c_str(), FALSE);
-	if (!img) return;
-	UINT len = img->GetPropertyItemSize(PropertyTagOrientation);
-	PropertyItem* pi = nullptr;
-	if (len)
-	{
-		std::vector<BYTE> buf(len);
-		pi = (PropertyItem*)buf.data();
-		img->GetPropertyItem(PropertyTagOrientation, len, pi);
-		// modify
-		if (pi->type == PropertyTagTypeShort)
-		{
-			*((WORD*)pi->value) = (WORD)val;
-			// save into temp
-			CLSID cls = GetEncoderClsid(L"image/jpeg");
-			std::wstring tmp = file + L".tmp_exif";
-			Status s = img->Save(tmp.c_str(), &cls, nullptr);
-			if (s == Ok)
-			{
-				MoveFileExW(tmp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING);
-			}
-		}
-	}
-	delete img;
+	UINT len = img->GetPropertyItemSize(PropertyTagICCProfile);
+	if (!len) return {};
+	std::pmr::vector<BYTE> buf(len, mr);
+	PropertyItem* pi = (PropertyItem*)buf.data();
+	if (img->GetPropertyItem(PropertyTagICCProfile, len, pi) != Ok) return {};
+	const BYTE* p = (const BYTE*)pi->value;
+	return std::vector<BYTE>(p, p + pi->length);
 }
 
-static std::shared_ptr<Bitmap> AssignNewBitmap(const std::wstring& p)
+static std::vector<BYTE> ReadFileBytes(const std::wstring& p)
 {
-	// read file into buffer
 	std::ifstream f(p, std::ios::binary);
-	if (!f) return nullptr;
-	std::vector<BYTE> buf((std::istreambuf_iterator<char>(f)), {});
+	if (!f) return {};
+	std::vector<BYTE> bytes((std::istreambuf_iterator<char>(f)), {});
+	ChargeRead(bytes.size());
+	return bytes;
+}
+
+static bool WriteFileBytes(const std::wstring& p, const std::vector<BYTE>& bytes)
+{
+	std::ofstream f(p, std::ios::binary | std::ios::trunc);
+	f.write((const char*)bytes.data(), bytes.size());
+	f.close();
+	if (!f.fail()) ChargeWrite(bytes.size());
+	return !f.fail();
+}
+
+static std::shared_ptr<Bitmap> CreateBitmapFromBytes(const std::vector<BYTE>& buf)
+{
 	if (buf.empty()) return nullptr;
 
 	// make HGLOBAL from buffer
@@ -221,197 +364,4651 @@ static std::shared_ptr<Bitmap> AssignNewBitmap(const std::wstring& p)
 	if (bmp->GetLastStatus() != Gdiplus::Ok) {
 		return nullptr;
 	}
+	return bmp;
+}
 
-	if (bmp && bmp->GetLastStatus() == Ok)
+// loads without keeping the file locked, so it can be replaced while displayed
+static std::shared_ptr<Bitmap> LoadBitmapFile(const std::wstring& p)
+{
+	return CreateBitmapFromBytes(ReadFileBytes(p));
+}
+
+// EXIF and the other metadata GDI+ exposes as property items
+static void CopyPropertyItems(Bitmap& from, Bitmap& to)
+{
+	UINT size = 0, count = 0;
+	from.GetPropertySize(&size, &count);
+	std::vector<BYTE> buf(size);
+	PropertyItem* items = (PropertyItem*)buf.data();
+	if (count && from.GetAllPropertyItems(size, count, items) == Ok)
 	{
-		WIN32_FILE_ATTRIBUTE_DATA fad;
-		GetFileAttributesExW(p.c_str(), GetFileExInfoStandard, &fad);
+		for (UINT i = 0; i < count; ++i) to.SetPropertyItem(&items[i]);
+	}
+}
 
-		// We assume cache is locked here!!
-		g_cache[p] = std::shared_ptr<CacheInfo>(new CacheInfo(bmp, fad.ftLastWriteTime));
-		return bmp;
+static std::shared_ptr<Bitmap> WrapPixels(const std::shared_ptr<PixelBuffer>& px)
+{
+	auto bmp = std::make_shared<Bitmap>((INT)px->width, (INT)px->height, (INT)px->stride, px->format, px->data.data());
+	if (!px->palette.empty())
+	{
+		std::vector<BYTE> buf(sizeof(ColorPalette) + px->palette.size() * sizeof(ARGB));
+		ColorPalette* pal = (ColorPalette*)buf.data();
+		pal->Flags = 0;
+		pal->Count = (UINT)px->palette.size();
+		std::copy(px->palette.begin(), px->palette.end(), pal->Entries);
+		bmp->SetPalette(pal);
 	}
-	return nullptr;
+	return bmp;
 }
 
-static std::shared_ptr<Bitmap> GetBitmapAt(int idx)
+// Process-wide WIC factory, created on first use. Only used on pool workers,
+// which live in the multithreaded apartment.
+static IWICImagingFactory* WicFactory()
 {
-	std::wstring p;
+	static IWICImagingFactory* factory = []()
 	{
-		std::lock_guard<std::mutex> lk(g_filesMutex);
-		if (g_files.empty()) return nullptr;
+		IWICImagingFactory* f = nullptr;
+		CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&f));
+		return f;
+	}();
+	return factory;
+}
 
-		int n = (int)g_files.size();
-		idx = (idx % n + n) % n;
-		p = g_files[idx].wstring();
+// WIC decoder reading straight from buf, which must outlive it; null on failure
+static IWICBitmapDecoder* CreateWicDecoder(const std::vector<BYTE>& buf)
+{
+	IWICImagingFactory* factory = WicFactory();
+	if (!factory || buf.empty()) return nullptr;
+	IWICStream* stream = nullptr;
+	IWICBitmapDecoder* decoder = nullptr;
+	if (SUCCEEDED(factory->CreateStream(&stream)) &&
+		SUCCEEDED(stream->InitializeFromMemory((BYTE*)buf.data(), (DWORD)buf.size())))
+	{
+		factory->CreateDecoderFromStream(stream, nullptr, WICDecodeMetadataCacheOnDemand, &decoder);
+	}
+	if (stream) stream->Release(); // decoder keeps its own ref
+	return decoder;
+}
+
+// the frame's embedded ICC profile, empty if none
+static std::vector<BYTE> GetWicIcc(IWICBitmapFrameDecode* frame)
+{
+	std::vector<BYTE> icc;
+	IWICColorContext* cc = nullptr;
+	UINT count = 0, size = 0;
+	WICColorContextType type;
+	if (SUCCEEDED(WicFactory()->CreateColorContext(&cc)) && SUCCEEDED(frame->GetColorContexts(1, &cc, &count)) && count &&
+		SUCCEEDED(cc->GetType(&type)) && type == WICColorContextProfile && SUCCEEDED(cc->GetProfileBytes(0, nullptr, &size)) && size)
+	{
+		icc.resize(size);
+		if (FAILED(cc->GetProfileBytes(size, icc.data(), &size))) icc.clear();
 	}
+	if (cc) cc->Release();
+	return icc;
+}
 
+static int GetWicOrientation(IWICBitmapFrameDecode* frame)
+{
+	IWICMetadataQueryReader* reader = nullptr;
+	if (FAILED(frame->GetMetadataQueryReader(&reader))) return 1;
+	int orient = 1;
+	for (const wchar_t* query : { L"/app1/ifd/{ushort=274}", L"/ifd/{ushort=274}" })
 	{
-		std::lock_guard<std::mutex> clk(g_cacheMutex);
-		auto it = g_cache.find(p);
-		if (it != g_cache.end()) return it->second->bitmap;
+		PROPVARIANT v;
+		PropVariantInit(&v);
+		if (SUCCEEDED(reader->GetMetadataByName(query, &v)) && v.vt == VT_UI2 && v.uiVal >= 1 && v.uiVal <= 8) orient = v.uiVal;
+		PropVariantClear(&v);
+		if (orient != 1) break;
 	}
+	reader->Release();
+	return orient;
+}
 
-	// not cached, load synchronously here (used rarely)
-	std::lock_guard<std::mutex> clk(g_cacheMutex);
-	return AssignNewBitmap(p);
+// 16-bit PNGs, which GDI+ truncates to 8 bits, decoded by WIC into 16-bit RGBA
+// (PixelFormat64bppARGB) with the file's own levels. Null for anything else;
+// bpp is what the file stores.
+static std::shared_ptr<PixelBuffer> DecodeDeepPng(const std::vector<BYTE>& bytes, UINT& bpp)
+{
+	static const BYTE sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	if (bytes.size() < 33 || memcmp(bytes.data(), sig, 8) || bytes[24] != 16) return nullptr;
+	static const UINT channels[7] = { 1, 0, 3, 0, 2, 0, 4 }; // by color type
+	BYTE colorType = bytes[25];
+	if (colorType > 6 || !channels[colorType]) return nullptr;
+
+	IWICBitmapDecoder* decoder = CreateWicDecoder(bytes);
+	if (!decoder) return nullptr;
+	std::shared_ptr<PixelBuffer> px;
+	IWICBitmapFrameDecode* frame = nullptr;
+	IWICFormatConverter* converter = nullptr;
+	UINT w = 0, h = 0;
+	if (SUCCEEDED(decoder->GetFrame(0, &frame)) && SUCCEEDED(frame->GetSize(&w, &h)) && w && h &&
+		SUCCEEDED(WicFactory()->CreateFormatConverter(&converter)) &&
+		SUCCEEDED(converter->Initialize(frame, GUID_WICPixelFormat64bppRGBA, WICBitmapDitherTypeNone, nullptr, 0, WICBitmapPaletteTypeCustom)))
+	{
+		px = std::make_shared<PixelBuffer>(w, h, PixelFormat64bppARGB);
+		if (FAILED(converter->CopyPixels(nullptr, px->stride, (UINT)px->data.size(), px->data.data()))) px.reset();
+	}
+	if (converter) converter->Release();
+	if (frame) frame->Release();
+	decoder->Release();
+	bpp = channels[colorType] * 16;
+	return px;
 }
 
-static void PreloadAround(int idx)
+static std::wstring FileTimeToString(const FILETIME& ft)
 {
-	std::lock_guard<std::mutex> lk(g_cacheMutex);
-	if (g_files.empty()) return;
+	SYSTEMTIME st = { 0 };
+	FileTimeToSystemTime(&ft, &st);
+	wchar_t buf[64];
+	swprintf(buf, 64, L"%04d-%02d-%02d %02d:%02d:%02d", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+	return buf;
+}
+
+static bool JpegMcuSize(const std::vector<BYTE>& bytes, UINT& mcuW, UINT& mcuH);
+static std::shared_ptr<const ColorLut> DisplayColorLut(const std::vector<BYTE>& icc);
+
+static void SetColorProfile(CacheInfo& info, std::vector<BYTE> icc)
+{
+	info.colorLut = DisplayColorLut(icc);
+	if (!icc.empty()) info.icc = std::make_shared<const std::vector<BYTE>>(std::move(icc));
+}
+static std::shared_ptr<Bitmap> BitmapForPixels(const std::shared_ptr<PixelBuffer>& px);
+static void DecodeSvg(const std::vector<BYTE>& bytes, CacheInfo& info);
+static bool DecodeAnimation(const std::vector<BYTE>& bytes, CacheInfo& info);
+
+// which decode subsystem a file's pixels are charged to, by its signature
+static Subsystem DecodeSubsystemFor(const std::vector<BYTE>& b)
+{
+	if (b.size() >= 3 && b[0] == 0xFF && b[1] == 0xD8 && b[2] == 0xFF) return Subsystem::DecodeJpeg;
+	if (b.size() >= 8 && !memcmp(b.data(), "\x89PNG\r\n\x1a\n", 8)) return Subsystem::DecodePng;
+	if (b.size() >= 4 && !memcmp(b.data(), "GIF8", 4)) return Subsystem::DecodeGif;
+	if (b.size() >= 2 && b[0] == 'B' && b[1] == 'M') return Subsystem::DecodeBmp;
+	if (b.size() >= 12 && !memcmp(b.data(), "RIFF", 4) && !memcmp(b.data() + 8, "WEBP", 4)) return Subsystem::DecodeWebp;
+	if (b.size() >= 12 && !memcmp(b.data() + 4, "ftypavi", 7)) return Subsystem::DecodeAvif; // avif or avis
+	if ((b.size() >= 2 && b[0] == 0xFF && b[1] == 0x0A) || (b.size() >= 12 && !memcmp(b.data(), "\0\0\0\x0CJXL \r\n\x87\n", 12))) return Subsystem::DecodeJxl;
+	if (std::string_view((const char*)b.data(), (std::min)(b.size(), (size_t)4096)).find("<svg") != std::string_view::npos) return Subsystem::DecodeSvg;
+	return Subsystem::DecodeOther;
+}
+
+// WebP, AVIF and JPEG XL, which GDI+ cannot read, through the WIC codecs that
+// come with Windows or its Store extensions. Fills in info with the first
+// frame as premultiplied BGRA; info->bitmap stays null if no codec is installed.
+static void DecodeWithWic(const std::vector<BYTE>& bytes, CacheInfo& info)
+{
+	static const wchar_t* const types[] = { L"WebP", L"AVIF", L"JPEG XL" };
+	Subsystem sub = DecodeSubsystemFor(bytes);
+	if (sub >= Subsystem::DecodeWebp && sub <= Subsystem::DecodeJxl) info.type = types[(int)sub - (int)Subsystem::DecodeWebp];
+
+	IWICBitmapDecoder* decoder = CreateWicDecoder(bytes);
+	if (!decoder) return;
+	IWICBitmapFrameDecode* frame = nullptr;
+	IWICFormatConverter* converter = nullptr;
+	UINT w = 0, h = 0;
+	if (SUCCEEDED(decoder->GetFrame(0, &frame)) && SUCCEEDED(frame->GetSize(&w, &h)) && w && h)
+	{
+		info.width = w;
+		info.height = h;
+		info.orientation = GetWicOrientation(frame);
+
+		// bits per pixel as stored
+		WICPixelFormatGUID pf = {};
+		IWICComponentInfo* ci = nullptr;
+		IWICPixelFormatInfo* pfi = nullptr;
+		if (SUCCEEDED(frame->GetPixelFormat(&pf)) && SUCCEEDED(WicFactory()->CreateComponentInfo(pf, &ci)) && SUCCEEDED(ci->QueryInterface(IID_PPV_ARGS(&pfi))))
+			pfi->GetBitsPerPixel(&info.bpp);
+		if (pfi) pfi->Release();
+		if (ci) ci->Release();
+
+		SetColorProfile(info, GetWicIcc(frame));
+
+		if (SUCCEEDED(WicFactory()->CreateFormatConverter(&converter)) &&
+			SUCCEEDED(converter->Initialize(frame, GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, nullptr, 0, WICBitmapPaletteTypeCustom)))
+		{
+			auto px = std::make_shared<PixelBuffer>(w, h);
+			if (SUCCEEDED(converter->CopyPixels(nullptr, px->stride, (UINT)px->data.size(), px->data.data())))
+			{
+				info.pixels = px;
+				info.bitmap = BitmapForPixels(px);
+				ChargePixels((uint64_t)w * h);
+			}
+		}
+	}
+	if (converter) converter->Release();
+	if (frame) frame->Release();
+	decoder->Release();
+}
+
+// Runs on a worker: decodes fully so the UI thread never pays for it.
+static std::shared_ptr<CacheInfo> DecodeImage(const std::vector<BYTE>& bytes, const WIN32_FILE_ATTRIBUTE_DATA& fad)
+{
+	UsageScope usage(Subsystem::Metadata);
+	ScopedArena<4096> arena;
+	auto info = std::make_shared<CacheInfo>();
+	info->lastWriteTime = fad.ftLastWriteTime;
+	info->fileSize = ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+	info->created = FileTimeToString(fad.ftCreationTime);
+	info->modified = FileTimeToString(fad.ftLastWriteTime);
+
+	if (DecodeSubsystemFor(bytes) == Subsystem::DecodeSvg)
+	{
+		usage.Switch(Subsystem::DecodeSvg);
+		DecodeSvg(bytes, *info);
+		return info;
+	}
+	if (DecodeAnimation(bytes, *info))
+	{
+		usage.Switch(DecodeSubsystemFor(bytes));
+		return info;
+	}
+
+	auto src = CreateBitmapFromBytes(bytes);
+	if (!src)
+	{
+		usage.Switch(DecodeSubsystemFor(bytes));
+		DecodeWithWic(bytes, *info);
+		return info;
+	}
+
+	info->width = src->GetWidth();
+	info->height = src->GetHeight();
+	PixelFormat pf = src->GetPixelFormat();
+	info->bpp = (pf & PixelFormatIndexed) ? 8 : GetPixelFormatSize(pf);
+	src->GetRawFormat(&info->rawFormat);
+	info->type = RawFormatToType(info->rawFormat);
+	info->exifDate = GetPropertyString(src.get(), PropertyTagDateTime, &arena);
+	info->orientation = GetExifOrientation(src.get(), &arena);
+	info->frameCount = (std::max)(1u, src->GetFrameCount(&FrameDimensionTime));
+	if (info->rawFormat == ImageFormatJPEG) JpegMcuSize(bytes, info->cropGridW, info->cropGridH);
+	SetColorProfile(*info, GetIccProfile(src.get(), &arena));
+
+	usage.Switch(DecodeSubsystemFor(bytes));
+	if (info->rawFormat == ImageFormatPNG)
+	{
+		UINT bpp = 0;
+		if (auto deep = DecodeDeepPng(bytes, bpp))
+		{
+			info->bpp = bpp;
+			info->pixels = deep;
+			info->bitmap = BitmapForPixels(deep);
+			ChargePixels((uint64_t)deep->width * deep->height);
+			return info;
+		}
+	}
+
+	// formats the pixel kernels read are kept as decoded, so conversion,
+	// orientation and scaling happen in one pass when the frame is rendered
+	PixelFormat keep = IsKernelFormat(pf) ? pf : PixelFormat32bppPARGB;
+	auto px = std::make_shared<PixelBuffer>(info->width, info->height, keep);
+	if (keep == PixelFormat8bppIndexed)
+	{
+		INT size = src->GetPaletteSize();
+		std::pmr::vector<BYTE> buf(size > 0 ? size : 0, &arena);
+		ColorPalette* pal = (ColorPalette*)buf.data();
+		if (size < (INT)sizeof(ColorPalette) || src->GetPalette(pal, size) != Ok) return info;
+		px->palette.assign(pal->Entries, pal->Entries + pal->Count);
+		px->palette.resize(256, 0xFF000000); // out of range indices read as black
+	}
+	BitmapData bd = {};
+	bd.Width = px->width;
+	bd.Height = px->height;
+	bd.Stride = (INT)px->stride;
+	bd.PixelFormat = keep;
+	bd.Scan0 = px->data.data();
+	Rect r(0, 0, (INT)px->width, (INT)px->height);
+	if (src->LockBits(&r, ImageLockModeRead | ImageLockModeUserInputBuf, keep, &bd) != Ok) return info;
+	src->UnlockBits(&bd);
+	ChargePixels((uint64_t)px->width * px->height);
+
+	info->pixels = px;
+	info->bitmap = WrapPixels(px);
+	return info;
+}
+
+static std::shared_ptr<CacheInfo> GetCachedAt(int idx)
+{
+	// never decodes; misses are filled in by the load pipeline. Looks up by
+	// view into g_files, so a hit does not allocate.
+	std::lock_guard<std::mutex> lk(g_filesMutex);
+	if (g_files.empty()) return nullptr;
+
 	int n = (int)g_files.size();
+	std::wstring_view p = g_files[(idx % n + n) % n].native();
+
+	std::lock_guard<std::mutex> clk(g_cacheMutex);
+	auto it = g_cache.find(p);
+	return it != g_cache.end() ? it->second : nullptr;
+}
+
+// Where an image of w x h (as displayed, i.e. after orientation) lands in rc.
+static Rect CalcDisplayRect(UINT w, UINT h, RECT rc)
+{
+	LayoutRect r = FitRect(w, h, { rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top }, g_zoom);
+	return Rect(r.x, r.y, r.width, r.height);
+}
+
+// Draws the stored w x h image with its EXIF orientation applied: rect is
+// where the unrotated image goes, mx turns it about the display rect's centre.
+static void CalcRectAndMatrix(UINT w, UINT h, int orient, RECT rc, Matrix& mx, Rect& rect)
+{
+	LayoutRect r;
+	LayoutMatrix m;
+	OrientedLayout(w, h, orient, { rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top }, g_zoom, r, m);
+	rect = Rect(r.x, r.y, r.width, r.height);
+	mx.SetElements(m.m11, m.m12, m.m21, m.m22, m.dx, m.dy);
+}
+
+// ---------------------------------------------------------------------------
+// SVG: Direct2D draws the document straight at the size of the display
+// target, so it stays sharp at every zoom, and the display frame cache keeps
+// the result until the target changes. Big targets are drawn as bands in
+// parallel, each on its own render target with its own parse of the document.
+
+struct SvgImage
+{
+	std::vector<BYTE> bytes;
+	float width = 0; // intrinsic size, in user units
+	float height = 0;
+};
 
-	// preload idx-2..idx+2
-	for (int d = -2; d <= 2; ++d)
+static ID2D1Factory1* D2DFactory()
+{
+	static ID2D1Factory1* factory = []()
 	{
-		auto i = (d % n + n) % n;
-		auto p = g_files[i].wstring();
-		if (g_cache.count(p)) return;
+		ID2D1Factory1* f = nullptr;
+		D2D1CreateFactory(D2D1_FACTORY_TYPE_MULTI_THREADED, __uuidof(ID2D1Factory1), nullptr, (void**)&f);
+		return f;
+	}();
+	return factory;
+}
 
-		AssignNewBitmap(p);
+// Parses bytes on a new w x h software render target with the given viewport,
+// calls draw(dc, doc) between BeginDraw and EndDraw and copies the result to
+// dst, if given, as premultiplied BGRA.
+template<class Draw>
+static bool WithSvgDocument(const std::vector<BYTE>& bytes, D2D1_SIZE_F viewport, UINT w, UINT h, BYTE* dst, UINT stride, Draw&& draw)
+{
+	IWICBitmap* bmp = nullptr;
+	ID2D1RenderTarget* rt = nullptr;
+	ID2D1DeviceContext5* dc = nullptr;
+	IStream* stream = nullptr;
+	ID2D1SvgDocument* doc = nullptr;
+	bool ok = false;
+	D2D1_RENDER_TARGET_PROPERTIES props = D2D1::RenderTargetProperties(D2D1_RENDER_TARGET_TYPE_SOFTWARE,
+		D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_PREMULTIPLIED));
+	if (D2DFactory() && WicFactory() &&
+		SUCCEEDED(WicFactory()->CreateBitmap(w, h, GUID_WICPixelFormat32bppPBGRA, WICBitmapCacheOnLoad, &bmp)) &&
+		SUCCEEDED(D2DFactory()->CreateWicBitmapRenderTarget(bmp, props, &rt)) &&
+		SUCCEEDED(rt->QueryInterface(IID_PPV_ARGS(&dc))) &&
+		(stream = SHCreateMemStream(bytes.data(), (UINT)bytes.size())) != nullptr &&
+		SUCCEEDED(dc->CreateSvgDocument(stream, viewport, &doc)))
+	{
+		dc->BeginDraw();
+		ok = draw(dc, doc);
+		ok = SUCCEEDED(dc->EndDraw()) && ok;
+	}
+	if (ok && dst)
+	{
+		WICRect r = { 0, 0, (INT)w, (INT)h };
+		ok = SUCCEEDED(bmp->CopyPixels(&r, stride, stride * h, dst));
 	}
-	// trim cache to a small size (keep max 9)
-	while (g_cache.size() > 12)
+	if (doc) doc->Release();
+	if (stream) stream->Release();
+	if (dc) dc->Release();
+	if (rt) rt->Release();
+	if (bmp) bmp->Release();
+	return ok;
+}
+
+// The document's own size: its width and height in user units, else its
+// viewBox, else the CSS default of 300 x 150.
+static bool SvgIntrinsicSize(const std::vector<BYTE>& bytes, float& w, float& h)
+{
+	return WithSvgDocument(bytes, D2D1::SizeF(300, 150), 1, 1, nullptr, 0, [&](ID2D1DeviceContext5*, ID2D1SvgDocument* doc)
+	{
+		ID2D1SvgElement* root = nullptr;
+		doc->GetRoot(&root);
+		if (!root) return false;
+		auto length = [&](const wchar_t* name)
+		{
+			D2D1_SVG_LENGTH v = {};
+			bool set = root->IsAttributeSpecified(name) &&
+				SUCCEEDED(root->GetAttributeValue(name, D2D1_SVG_ATTRIBUTE_POD_TYPE_LENGTH, &v, sizeof(v))) && v.units == D2D1_SVG_LENGTH_UNITS_NUMBER;
+			return set ? v.value : 0.0f;
+		};
+		D2D1_SVG_VIEWBOX vb = {};
+		if (root->IsAttributeSpecified(L"viewBox")) root->GetAttributeValue(L"viewBox", D2D1_SVG_ATTRIBUTE_POD_TYPE_VIEWBOX, &vb, sizeof(vb));
+		w = length(L"width");
+		h = length(L"height");
+		if (w <= 0) w = (h > 0 && vb.width > 0 && vb.height > 0) ? h * vb.width / vb.height : vb.width > 0 ? vb.width : 300;
+		if (h <= 0) h = (vb.width > 0 && vb.height > 0) ? w * vb.height / vb.width : 150;
+		root->Release();
+		return true;
+	});
+}
+
+// The part of svg inside target, drawn at the target's size.
+static std::shared_ptr<PixelBuffer> RasterizeSvg(const SvgImage& svg, const DisplayTarget& target, QoS qos)
+{
+	UsageScope usage(Subsystem::DecodeSvg);
+	auto px = std::make_shared<PixelBuffer>(target.clipW, target.clipH);
+	const float sx = target.width / svg.width, sy = target.height / svg.height;
+
+	// bands of about a megapixel; parsing again per band only pays for big frames
+	const UINT bandH = (std::max)(64u, (1u << 20) / (std::max)(1u, target.clipW));
+	std::atomic<bool> ok{ true };
+	ParallelFor((target.clipH + bandH - 1) / bandH, 1, qos, [&](UINT b0, UINT b1)
+	{
+		for (UINT b = b0; b < b1; ++b)
+		{
+			const UINT y0 = b * bandH, h = (std::min)(bandH, target.clipH - y0);
+			bool drawn = WithSvgDocument(svg.bytes, D2D1::SizeF(svg.width, svg.height), target.clipW, h, px->Row(y0), px->stride,
+				[&](ID2D1DeviceContext5* dc, ID2D1SvgDocument* doc)
+				{
+					dc->Clear(D2D1::ColorF(0, 0, 0, 0));
+					dc->SetTransform(D2D1::Matrix3x2F::Scale(sx, sy) * D2D1::Matrix3x2F::Translation(-(float)target.clipX, -(float)(target.clipY + y0)));
+					dc->DrawSvgDocument(doc);
+					return true;
+				});
+			if (!drawn) ok = false;
+		}
+	});
+	return ok ? px : nullptr;
+}
+
+// Keeps the document for drawing at display size, plus a raster at its own
+// size (at most 8192 on the long side) for whatever needs pixels.
+static void DecodeSvg(const std::vector<BYTE>& bytes, CacheInfo& info)
+{
+	info.type = L"SVG";
+	auto svg = std::make_shared<SvgImage>();
+	svg->bytes = bytes;
+	if (!SvgIntrinsicSize(svg->bytes, svg->width, svg->height) || svg->width <= 0 || svg->height <= 0) return;
+	float fit = (std::min)(1.0f, 8192 / (std::max)(svg->width, svg->height));
+	info.width = (std::max)(1u, (UINT)std::ceil(svg->width * fit));
+	info.height = (std::max)(1u, (UINT)std::ceil(svg->height * fit));
+	info.bpp = 32;
+	info.colorLut = DisplayColorLut({}); // SVG colors are sRGB
+
+	DisplayTarget own;
+	own.width = own.clipW = info.width;
+	own.height = own.clipH = info.height;
+	info.pixels = RasterizeSvg(*svg, own, QoS::Prefetch);
+	if (!info.pixels) return;
+	info.bitmap = WrapPixels(info.pixels);
+	info.svg = svg;
+	ChargePixels((uint64_t)info.width * info.height);
+}
+
+// ---------------------------------------------------------------------------
+// Pixels in GDI+ terms; the kernels themselves are in pixel_kernels.h.
+
+// The stored pixels of a w x h image that rendering the clip of a dispW x
+// dispH display frame reads; every filter stays within a pixel of the
+// clip's footprint.
+static Rect OrientedSourceRect(UINT w, UINT h, int orient, UINT dispW, UINT dispH, int clipX, int clipY, UINT clipW, UINT clipH)
+{
+	auto range = [](UINT len, UINT disp, int from, UINT count, int& lo, int& hi)
+	{
+		double scale = (double)len / disp;
+		lo = (std::max)(0, (int)std::floor(from * scale) - 1);
+		hi = (std::min)((int)len - 1, (int)std::ceil((from + count) * scale));
+	};
+	int x0, x1, y0, y1, ax, ay, bx, by;
+	range(IsTransposed(orient) ? h : w, dispW, clipX, clipW, x0, x1);
+	range(IsTransposed(orient) ? w : h, dispH, clipY, clipH, y0, y1);
+	OrientedToStored(orient, x0, y0, w, h, ax, ay);
+	OrientedToStored(orient, x1, y1, w, h, bx, by);
+	return Rect((std::min)(ax, bx), (std::min)(ay, by), std::abs(bx - ax) + 1, std::abs(by - ay) + 1);
+}
+
+// The GDI+ bitmap for decoded pixels. GDI+ reads 64bpp as linear light, so
+// 16-bit sources get an 8-bit copy for quick previews, the clipboard and GDI+
+// encoders; their display frames still come from the full-depth pixels.
+static std::shared_ptr<Bitmap> BitmapForPixels(const std::shared_ptr<PixelBuffer>& px)
+{
+	if (px->format != PixelFormat64bppARGB) return WrapPixels(px);
+	PixelBuffer reduced(px->width, px->height);
+	RenderOriented(*px, 1, px->width, px->height, 0, 0, reduced, QoS::Background);
+	auto bmp = std::make_shared<Bitmap>((INT)px->width, (INT)px->height, PixelFormat32bppPARGB);
+	BitmapData bd = {};
+	bd.Width = reduced.width;
+	bd.Height = reduced.height;
+	bd.Stride = (INT)reduced.stride;
+	bd.PixelFormat = PixelFormat32bppPARGB;
+	bd.Scan0 = reduced.data.data();
+	Rect r(0, 0, (INT)px->width, (INT)px->height);
+	if (bmp->LockBits(&r, ImageLockModeWrite | ImageLockModeUserInputBuf, PixelFormat32bppPARGB, &bd) == Ok) bmp->UnlockBits(&bd);
+	return bmp;
+}
+
+// ---------------------------------------------------------------------------
+// Color management. Embedded ICC profiles (matrix/TRC RGB, the kind cameras,
+// Adobe RGB and Display P3 use) are converted to the display's profile through
+// a 3D LUT with tetrahedral interpolation, applied to each display frame.
+// Untagged images count as sRGB. A LUT is built once per (source, display)
+// profile pair and shared by every image using that pair; the LUT itself is
+// in color_lut.h.
+
+static uint32_t IccWord(const BYTE* p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static double IccFixed(const BYTE* p) { return (int32_t)IccWord(p) / 65536.0; }
+
+// Reads an RGB matrix/TRC profile. LUT-based profiles without colorant
+// tags are not handled and read as sRGB.
+static bool ParseIccProfile(const std::vector<BYTE>& icc, ColorProfile& out)
+{
+	size_t n = icc.size();
+	if (n < 132 || IccWord(&icc[16]) != 'RGB ' || IccWord(&icc[20]) != 'XYZ ') return false;
+	uint32_t tags = IccWord(&icc[128]);
+	if (tags > (n - 132) / 12) return false;
+	auto find = [&](uint32_t sig, size_t& size) -> const BYTE*
+	{
+		for (uint32_t i = 0; i < tags; ++i)
+		{
+			const BYTE* t = &icc[132 + 12 * i];
+			size_t offset = IccWord(t + 4);
+			size = IccWord(t + 8);
+			if (IccWord(t) == sig && offset < n && size <= n - offset && size >= 12) return &icc[offset];
+		}
+		return nullptr;
+	};
+
+	static const uint32_t colorants[3] = { 'rXYZ', 'gXYZ', 'bXYZ' };
+	static const uint32_t curves[3] = { 'rTRC', 'gTRC', 'bTRC' };
+	for (int ch = 0; ch < 3; ++ch)
 	{
-		auto it = g_cache.begin();
-		g_cache.erase(it);
+		size_t size;
+		const BYTE* xyz = find(colorants[ch], size);
+		if (!xyz || size < 20 || IccWord(xyz) != 'XYZ ') return false;
+		for (int row = 0; row < 3; ++row) out.toXyz[row][ch] = IccFixed(xyz + 8 + 4 * row);
+
+		const BYTE* curve = find(curves[ch], size);
+		if (!curve) return false;
+		ToneCurve& t = out.trc[ch];
+		if (IccWord(curve) == 'curv')
+		{
+			uint32_t count = IccWord(curve + 8);
+			if (count > (size - 12) / 2) return false;
+			if (count == 1) t.g = ((curve[12] << 8) | curve[13]) / 256.0;
+			for (uint32_t i = 0; count > 1 && i < count; ++i) t.table.push_back((uint16_t)((curve[12 + 2 * i] << 8) | curve[13 + 2 * i]));
+		}
+		else if (IccWord(curve) == 'para')
+		{
+			static const int params[] = { 1, 3, 4, 5, 7 };
+			int type = (curve[8] << 8) | curve[9];
+			if (type > 4 || size < 12 + 4u * params[type]) return false;
+			double p[7] = {};
+			for (int i = 0; i < params[type]; ++i) p[i] = IccFixed(curve + 12 + 4 * i);
+			t.g = p[0];
+			if (type == 0) continue;
+			t.a = p[1];
+			t.b = p[2];
+			if (type <= 2)
+			{
+				// below -b/a the curve is flat at 0 (type 1) or c (type 2)
+				t.d = p[1] ? -p[2] / p[1] : 0;
+				t.c = 0;
+				t.e = t.f = type == 2 ? p[3] : 0;
+			}
+			else
+			{
+				t.c = p[3];
+				t.d = p[4];
+				t.e = p[5];
+				t.f = p[6];
+			}
+		}
+		else
+		{
+			return false;
+		}
 	}
+	return true;
+}
+
+static std::mutex g_colorMutex;
+static std::shared_ptr<const ColorProfile> g_displayProfile; // null for sRGB
+static uint64_t g_displayProfileHash = 0;
+static std::map<std::pair<uint64_t, uint64_t>, std::shared_ptr<const ColorLut>> g_colorLuts;
+
+static uint64_t HashBytes(const std::vector<BYTE>& bytes)
+{
+	uint64_t h = 14695981039346656037ull; // FNV-1a
+	for (BYTE b : bytes) h = (h ^ b) * 1099511628211ull;
+	return h;
+}
+
+// The display's profile, from the monitor the window is on. Frames rendered
+// before this call keep their LUTs.
+static void LoadDisplayProfile(HWND hWnd)
+{
+	HDC hdc = GetDC(hWnd);
+	wchar_t file[MAX_PATH];
+	DWORD size = MAX_PATH;
+	std::vector<BYTE> icc;
+	if (GetICMProfileW(hdc, &size, file)) icc = ReadFileBytes(file);
+	ReleaseDC(hWnd, hdc);
+
+	auto profile = std::make_shared<ColorProfile>();
+	std::lock_guard<std::mutex> lk(g_colorMutex);
+	g_displayProfile = ParseIccProfile(icc, *profile) ? profile : nullptr;
+	g_displayProfileHash = g_displayProfile ? HashBytes(icc) : 0;
+}
+
+// LUT from an image's embedded profile (empty for sRGB) to the display, or
+// null if the colors need no conversion.
+static std::shared_ptr<const ColorLut> DisplayColorLut(const std::vector<BYTE>& icc)
+{
+	uint64_t hash = icc.empty() ? 0 : HashBytes(icc);
+	std::lock_guard<std::mutex> lk(g_colorMutex);
+	auto key = std::make_pair(hash, g_displayProfileHash);
+	auto it = g_colorLuts.find(key);
+	if (it != g_colorLuts.end()) return it->second;
+
+	ColorProfile src;
+	if (!ParseIccProfile(icc, src)) src = SrgbProfile();
+	const ColorProfile& dst = g_displayProfile ? *g_displayProfile : SrgbProfile();
+	return g_colorLuts[key] = BuildColorLut(src, dst);
 }
 
-static void BackgroundLoader()
+// ---------------------------------------------------------------------------
+// GIF rotation on the stream itself. GDI+ only saves the frame it has
+// selected, so each frame is decoded to indices, oriented and LZW-encoded
+// again (frames in parallel); palettes, delays, disposal and every other
+// block are copied unchanged.
+
+// Decodes GIF LZW data into indices, filling at most indices.size() of them.
+// Data that ends early leaves the rest as is, like most viewers do.
+static bool GifDecodeLzw(const BYTE* data, size_t size, int minCode, std::vector<BYTE>& indices)
 {
-	while (!g_stopThreads)
+	const int clear = 1 << minCode, eoi = clear + 1;
+	uint16_t prefix[4096], length[4096];
+	BYTE suffix[4096], first[4096];
+	for (int c = 0; c < clear; ++c)
+	{
+		prefix[c] = 0;
+		length[c] = 1;
+		suffix[c] = first[c] = (BYTE)c;
+	}
+
+	int width = minCode + 1, next = eoi + 1, prev = -1;
+	uint32_t bits = 0;
+	int nbits = 0;
+	size_t out = 0, total = indices.size();
+	for (size_t i = 0; out < total;)
 	{
-		if (!g_loading)
+		while (nbits < width)
+		{
+			if (i >= size) return true;
+			bits |= (uint32_t)data[i++] << nbits;
+			nbits += 8;
+		}
+		int code = bits & ((1 << width) - 1);
+		bits >>= width;
+		nbits -= width;
+
+		if (code == clear)
 		{
-			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			width = minCode + 1;
+			next = eoi + 1;
+			prev = -1;
 			continue;
 		}
-		int idx = g_index;
-		PreloadAround(idx);
-		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		if (code == eoi) break;
+		if (prev < 0)
+		{
+			if (code >= clear) return false;
+			indices[out++] = (BYTE)code;
+			prev = code;
+			continue;
+		}
+		if (code > next || (code == next && next == 4096)) return false;
+
+		if (next < 4096)
+		{
+			// the new entry is prev plus the first index of code (of prev if code is the new one)
+			prefix[next] = (uint16_t)prev;
+			suffix[next] = first[code == next ? prev : code];
+			first[next] = first[prev];
+			length[next] = length[prev] + 1;
+			if (++next == (1 << width) && width < 12) ++width;
+		}
+
+		// strings are stored back to front
+		size_t len = length[code];
+		for (int c = code, p = (int)len - 1; p >= 0; c = prefix[c], --p)
+		{
+			if (out + p < total) indices[out + p] = suffix[c];
+		}
+		out += len;
+		prev = code;
 	}
+	return true;
 }
 
-static void StartBackground()
+// Appends indices as GIF LZW data: min code size, sub-blocks, terminator.
+static void GifEncodeLzw(const BYTE* indices, size_t count, int minCode, std::vector<BYTE>& out)
 {
-	g_stopThreads = false;
-	std::thread([]() { BackgroundLoader(); }).detach();
+	const int clear = 1 << minCode, eoi = clear + 1;
+	std::vector<int32_t> keys(8192);
+	std::vector<uint16_t> codes(8192);
+	int width = minCode + 1, next = eoi + 1;
+
+	BYTE block[256];
+	int used = 0;
+	uint32_t bits = 0;
+	int nbits = 0;
+	auto flushBlock = [&]()
+	{
+		if (!used) return;
+		out.push_back((BYTE)used);
+		out.insert(out.end(), block, block + used);
+		used = 0;
+	};
+	auto emit = [&](int code)
+	{
+		bits |= (uint32_t)code << nbits;
+		nbits += width;
+		for (; nbits >= 8; bits >>= 8, nbits -= 8)
+		{
+			block[used++] = (BYTE)bits;
+			if (used == 255) flushBlock();
+		}
+	};
+	auto reset = [&]()
+	{
+		std::fill(keys.begin(), keys.end(), -1);
+		emit(clear);
+		width = minCode + 1;
+		next = eoi + 1;
+	};
+
+	out.push_back((BYTE)minCode);
+	reset();
+	if (count)
+	{
+		int prefix = indices[0];
+		for (size_t i = 1; i < count; ++i)
+		{
+			int32_t key = (prefix << 8) | indices[i];
+			uint32_t slot = ((uint32_t)key * 2654435761u) >> 19;
+			while (keys[slot] >= 0 && keys[slot] != key) slot = (slot + 1) & 8191;
+			if (keys[slot] == key)
+			{
+				prefix = codes[slot];
+				continue;
+			}
+
+			emit(prefix);
+			keys[slot] = key;
+			codes[slot] = (uint16_t)next++;
+			// the decoder adds its entry one code later, hence > rather than ==
+			if (next > (1 << width) && width < 12) ++width;
+			if (next == 4096) reset();
+			prefix = indices[i];
+		}
+		emit(prefix);
+	}
+	emit(eoi);
+	if (nbits) block[used++] = (BYTE)bits;
+	flushBlock();
+	out.push_back(0);
 }
 
-static void StopBackground()
+struct GifFrame
 {
-	g_stopThreads = true;
+	size_t start;          // offset of the image descriptor
+	size_t end;            // just past the image data
+	std::vector<BYTE> out; // rewritten descriptor, color table and data
+};
+
+static UINT GifWord(const BYTE* p) { return p[0] | (p[1] << 8); }
+
+static void GifPutWord(BYTE* p, UINT v)
+{
+	p[0] = (BYTE)v;
+	p[1] = (BYTE)(v >> 8);
+}
+
+// skips a chain of data sub-blocks; returns the offset past its terminator, or 0
+static size_t GifSkipBlocks(const std::vector<BYTE>& in, size_t pos)
+{
+	while (pos < in.size() && in[pos]) pos += in[pos] + 1;
+	return pos < in.size() ? pos + 1 : 0;
+}
+
+template<int Orient>
+static void GifOrientFrame(const std::vector<BYTE>& src, UINT w, UINT h, std::vector<BYTE>& dst)
+{
+	bool transposed = IsTransposed(Orient);
+	UINT ow = transposed ? h : w, oh = transposed ? w : h;
+	for (UINT y = 0; y < oh; ++y)
+	{
+		for (UINT x = 0; x < ow; ++x)
+		{
+			int sx, sy;
+			Orientation<Orient>::Map((int)x, (int)y, (int)w, (int)h, sx, sy);
+			dst[(size_t)y * ow + x] = src[(size_t)sy * w + sx];
+		}
+	}
+}
+
+static bool GifRewriteFrame(const std::vector<BYTE>& in, GifFrame& frame, int orient, UINT canvasW, UINT canvasH)
+{
+	using OrientFn = void (*)(const std::vector<BYTE>&, UINT, UINT, std::vector<BYTE>&);
+	static const OrientFn orientFrame[] = {
+		&GifOrientFrame<1>, &GifOrientFrame<1>, &GifOrientFrame<2>, &GifOrientFrame<3>, &GifOrientFrame<4>,
+		&GifOrientFrame<5>, &GifOrientFrame<6>, &GifOrientFrame<7>, &GifOrientFrame<8>,
+	};
+
+	const BYTE* desc = &in[frame.start];
+	UINT left = GifWord(desc + 1), top = GifWord(desc + 3), w = GifWord(desc + 5), h = GifWord(desc + 7);
+	BYTE flags = desc[9];
+	size_t tableSize = (flags & 0x80) ? 3u << ((flags & 7) + 1) : 0;
+	size_t lzw = frame.start + 10 + tableSize;
+	int minCode = in[lzw];
+	if (minCode < 2 || minCode > 8) return false;
+
+	// gather the data sub-blocks
+	std::vector<BYTE> data;
+	for (size_t pos = lzw + 1; in[pos]; pos += in[pos] + 1) data.insert(data.end(), in.begin() + pos + 1, in.begin() + pos + 1 + in[pos]);
+	std::vector<BYTE> indices((size_t)w * h);
+	if (!GifDecodeLzw(data.data(), data.size(), minCode, indices)) return false;
+
+	if (flags & 0x40)
+	{
+		// interlaced: rows come in four passes
+		std::vector<BYTE> rows(indices.size());
+		static const UINT startRow[] = { 0, 4, 2, 1 }, step[] = { 8, 8, 4, 2 };
+		size_t row = 0;
+		for (int pass = 0; pass < 4; ++pass)
+		{
+			for (UINT y = startRow[pass]; y < h; y += step[pass], ++row)
+			{
+				std::copy_n(&indices[row * w], w, &rows[(size_t)y * w]);
+			}
+		}
+		indices.swap(rows);
+	}
+
+	std::vector<BYTE> oriented(indices.size());
+	orientFrame[orient](indices, w, h, oriented);
+
+	// where the frame's corners land on the oriented canvas
+	bool transposed = IsTransposed(orient);
+	UINT ow = transposed ? h : w, oh = transposed ? w : h;
+	bool flipX = (orient == 2 || orient == 3 || orient == 6 || orient == 7);
+	bool flipY = (orient == 3 || orient == 4 || orient == 7 || orient == 8);
+	UINT x0 = transposed ? top : left, y0 = transposed ? left : top;
+	UINT cw = transposed ? canvasH : canvasW, ch = transposed ? canvasW : canvasH;
+	UINT nx = flipX ? (cw > x0 + ow ? cw - x0 - ow : 0) : x0;
+	UINT ny = flipY ? (ch > y0 + oh ? ch - y0 - oh : 0) : y0;
+
+	frame.out.assign(desc, desc + 10 + tableSize);
+	GifPutWord(&frame.out[1], nx);
+	GifPutWord(&frame.out[3], ny);
+	GifPutWord(&frame.out[5], ow);
+	GifPutWord(&frame.out[7], oh);
+	frame.out[9] = flags & ~0x40;
+	GifEncodeLzw(oriented.data(), oriented.size(), minCode, frame.out);
+	return true;
+}
+
+// Writes in, turned by EXIF orientation orient, to out.
+static bool RotateGif(const std::vector<BYTE>& in, int orient, std::vector<BYTE>& out, QoS qos)
+{
+	if (in.size() < 13 || memcmp(in.data(), "GIF8", 4) != 0) return false;
+	if (orient < 1 || orient > 8) orient = 1;
+	UINT canvasW = GifWord(&in[6]), canvasH = GifWord(&in[8]);
+	size_t pos = 13 + ((in[10] & 0x80) ? 3u << ((in[10] & 7) + 1) : 0);
+
+	std::vector<GifFrame> frames;
+	for (bool done = false; !done;)
+	{
+		if (pos >= in.size()) return false;
+		switch (in[pos])
+		{
+		case 0x21: // extension: label, then sub-blocks
+			if (!(pos = GifSkipBlocks(in, pos + 2))) return false;
+			break;
+		case 0x2C: // image: descriptor, color table, min code size, sub-blocks
+		{
+			if (pos + 11 > in.size()) return false;
+			BYTE flags = in[pos + 9];
+			size_t lzw = pos + 10 + ((flags & 0x80) ? 3u << ((flags & 7) + 1) : 0);
+			size_t end = lzw < in.size() ? GifSkipBlocks(in, lzw + 1) : 0;
+			if (!end) return false;
+			frames.push_back({ pos, end });
+			pos = end;
+			break;
+		}
+		case 0x3B:
+			done = true;
+			break;
+		default:
+			return false;
+		}
+	}
+
+	std::atomic<bool> ok{ true };
+	ParallelFor((UINT)frames.size(), 1, qos, [&](UINT f0, UINT f1)
+	{
+		for (UINT f = f0; f < f1 && ok; ++f)
+		{
+			if (!GifRewriteFrame(in, frames[f], orient, canvasW, canvasH)) ok = false;
+		}
+	});
+	if (!ok) return false;
+
+	out.clear();
+	out.reserve(in.size() + in.size() / 8);
+	size_t copied = 0;
+	for (GifFrame& f : frames)
+	{
+		out.insert(out.end(), in.begin() + copied, in.begin() + f.start);
+		out.insert(out.end(), f.out.begin(), f.out.end());
+		copied = f.end;
+	}
+	out.insert(out.end(), in.begin() + copied, in.begin() + pos + 1);
+	if (IsTransposed(orient))
+	{
+		GifPutWord(&out[6], canvasH);
+		GifPutWord(&out[8], canvasW);
+	}
+	return true;
+}
+
+// ---------------------------------------------------------------------------
+// PNG encoder for rewrites. Rows are filtered in parallel, and the filtered
+// stream is cut into chunks that are DEFLATE-compressed on separate workers.
+// Each chunk uses the 32K before it as history. The pieces are joined the way
+// pigz does it: every chunk but the last ends in an empty stored block, so
+// they concatenate into one valid stream.
+
+enum class PngPreset
+{
+	Fast,     // Up filter, short match search
+	Balanced, // adaptive filters, lazy matching
+	Small,    // adaptive filters, long match search
+};
+
+// Huffman code lengths of at most maxBits for freq[0, n); unused symbols get
+// 0. At least two symbols get a code, so the code is always complete.
+static void BuildHuffmanLengths(const uint32_t* freq, int n, int maxBits, BYTE* lengths)
+{
+	std::vector<int> syms;
+	for (int i = 0; i < n; ++i) if (freq[i]) syms.push_back(i);
+	for (int i = 0; syms.size() < 2 && i < n; ++i)
+	{
+		if (!freq[i]) syms.push_back(i);
+	}
+	std::stable_sort(syms.begin(), syms.end(), [&](int a, int b) { return freq[a] < freq[b]; });
+	std::fill(lengths, lengths + n, 0);
+	int m = (int)syms.size();
+	if (m < 2) return;
+
+	// two-queue Huffman: leaves in ascending order, internal nodes are created
+	// in ascending order too
+	std::vector<uint64_t> weight(2 * m - 1);
+	std::vector<int> parent(2 * m - 1, 0);
+	for (int i = 0; i < m; ++i) weight[i] = (std::max)(1u, freq[syms[i]]);
+	int leaf = 0, node = m;
+	auto smallest = [&](int k) { return (leaf < m && (node >= k || weight[leaf] <= weight[node])) ? leaf++ : node++; };
+	for (int k = m; k < 2 * m - 1; ++k)
+	{
+		int a = smallest(k);
+		int b = smallest(k);
+		weight[k] = weight[a] + weight[b];
+		parent[a] = parent[b] = k;
+	}
+
+	// depths, then clamp to maxBits and repair the Kraft sum
+	std::vector<int> depth(2 * m - 1, 0);
+	int counts[33] = {};
+	for (int k = 2 * m - 3; k >= 0; --k) depth[k] = depth[parent[k]] + 1;
+	for (int i = 0; i < m; ++i) ++counts[(std::min)(depth[i], maxBits)];
+	uint32_t total = 0;
+	for (int i = 1; i <= maxBits; ++i) total += (uint32_t)counts[i] << (maxBits - i);
+	for (; total > (1u << maxBits); --total)
+	{
+		--counts[maxBits];
+		for (int i = maxBits - 1; i > 0; --i)
+		{
+			if (!counts[i]) continue;
+			--counts[i];
+			counts[i + 1] += 2;
+			break;
+		}
+	}
+
+	// rarest symbols get the longest codes
+	for (int len = maxBits, i = 0; len > 0; --len)
+	{
+		for (int c = 0; c < counts[len]; ++c) lengths[syms[i++]] = (BYTE)len;
+	}
+}
+
+// canonical codes for the given lengths, most significant bit first
+static void BuildHuffmanCodes(const BYTE* lengths, int n, uint16_t* codes)
+{
+	int count[17] = {};
+	uint16_t next[17] = {};
+	for (int i = 0; i < n; ++i) ++count[lengths[i]];
+	count[0] = 0;
+	uint16_t code = 0;
+	for (int bits = 1; bits <= 16; ++bits) next[bits] = code = (uint16_t)((code + count[bits - 1]) << 1);
+	for (int i = 0; i < n; ++i) codes[i] = lengths[i] ? next[lengths[i]]++ : 0;
+}
+
+// LSB-first bit packing as DEFLATE wants it
+class DeflateBits
+{
+public:
+	explicit DeflateBits(std::vector<BYTE>& out) : m_out(out) {}
+
+	void Put(uint32_t bits, int count)
+	{
+		m_bits |= (uint64_t)bits << m_count;
+		for (m_count += count; m_count >= 8; m_count -= 8, m_bits >>= 8) m_out.push_back((BYTE)m_bits);
+	}
+
+	// Huffman codes go out starting with their most significant bit
+	void PutCode(uint16_t code, int len)
+	{
+		uint32_t rev = 0;
+		for (int i = 0; i < len; ++i) rev |= ((code >> i) & 1) << (len - 1 - i);
+		Put(rev, len);
+	}
+
+	void Align()
+	{
+		if (m_count) Put(0, 8 - m_count);
+	}
+
+private:
+	std::vector<BYTE>& m_out;
+	uint64_t m_bits = 0;
+	int m_count = 0;
+};
+
+struct DeflateParams
+{
+	int maxChain;   // match candidates tried per position
+	int niceLength; // stop searching at a match this long
+	int maxLazy;    // matches shorter than this are deferred if the next position has a longer one
+};
+
+static const uint16_t kLenBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const BYTE kLenExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t kDistBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const BYTE kDistExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static int DeflateLenCode(int len)
+{
+	static const auto table = []()
+	{
+		std::array<BYTE, 259> t = {};
+		for (int c = 0, l = 3; l <= 258; ++l)
+		{
+			while (c < 28 && kLenBase[c + 1] <= l) ++c;
+			t[l] = (BYTE)c;
+		}
+		return t;
+	}();
+	return table[len];
+}
+
+static int DeflateDistCode(int dist)
+{
+	// distances up to 256 directly, longer ones in steps of 128
+	static const auto table = []()
+	{
+		std::array<BYTE, 512> t = {};
+		for (int c = 0, d = 1; d <= 32768; ++d)
+		{
+			while (c < 29 && kDistBase[c + 1] <= d) ++c;
+			if (d <= 256) t[d - 1] = (BYTE)c;
+			else t[256 + ((d - 1) >> 7)] = (BYTE)c;
+		}
+		return t;
+	}();
+	return dist <= 256 ? table[dist - 1] : table[256 + ((dist - 1) >> 7)];
+}
+
+// a literal byte, or a match with the top bit set: length << 16 | distance
+static const uint32_t kMatch = 0x80000000u;
+
+static void DeflateBlock(DeflateBits& bw, const std::vector<uint32_t>& tokens, bool final)
+{
+	uint32_t litFreq[286] = {}, distFreq[30] = {};
+	for (uint32_t t : tokens)
+	{
+		if (!(t & kMatch))
+		{
+			++litFreq[t];
+			continue;
+		}
+		++litFreq[257 + DeflateLenCode((t >> 16) & 0x1FF)];
+		++distFreq[DeflateDistCode(t & 0xFFFF)];
+	}
+	litFreq[256] = 1;
+
+	BYTE litLen[286], distLen[30];
+	BuildHuffmanLengths(litFreq, 286, 15, litLen);
+	BuildHuffmanLengths(distFreq, 30, 15, distLen);
+	int hlit = 286, hdist = 30;
+	while (hlit > 257 && !litLen[hlit - 1]) --hlit;
+	while (hdist > 1 && !distLen[hdist - 1]) --hdist;
+
+	// code lengths, run-length coded with symbols 16 (repeat), 17 and 18 (zeros)
+	std::vector<BYTE> all(litLen, litLen + hlit);
+	all.insert(all.end(), distLen, distLen + hdist);
+	std::vector<std::pair<BYTE, BYTE>> rle; // symbol, extra bits value
+	for (size_t i = 0; i < all.size();)
+	{
+		size_t run = 1;
+		while (i + run < all.size() && all[i + run] == all[i]) ++run;
+		if (!all[i] && run >= 3)
+		{
+			size_t r = (std::min)(run, (size_t)138);
+			rle.push_back(r >= 11 ? std::make_pair((BYTE)18, (BYTE)(r - 11)) : std::make_pair((BYTE)17, (BYTE)(r - 3)));
+			i += r;
+		}
+		else if (all[i] && run >= 4)
+		{
+			size_t r = (std::min)(run - 1, (size_t)6);
+			rle.push_back({ all[i], 0 });
+			rle.push_back({ 16, (BYTE)(r - 3) });
+			i += 1 + r;
+		}
+		else
+		{
+			rle.push_back({ all[i], 0 });
+			++i;
+		}
+	}
+	uint32_t clFreq[19] = {};
+	for (auto& s : rle) ++clFreq[s.first];
+	BYTE clLen[19];
+	uint16_t clCode[19];
+	BuildHuffmanLengths(clFreq, 19, 7, clLen);
+	BuildHuffmanCodes(clLen, 19, clCode);
+	static const BYTE order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	int hclen = 19;
+	while (hclen > 4 && !clLen[order[hclen - 1]]) --hclen;
+
+	bw.Put(final ? 1 : 0, 1);
+	bw.Put(2, 2); // dynamic Huffman
+	bw.Put(hlit - 257, 5);
+	bw.Put(hdist - 1, 5);
+	bw.Put(hclen - 4, 4);
+	for (int i = 0; i < hclen; ++i) bw.Put(clLen[order[i]], 3);
+	static const BYTE rleExtra[3] = { 2, 3, 7 };
+	for (auto& s : rle)
+	{
+		bw.PutCode(clCode[s.first], clLen[s.first]);
+		if (s.first >= 16) bw.Put(s.second, rleExtra[s.first - 16]);
+	}
+
+	uint16_t litCode[286], distCode[30];
+	BuildHuffmanCodes(litLen, 286, litCode);
+	BuildHuffmanCodes(distLen, 30, distCode);
+	for (uint32_t t : tokens)
+	{
+		if (!(t & kMatch))
+		{
+			bw.PutCode(litCode[t], litLen[t]);
+			continue;
+		}
+		int len = (t >> 16) & 0x1FF, dist = t & 0xFFFF;
+		int lc = DeflateLenCode(len), dc = DeflateDistCode(dist);
+		bw.PutCode(litCode[257 + lc], litLen[257 + lc]);
+		bw.Put(len - kLenBase[lc], kLenExtra[lc]);
+		bw.PutCode(distCode[dc], distLen[dc]);
+		bw.Put(dist - kDistBase[dc], kDistExtra[dc]);
+	}
+	bw.PutCode(litCode[256], litLen[256]);
+}
+
+// Compresses data[start, end) to raw DEFLATE blocks, with up to 32K before
+// start as history. Unless final, ends in an empty stored block so the next
+// chunk's output can be appended as is.
+static void DeflateChunk(const BYTE* data, size_t start, size_t end, bool final, const DeflateParams& params, std::vector<BYTE>& out)
+{
+	const size_t base = start > 32768 ? start - 32768 : 0;
+	const BYTE* p = data + base;
+	const size_t n = end - base;
+	std::vector<int32_t> head(1 << 15, -1), prev(n, -1);
+	auto hash = [&](size_t i) { return ((p[i] << 10) ^ (p[i + 1] << 5) ^ p[i + 2]) & 0x7FFF; };
+	auto insert = [&](size_t i)
+	{
+		if (i + 2 >= n) return;
+		int h = hash(i);
+		prev[i] = head[h];
+		head[h] = (int32_t)i;
+	};
+	auto longest = [&](size_t i, int& dist)
+	{
+		if (i + 2 >= n) return 0;
+		int best = 0, maxLen = (int)(std::min)((size_t)258, n - i), chain = params.maxChain;
+		for (int32_t c = head[hash(i)]; c >= 0 && i - c <= 32768 && chain-- > 0; c = prev[c])
+		{
+			if (p[c + best] != p[i + best]) continue;
+			// eight bytes at a time, then the first differing byte
+			int len = 0;
+			for (uint64_t a, b; len + 8 <= maxLen; len += 8)
+			{
+				memcpy(&a, p + c + len, 8);
+				memcpy(&b, p + i + len, 8);
+				if (a != b)
+				{
+					len += std::countr_zero(a ^ b) >> 3;
+					break;
+				}
+			}
+			while (len < maxLen && p[c + len] == p[i + len]) ++len;
+			if (len <= best) continue;
+			best = len;
+			dist = (int)(i - c);
+			if (len >= params.niceLength || len == maxLen) break;
+		}
+		return best >= 3 ? best : 0;
+	};
+
+	DeflateBits bw(out);
+	std::vector<uint32_t> tokens;
+	tokens.reserve(32768);
+	for (size_t i = 0; i < start - base; ++i) insert(i);
+	for (size_t i = start - base; i < n;)
+	{
+		int dist = 0, len = longest(i, dist);
+		insert(i);
+		if (len && len < params.maxLazy)
+		{
+			int dist2 = 0;
+			if (longest(i + 1, dist2) > len) len = 0;
+		}
+		if (len)
+		{
+			tokens.push_back(kMatch | (uint32_t)len << 16 | (uint32_t)dist);
+			for (int k = 1; k < len; ++k) insert(i + k);
+			i += len;
+		}
+		else
+		{
+			tokens.push_back(p[i++]);
+		}
+		if (tokens.size() == 32768)
+		{
+			DeflateBlock(bw, tokens, false);
+			tokens.clear();
+		}
+	}
+	DeflateBlock(bw, tokens, final);
+	if (!final)
+	{
+		// empty stored block: byte aligns the stream
+		bw.Put(0, 3);
+		bw.Align();
+		BYTE sync[4] = { 0, 0, 0xFF, 0xFF };
+		out.insert(out.end(), sync, sync + 4);
+	}
+	bw.Align();
+}
+
+static uint32_t Adler32(const BYTE* p, size_t n)
+{
+	uint32_t a = 1, b = 0;
+	while (n)
+	{
+		size_t step = (std::min)(n, (size_t)5552); // no overflow before the modulo
+		for (size_t i = 0; i < step; ++i)
+		{
+			a += p[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		p += step;
+		n -= step;
+	}
+	return (b << 16) | a;
+}
+
+// Adler-32 of two pieces joined, from their separate checksums
+static uint32_t Adler32Combine(uint32_t a1, uint32_t a2, size_t len2)
+{
+	const uint32_t mod = 65521;
+	uint32_t rem = (uint32_t)(len2 % mod);
+	uint32_t sum1 = a1 & 0xFFFF;
+	uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % mod);
+	sum1 += (a2 & 0xFFFF) + mod - 1;
+	sum2 += ((a1 >> 16) & 0xFFFF) + ((a2 >> 16) & 0xFFFF) + mod - rem;
+	if (sum1 >= mod) sum1 -= mod;
+	if (sum1 >= mod) sum1 -= mod;
+	if (sum2 >= (mod << 1)) sum2 -= (mod << 1);
+	if (sum2 >= mod) sum2 -= mod;
+	return sum1 | (sum2 << 16);
+}
+
+static uint32_t Crc32(const BYTE* p, size_t n, uint32_t crc = 0)
+{
+	static const auto table = []()
+	{
+		std::array<uint32_t, 256> t = {};
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+	crc = ~crc;
+	for (size_t i = 0; i < n; ++i) crc = table[(crc ^ p[i]) & 255] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void PutBE32(std::vector<BYTE>& out, uint32_t v)
+{
+	BYTE b[4] = { (BYTE)(v >> 24), (BYTE)(v >> 16), (BYTE)(v >> 8), (BYTE)v };
+	out.insert(out.end(), b, b + 4);
+}
+
+static void PngChunk(std::vector<BYTE>& out, const char* type, const BYTE* data, size_t size)
+{
+	PutBE32(out, (uint32_t)size);
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	PutBE32(out, Crc32(data, size, Crc32((const BYTE*)type, 4)));
+}
+
+// Row y as PNG samples: RGBA, RGB (channels 3) or palette indices; 16-bit
+// big-endian for 64bpp sources.
+static void PngRow(const PixelBuffer& px, UINT y, int channels, BYTE* out)
+{
+	const BYTE* row = px.Row(y);
+	switch (px.format)
+	{
+	case PixelFormat64bppARGB:
+		for (UINT x = 0; x < px.width; ++x, out += channels * 2)
+		{
+			const uint16_t* p = (const uint16_t*)row + x * 4;
+			for (int c = 0; c < channels; ++c)
+			{
+				out[2 * c] = (BYTE)(p[c] >> 8);
+				out[2 * c + 1] = (BYTE)p[c];
+			}
+		}
+		return;
+	case PixelFormat8bppIndexed:
+		memcpy(out, row, px.width);
+		return;
+	case PixelFormat24bppRGB:
+		for (UINT x = 0; x < px.width; ++x, out += 3, row += 3)
+		{
+			out[0] = row[2];
+			out[1] = row[1];
+			out[2] = row[0];
+		}
+		return;
+	default:
+		for (UINT x = 0; x < px.width; ++x, out += channels, row += 4)
+		{
+			BYTE a = px.format == PixelFormat32bppRGB ? 255 : row[3];
+			if (px.format == PixelFormat32bppPARGB && a != 255)
+			{
+				// undo premultiplication
+				out[0] = a ? (BYTE)(std::min)(255, (row[2] * 255 + a / 2) / a) : 0;
+				out[1] = a ? (BYTE)(std::min)(255, (row[1] * 255 + a / 2) / a) : 0;
+				out[2] = a ? (BYTE)(std::min)(255, (row[0] * 255 + a / 2) / a) : 0;
+			}
+			else
+			{
+				out[0] = row[2];
+				out[1] = row[1];
+				out[2] = row[0];
+			}
+			if (channels == 4) out[3] = a;
+		}
+		return;
+	}
+}
+
+// Encodes px as PNG. Color and text chunks of original (a PNG file, may be
+// null) are carried over.
+static std::vector<BYTE> EncodePng(const PixelBuffer& px, PngPreset preset, QoS qos, const std::vector<BYTE>* original = nullptr)
+{
+	// RGBA only if some pixel is not opaque
+	bool indexed = px.format == PixelFormat8bppIndexed;
+	bool alpha = false;
+	if (px.format == PixelFormat32bppARGB || px.format == PixelFormat32bppPARGB)
+	{
+		for (UINT y = 0; y < px.height && !alpha; ++y)
+		{
+			const BYTE* row = px.Row(y);
+			for (UINT x = 0; x < px.width; ++x) alpha |= row[x * 4 + 3] != 255;
+		}
+	}
+	else if (px.format == PixelFormat64bppARGB)
+	{
+		for (UINT y = 0; y < px.height && !alpha; ++y)
+		{
+			const uint16_t* row = (const uint16_t*)px.Row(y);
+			for (UINT x = 0; x < px.width; ++x) alpha |= row[x * 4 + 3] != 65535;
+		}
+	}
+	const int depth = px.format == PixelFormat64bppARGB ? 16 : 8;
+	const int channels = indexed ? 1 : alpha ? 4 : 3;
+	const int pixelBytes = channels * depth / 8;
+	const size_t rowBytes = (size_t)px.width * pixelBytes;
+
+	// filter rows in bands; each band starts from the unfiltered row above it
+	std::vector<BYTE> filtered((rowBytes + 1) * px.height);
+	ParallelFor(px.height, 64, qos, [&](UINT y0, UINT y1)
+	{
+		std::vector<BYTE> prev(rowBytes, 0), cur(rowBytes), trial(rowBytes);
+		if (y0) PngRow(px, y0 - 1, channels, prev.data());
+		for (UINT y = y0; y < y1; ++y)
+		{
+			PngRow(px, y, channels, cur.data());
+			BYTE* out = &filtered[y * (rowBytes + 1)];
+			int best = 2;
+			if (preset != PngPreset::Fast && !indexed)
+			{
+				// the filter with the smallest sum of absolute differences
+				uint64_t bestSum = ~0ull;
+				for (int type = 0; type < 5; ++type)
+				{
+					PngFilter(type, cur.data(), prev.data(), rowBytes, pixelBytes, trial.data());
+					uint64_t sum = PngFilterCost(trial.data(), rowBytes);
+					if (sum < bestSum)
+					{
+						bestSum = sum;
+						best = type;
+					}
+				}
+			}
+			else if (indexed)
+			{
+				best = 0; // filtering palette indices rarely pays
+			}
+			out[0] = (BYTE)best;
+			PngFilter(best, cur.data(), prev.data(), rowBytes, pixelBytes, out + 1);
+			cur.swap(prev);
+		}
+	});
+
+	// deflate in chunks, checksums alongside
+	static const DeflateParams params[] = { { 4, 16, 0 }, { 16, 64, 16 }, { 128, 258, 64 } };
+	const size_t chunkSize = 256 * 1024;
+	UINT chunks = (UINT)(std::max)((size_t)1, (filtered.size() + chunkSize - 1) / chunkSize);
+	std::vector<std::vector<BYTE>> packed(chunks);
+	std::vector<uint32_t> adler(chunks);
+	ParallelFor(chunks, 1, qos, [&](UINT c0, UINT c1)
+	{
+		for (UINT c = c0; c < c1; ++c)
+		{
+			size_t start = c * chunkSize, end = (std::min)(filtered.size(), start + chunkSize);
+			DeflateChunk(filtered.data(), start, end, c + 1 == chunks, params[(int)preset], packed[c]);
+			adler[c] = Adler32(filtered.data() + start, end - start);
+		}
+	});
+	std::vector<BYTE> zlib = { 0x78, 0x9C };
+	uint32_t check = adler[0];
+	for (UINT c = 0; c < chunks; ++c)
+	{
+		zlib.insert(zlib.end(), packed[c].begin(), packed[c].end());
+		if (c) check = Adler32Combine(check, adler[c], (std::min)(filtered.size() - c * chunkSize, chunkSize));
+	}
+	PutBE32(zlib, check);
+
+	std::vector<BYTE> out = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	BYTE ihdr[13] = {};
+	ihdr[0] = (BYTE)(px.width >> 24);
+	ihdr[1] = (BYTE)(px.width >> 16);
+	ihdr[2] = (BYTE)(px.width >> 8);
+	ihdr[3] = (BYTE)px.width;
+	ihdr[4] = (BYTE)(px.height >> 24);
+	ihdr[5] = (BYTE)(px.height >> 16);
+	ihdr[6] = (BYTE)(px.height >> 8);
+	ihdr[7] = (BYTE)px.height;
+	ihdr[8] = (BYTE)depth;
+	ihdr[9] = indexed ? 3 : alpha ? 6 : 2;
+	PngChunk(out, "IHDR", ihdr, sizeof(ihdr));
+
+	if (original && original->size() > 33 && !memcmp(original->data(), out.data(), 8))
+	{
+		// color space, density, text and time; everything else depends on the old layout
+		static const char* keep[] = { "gAMA", "cHRM", "sRGB", "iCCP", "pHYs", "tEXt", "zTXt", "iTXt", "tIME" };
+		bool wasGray = !((*original)[25] & 2);
+		for (size_t pos = 8; pos + 12 <= original->size();)
+		{
+			const BYTE* c = original->data() + pos;
+			size_t len = ((size_t)c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+			if (len > original->size() - pos - 12) break;
+			bool copy = std::any_of(std::begin(keep), std::end(keep), [&](const char* t) { return !memcmp(c + 4, t, 4); });
+			if (!memcmp(c + 4, "iCCP", 4) && wasGray && !indexed) copy = false; // a gray profile would not fit RGB
+			if (copy) out.insert(out.end(), c, c + len + 12);
+			pos += len + 12;
+		}
+	}
+
+	if (indexed)
+	{
+		std::vector<BYTE> plte, trns;
+		for (ARGB c : px.palette)
+		{
+			plte.push_back((BYTE)(c >> 16));
+			plte.push_back((BYTE)(c >> 8));
+			plte.push_back((BYTE)c);
+			trns.push_back((BYTE)(c >> 24));
+		}
+		while (!trns.empty() && trns.back() == 255) trns.pop_back();
+		PngChunk(out, "PLTE", plte.data(), plte.size());
+		if (!trns.empty()) PngChunk(out, "tRNS", trns.data(), trns.size());
+	}
+
+	// IDATs of 1MB, their CRCs computed in parallel
+	const size_t idatSize = 1 << 20;
+	UINT idats = (UINT)((zlib.size() + idatSize - 1) / idatSize);
+	std::vector<uint32_t> crcs(idats);
+	ParallelFor(idats, 1, qos, [&](UINT i0, UINT i1)
+	{
+		for (UINT i = i0; i < i1; ++i)
+		{
+			size_t start = i * idatSize, size = (std::min)(idatSize, zlib.size() - start);
+			crcs[i] = Crc32(zlib.data() + start, size, Crc32((const BYTE*)"IDAT", 4));
+		}
+	});
+	out.reserve(out.size() + zlib.size() + idats * 12 + 12);
+	for (UINT i = 0; i < idats; ++i)
+	{
+		size_t start = i * idatSize, size = (std::min)(idatSize, zlib.size() - start);
+		PutBE32(out, (uint32_t)size);
+		out.insert(out.end(), { 'I', 'D', 'A', 'T' });
+		out.insert(out.end(), zlib.begin() + start, zlib.begin() + start + size);
+		PutBE32(out, crcs[i]);
+	}
+	PngChunk(out, "IEND", nullptr, 0);
+	return out;
+}
+
+// ---------------------------------------------------------------------------
+// Animation: GIF, APNG and animated WebP feed one player. The parsers split a
+// file into frames, each kept as a small standalone image of its own format,
+// so the frame store is about as large as the file and one WIC decode serves
+// all three. Frames carry their rectangle on the canvas, delay, blend and
+// dispose; the player decodes a few ahead on a worker and composites them.
+
+enum class AnimDispose { None, Background, Previous };
+
+struct AnimFrame
+{
+	UINT x = 0, y = 0, width = 0, height = 0; // on the canvas
+	UINT delayMs = 100;
+	bool blend = true;                       // over the canvas, else replaces its rectangle
+	AnimDispose dispose = AnimDispose::None; // applied before the next frame is drawn
+	std::vector<BYTE> image;                 // the frame as a file of its own
+};
+
+struct Animation
+{
+	UINT width = 0, height = 0;
+	UINT bpp = 32;
+	UINT loops = 0; // 0 plays forever
+	Subsystem decoder = Subsystem::DecodeOther;
+	std::vector<AnimFrame> frames;
+};
+
+static const uint64_t MaxAnimationPixels = 64ull << 20; // canvas size refused beyond this
+
+static std::shared_ptr<PixelBuffer> DecodeReduced(const std::vector<BYTE>& bytes, UINT minEdge, int& orientation);
+
+static uint32_t GetBE32(const BYTE* p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static uint32_t GetLE24(const BYTE* p) { return p[0] | (p[1] << 8) | (p[2] << 16); }
+static uint32_t GetLE32(const BYTE* p) { return GetLE24(p) | ((uint32_t)p[3] << 24); }
+
+// delays this short are from encoders that meant "as fast as possible";
+// browsers play them at 100 ms and so do we
+static UINT FrameDelay(UINT ms) { return ms <= 10 ? 100 : ms; }
+
+static std::shared_ptr<Animation> ParseGifAnimation(const std::vector<BYTE>& in)
+{
+	if (in.size() < 13) return nullptr;
+	auto anim = std::make_shared<Animation>();
+	anim->width = GifWord(&in[6]);
+	anim->height = GifWord(&in[8]);
+	anim->bpp = 8;
+	anim->loops = 1; // without a NETSCAPE2.0 block it plays once
+	BYTE flags = in[10];
+	size_t pos = 13, gct = 0, gctSize = 0;
+	if (flags & 0x80)
+	{
+		gct = pos;
+		gctSize = 3u << ((flags & 7) + 1);
+		pos += gctSize;
+	}
+
+	// the graphic control extension applies to the next image only
+	UINT delay = 0;
+	int transparent = -1;
+	AnimDispose dispose = AnimDispose::None;
+	while (pos < in.size() && in[pos] != 0x3B)
+	{
+		if (in[pos] == 0x21 && pos + 2 < in.size())
+		{
+			size_t data = pos + 2;
+			if (in[pos + 1] == 0xF9 && data + 5 < in.size() && in[data] == 4)
+			{
+				BYTE packed = in[data + 1];
+				delay = GifWord(&in[data + 2]);
+				transparent = (packed & 1) ? in[data + 4] : -1;
+				int d = (packed >> 2) & 7;
+				dispose = d == 2 ? AnimDispose::Background : d == 3 ? AnimDispose::Previous : AnimDispose::None;
+			}
+			else if (in[pos + 1] == 0xFF && data + 16 < in.size() && in[data] == 11 && !memcmp(&in[data + 1], "NETSCAPE2.0", 11) &&
+				in[data + 12] >= 3 && in[data + 13] == 1)
+			{
+				// repeats after the first play
+				UINT repeats = GifWord(&in[data + 14]);
+				anim->loops = repeats ? repeats + 1 : 0;
+			}
+			pos = GifSkipBlocks(in, data);
+			if (!pos) break;
+			continue;
+		}
+		if (in[pos] != 0x2C || pos + 10 >= in.size()) break;
+
+		AnimFrame f;
+		f.x = GifWord(&in[pos + 1]);
+		f.y = GifWord(&in[pos + 3]);
+		f.width = GifWord(&in[pos + 5]);
+		f.height = GifWord(&in[pos + 7]);
+		BYTE packed = in[pos + 9];
+		size_t data = pos + 10, ct = gct, ctSize = gctSize;
+		BYTE ctBits = flags & 7;
+		if (packed & 0x80)
+		{
+			ct = data;
+			ctSize = 3u << ((packed & 7) + 1);
+			ctBits = packed & 7;
+			data += ctSize;
+		}
+		size_t end = data < in.size() ? GifSkipBlocks(in, data + 1) : 0;
+		if (!end || !ctSize || !f.width || !f.height) break;
+
+		// a GIF of its own: the frame at the origin, its color table as the global one
+		std::vector<BYTE>& o = f.image;
+		o.reserve(64 + ctSize + (end - data));
+		o.insert(o.end(), { 'G', 'I', 'F', '8', '9', 'a' });
+		BYTE lsd[7] = { 0, 0, 0, 0, (BYTE)(0xF0 | ctBits), 0, 0 };
+		GifPutWord(lsd, f.width);
+		GifPutWord(lsd + 2, f.height);
+		o.insert(o.end(), lsd, lsd + 7);
+		o.insert(o.end(), in.begin() + ct, in.begin() + ct + ctSize);
+		if (transparent >= 0) o.insert(o.end(), { 0x21, 0xF9, 4, 1, 0, 0, (BYTE)transparent, 0 });
+		BYTE desc[10] = { 0x2C, 0, 0, 0, 0, 0, 0, 0, 0, (BYTE)(packed & 0x40) };
+		GifPutWord(desc + 5, f.width);
+		GifPutWord(desc + 7, f.height);
+		o.insert(o.end(), desc, desc + 10);
+		o.insert(o.end(), in.begin() + data, in.begin() + end);
+		o.push_back(0x3B);
+
+		f.delayMs = FrameDelay(delay * 10);
+		f.dispose = dispose;
+		anim->frames.push_back(std::move(f));
+		delay = 0;
+		transparent = -1;
+		dispose = AnimDispose::None;
+		pos = end;
+	}
+	return anim;
+}
+
+static std::shared_ptr<Animation> ParseApng(const std::vector<BYTE>& in)
+{
+	auto anim = std::make_shared<Animation>();
+	const BYTE* ihdr = nullptr;
+	std::vector<BYTE> shared; // chunks before the image data, copied into every frame
+	std::vector<BYTE> data;   // the current frame's compressed data
+	bool animated = false;
+
+	// a PNG of its own: the file's header chunks around the frame's data
+	auto finish = [&]()
+	{
+		if (anim->frames.empty() || data.empty()) return;
+		std::vector<BYTE>& o = anim->frames.back().image;
+		o = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		BYTE header[13];
+		memcpy(header, ihdr, 13);
+		const AnimFrame& f = anim->frames.back();
+		for (int i = 0; i < 4; ++i)
+		{
+			header[i] = (BYTE)(f.width >> (24 - 8 * i));
+			header[4 + i] = (BYTE)(f.height >> (24 - 8 * i));
+		}
+		PngChunk(o, "IHDR", header, 13);
+		o.insert(o.end(), shared.begin(), shared.end());
+		PngChunk(o, "IDAT", data.data(), data.size());
+		PngChunk(o, "IEND", nullptr, 0);
+		data.clear();
+	};
+
+	bool inImage = false, frameOpen = false;
+	for (size_t pos = 8; pos + 12 <= in.size();)
+	{
+		uint32_t len = GetBE32(&in[pos]);
+		const char* type = (const char*)&in[pos + 4];
+		const BYTE* p = &in[pos + 8];
+		if (len > in.size() - pos - 12) break;
+		if (!memcmp(type, "IHDR", 4) && len >= 13) ihdr = p;
+		else if (!memcmp(type, "acTL", 4) && len >= 8)
+		{
+			animated = true;
+			anim->loops = GetBE32(p + 4);
+		}
+		else if (!memcmp(type, "fcTL", 4) && len >= 26)
+		{
+			finish();
+			AnimFrame f;
+			f.width = GetBE32(p + 4);
+			f.height = GetBE32(p + 8);
+			f.x = GetBE32(p + 12);
+			f.y = GetBE32(p + 16);
+			UINT num = (p[20] << 8) | p[21], den = (p[22] << 8) | p[23];
+			f.delayMs = FrameDelay(num * 1000 / (den ? den : 100));
+			f.dispose = p[24] == 1 ? AnimDispose::Background : p[24] == 2 ? AnimDispose::Previous : AnimDispose::None;
+			f.blend = p[25] == 1;
+			anim->frames.push_back(std::move(f));
+			frameOpen = true;
+		}
+		else if (!memcmp(type, "IDAT", 4))
+		{
+			// acTL comes before the image data; without it this is a still PNG
+			if (!animated || !ihdr) return nullptr;
+			inImage = true;
+			if (frameOpen) data.insert(data.end(), p, p + len); // else the default image is not a frame
+		}
+		else if (!memcmp(type, "fdAT", 4) && len >= 4)
+		{
+			if (frameOpen) data.insert(data.end(), p + 4, p + len);
+		}
+		else if (!memcmp(type, "IEND", 4)) break;
+		else if (!inImage && memcmp(type, "IHDR", 4)) shared.insert(shared.end(), in.begin() + pos, in.begin() + pos + len + 12);
+		pos += len + 12;
+	}
+	finish();
+	if (!animated || !ihdr) return nullptr;
+
+	// frames that failed to carry data are dropped
+	anim->frames.erase(std::remove_if(anim->frames.begin(), anim->frames.end(), [](const AnimFrame& f) { return f.image.empty(); }), anim->frames.end());
+	if (!anim->frames.empty() && anim->frames[0].dispose == AnimDispose::Previous) anim->frames[0].dispose = AnimDispose::Background;
+	anim->width = GetBE32(ihdr);
+	anim->height = GetBE32(ihdr + 4);
+	static const UINT channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+	anim->bpp = ihdr[8] * (ihdr[9] < 7 ? channels[ihdr[9]] : 0);
+	return anim;
+}
+
+static std::shared_ptr<Animation> ParseAnimatedWebp(const std::vector<BYTE>& in)
+{
+	// VP8X with the animation flag, then ANIM and one ANMF per frame
+	if (in.size() < 30 || memcmp(&in[12], "VP8X", 4) || !(in[20] & 0x02)) return nullptr;
+	auto anim = std::make_shared<Animation>();
+	anim->width = GetLE24(&in[24]) + 1;
+	anim->height = GetLE24(&in[27]) + 1;
+
+	for (size_t pos = 12; pos + 8 <= in.size();)
+	{
+		uint32_t len = GetLE32(&in[pos + 4]);
+		size_t data = pos + 8;
+		if (len > in.size() - data) break;
+		if (!memcmp(&in[pos], "ANIM", 4) && len >= 6) anim->loops = GifWord(&in[data + 4]);
+		else if (!memcmp(&in[pos], "ANMF", 4) && len >= 16)
+		{
+			const BYTE* p = &in[data];
+			AnimFrame f;
+			f.x = GetLE24(p) * 2;
+			f.y = GetLE24(p + 3) * 2;
+			f.width = GetLE24(p + 6) + 1;
+			f.height = GetLE24(p + 9) + 1;
+			f.delayMs = FrameDelay(GetLE24(p + 12));
+			f.blend = !(p[15] & 0x02);
+			f.dispose = (p[15] & 0x01) ? AnimDispose::Background : AnimDispose::None;
+
+			// a WebP of its own: VP8X for the alpha flag, then the frame's chunks as stored
+			bool alpha = false;
+			for (size_t c = data + 16; c + 8 <= data + len; c += 8 + ((GetLE32(&in[c + 4]) + 1) & ~1u))
+				alpha |= !memcmp(&in[c], "ALPH", 4) || !memcmp(&in[c], "VP8L", 4);
+			std::vector<BYTE>& o = f.image;
+			o.reserve(len + 30);
+			o.insert(o.end(), { 'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'E', 'B', 'P', 'V', 'P', '8', 'X', 10, 0, 0, 0 });
+			o.insert(o.end(), { (BYTE)(alpha ? 0x10 : 0), 0, 0, 0 });
+			for (UINT v : { f.width - 1, f.height - 1 }) o.insert(o.end(), { (BYTE)v, (BYTE)(v >> 8), (BYTE)(v >> 16) });
+			o.insert(o.end(), in.begin() + data + 16, in.begin() + data + len);
+			if (o.size() & 1) o.push_back(0);
+			uint32_t riff = (uint32_t)o.size() - 8;
+			for (int i = 0; i < 4; ++i) o[4 + i] = (BYTE)(riff >> (8 * i));
+			anim->frames.push_back(std::move(f));
+		}
+		pos = data + len + (len & 1);
+	}
+	return anim;
+}
+
+// null unless bytes hold an animation of at least two frames
+static std::shared_ptr<Animation> ParseAnimation(const std::vector<BYTE>& bytes)
+{
+	Subsystem sub = DecodeSubsystemFor(bytes);
+	std::shared_ptr<Animation> anim = sub == Subsystem::DecodeGif ? ParseGifAnimation(bytes) :
+		sub == Subsystem::DecodePng ? ParseApng(bytes) :
+		sub == Subsystem::DecodeWebp ? ParseAnimatedWebp(bytes) : nullptr;
+	if (!anim) return nullptr;
+	anim->frames.erase(std::remove_if(anim->frames.begin(), anim->frames.end(),
+		[](const AnimFrame& f) { return (uint64_t)f.width * f.height > MaxAnimationPixels; }), anim->frames.end());
+	if (anim->frames.size() < 2 || !anim->width || !anim->height || (uint64_t)anim->width * anim->height > MaxAnimationPixels) return nullptr;
+	anim->decoder = sub;
+	return anim;
+}
+
+// Draws a decoded frame onto the canvas, over it when the frame blends and
+// replacing its rectangle otherwise. Both are premultiplied BGRA.
+static void CompositeFrame(PixelBuffer& canvas, const AnimFrame& f, const PixelBuffer& px)
+{
+	if (f.x >= canvas.width || f.y >= canvas.height) return;
+	UINT w = (std::min)(px.width, canvas.width - f.x), h = (std::min)(px.height, canvas.height - f.y);
+
+	// c * k / 255 for all four channels at once
+	auto scale = [](uint32_t c, uint32_t k)
+	{
+		uint32_t rb = (c & 0x00FF00FF) * k + 0x00800080;
+		uint32_t ag = ((c >> 8) & 0x00FF00FF) * k + 0x00800080;
+		return (((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF) | ((ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00);
+	};
+	for (UINT y = 0; y < h; ++y)
+	{
+		const uint32_t* s = (const uint32_t*)px.Row(y);
+		uint32_t* d = (uint32_t*)canvas.Row(f.y + y) + f.x;
+		if (!f.blend)
+		{
+			memcpy(d, s, w * 4);
+			continue;
+		}
+		for (UINT x = 0; x < w; ++x)
+		{
+			uint32_t a = s[x] >> 24;
+			if (a == 255) d[x] = s[x];
+			else if (a) d[x] = s[x] + scale(d[x], 255 - a);
+		}
+	}
+}
+
+// Copies the canvas under f into saved, or back from it when restore is set;
+// with no saved pixels to restore, clears it instead.
+static void FrameRect(PixelBuffer& canvas, const AnimFrame& f, std::vector<uint32_t>& saved, bool restore)
+{
+	if (f.x >= canvas.width || f.y >= canvas.height) return;
+	UINT w = (std::min)(f.width, canvas.width - f.x), h = (std::min)(f.height, canvas.height - f.y);
+	if (!restore) saved.resize((size_t)w * h);
+	for (UINT y = 0; y < h; ++y)
+	{
+		uint32_t* row = (uint32_t*)canvas.Row(f.y + y) + f.x;
+		if (!restore) memcpy(&saved[(size_t)y * w], row, w * 4);
+		else if (saved.size() == (size_t)w * h) memcpy(row, &saved[(size_t)y * w], w * 4);
+		else memset(row, 0, w * 4);
+	}
+}
+
+// Fills info from an animated file, the first frame as its pixels; false if
+// bytes hold a single image.
+static bool DecodeAnimation(const std::vector<BYTE>& bytes, CacheInfo& info)
+{
+	std::shared_ptr<Animation> anim = ParseAnimation(bytes);
+	if (!anim) return false;
+	auto px = std::make_shared<PixelBuffer>(anim->width, anim->height);
+	int orient = 1;
+	if (auto first = DecodeReduced(anim->frames[0].image, 0, orient)) CompositeFrame(*px, anim->frames[0], *first);
+	static const wchar_t* const types[] = { L"GIF", L"PNG", L"WebP" };
+	int kind = anim->decoder == Subsystem::DecodeGif ? 0 : anim->decoder == Subsystem::DecodePng ? 1 : 2;
+	info.type = types[kind];
+	info.rawFormat = kind == 0 ? ImageFormatGIF : kind == 1 ? ImageFormatPNG : GUID();
+	info.width = anim->width;
+	info.height = anim->height;
+	info.bpp = anim->bpp;
+	info.frameCount = (UINT)anim->frames.size();
+	info.animation = anim;
+	info.pixels = px;
+	info.bitmap = WrapPixels(px);
+	return true;
+}
+
+// ---------------------------------------------------------------------------
+// Lossless JPEG crop. The scan is walked with the file's own Huffman tables
+// only to find where each block's bits start and end; the blocks inside the
+// crop are then copied bit for bit, without dequantizing or transforming
+// anything. Only the DC terms change, since each is coded as the difference to
+// the block before it, so they get new optimal DC tables. Handles single-scan
+// baseline and extended Huffman JPEGs; the crop origin must be on the MCU grid.
+
+struct JpegHuffman
+{
+	uint16_t fast[1 << 9] = {}; // (length << 8) | symbol for codes of up to 9 bits
+	int maxCode[17] = {};       // largest code of each length, -1 if none
+	int valOffset[17] = {};     // index in vals of a length's codes, minus its first code
+	BYTE vals[256] = {};
+	bool defined = false;
+};
+
+struct JpegLayout
+{
+	struct Component
+	{
+		BYTE id, h, v, dc, ac;
+	};
+
+	UINT width = 0;
+	UINT height = 0;
+	int comps = 0;
+	Component comp[4] = {};
+	UINT mcuW = 8;
+	UINT mcuH = 8;
+	UINT mcusX = 0;
+	UINT restart = 0;              // MCUs per restart interval, 0 for none
+	std::vector<size_t> segments;  // marker segments before the scan
+	size_t sos = 0;                // the SOS marker
+	size_t scan = 0;               // entropy-coded data
+	size_t scanEnd = 0;
+	JpegHuffman dc[4];
+	JpegHuffman ac[4];
+};
+
+static UINT JpegWord(const BYTE* p) { return (p[0] << 8) | p[1]; }
+
+static bool JpegBuildHuffman(const BYTE* counts, const BYTE* vals, JpegHuffman& h)
+{
+	h = {};
+	int code = 0, k = 0;
+	for (int len = 1; len <= 16; ++len)
+	{
+		h.valOffset[len] = k - code;
+		for (int i = 0; i < counts[len - 1]; ++i, ++k, ++code)
+		{
+			if (len <= 9)
+			{
+				int first = code << (9 - len);
+				for (int j = 0; j < (1 << (9 - len)); ++j) h.fast[first + j] = (uint16_t)((len << 8) | vals[k]);
+			}
+		}
+		if (code > (1 << len)) return false;
+		h.maxCode[len] = counts[len - 1] ? code - 1 : -1;
+		code <<= 1;
+	}
+	std::copy(vals, vals + k, h.vals);
+	h.defined = true;
+	return true;
+}
+
+// Reads the markers up to the end of the first scan. False for anything the
+// lossless crop does not handle (progressive, arithmetic, multi-scan, 12 bit).
+static bool ParseJpeg(const std::vector<BYTE>& in, JpegLayout& jl)
+{
+	size_t n = in.size();
+	if (n < 4 || in[0] != 0xFF || in[1] != 0xD8) return false;
+	size_t pos = 2;
+	for (;;)
+	{
+		while (pos < n && in[pos] == 0xFF && pos + 1 < n && in[pos + 1] == 0xFF) ++pos; // fill bytes
+		if (pos + 4 > n || in[pos] != 0xFF) return false;
+		BYTE m = in[pos + 1];
+		size_t len = JpegWord(&in[pos + 2]);
+		if (len < 2 || pos + 2 + len > n) return false;
+		const BYTE* seg = &in[pos + 4];
+		size_t segLen = len - 2;
+
+		if (m == 0xC0 || m == 0xC1)
+		{
+			if (segLen < 6 || seg[0] != 8) return false;
+			jl.height = JpegWord(seg + 1);
+			jl.width = JpegWord(seg + 3);
+			jl.comps = seg[5];
+			if (!jl.width || !jl.height || jl.comps < 1 || jl.comps > 4 || segLen < 6 + 3u * jl.comps) return false;
+			int hmax = 1, vmax = 1, blocks = 0;
+			for (int c = 0; c < jl.comps; ++c)
+			{
+				auto& cp = jl.comp[c];
+				cp.id = seg[6 + 3 * c];
+				cp.h = seg[7 + 3 * c] >> 4;
+				cp.v = seg[7 + 3 * c] & 15;
+				if (cp.h < 1 || cp.h > 4 || cp.v < 1 || cp.v > 4) return false;
+				hmax = (std::max)(hmax, (int)cp.h);
+				vmax = (std::max)(vmax, (int)cp.v);
+				blocks += cp.h * cp.v;
+			}
+			if (jl.comps == 1)
+			{
+				jl.comp[0].h = jl.comp[0].v = 1; // a lone component is never interleaved
+				hmax = vmax = 1;
+			}
+			else if (blocks > 10)
+			{
+				return false;
+			}
+			jl.mcuW = 8 * hmax;
+			jl.mcuH = 8 * vmax;
+			jl.mcusX = (jl.width + jl.mcuW - 1) / jl.mcuW;
+		}
+		else if (m >= 0xC2 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC)
+		{
+			return false;
+		}
+		else if (m == 0xC4)
+		{
+			for (size_t i = 0; i < segLen;)
+			{
+				if (i + 17 > segLen) return false;
+				BYTE tc = seg[i] >> 4, th = seg[i] & 15;
+				const BYTE* counts = seg + i + 1;
+				size_t total = 0;
+				for (int k = 0; k < 16; ++k) total += counts[k];
+				if (tc > 1 || th > 3 || total > 256 || i + 17 + total > segLen) return false;
+				if (!JpegBuildHuffman(counts, seg + i + 17, tc ? jl.ac[th] : jl.dc[th])) return false;
+				i += 17 + total;
+			}
+		}
+		else if (m == 0xDD)
+		{
+			if (segLen < 2) return false;
+			jl.restart = JpegWord(seg);
+		}
+		else if (m == 0xDA)
+		{
+			if (!jl.comps || segLen < 1u + 2 * jl.comps || seg[0] != jl.comps) return false;
+			for (int i = 0; i < jl.comps; ++i)
+			{
+				auto& cp = jl.comp[i];
+				if (seg[1 + 2 * i] != cp.id) return false;
+				cp.dc = seg[2 + 2 * i] >> 4;
+				cp.ac = seg[2 + 2 * i] & 15;
+				if (cp.dc > 3 || cp.ac > 3 || !jl.dc[cp.dc].defined || !jl.ac[cp.ac].defined) return false;
+			}
+			jl.sos = pos;
+			jl.scan = pos + 2 + len;
+
+			// the scan runs to the first marker that is not a restart
+			size_t i = jl.scan;
+			for (; i + 1 < n; ++i)
+			{
+				if (in[i] != 0xFF) continue;
+				BYTE next = in[i + 1];
+				if (next == 0x00 || (next >= 0xD0 && next <= 0xD7)) ++i;
+				else if (next != 0xFF) break;
+			}
+			jl.scanEnd = i;
+			return i + 1 < n && in[i + 1] == 0xD9; // a second scan means progressive-like layouts
+		}
+		else if (m == 0xD9)
+		{
+			return false;
+		}
+		jl.segments.push_back(pos);
+		pos += 2 + len;
+	}
+}
+
+static bool JpegMcuSize(const std::vector<BYTE>& bytes, UINT& mcuW, UINT& mcuH)
+{
+	JpegLayout jl;
+	if (!ParseJpeg(bytes, jl)) return false;
+	mcuW = jl.mcuW;
+	mcuH = jl.mcuH;
+	return true;
+}
+
+// 16 bits of the destuffed scan at bit pos, most significant first
+static uint32_t JpegPeek16(const BYTE* data, size_t pos)
+{
+	const BYTE* p = data + (pos >> 3);
+	uint32_t v = ((uint32_t)p[0] << 16) | (p[1] << 8) | p[2];
+	return (v >> (8 - (pos & 7))) & 0xFFFF;
+}
+
+static int JpegDecode(const BYTE* data, size_t& pos, const JpegHuffman& h)
+{
+	uint32_t bits = JpegPeek16(data, pos);
+	uint16_t f = h.fast[bits >> 7];
+	if (f)
+	{
+		pos += f >> 8;
+		return f & 0xFF;
+	}
+	for (int len = 10; len <= 16; ++len)
+	{
+		int code = (int)(bits >> (16 - len));
+		if (code <= h.maxCode[len])
+		{
+			pos += len;
+			return h.vals[h.valOffset[len] + code];
+		}
+	}
+	return -1;
+}
+
+// MSB-first bit packing with the 0xFF byte stuffing of entropy-coded data
+class JpegBits
+{
+public:
+	explicit JpegBits(std::vector<BYTE>& out) : m_out(out) {}
+
+	void Put(uint32_t bits, int count)
+	{
+		m_bits = (m_bits << count) | (bits & ((1u << count) - 1));
+		for (m_count += count; m_count >= 8;)
+		{
+			m_count -= 8;
+			BYTE b = (BYTE)(m_bits >> m_count);
+			m_out.push_back(b);
+			if (b == 0xFF) m_out.push_back(0);
+		}
+	}
+
+	void Flush()
+	{
+		if (m_count) Put(0x7F, 8 - m_count); // padded with ones
+	}
+
+private:
+	std::vector<BYTE>& m_out;
+	uint64_t m_bits = 0;
+	int m_count = 0;
+};
+
+static int JpegCategory(int v) { return v ? std::bit_width((unsigned)(v < 0 ? -v : v)) : 0; }
+
+// Crops to w x h stored pixels at (x, y), which must be a multiple of the MCU
+// size. Every marker segment is kept (EXIF, ICC, quantization tables); the
+// restart intervals are dropped.
+static bool CropJpegLossless(const std::vector<BYTE>& in, UINT x, UINT y, UINT w, UINT h, std::vector<BYTE>& out)
+{
+	JpegLayout jl;
+	if (!ParseJpeg(in, jl) || x % jl.mcuW || y % jl.mcuH || !w || !h || x + w > jl.width || y + h > jl.height) return false;
+
+	// the scan without stuffing; each restart interval starts a new segment
+	std::vector<BYTE> data;
+	std::vector<size_t> intervals{ 0 };
+	data.reserve(jl.scanEnd - jl.scan + 4);
+	for (size_t i = jl.scan; i < jl.scanEnd; ++i)
+	{
+		if (in[i] != 0xFF)
+		{
+			data.push_back(in[i]);
+			continue;
+		}
+		BYTE next = in[++i];
+		if (next == 0x00) data.push_back(0xFF);
+		else if (next >= 0xD0 && next <= 0xD7) intervals.push_back(data.size());
+		else --i; // fill byte
+	}
+	size_t dataBits = data.size() * 8;
+	data.insert(data.end(), 512, 0); // room for reading past the end within one block
+
+	// find the bits of every block inside the crop
+	struct Block
+	{
+		size_t ac;     // bit position of the AC terms
+		uint32_t bits; // their length
+		int dc;
+		int comp;
+	};
+	UINT mx0 = x / jl.mcuW, my0 = y / jl.mcuH;
+	UINT nx = (w + jl.mcuW - 1) / jl.mcuW, ny = (h + jl.mcuH - 1) / jl.mcuH;
+	int perMcu = 0;
+	for (int c = 0; c < jl.comps; ++c) perMcu += jl.comp[c].h * jl.comp[c].v;
+	std::vector<Block> blocks;
+	blocks.reserve((size_t)nx * ny * perMcu);
+	int pred[4] = {};
+	size_t pos = 0, interval = 0, mcu = 0;
+	for (UINT my = 0; my < my0 + ny; ++my)
+	{
+		for (UINT mx = 0; mx < jl.mcusX; ++mx, ++mcu)
+		{
+			if (jl.restart && mcu && mcu % jl.restart == 0)
+			{
+				if (++interval >= intervals.size()) return false;
+				pos = intervals[interval] * 8;
+				std::fill(pred, pred + 4, 0);
+			}
+			bool inside = my >= my0 && mx >= mx0 && mx < mx0 + nx;
+			for (int c = 0; c < jl.comps; ++c)
+			{
+				const JpegHuffman& dc = jl.dc[jl.comp[c].dc];
+				const JpegHuffman& ac = jl.ac[jl.comp[c].ac];
+				for (int b = 0; b < jl.comp[c].h * jl.comp[c].v; ++b)
+				{
+					if (pos > dataBits) return false;
+					int s = JpegDecode(data.data(), pos, dc);
+					if (s < 0 || s > 11) return false;
+					if (s)
+					{
+						uint32_t v = JpegPeek16(data.data(), pos) >> (16 - s);
+						pos += s;
+						pred[c] += v < (1u << (s - 1)) ? (int)v - (1 << s) + 1 : (int)v;
+					}
+					size_t acPos = pos;
+					for (int k = 1; k < 64; ++k)
+					{
+						int rs = JpegDecode(data.data(), pos, ac);
+						if (rs < 0) return false;
+						if (!(rs & 15))
+						{
+							if (rs != 0xF0) break; // end of block
+							k += 15;
+							continue;
+						}
+						k += rs >> 4;
+						pos += rs & 15;
+					}
+					if (inside) blocks.push_back({ acPos, (uint32_t)(pos - acPos), pred[c], c });
+				}
+			}
+		}
+	}
+	if (pos > dataBits) return false;
+
+	// DC tables for the new differences. A dummy symbol with the longest code
+	// keeps real codes off all ones, as the standard requires.
+	const int kDummy = 16;
+	uint32_t freq[4][17] = {};
+	int prev[4] = {};
+	for (auto& b : blocks)
+	{
+		int s = JpegCategory(b.dc - prev[b.comp]);
+		if (s > 11) return false;
+		++freq[jl.comp[b.comp].dc][s];
+		prev[b.comp] = b.dc;
+	}
+	BYTE lengths[4][17] = {};
+	uint16_t codes[4][17] = {};
+	bool used[4] = {};
+	for (int c = 0; c < jl.comps; ++c) used[jl.comp[c].dc] = true;
+	std::vector<BYTE> dht;
+	for (int t = 0; t < 4; ++t)
+	{
+		if (!used[t]) continue;
+		freq[t][kDummy] = 1;
+		BuildHuffmanLengths(freq[t], 17, 16, lengths[t]);
+		BYTE* longest = std::max_element(lengths[t], lengths[t] + 17);
+		std::swap(*longest, lengths[t][kDummy]);
+		BuildHuffmanCodes(lengths[t], 17, codes[t]);
+
+		dht.push_back((BYTE)t);
+		size_t countsAt = dht.size();
+		dht.resize(dht.size() + 16);
+		for (int len = 1; len <= 16; ++len)
+		{
+			for (int sym = 0; sym < kDummy; ++sym)
+			{
+				if (lengths[t][sym] != len) continue;
+				++dht[countsAt + len - 1];
+				dht.push_back((BYTE)sym);
+			}
+		}
+	}
+
+	out.clear();
+	out.reserve(in.size());
+	out.insert(out.end(), in.begin(), in.begin() + 2);
+	for (size_t p : jl.segments)
+	{
+		BYTE m = in[p + 1];
+		if (m == 0xDD) continue; // no restart intervals in the output
+		size_t at = out.size();
+		out.insert(out.end(), in.begin() + p, in.begin() + p + 2 + JpegWord(&in[p + 2]));
+		if (m == 0xC0 || m == 0xC1)
+		{
+			out[at + 5] = (BYTE)(h >> 8);
+			out[at + 6] = (BYTE)h;
+			out[at + 7] = (BYTE)(w >> 8);
+			out[at + 8] = (BYTE)w;
+		}
+	}
+	out.push_back(0xFF);
+	out.push_back(0xC4);
+	out.push_back((BYTE)((dht.size() + 2) >> 8));
+	out.push_back((BYTE)(dht.size() + 2));
+	out.insert(out.end(), dht.begin(), dht.end());
+	out.insert(out.end(), in.begin() + jl.sos, in.begin() + jl.scan);
+
+	JpegBits bw(out);
+	std::fill(prev, prev + 4, 0);
+	for (auto& b : blocks)
+	{
+		int t = jl.comp[b.comp].dc;
+		int diff = b.dc - prev[b.comp];
+		int s = JpegCategory(diff);
+		prev[b.comp] = b.dc;
+		bw.Put(codes[t][s], lengths[t][s]);
+		if (s) bw.Put(diff < 0 ? diff + (1 << s) - 1 : diff, s);
+		for (size_t p = b.ac, left = b.bits; left;)
+		{
+			int count = (int)(std::min)(left, (size_t)16);
+			bw.Put(JpegPeek16(data.data(), p) >> (16 - count), count);
+			p += count;
+			left -= count;
+		}
+	}
+	bw.Flush();
+	out.push_back(0xFF);
+	out.push_back(0xD9);
+	return true;
+}
+
+// ---------------------------------------------------------------------------
+// Tile pyramid: the first time a very large image is decoded, a background
+// job writes its stored pixels as 256 x 256 tiles at full size and at every
+// halving down to a single tile, with an index, into one file under
+// %LOCALAPPDATA%. Full size stays lossless, as 100% and the loupe show it;
+// the halvings are only ever shown reduced and may be JPEGs. Opening it
+// again decodes nothing: each display frame and loupe tile reads only the
+// tiles of the level it needs. A pyramid is used only while the image's size
+// and modification time match; the cache is trimmed least recently used
+// first.
+
+static const UINT PyramidTileSize = 256;
+static const uint64_t PyramidMinPixels = 64ull << 20; // smaller images decode quickly enough
+static const uint64_t PyramidMaxBytes = 2ull << 30;   // per image; larger pyramids are abandoned
+static const uint64_t PyramidCacheBytes = 8ull << 30; // all pyramids together
+static const UINT PyramidOverviewEdge = 1024;         // the level kept in memory for previews
+static const char PyramidMagic[8] = { 'I', 'V', 'P', 'Y', 'R', 'M', 'D', '2' }; // 1 had lossy full size tiles
+
+struct PyramidTile
+{
+	uint64_t offset;
+	uint32_t size;
+};
+
+struct TilePyramid
+{
+	std::wstring file;
+	UINT width = 0, height = 0;     // level 0, as stored
+	std::vector<UINT> levelFirst;   // index of each level's first tile; one extra at the end
+	std::vector<PyramidTile> tiles; // level by level, rows top to bottom, as they are in the file
+	std::shared_ptr<PixelBuffer> overview;
+
+	// what the cache entry needs without opening the image
+	GUID rawFormat = {};
+	std::wstring type, exifDate;
+	UINT bpp = 0;
+	int orientation = 1;
+	UINT cropGridW = 1, cropGridH = 1;
+	std::vector<BYTE> icc;
+
+	UINT Levels() const { return (UINT)levelFirst.size() - 1; }
+	UINT LevelWidth(UINT level) const { return (width + (1u << level) - 1) >> level; }
+	UINT LevelHeight(UINT level) const { return (height + (1u << level) - 1) >> level; }
+	UINT TilesX(UINT level) const { return (LevelWidth(level) + PyramidTileSize - 1) / PyramidTileSize; }
+	UINT TilesY(UINT level) const { return (LevelHeight(level) + PyramidTileSize - 1) / PyramidTileSize; }
+};
+
+static fs::path PyramidDir()
+{
+	PWSTR local = nullptr;
+	fs::path dir;
+	if (SUCCEEDED(SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, nullptr, &local))) dir = fs::path(local) / L"ImageViewer" / L"Pyramids";
+	CoTaskMemFree(local);
+	return dir;
+}
+
+static fs::path PyramidFile(const std::wstring& path)
+{
+	fs::path dir = PyramidDir();
+	if (dir.empty()) return dir;
+	wchar_t name[32];
+	swprintf(name, 32, L"%016llx.pyr", (unsigned long long)std::hash<std::wstring>()(FolderKey(path)));
+	return dir / name;
+}
+
+static bool WantsPyramid(const CacheInfo& info)
+{
+	return info.pixels && !info.svg && !info.animation && info.pixels->format != PixelFormat64bppARGB &&
+		(uint64_t)info.width * info.height >= PyramidMinPixels;
+}
+
+static bool ReadAt(HANDLE h, uint64_t offset, void* dst, size_t size)
+{
+	OVERLAPPED ov = {};
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD got = 0;
+	return ReadFile(h, dst, (DWORD)size, &got, &ov) && got == size;
+}
+
+static bool WriteAt(HANDLE h, uint64_t offset, const void* src, size_t size)
+{
+	OVERLAPPED ov = {};
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD put = 0;
+	if (!WriteFile(h, src, (DWORD)size, &put, &ov) || put != size) return false;
+	ChargeWrite(size);
+	return true;
+}
+
+// Opaque tiles become JPEGs, a fraction of the size, unless they must stay
+// lossless; tiles with transparency always do.
+static std::vector<BYTE> EncodeTile(const PixelBuffer& px, bool lossless)
+{
+	if (lossless) return EncodePng(px, PngPreset::Fast, QoS::Background);
+	bool opaque = true;
+	for (UINT y = 0; y < px.height && opaque; ++y)
+	{
+		const BYTE* row = px.Row(y);
+		for (UINT x = 0; x < px.width; ++x) opaque &= row[x * 4 + 3] == 255;
+	}
+	if (!opaque) return EncodePng(px, PngPreset::Fast, QoS::Background);
+
+	std::vector<BYTE> out;
+	Bitmap bmp((INT)px.width, (INT)px.height, (INT)px.stride, px.format, (BYTE*)px.data.data());
+	CLSID enc = GetEncoderClsid(L"image/jpeg");
+	ULONG quality = 90;
+	EncoderParameters params = {};
+	params.Count = 1;
+	params.Parameter[0].Guid = EncoderQuality;
+	params.Parameter[0].Type = EncoderParameterValueTypeLong;
+	params.Parameter[0].NumberOfValues = 1;
+	params.Parameter[0].Value = &quality;
+	IStream* stream = SHCreateMemStream(nullptr, 0);
+	STATSTG st = {};
+	if (stream && bmp.Save(stream, &enc, &params) == Ok && SUCCEEDED(stream->Stat(&st, STATFLAG_NONAME)))
+	{
+		LARGE_INTEGER zero = {};
+		ULONG got = 0;
+		out.resize((size_t)st.cbSize.QuadPart);
+		if (FAILED(stream->Seek(zero, STREAM_SEEK_SET, nullptr)) || FAILED(stream->Read(out.data(), (ULONG)out.size(), &got)) || got != out.size()) out.clear();
+	}
+	if (stream) stream->Release();
+	return out;
+}
+
+// The index at the end of a pyramid file: the image it was made from, the
+// cache entry's metadata and every tile's place.
+static std::vector<BYTE> PyramidIndex(const std::wstring& path, const CacheInfo& info, const TilePyramid& pyr)
+{
+	std::vector<BYTE> out;
+	auto put = [&](const void* p, size_t n) { out.insert(out.end(), (const BYTE*)p, (const BYTE*)p + n); };
+	auto put32 = [&](uint32_t v) { put(&v, 4); };
+	auto putBlob = [&](const void* p, size_t n) { put32((uint32_t)n); put(p, n); };
+	std::wstring key = FolderKey(path);
+	putBlob(key.data(), key.size() * sizeof(wchar_t));
+	put(&info.fileSize, 8);
+	put(&info.lastWriteTime, 8);
+	put32(pyr.width);
+	put32(pyr.height);
+	put(&info.rawFormat, sizeof(GUID));
+	putBlob(info.type.data(), info.type.size() * sizeof(wchar_t));
+	putBlob(info.exifDate.data(), info.exifDate.size() * sizeof(wchar_t));
+	put32(info.bpp);
+	put32((uint32_t)info.orientation);
+	put32(info.cropGridW);
+	put32(info.cropGridH);
+	if (info.icc) putBlob(info.icc->data(), info.icc->size());
+	else put32(0);
+	putBlob(pyr.levelFirst.data(), pyr.levelFirst.size() * sizeof(UINT));
+	for (const PyramidTile& t : pyr.tiles)
+	{
+		put(&t.offset, 8);
+		put32(t.size);
+	}
+	return out;
+}
+
+// Drops the least recently used pyramids beyond PyramidCacheBytes.
+static void TrimPyramids()
+{
+	struct Entry { fs::path file; uint64_t size; fs::file_time_type used; };
+	std::vector<Entry> entries;
+	std::error_code ec;
+	for (fs::directory_iterator it(PyramidDir(), ec), end; !ec && it != end; it.increment(ec))
+	{
+		if (it->path().extension() != L".pyr") continue;
+		std::error_code e1, e2;
+		uint64_t size = it->file_size(e1);
+		fs::file_time_type used = it->last_write_time(e2);
+		if (!e1 && !e2) entries.push_back({ it->path(), size, used });
+	}
+	std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used > b.used; });
+	uint64_t total = 0;
+	for (const Entry& e : entries)
+	{
+		total += e.size;
+		if (total > PyramidCacheBytes) fs::remove(e.file, ec);
+	}
+}
+
+// Runs on a worker: writes the pyramid for path from its decoded pixels.
+// Level 0 is cut from the pixels and stored losslessly, every other level is
+// the one above halved.
+static bool WritePyramid(const std::wstring& path, const CacheInfo& info)
+{
+	UsageScope usage(Subsystem::Encode);
+	fs::path file = PyramidFile(path);
+	if (file.empty()) return false;
+	std::error_code ec;
+	fs::create_directories(file.parent_path(), ec);
+	std::wstring tmp = file.wstring() + L".tmp";
+	HANDLE h = CreateFileW(tmp.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (h == INVALID_HANDLE_VALUE) return false;
+
+	// header: magic, then where the index is and its size
+	TilePyramid pyr;
+	pyr.width = info.width;
+	pyr.height = info.height;
+	uint64_t header[2] = {};
+	uint64_t offset = sizeof(PyramidMagic) + sizeof(header);
+	bool ok = true;
+	const PixelBuffer* level = info.pixels.get();
+	std::unique_ptr<PixelBuffer> halved;
+	for (UINT l = 0; ok; ++l)
+	{
+		const UINT lw = pyr.LevelWidth(l), lh = pyr.LevelHeight(l), cols = pyr.TilesX(l);
+		pyr.levelFirst.push_back((UINT)pyr.tiles.size());
+		for (UINT ty = 0; ty < pyr.TilesY(l) && ok; ++ty)
+		{
+			std::vector<std::vector<BYTE>> row(cols);
+			ParallelFor(cols, 1, QoS::Background, [&](UINT c0, UINT c1)
+			{
+				for (UINT tx = c0; tx < c1; ++tx)
+				{
+					PixelBuffer tile((std::min)(PyramidTileSize, lw - tx * PyramidTileSize), (std::min)(PyramidTileSize, lh - ty * PyramidTileSize));
+					RenderOriented(*level, 1, lw, lh, tx * PyramidTileSize, ty * PyramidTileSize, tile, QoS::Background);
+					row[tx] = EncodeTile(tile, l == 0);
+				}
+			});
+			for (const std::vector<BYTE>& t : row)
+			{
+				ok = ok && !g_stopThreads && !t.empty() && offset + t.size() <= PyramidMaxBytes && WriteAt(h, offset, t.data(), t.size());
+				pyr.tiles.push_back({ offset, (uint32_t)t.size() });
+				offset += t.size();
+			}
+		}
+		if (!ok || (lw <= PyramidTileSize && lh <= PyramidTileSize)) break;
+
+		auto next = std::make_unique<PixelBuffer>(pyr.LevelWidth(l + 1), pyr.LevelHeight(l + 1));
+		RenderOriented(*level, 1, next->width, next->height, 0, 0, *next, QoS::Background);
+		halved = std::move(next);
+		level = halved.get();
+	}
+	pyr.levelFirst.push_back((UINT)pyr.tiles.size());
+	halved.reset();
+
+	if (ok)
+	{
+		std::vector<BYTE> index = PyramidIndex(path, info, pyr);
+		header[0] = offset;
+		header[1] = index.size();
+		ok = WriteAt(h, offset, index.data(), index.size()) && WriteAt(h, 0, PyramidMagic, sizeof(PyramidMagic)) &&
+			WriteAt(h, sizeof(PyramidMagic), header, sizeof(header));
+	}
+	CloseHandle(h);
+	if (!ok || !MoveFileExW(tmp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFileW(tmp.c_str());
+		return false;
+	}
+	TrimPyramids();
+	return true;
+}
+
+// The pyramid for path if there is one for the file as it is now; stale ones
+// are deleted. Opening counts as a use for TrimPyramids.
+static std::shared_ptr<TilePyramid> OpenPyramid(const std::wstring& path, const WIN32_FILE_ATTRIBUTE_DATA& fad)
+{
+	fs::path file = PyramidFile(path);
+	if (file.empty()) return nullptr;
+	HANDLE h = CreateFileW(file.c_str(), GENERIC_READ | FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (h == INVALID_HANDLE_VALUE) return nullptr;
+
+	char magic[sizeof(PyramidMagic)];
+	uint64_t header[2] = {};
+	std::vector<BYTE> index;
+	if (ReadAt(h, 0, magic, sizeof(magic)) && !memcmp(magic, PyramidMagic, sizeof(magic)) && ReadAt(h, sizeof(magic), header, sizeof(header)) &&
+		header[1] <= (64u << 20))
+	{
+		index.resize((size_t)header[1]);
+		if (!ReadAt(h, header[0], index.data(), index.size())) index.clear();
+	}
+
+	const BYTE* p = index.data();
+	const BYTE* end = p + index.size();
+	bool ok = !index.empty();
+	auto get = [&](void* dst, size_t n) { ok = ok && (size_t)(end - p) >= n; if (ok) { memcpy(dst, p, n); p += n; } };
+	auto get32 = [&]() { uint32_t v = 0; get(&v, 4); return v; };
+	auto getBlob = [&](size_t unit) { uint32_t n = get32(); ok = ok && n % unit == 0 && n <= (size_t)(end - p); const BYTE* b = p; if (ok) p += n; return std::make_pair(b, ok ? n : 0u); };
+	auto getString = [&]() { auto [b, n] = getBlob(sizeof(wchar_t)); return std::wstring((const wchar_t*)b, n / sizeof(wchar_t)); };
+
+	auto pyr = std::make_shared<TilePyramid>();
+	pyr->file = file.wstring();
+	std::wstring key = getString();
+	ULONGLONG size = 0;
+	FILETIME written = {};
+	get(&size, 8);
+	get(&written, 8);
+	bool current = ok && key == FolderKey(path) && size == (((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow) &&
+		CompareFileTime(&written, &fad.ftLastWriteTime) == 0;
+	pyr->width = get32();
+	pyr->height = get32();
+	get(&pyr->rawFormat, sizeof(GUID));
+	pyr->type = getString();
+	pyr->exifDate = getString();
+	pyr->bpp = get32();
+	pyr->orientation = (int)get32();
+	pyr->cropGridW = get32();
+	pyr->cropGridH = get32();
+	auto [icc, iccSize] = getBlob(1);
+	pyr->icc.assign(icc, icc + iccSize);
+	auto [levels, levelsSize] = getBlob(sizeof(UINT));
+	pyr->levelFirst.resize(levelsSize / sizeof(UINT));
+	if (levelsSize) memcpy(pyr->levelFirst.data(), levels, levelsSize);
+
+	// every level holds exactly its tiles
+	ok = ok && pyr->width && pyr->height && pyr->levelFirst.size() >= 2 && pyr->levelFirst[0] == 0;
+	for (UINT l = 0; ok && l < pyr->Levels(); ++l) ok = l < 16 && pyr->levelFirst[l + 1] - pyr->levelFirst[l] == pyr->TilesX(l) * pyr->TilesY(l);
+	ok = ok && (size_t)(end - p) == (size_t)pyr->levelFirst.back() * 12;
+
+	// and the tiles fill the file up to the index, in order
+	uint64_t next = sizeof(PyramidMagic) + sizeof(header);
+	for (UINT i = 0; ok && i < pyr->levelFirst.back(); ++i)
+	{
+		PyramidTile t;
+		get(&t.offset, 8);
+		t.size = get32();
+		ok = ok && t.offset == next;
+		next += t.size;
+		pyr->tiles.push_back(t);
+	}
+	ok = ok && next == header[0];
+
+	if (ok && current)
+	{
+		FILETIME now;
+		GetSystemTimeAsFileTime(&now);
+		SetFileTime(h, nullptr, nullptr, &now);
+	}
+	CloseHandle(h);
+	if (ok && current) return pyr;
+	DeleteFileW(file.c_str());
+	return nullptr;
+}
+
+// Decodes tiles [tx0, tx1] x [ty0, ty1] of a level into part, whose corner
+// is that of the first tile. Tiles that cannot be read stay transparent.
+static void ReadPyramidTiles(const TilePyramid& pyr, UINT level, UINT tx0, UINT ty0, UINT tx1, UINT ty1, PixelBuffer& part, QoS qos)
+{
+	const UINT cols = tx1 - tx0 + 1;
+	std::vector<std::vector<BYTE>> data((size_t)cols * (ty1 - ty0 + 1));
+	{
+		UsageScope usage(Subsystem::Read);
+		HANDLE h = CreateFileW(pyr.file.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (h == INVALID_HANDLE_VALUE) return;
+		for (UINT ty = ty0; ty <= ty1; ++ty)
+		{
+			// a row's tiles are stored one after another: one read each
+			const PyramidTile* first = &pyr.tiles[pyr.levelFirst[level] + ty * pyr.TilesX(level) + tx0];
+			std::vector<BYTE> row((size_t)(first[cols - 1].offset + first[cols - 1].size - first->offset));
+			if (!ReadAt(h, first->offset, row.data(), row.size())) continue;
+			ChargeRead(row.size());
+			for (UINT i = 0; i < cols; ++i)
+			{
+				auto from = row.begin() + (size_t)(first[i].offset - first->offset);
+				data[(size_t)(ty - ty0) * cols + i].assign(from, from + first[i].size);
+			}
+		}
+		CloseHandle(h);
+	}
+
+	ParallelFor((UINT)data.size(), 1, qos, [&](UINT i0, UINT i1)
+	{
+		for (UINT i = i0; i < i1; ++i)
+		{
+			int orient = 1;
+			std::shared_ptr<PixelBuffer> tile = data[i].empty() ? nullptr : DecodeReduced(data[i], 0, orient);
+			if (!tile) continue;
+			UINT x = (i % cols) * PyramidTileSize, y = (i / cols) * PyramidTileSize;
+			if (x >= part.width || y >= part.height) continue;
+			UINT w = (std::min)(tile->width, part.width - x), h = (std::min)(tile->height, part.height - y);
+			for (UINT r = 0; r < h; ++r) memcpy(part.Row(y + r) + x * 4, tile->Row(r), w * 4);
+		}
+	});
+}
+
+// RenderOriented for an image known by its pyramid: reads the smallest level
+// that is still at least the display size, and of it only the tiles the clip
+// needs.
+static void RenderFromPyramid(const TilePyramid& pyr, int orient, UINT dispW, UINT dispH, int clipX, int clipY, PixelBuffer& dst, QoS qos)
+{
+	bool transposed = IsTransposed(orient);
+	UINT sw = transposed ? dispH : dispW, sh = transposed ? dispW : dispH;
+	UINT level = 0;
+	while (level + 1 < pyr.Levels() && pyr.LevelWidth(level + 1) >= sw && pyr.LevelHeight(level + 1) >= sh) ++level;
+	const UINT lw = pyr.LevelWidth(level), lh = pyr.LevelHeight(level);
+
+	Rect need = OrientedSourceRect(lw, lh, orient, dispW, dispH, clipX, clipY, dst.width, dst.height);
+	UINT tx0 = need.X / PyramidTileSize, ty0 = need.Y / PyramidTileSize;
+	UINT tx1 = (need.GetRight() - 1) / PyramidTileSize, ty1 = (need.GetBottom() - 1) / PyramidTileSize;
+	UINT x = tx0 * PyramidTileSize, y = ty0 * PyramidTileSize;
+	PixelBuffer part((std::min)(lw, (tx1 + 1) * PyramidTileSize) - x, (std::min)(lh, (ty1 + 1) * PyramidTileSize) - y);
+	ReadPyramidTiles(pyr, level, tx0, ty0, tx1, ty1, part, qos);
+	RenderOrientedPart(part, lw, lh, x, y, orient, dispW, dispH, clipX, clipY, dst, qos);
+}
+
+// A cache entry for the image of pyr, with no pixels: frames and loupe tiles
+// come from the pyramid, and a small level is kept to draw previews from.
+static std::shared_ptr<CacheInfo> PyramidInfo(const std::shared_ptr<TilePyramid>& pyr, const WIN32_FILE_ATTRIBUTE_DATA& fad, QoS qos)
+{
+	auto info = std::make_shared<CacheInfo>();
+	info->lastWriteTime = fad.ftLastWriteTime;
+	info->fileSize = ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+	info->created = FileTimeToString(fad.ftCreationTime);
+	info->modified = FileTimeToString(fad.ftLastWriteTime);
+	info->rawFormat = pyr->rawFormat;
+	info->type = pyr->type;
+	info->exifDate = pyr->exifDate;
+	info->width = pyr->width;
+	info->height = pyr->height;
+	info->bpp = pyr->bpp;
+	info->orientation = pyr->orientation;
+	info->cropGridW = pyr->cropGridW;
+	info->cropGridH = pyr->cropGridH;
+	SetColorProfile(*info, pyr->icc);
+
+	UINT level = 0;
+	while (level + 1 < pyr->Levels() && (std::max)(pyr->LevelWidth(level), pyr->LevelHeight(level)) > PyramidOverviewEdge) ++level;
+	pyr->overview = std::make_shared<PixelBuffer>(pyr->LevelWidth(level), pyr->LevelHeight(level));
+	ReadPyramidTiles(*pyr, level, 0, 0, pyr->TilesX(level) - 1, pyr->TilesY(level) - 1, *pyr->overview, qos);
+	info->bitmap = WrapPixels(pyr->overview);
+	info->pyramid = pyr;
+	return info;
+}
+
+// ---------------------------------------------------------------------------
+// Decode cost: what a file will take to decode and to hold in memory,
+// predicted from its header (format, size, bit depth, progressive or
+// interlaced, file size) and the decode rates seen on this machine. Prefetch
+// orders its work by it, reads ahead only as far as the budget reaches, and
+// shows a reduced decode first where the full one would keep the user waiting.
+
+struct ImageProbe
+{
+	Subsystem format = Subsystem::DecodeOther;
+	UINT width = 0, height = 0; // 0 if the header does not say
+	UINT depth = 8;             // bits per channel
+	bool progressive = false;   // progressive JPEG, interlaced PNG
+	uint64_t fileSize = 0;
+};
+
+struct DecodeCost
+{
+	double ms = 0;      // on one decode slot
+	uint64_t bytes = 0; // decoded pixels
+};
+
+// learned per format, progressive or not
+struct DecodeRate
+{
+	double msPerMegapixel = 0;
+	double msPerMegabyte = 0; // of file, for headers without a size
+};
+
+static const size_t ProbeBytes = 128 << 10;               // holds the headers of nearly every file
+static const double PrefetchBudgetMs = 1200;              // decode work read ahead: about 400 ms on each decode slot
+static const uint64_t PrefetchBudgetBytes = 1ull << 30;   // decoded pixels of the neighbours together
+static const DecodeCost UnknownCost = { 250, 48ull << 20 }; // not probed yet: two neighbours each way fit
+static const double PreviewAboveMs = 150;                 // slower decodes show a reduced one first
+
+static std::mutex g_rateMutex;
+static DecodeRate g_rates[(int)Subsystem::Count][2]; // zero until the first decode of the kind
+static std::mutex g_probeMutex;
+static std::map<std::wstring, ImageProbe, std::less<>> g_probes; // by path
+
+// The stock codecs on one core of a typical desktop, until this machine's
+// own rates are known.
+static DecodeRate DefaultRate(Subsystem format, bool progressive)
+{
+	switch (format)
+	{
+	case Subsystem::DecodeJpeg: return progressive ? DecodeRate{ 22, 60 } : DecodeRate{ 9, 30 };
+	case Subsystem::DecodePng: return progressive ? DecodeRate{ 35, 25 } : DecodeRate{ 25, 20 };
+	case Subsystem::DecodeGif: return { 12, 15 };
+	case Subsystem::DecodeBmp: return { 3, 1 };
+	case Subsystem::DecodeWebp: return { 20, 60 };
+	case Subsystem::DecodeAvif: return { 60, 200 };
+	case Subsystem::DecodeJxl: return { 40, 150 };
+	case Subsystem::DecodeSvg: return { 30, 300 };
+	default: return { 30, 30 };
+	}
+}
+
+// Reads what the header of an image in b (its first bytes) says about its
+// cost. The size of AVIF, JPEG XL and SVG is deep in the file; those are
+// judged by file size alone.
+static ImageProbe ProbeImage(const std::vector<BYTE>& b, uint64_t fileSize)
+{
+	ImageProbe p;
+	p.format = DecodeSubsystemFor(b);
+	p.fileSize = fileSize;
+	const size_t n = b.size();
+	auto be16 = [&](size_t i) { return (UINT)(b[i] << 8 | b[i + 1]); };
+	auto le16 = [&](size_t i) { return (UINT)(b[i] | b[i + 1] << 8); };
+	switch (p.format)
+	{
+	case Subsystem::DecodeJpeg:
+		// segments up to the frame header
+		for (size_t i = 2; i + 9 < n && b[i] == 0xFF;)
+		{
+			BYTE m = b[i + 1];
+			if (m == 0xFF)
+			{
+				++i; // fill byte
+				continue;
+			}
+			if (m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC)
+			{
+				p.depth = b[i + 4];
+				p.height = be16(i + 5);
+				p.width = be16(i + 7);
+				p.progressive = m == 0xC2 || m == 0xC6 || m == 0xCA || m == 0xCE;
+				break;
+			}
+			i += 2 + be16(i + 2);
+		}
+		break;
+	case Subsystem::DecodePng:
+		if (n >= 29 && !memcmp(&b[12], "IHDR", 4))
+		{
+			p.width = GetBE32(&b[16]);
+			p.height = GetBE32(&b[20]);
+			p.depth = b[24];
+			p.progressive = b[28] == 1; // Adam7
+		}
+		break;
+	case Subsystem::DecodeGif:
+		if (n >= 10)
+		{
+			p.width = le16(6);
+			p.height = le16(8);
+		}
+		break;
+	case Subsystem::DecodeBmp:
+		if (n >= 26)
+		{
+			p.width = GetLE32(&b[18]);
+			p.height = (UINT)std::abs((int32_t)GetLE32(&b[22])); // negative when stored top-down
+		}
+		break;
+	case Subsystem::DecodeWebp:
+		if (n >= 30 && !memcmp(&b[12], "VP8X", 4))
+		{
+			p.width = GetLE24(&b[24]) + 1;
+			p.height = GetLE24(&b[27]) + 1;
+		}
+		else if (n >= 30 && !memcmp(&b[12], "VP8 ", 4))
+		{
+			p.width = le16(26) & 0x3FFF;
+			p.height = le16(28) & 0x3FFF;
+		}
+		else if (n >= 25 && !memcmp(&b[12], "VP8L", 4))
+		{
+			uint32_t v = GetLE32(&b[21]);
+			p.width = (v & 0x3FFF) + 1;
+			p.height = ((v >> 14) & 0x3FFF) + 1;
+		}
+		break;
+	default:
+		break;
+	}
+	if ((uint64_t)p.width * p.height > (1ull << 32)) p.width = p.height = 0; // a corrupt header
+	return p;
+}
+
+static ImageProbe ProbeFile(const std::wstring& path)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad = {};
+	GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &fad);
+	std::vector<BYTE> head(ProbeBytes);
+	std::ifstream f(path, std::ios::binary);
+	f.read((char*)head.data(), head.size());
+	head.resize(f ? head.size() : (size_t)f.gcount());
+	ChargeRead(head.size());
+	return ProbeImage(head, ((uint64_t)fad.nFileSizeHigh << 32) | fad.nFileSizeLow);
+}
+
+static void RememberProbe(const std::wstring& path, const ImageProbe& probe)
+{
+	std::lock_guard<std::mutex> lk(g_probeMutex);
+	if (g_probes.size() >= 4096) g_probes.clear(); // folders browsed long ago
+	g_probes[path] = probe;
+}
+
+static DecodeCost PredictDecode(const ImageProbe& p)
+{
+	DecodeRate r;
+	{
+		std::lock_guard<std::mutex> lk(g_rateMutex);
+		r = g_rates[(int)p.format][p.progressive];
+	}
+	if (!r.msPerMegapixel) r = DefaultRate(p.format, p.progressive);
+
+	// more than 8 bits per channel decode to, and are kept at, twice the size
+	const double mp = (double)p.width * p.height / 1e6, deep = p.depth > 8 ? 2 : 1;
+	DecodeCost c;
+	if (mp > 0)
+	{
+		c.ms = r.msPerMegapixel * mp * deep;
+		c.bytes = (uint64_t)(mp * 1e6 * 4 * deep);
+	}
+	else
+	{
+		c.ms = r.msPerMegabyte * p.fileSize / 1e6;
+		c.bytes = p.fileSize * 8; // what compressed images typically grow to
+	}
+	return c;
+}
+
+// Refines the rates of p's kind with a decode that took ms; a few decodes
+// move them most of the way.
+static void ObserveDecode(const ImageProbe& p, double ms)
+{
+	const double mp = (double)p.width * p.height / 1e6, deep = p.depth > 8 ? 2 : 1;
+	const double a = 0.25;
+	std::lock_guard<std::mutex> lk(g_rateMutex);
+	DecodeRate& r = g_rates[(int)p.format][p.progressive];
+	if (!r.msPerMegapixel) r = DefaultRate(p.format, p.progressive);
+	if (mp >= 0.01) r.msPerMegapixel += a * (ms / (mp * deep) - r.msPerMegapixel);
+	if (p.fileSize >= 1000) r.msPerMegabyte += a * (ms * 1e6 / p.fileSize - r.msPerMegabyte);
+}
+
+// The rates are kept between runs, next to the window placement.
+static void LoadDecodeRates()
+{
+	DecodeRate rates[(int)Subsystem::Count][2];
+	DWORD size = sizeof(rates);
+	if (RegGetValueW(HKEY_CURRENT_USER, L"Software\\ImageViewer", L"DecodeRates", RRF_RT_REG_BINARY, nullptr, rates, &size) != ERROR_SUCCESS ||
+		size != sizeof(rates)) return;
+	for (const auto& kind : rates)
+	{
+		for (const DecodeRate& r : kind)
+		{
+			if (!(r.msPerMegapixel >= 0 && r.msPerMegapixel < 1e5 && r.msPerMegabyte >= 0 && r.msPerMegabyte < 1e5)) return;
+		}
+	}
+	std::lock_guard<std::mutex> lk(g_rateMutex);
+	memcpy(g_rates, rates, sizeof(rates));
+}
+
+static void SaveDecodeRates()
+{
+	std::lock_guard<std::mutex> lk(g_rateMutex);
+	RegSetKeyValueW(HKEY_CURRENT_USER, L"Software\\ImageViewer", L"DecodeRates", REG_BINARY, g_rates, sizeof(g_rates));
+}
+
+// A stand-in for an image whose full decode is slow: decoded by the codec at
+// a power-of-two reduction that still covers the panel. Only JPEG reduces in
+// the codec (in the DCT); null where nothing would be saved. The entry has
+// the image's size but only the reduced pixels, and is marked preview.
+static std::shared_ptr<CacheInfo> DecodePreview(const std::vector<BYTE>& bytes, const ImageProbe& probe, const WIN32_FILE_ATTRIBUTE_DATA& fad)
+{
+	if (probe.format != Subsystem::DecodeJpeg || !probe.width || !probe.height) return nullptr;
+
+	// the long side on screen, whichever way the image turns out to be oriented
+	RECT rc = { 0, 0, g_panelW, g_panelH };
+	Rect a = CalcDisplayRect(probe.width, probe.height, rc), b = CalcDisplayRect(probe.height, probe.width, rc);
+	UINT edge = (UINT)(std::max)((std::max)(a.Width, a.Height), (std::max)(b.Width, b.Height));
+	if (!edge || edge * 2 > (std::max)(probe.width, probe.height)) return nullptr;
+
+	int orient = 1;
+	std::shared_ptr<PixelBuffer> px = DecodeReduced(bytes, edge, orient);
+	if (!px || px->width >= probe.width) return nullptr;
+	auto info = std::make_shared<CacheInfo>();
+	info->preview = true;
+	info->lastWriteTime = fad.ftLastWriteTime;
+	info->fileSize = ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+	info->created = FileTimeToString(fad.ftCreationTime);
+	info->modified = FileTimeToString(fad.ftLastWriteTime);
+	info->rawFormat = ImageFormatJPEG;
+	info->type = RawFormatToType(ImageFormatJPEG);
+	info->width = probe.width;
+	info->height = probe.height;
+	info->orientation = orient;
+	info->pixels = px;
+	info->bitmap = WrapPixels(px);
+	return info;
+}
+
+// ---------------------------------------------------------------------------
+// Load pipeline: load -> decode -> scale (pool threads) -> present (UI
+// thread). Each image is one coroutine hopping between executors; the UI
+// thread is woken through a posted message and repaints only when data lands.
+
+struct PendingLoad
+{
+	CancelToken token;
+	std::shared_ptr<std::atomic<QoS>> qos = std::make_shared<std::atomic<QoS>>(QoS::Prefetch); // raised when it becomes current
+	DisplayTarget rescale; // set for rescale-only jobs
+
+	QoS Qos() const { return *qos; }
+};
+
+// A result handed from a worker to the UI thread.
+struct Completion
+{
+	enum Kind
+	{
+		DecodeDone,    // info is ready to be published to the cache
+		PreviewReady,  // info is a reduced decode to show until DecodeDone
+		MetadataReady, // info has file and header data but no pixels yet
+		Saved,         // an edit was written; info matches the new file, null to reload
+		ExportProgress, // a file of the running export finished
+		LoupeTile,     // a loupe tile is ready
+		ScanBatch,     // folder listings were refreshed; path is the folder if a single one changed
+		Probed,        // headers of files near the current one were read
+	};
+
+	Kind kind;
+	std::wstring path;
+	std::shared_ptr<CacheInfo> info;
+	CancelToken token;
+	Completion* next = nullptr;
+};
+
+static CompletionQueue<Completion> g_completions;
+static AsyncSemaphore g_decodeSlots{ 3 };
+static std::map<std::wstring, PendingLoad, std::less<>> g_inflight; // UI thread only
+static CancelToken g_probeAhead; // the newest header probe; UI thread only
+
+// A file rewrite after a rotation or crop; the newest one per file wins.
+struct PendingSave
+{
+	CancelToken token;
+	std::shared_ptr<PixelBuffer> source; // pixels of the entry shown meanwhile
+};
+
+static std::map<std::wstring, PendingSave, std::less<>> g_saves; // UI thread only
+static std::atomic<int> g_pendingSaves{ 0 }; // waited for at exit
+
+static void UpdateInfoLabel(const std::shared_ptr<CacheInfo>& info = nullptr);
+static void PlayCurrentAnimation();
+static Bitmap* PlayingFrame(const CacheInfo& info);
+static void UpdateExportTitle();
+static void InvalidateLoupe();
+static void OnFoldersScanned(bool rootChanged);
+static void PreloadAround(int idx, std::pmr::memory_resource* mr = std::pmr::get_default_resource(), bool targetOnly = false);
+
+static void Complete(Completion::Kind kind, const std::wstring& path, const std::shared_ptr<CacheInfo>& info, const CancelToken& token)
+{
+	g_completions.Push(new Completion{ kind, path, info, token });
+}
+
+static std::wstring PathAt(int idx)
+{
+	std::lock_guard<std::mutex> lk(g_filesMutex);
+	if (g_files.empty()) return std::wstring();
+	int n = (int)g_files.size();
+	return g_files[(idx % n + n) % n].wstring();
+}
+
+// What of info the panel shows; false if info->bitmap can be drawn as is
+// (1:1, upright, already premultiplied BGRA and in the display's colors).
+static bool GetDisplayTarget(const CacheInfo& info, DisplayTarget& target)
+{
+	RECT rc = { 0, 0, g_panelW, g_panelH };
+	if (rc.right <= 0 || rc.bottom <= 0 || !info.width || !info.height || (!info.pixels && !info.pyramid)) return false;
+	bool transposed = IsTransposed(info.orientation);
+	UINT ow = transposed ? info.height : info.width;
+	UINT oh = transposed ? info.width : info.height;
+	Rect disp = CalcDisplayRect(ow, oh, rc);
+	if (disp.Width <= 0 || disp.Height <= 0) return false;
+	if ((UINT)disp.Width == ow && (UINT)disp.Height == oh && info.orientation == 1 && info.pixels && info.pixels->format == PixelFormat32bppPARGB && !info.colorLut) return false;
+
+	// only the part inside the panel is rendered
+	target.width = disp.Width;
+	target.height = disp.Height;
+	target.clipX = (std::max)(0, (INT)rc.left - disp.X);
+	target.clipY = (std::max)(0, (INT)rc.top - disp.Y);
+	target.clipW = (std::min)(disp.GetRight(), (INT)rc.right) - (disp.X + target.clipX);
+	target.clipH = (std::min)(disp.GetBottom(), (INT)rc.bottom) - (disp.Y + target.clipY);
+	target.linearLight = g_linearLight;
+	target.sharpen = g_sharpen && !info.svg && ((UINT)disp.Width < ow || (UINT)disp.Height < oh);
+	if (info.pixels && info.pixels->format == PixelFormat64bppARGB) target.tone = g_tone;
+	return true;
+}
+
+// Runs on a worker: returns a copy of info carrying the frame for target,
+// converted, oriented and scaled in one pass by the pixel kernels.
+static std::shared_ptr<CacheInfo> ScaleForDisplay(const std::shared_ptr<CacheInfo>& info, const DisplayTarget& target, QoS qos)
+{
+	UsageScope usage(Subsystem::Scale);
+	auto out = std::make_shared<CacheInfo>(*info);
+	auto start = std::chrono::steady_clock::now();
+	std::shared_ptr<PixelBuffer> px = info->svg ? RasterizeSvg(*info->svg, target, qos) : nullptr; // vectors are drawn, not resampled
+	if (!px)
+	{
+		px = std::make_shared<PixelBuffer>(target.clipW, target.clipH);
+		if (info->pyramid) RenderFromPyramid(*info->pyramid, info->orientation, target.width, target.height, target.clipX, target.clipY, *px, qos);
+		else RenderOriented(*info->pixels, info->orientation, target.width, target.height, target.clipX, target.clipY, *px, qos, target.linearLight, target.tone);
+	}
+	if (info->colorLut) ApplyColorLut(*info->colorLut, *px, qos);
+	auto scaled = std::chrono::steady_clock::now();
+	if (target.sharpen) UnsharpMask(*px, qos);
+	out->scaleMs = std::chrono::duration<double, std::milli>(scaled - start).count();
+	out->sharpenMs = target.sharpen ? std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - scaled).count() : 0;
+	out->scaled = WrapPixels(px);
+	out->scaledPixels = px;
+	out->scaledFor = target;
+	return out;
+}
+
+static bool PresentLoaded(const std::wstring& path, const std::shared_ptr<CacheInfo>& info, const CancelToken& token)
+{
+	auto it = g_inflight.find(path);
+	if (it == g_inflight.end() || !it->second.token.SameAs(token)) return false; // superseded
+	g_inflight.erase(it);
+
+	std::lock_guard<std::mutex> clk(g_cacheMutex);
+	g_cache[path] = info;
+	return true;
+}
+
+// A reduced decode stands in while its load is still the one in flight and
+// nothing better is cached.
+static bool PresentPreview(const std::wstring& path, const std::shared_ptr<CacheInfo>& info, const CancelToken& token)
+{
+	auto it = g_inflight.find(path);
+	if (it == g_inflight.end() || !it->second.token.SameAs(token)) return false;
+
+	std::lock_guard<std::mutex> clk(g_cacheMutex);
+	auto cur = g_cache.find(path);
+	if (cur != g_cache.end() && !cur->second->preview) return false;
+	g_cache[path] = info;
+	return true;
+}
+
+// drops the cached entry and any work in flight for it, e.g. after the file changed
+static void InvalidateCached(const std::wstring& path)
+{
+	auto it = g_inflight.find(path);
+	if (it != g_inflight.end())
+	{
+		it->second.token.Cancel();
+		g_inflight.erase(it);
+	}
+	{
+		std::lock_guard<std::mutex> plk(g_probeMutex);
+		g_probes.erase(path);
+	}
+	std::lock_guard<std::mutex> clk(g_cacheMutex);
+	g_cache.erase(path);
+}
+
+// Publishes the entry for a rewritten file. The optimistic entry shown
+// meanwhile looks the same, so its display frame is kept.
+static bool FinishSave(const std::wstring& path, const std::shared_ptr<CacheInfo>& info, const CancelToken& token)
+{
+	auto it = g_saves.find(path);
+	if (it == g_saves.end() || !it->second.token.SameAs(token)) return false; // a newer rotation is pending
+	std::shared_ptr<PixelBuffer> source = it->second.source;
+	g_saves.erase(it);
+
+	if (!info)
+	{
+		InvalidateCached(path);
+		return true;
+	}
+
+	// work still based on the old entry must not overwrite this one
+	auto fl = g_inflight.find(path);
+	if (fl != g_inflight.end())
+	{
+		fl->second.token.Cancel();
+		g_inflight.erase(fl);
+	}
+
+	std::lock_guard<std::mutex> clk(g_cacheMutex);
+	auto cur = g_cache.find(path);
+	if (cur != g_cache.end() && cur->second->pixels == source && cur->second->scaled)
+	{
+		info->scaled = cur->second->scaled;
+		info->scaledPixels = cur->second->scaledPixels;
+		info->scaledFor = cur->second->scaledFor;
+	}
+	g_cache[path] = info;
+	return true;
+}
+
+// UI thread, once per wake-up: applies every queued completion, then
+// repaints at most once.
+static void DrainCompletions()
+{
+	const std::wstring current = PathAt(g_index);
+	bool presented = false;
+	bool exported = false;
+	bool loupe = false;
+	bool scanned = false;
+	bool rootChanged = false;
+	bool probed = false;
+	std::shared_ptr<CacheInfo> metadata;
+	g_completions.Drain([&](Completion& c)
+	{
+		switch (c.kind)
+		{
+		case Completion::DecodeDone:
+			if (PresentLoaded(c.path, c.info, c.token) && c.path == current) presented = true;
+			break;
+		case Completion::PreviewReady:
+			if (PresentPreview(c.path, c.info, c.token) && c.path == current) presented = true;
+			break;
+		case Completion::MetadataReady:
+			if (c.path == current && g_inflight.count(c.path) && g_inflight[c.path].token.SameAs(c.token)) metadata = c.info;
+			break;
+		case Completion::Saved:
+			if (FinishSave(c.path, c.info, c.token) && c.path == current) presented = true;
+			break;
+		case Completion::ExportProgress:
+			exported = true;
+			break;
+		case Completion::LoupeTile:
+			loupe = true;
+			break;
+		case Completion::ScanBatch:
+			scanned = true;
+			if (!c.path.empty() && c.path == FolderKey(g_rootPath)) rootChanged = true;
+			break;
+		case Completion::Probed:
+			if (c.token.SameAs(g_probeAhead)) probed = true;
+			break;
+		}
+	});
+	if (exported) UpdateExportTitle();
+	if (loupe) InvalidateLoupe();
+	if (scanned) OnFoldersScanned(rootChanged);
+	else if (probed) PreloadAround(g_index); // the window may reach further now
+
+	if (presented)
+	{
+		InvalidateRect(g_hPanel, NULL, FALSE);
+		UpdateInfoLabel();
+		PlayCurrentAnimation();
+	}
+	else if (metadata)
+	{
+		UpdateInfoLabel(metadata);
+	}
+}
+
+static std::mutex g_pyramidMutex;
+static std::vector<std::wstring> g_pyramidBuilds; // paths whose pyramid is being written
+
+static Job BuildPyramid(std::wstring path, std::shared_ptr<CacheInfo> info)
+{
+	co_await g_pool.Schedule(QoS::Background);
+	WritePyramid(path, *info);
+	std::lock_guard<std::mutex> lk(g_pyramidMutex);
+	g_pyramidBuilds.erase(std::find(g_pyramidBuilds.begin(), g_pyramidBuilds.end(), path));
+}
+
+// Writes path's pyramid in the background unless that is already under way;
+// the job keeps info's pixels alive until it is done.
+static void StartPyramid(const std::wstring& path, const std::shared_ptr<CacheInfo>& info)
+{
+	{
+		std::lock_guard<std::mutex> lk(g_pyramidMutex);
+		if (std::find(g_pyramidBuilds.begin(), g_pyramidBuilds.end(), path) != g_pyramidBuilds.end()) return;
+		g_pyramidBuilds.push_back(path);
+	}
+	BuildPyramid(path, info);
+}
+
+static Job LoadPipeline(std::wstring path, PendingLoad job)
+{
+	// load
+	co_await g_pool.Schedule(job.Qos());
+	if (job.token.Cancelled()) co_return;
+	WIN32_FILE_ATTRIBUTE_DATA fad = {};
+	std::vector<BYTE> bytes;
+	std::shared_ptr<TilePyramid> pyramid;
+	{
+		// a very large image seen before is read from its pyramid instead
+		UsageScope usage(Subsystem::Read);
+		GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &fad);
+		pyramid = OpenPyramid(path, fad);
+		if (!pyramid) bytes = ReadFileBytes(path);
+	}
+
+	// decode; a slow one shows a reduced decode first
+	co_await g_decodeSlots.Acquire(job.Qos());
+	co_await g_pool.Schedule(job.Qos());
+	ImageProbe probe;
+	if (!pyramid)
+	{
+		probe = ProbeImage(bytes, ((uint64_t)fad.nFileSizeHigh << 32) | fad.nFileSizeLow);
+		RememberProbe(path, probe);
+		if (!job.token.Cancelled() && PredictDecode(probe).ms > PreviewAboveMs)
+		{
+			UsageScope usage(probe.format);
+			if (auto preview = DecodePreview(bytes, probe, fad)) Complete(Completion::PreviewReady, path, preview, job.token);
+		}
+	}
+	std::shared_ptr<CacheInfo> info;
+	auto start = std::chrono::steady_clock::now();
+	if (!job.token.Cancelled()) info = pyramid ? PyramidInfo(pyramid, fad, job.Qos()) : DecodeImage(bytes, fad);
+	if (info) info->decodeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if (info && info->bitmap && !pyramid && !info->animation) ObserveDecode(probe, info->decodeMs); // animations decode every frame
+	std::vector<BYTE>().swap(bytes);
+	g_decodeSlots.Release();
+	if (!info) co_return;
+	if (WantsPyramid(*info)) StartPyramid(path, info);
+
+	// scale
+	DisplayTarget target;
+	if (GetDisplayTarget(*info, target))
+	{
+		Complete(Completion::MetadataReady, path, info, job.token);
+		co_await g_pool.Schedule(job.Qos());
+		if (job.token.Cancelled()) co_return;
+		info = ScaleForDisplay(info, target, job.Qos());
+	}
+
+	// present
+	Complete(Completion::DecodeDone, path, info, job.token);
+}
+
+static Job RescalePipeline(std::wstring path, std::shared_ptr<CacheInfo> info, PendingLoad job)
+{
+	co_await g_pool.Schedule(job.Qos());
+	if (job.token.Cancelled()) co_return;
+	info = ScaleForDisplay(info, job.rescale, job.Qos());
+	Complete(Completion::DecodeDone, path, info, job.token);
+}
+
+// GDI+ writes the file itself; its size is what gets charged
+static bool SaveBitmap(Bitmap& bmp, const std::wstring& path, const CLSID& enc, const EncoderParameters* params = nullptr)
+{
+	if (bmp.Save(path.c_str(), &enc, params) != Ok) return false;
+	WIN32_FILE_ATTRIBUTE_DATA fad = {};
+	if (GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &fad)) ChargeWrite(((size_t)fad.nFileSizeHigh << 32) | fad.nFileSizeLow);
+	return true;
+}
+
+// Moves a freshly written temp file over path, or deletes it if writing failed.
+static bool ReplaceWithTemp(const std::wstring& path, const std::wstring& tmp, bool written)
+{
+	if (written && MoveFileExW(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) return true;
+	DeleteFileW(tmp.c_str());
+	return false;
+}
+
+// info with the file data of path as it is now on disk
+static std::shared_ptr<CacheInfo> RewrittenInfo(const std::wstring& path, const CacheInfo& info)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad = {};
+	GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &fad);
+	auto out = std::make_shared<CacheInfo>(info);
+	out->lastWriteTime = fad.ftLastWriteTime;
+	out->fileSize = ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+	out->modified = FileTimeToString(fad.ftLastWriteTime);
+	return out;
+}
+
+// Runs on a worker: writes info, with its orientation baked in, over path
+// (temp file, then an atomic rename). Returns the entry matching the new
+// file, or null if the file has to be read again.
+static std::shared_ptr<CacheInfo> WriteRotated(const std::wstring& path, const std::shared_ptr<CacheInfo>& info)
+{
+	UsageScope usage(Subsystem::Encode);
+	std::vector<BYTE> bytes = ReadFileBytes(path);
+	std::wstring tmp = path + L".tmp";
+
+	if (info->rawFormat == ImageFormatGIF)
+	{
+		// turned on the stream so animations keep every frame
+		std::vector<BYTE> gif;
+		if (!ReplaceWithTemp(path, tmp, RotateGif(bytes, info->orientation, gif, QoS::Background) && WriteFileBytes(tmp, gif))) return nullptr;
+		WIN32_FILE_ATTRIBUTE_DATA fad = {};
+		GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &fad);
+		return DecodeImage(gif, fad);
+	}
+
+	// metadata comes from the file as it is on disk
+	std::shared_ptr<Bitmap> bmp = CreateBitmapFromBytes(bytes);
+	if (!bmp) return nullptr;
+
+	std::shared_ptr<PixelBuffer> px;
+	if (info->pixels)
+	{
+		px = ApplyOrientation(*info->pixels, info->orientation, QoS::Background);
+		std::shared_ptr<Bitmap> original = bmp;
+		bmp = BitmapForPixels(px);
+		CopyPropertyItems(*original, *bmp);
+	}
+	else
+	{
+		// other multi-frame formats and pyramid-backed entries: GDI+ turns the frame it decodes
+		static const RotateFlipType flips[] = {
+			RotateNoneFlipNone, RotateNoneFlipNone, RotateNoneFlipX, Rotate180FlipNone, RotateNoneFlipY,
+			Rotate90FlipX, Rotate90FlipNone, Rotate270FlipX, Rotate270FlipNone,
+		};
+		bmp->RotateFlip(flips[(info->orientation >= 1 && info->orientation <= 8) ? info->orientation : 1]);
+	}
+
+	// the pixels are upright now
+	if (bmp->GetPropertyItemSize(PropertyTagOrientation))
+	{
+		WORD upright = 1;
+		PropertyItem pi = { PropertyTagOrientation, sizeof(WORD), PropertyTagTypeShort, &upright };
+		bmp->SetPropertyItem(&pi);
+	}
+
+	bool written;
+	if (px && info->rawFormat == ImageFormatPNG)
+	{
+		// GDI+ encodes PNG on one thread, which takes seconds for large images
+		written = WriteFileBytes(tmp, EncodePng(*px, PngPreset::Balanced, QoS::Background, &bytes));
+	}
+	else
+	{
+		CLSID enc = EncoderForRawFormat(info->rawFormat);
+		written = SaveBitmap(*bmp, tmp, enc);
+	}
+	if (!ReplaceWithTemp(path, tmp, written) || !px) return nullptr;
+
+	auto out = RewrittenInfo(path, *info);
+	out->pixels = px;
+	out->bitmap = bmp;
+	out->width = px->width;
+	out->height = px->height;
+	out->orientation = 1;
+	return out;
+}
+
+// Writes the crop that info already shows; (x, y, w, h) is the crop in stored
+// pixels of the file on disk. JPEGs are cropped losslessly when they can be.
+static std::shared_ptr<CacheInfo> WriteCropped(const std::wstring& path, const std::shared_ptr<CacheInfo>& info, Rect crop)
+{
+	UsageScope usage(Subsystem::Encode);
+	std::vector<BYTE> bytes = ReadFileBytes(path);
+	std::wstring tmp = path + L".tmp";
+	std::vector<BYTE> jpeg;
+	bool written;
+	if (info->rawFormat == ImageFormatJPEG && CropJpegLossless(bytes, crop.X, crop.Y, crop.Width, crop.Height, jpeg))
+	{
+		written = WriteFileBytes(tmp, jpeg);
+	}
+	else if (info->rawFormat == ImageFormatPNG)
+	{
+		written = WriteFileBytes(tmp, EncodePng(*info->pixels, PngPreset::Balanced, QoS::Background, &bytes));
+	}
+	else
+	{
+		std::shared_ptr<Bitmap> original = CreateBitmapFromBytes(bytes);
+		if (!original) return nullptr;
+		std::shared_ptr<Bitmap> bmp = WrapPixels(info->pixels);
+		CopyPropertyItems(*original, *bmp);
+		CLSID enc = EncoderForRawFormat(info->rawFormat);
+		written = SaveBitmap(*bmp, tmp, enc);
+	}
+	if (!ReplaceWithTemp(path, tmp, written)) return nullptr;
+	return RewrittenInfo(path, *info);
+}
+
+// Runs write, a rewrite of path, on a worker unless a newer edit superseded it.
+static Job SavePipeline(std::wstring path, std::function<std::shared_ptr<CacheInfo>()> write, CancelToken token)
+{
+	co_await g_pool.Schedule(QoS::Background);
+	std::shared_ptr<CacheInfo> saved;
+	{
+		// one rewrite at a time, so a superseded one never lands after its successor
+		static std::mutex writeMutex;
+		std::lock_guard<std::mutex> lk(writeMutex);
+		if (!token.Cancelled()) saved = write();
+	}
+	Complete(Completion::Saved, path, saved, token);
+	if (--g_pendingSaves == 0) g_pendingSaves.notify_all();
+}
+
+static void RequestLoad(std::wstring_view path, QoS qos = QoS::Interactive)
+{
+	if (path.empty()) return;
+	auto it = g_inflight.find(path);
+	if (it != g_inflight.end())
+	{
+		// already queued; its remaining stages run at the higher class
+		if (qos < it->second.Qos()) *it->second.qos = qos;
+		return;
+	}
+	{
+		// a preview still wants its full decode
+		std::lock_guard<std::mutex> clk(g_cacheMutex);
+		auto cached = g_cache.find(path);
+		if (cached != g_cache.end() && !cached->second->preview) return;
+	}
+	PendingLoad pending;
+	*pending.qos = qos;
+	g_inflight.emplace(path, pending);
+	LoadPipeline(std::wstring(path), pending);
+}
+
+static void RequestRescale(const std::wstring& path, const std::shared_ptr<CacheInfo>& info, const DisplayTarget& target)
+{
+	auto it = g_inflight.find(path);
+	if (it != g_inflight.end())
+	{
+		// a full load in flight will scale for the panel by itself
+		if (!it->second.rescale.width || it->second.rescale == target) return;
+		it->second.token.Cancel();
+	}
+	PendingLoad pending;
+	*pending.qos = QoS::Interactive;
+	pending.rescale = target;
+	g_inflight[path] = pending;
+	RescalePipeline(path, info, pending);
+}
+
+// Reads a watched folder again after a change notification.
+static Job RescanFolder(fs::path dir)
+{
+	co_await g_pool.Schedule(QoS::Background);
+	std::wstring key = FolderKey(dir);
+	{
+		std::lock_guard<std::mutex> lk(g_foldersMutex);
+		auto it = g_folders.find(key);
+		if (it == g_folders.end()) co_return; // no longer watched
+		it->second.watch->queued = false; // changes from here on need another pass
+	}
+	std::vector<fs::path> files = ListImages(dir, false);
+	{
+		std::lock_guard<std::mutex> lk(g_foldersMutex);
+		auto it = g_folders.find(key);
+		if (it == g_folders.end()) co_return;
+		it->second.files = std::move(files);
+	}
+	Complete(Completion::ScanBatch, key, nullptr, CancelToken());
+}
+
+static void CALLBACK FolderChanged(PVOID context, BOOLEAN)
+{
+	auto* watch = (FolderWatch*)context;
+	FindNextChangeNotification(watch->change);
+	if (!g_stopThreads && !watch->queued.exchange(true)) RescanFolder(watch->dir);
+}
+
+static const size_t MaxListedFolders = 32;
+
+// Lists the folders next to root, nearest first, and watches them for
+// changes; folders further away are dropped. Runs at background priority so
+// it never delays a decode.
+static Job ScanSiblingFolders(fs::path root, CancelToken token)
+{
+	co_await g_pool.Schedule(QoS::Background);
+	UsageScope usage(Subsystem::Scan); // nothing below suspends
+	const std::wstring rootKey = FolderKey(root);
+	std::vector<std::pair<std::wstring, fs::path>> dirs; // by key
+	fs::path parent = root.parent_path();
+	if (parent.empty() || FolderKey(parent) == rootKey) dirs.emplace_back(rootKey, root); // a drive root has no siblings
+	else
+	{
+		try
+		{
+			for (auto& e : fs::directory_iterator(parent, fs::directory_options::skip_permission_denied))
+			{
+				if (e.is_directory()) dirs.emplace_back(FolderKey(e.path()), e.path());
+			}
+		}
+		catch (...) {}
+	}
+	std::sort(dirs.begin(), dirs.end());
+
+	// outwards from the root
+	int at = 0;
+	for (size_t i = 0; i < dirs.size(); ++i)
+	{
+		if (dirs[i].first == rootKey) at = (int)i;
+	}
+	std::vector<size_t> order;
+	for (int d = 0; order.size() < (std::min)(MaxListedFolders, dirs.size()); ++d)
+	{
+		if (at + d < (int)dirs.size()) order.push_back(at + d);
+		if (d && at - d >= 0 && order.size() < MaxListedFolders) order.push_back(at - d);
+	}
+
+	std::vector<FolderListing> dropped; // destroyed outside the lock
+	{
+		std::lock_guard<std::mutex> lk(g_foldersMutex);
+		if (token.Cancelled()) co_return;
+		g_siblings.clear();
+		for (auto& d : dirs) g_siblings.push_back(d.second);
+		for (auto it = g_folders.begin(); it != g_folders.end();)
+		{
+			if (std::any_of(order.begin(), order.end(), [&](size_t i) { return dirs[i].first == it->first; })) ++it;
+			else
+			{
+				dropped.push_back(std::move(it->second));
+				it = g_folders.erase(it);
+			}
+		}
+	}
+	dropped.clear();
+
+	for (size_t n = 0; n < order.size(); ++n)
+	{
+		if (token.Cancelled()) co_return;
+		const std::wstring& key = dirs[order[n]].first;
+		const fs::path& dir = dirs[order[n]].second;
+		{
+			std::lock_guard<std::mutex> lk(g_foldersMutex);
+			if (g_folders.count(key)) continue;
+		}
+
+		// watched before it is read, so nothing that changes meanwhile is missed
+		auto watch = std::make_unique<FolderWatch>();
+		watch->dir = dir;
+		watch->change = FindFirstChangeNotificationW(dir.c_str(), FALSE, FILE_NOTIFY_CHANGE_FILE_NAME);
+		std::vector<fs::path> files = ListImages(dir, false);
+		{
+			std::lock_guard<std::mutex> lk(g_foldersMutex);
+			if (token.Cancelled()) co_return;
+			FolderWatch* w = watch.get();
+			g_folders[key] = { std::move(files), std::move(watch) };
+			if (w->change != INVALID_HANDLE_VALUE) RegisterWaitForSingleObject(&w->wait, w->change, FolderChanged, w, INFINITE, WT_EXECUTEDEFAULT);
+		}
+		if (n % 8 == 7 || n + 1 == order.size()) Complete(Completion::ScanBatch, std::wstring(), nullptr, token);
+	}
+}
+
+static CancelToken g_folderScan; // UI thread only
+
+static void StartFolderScan()
+{
+	if (!g_hMain) return; // not before the pool runs; WM_CREATE starts the first scan
+	g_folderScan.Cancel();
+	g_folderScan = CancelToken();
+	ScanSiblingFolders(g_rootPath, g_folderScan);
+}
+
+// Stops the watches, before the pool they queue rescans on goes away.
+static void StopFolderWatches()
+{
+	std::map<std::wstring, FolderListing, std::less<>> folders;
+	{
+		std::lock_guard<std::mutex> lk(g_foldersMutex);
+		folders.swap(g_folders);
+	}
+}
+
+// The folder step places away from the root that has images, from the
+// background listings; empty if there is none or the folders are not listed yet.
+static fs::path SiblingFolder(int step, std::wstring* firstImage = nullptr)
+{
+	std::lock_guard<std::mutex> lk(g_foldersMutex);
+	const std::wstring rootKey = FolderKey(g_rootPath);
+	int n = (int)g_siblings.size();
+	int at = -1;
+	for (int i = 0; i < n; ++i)
+	{
+		if (FolderKey(g_siblings[i]) == rootKey) at = i;
+	}
+	if (at < 0) return fs::path();
+	for (int i = at + step; i >= 0 && i < n; i += step)
+	{
+		auto it = g_folders.find(FolderKey(g_siblings[i]));
+		if (it == g_folders.end()) return fs::path(); // not listed yet
+		if (it->second.files.empty()) continue;
+		if (firstImage) *firstImage = it->second.files.front().wstring();
+		return g_siblings[i];
+	}
+	return fs::path();
+}
+
+// Reads the headers of files near the current one, so the prefetch window
+// can be planned again with what they cost.
+static Job ProbeAhead(std::vector<std::wstring> paths, CancelToken token)
+{
+	co_await g_pool.Schedule(QoS::Background);
+	UsageScope usage(Subsystem::Read);
+	for (const std::wstring& p : paths)
+	{
+		if (token.Cancelled()) co_return;
+		RememberProbe(p, ProbeFile(p));
+	}
+	Complete(Completion::Probed, std::wstring(), nullptr, token);
+}
+
+// targetOnly while scrubbing: neighbours of a position passed a moment later
+// would only be cancelled again.
+static void PreloadAround(int idx, std::pmr::memory_resource* mr, bool targetOnly)
+{
+	std::pmr::vector<std::pmr::wstring> window(mr);
+	std::vector<std::wstring> unprobed;
+	{
+		std::lock_guard<std::mutex> lk(g_filesMutex);
+		if (g_files.empty()) return;
+		int n = (int)g_files.size();
+
+		// current first, then neighbours outwards while their predicted
+		// decodes fit the budgets; the two next to it always do. Of the two
+		// at the same distance, the cheaper one goes first.
+		static const int order[] = { 0, 1, -1, 2, -2, 3, -3, 4, -4 };
+		const size_t count = targetOnly ? 1 : std::size(order);
+		window.reserve(count);
+		std::lock_guard<std::mutex> plk(g_probeMutex);
+		double ms = 0, lastMs = 0;
+		uint64_t bytes = 0;
+		size_t last = 0; // order index of the last one taken
+		bool full = false;
+		for (size_t i = 0; i < count; ++i)
+		{
+			std::wstring_view p = g_files[((idx + order[i]) % n + n) % n].native();
+			auto probe = g_probes.find(p);
+			if (probe == g_probes.end() && i && std::find(unprobed.begin(), unprobed.end(), p) == unprobed.end()) unprobed.emplace_back(p);
+			if (full || std::find(window.begin(), window.end(), p) != window.end()) continue;
+
+			DecodeCost cost = probe != g_probes.end() ? PredictDecode(probe->second) : UnknownCost;
+			if (i)
+			{
+				ms += cost.ms;
+				bytes += cost.bytes;
+			}
+			full = i > 2 && (ms > PrefetchBudgetMs || bytes > PrefetchBudgetBytes);
+			if (full) continue;
+			window.emplace_back(p);
+			if (i % 2 == 0 && last == i - 1 && cost.ms < lastMs) std::swap(window.back(), window[window.size() - 2]);
+			last = i;
+			lastMs = cost.ms;
+		}
+	}
+	g_probeAhead.Cancel(); // planned for another position
+	if (!unprobed.empty())
+	{
+		g_probeAhead = CancelToken();
+		ProbeAhead(std::move(unprobed), g_probeAhead);
+	}
+	const size_t nearby = window.size();
+
+	// the first image of the next folder, so switching to it is instant
+	auto inWindow = [&](std::wstring_view p) { return std::find(window.begin(), window.end(), p) != window.end(); };
+	std::wstring next;
+	if (!targetOnly && !g_recursive && !SiblingFolder(1, &next).empty() && !inWindow(next)) window.emplace_back(next);
+
+	// cancel work for images that fell out of the window
+	for (auto it = g_inflight.begin(); it != g_inflight.end();)
+	{
+		if (inWindow(it->first))
+		{
+			++it;
+			continue;
+		}
+		it->second.token.Cancel();
+		it = g_inflight.erase(it);
+	}
+
+	for (size_t i = 0; i < window.size(); ++i) RequestLoad(window[i], i == 0 ? QoS::Interactive : i < nearby ? QoS::Prefetch : QoS::Background);
+
+	// trim cache to a small size (keep max 12)
+	std::lock_guard<std::mutex> clk(g_cacheMutex);
+	for (auto it = g_cache.begin(); it != g_cache.end() && g_cache.size() > 12;)
+	{
+		if (inWindow(it->first)) ++it;
+		else it = g_cache.erase(it);
+	}
+}
+
+static void SyncSlider()
+{
+	SendMessageW(g_hSlider, TBM_SETRANGEMAX, FALSE, (LPARAM)(std::max)((size_t)1, g_files.size()) - 1);
+	SendMessageW(g_hSlider, TBM_SETPOS, TRUE, g_index);
+}
+
+// UI thread: the root's listing may have changed, and with it the window
+static void OnFoldersScanned(bool rootChanged)
+{
+	if (rootChanged && !g_recursive)
+	{
+		// stay on the same file if it is still there
+		std::wstring current = PathAt(g_index);
+		EnumFiles(true);
+		{
+			std::lock_guard<std::mutex> lk(g_filesMutex);
+			for (size_t i = 0; i < g_files.size(); ++i)
+			{
+				if (g_files[i] == current)
+				{
+					g_index = (int)i;
+					break;
+				}
+			}
+		}
+		SyncSlider();
+		UpdateInfoLabel();
+		InvalidateRect(g_hPanel, NULL, FALSE);
+	}
+	PreloadAround(g_index);
+}
+
+// threads is the pool's size, 0 for one per core
+static void StartBackground(int threads = 0)
+{
+	g_stopThreads = false;
+	g_completions.SetWake([]() { PostMessageW(g_hMain, WM_APP_PIPELINE, 0, 0); });
+	g_pool.Start(threads > 0 ? threads : (std::max)(2, (int)std::thread::hardware_concurrency()));
+}
+
+static void StopBackground()
+{
+	// rotations are only on screen until their file is written
+	for (int n; (n = g_pendingSaves) != 0;) g_pendingSaves.wait(n);
+	g_stopThreads = true;
+	StopFolderWatches();
+	g_pool.Stop();
+}
+
+// ---------------------------------------------------------------------------
+// Batch export: read -> decode (reduced where the codec can) -> resample ->
+// encode, one coroutine per file on the pool. A semaphore bounds how many files
+// are in memory at once; the UI and the --export command line share it.
+
+enum class ExportFormat { Jpeg, Png, Bmp };
+
+struct ExportOptions
+{
+	std::wstring outDir;
+	ExportFormat format = ExportFormat::Jpeg;
+	UINT maxEdge = 2048;   // longest side of the output, 0 keeps the size
+	ULONG jpegQuality = 90;
+	PngPreset pngPreset = PngPreset::Balanced;
+	bool linearLight = false;
+	QoS qos = QoS::Background;
+};
+
+struct ExportBatch
+{
+	explicit ExportBatch(int slots) : slots(slots) {}
+
+	ExportOptions options;
+	int total = 0;
+	std::atomic<int> done{ 0 };
+	std::atomic<int> failed{ 0 };
+	std::atomic<int> finished{ 0 }; // done + failed, bumped after progress so it can be waited on
+	AsyncSemaphore slots;
+	std::function<void(const ExportBatch&, const std::wstring&, bool)> progress; // called on a worker
+};
+
+// Decodes the first frame, letting the codec downscale by a power of two as
+// long as the longest side stays at least minEdge (JPEG does this in the DCT).
+// Falls back to a full-size decode for formats that cannot.
+static std::shared_ptr<PixelBuffer> DecodeReduced(const std::vector<BYTE>& bytes, UINT minEdge, int& orientation)
+{
+	static const struct { const GUID* wic; PixelFormat gdi; } formats[] = {
+		{ &GUID_WICPixelFormat32bppPBGRA, PixelFormat32bppPARGB },
+		{ &GUID_WICPixelFormat32bppBGRA, PixelFormat32bppARGB },
+		{ &GUID_WICPixelFormat32bppBGR, PixelFormat32bppRGB },
+		{ &GUID_WICPixelFormat24bppBGR, PixelFormat24bppRGB },
+		{ &GUID_WICPixelFormat8bppGray, PixelFormat8bppIndexed },
+	};
+
+	IWICBitmapDecoder* decoder = CreateWicDecoder(bytes);
+	if (!decoder) return nullptr;
+	std::shared_ptr<PixelBuffer> px;
+	IWICBitmapFrameDecode* frame = nullptr;
+	IWICBitmapSourceTransform* transform = nullptr;
+	UINT w = 0, h = 0;
+	if (SUCCEEDED(decoder->GetFrame(0, &frame)) && SUCCEEDED(frame->GetSize(&w, &h)) && w && h)
+	{
+		orientation = GetWicOrientation(frame);
+		UINT sw = w, sh = h;
+		if (minEdge && SUCCEEDED(frame->QueryInterface(IID_PPV_ARGS(&transform))))
+		{
+			for (UINT div = 8; div > 1; div /= 2)
+			{
+				UINT tw = (w + div - 1) / div, th = (h + div - 1) / div;
+				if ((std::max)(tw, th) < minEdge) continue;
+				if (SUCCEEDED(transform->GetClosestSize(&tw, &th)) && (std::max)(tw, th) >= minEdge && tw < w)
+				{
+					sw = tw;
+					sh = th;
+					break;
+				}
+			}
+		}
+		if (sw != w)
+		{
+			WICPixelFormatGUID fmt = GUID_WICPixelFormat32bppPBGRA;
+			transform->GetClosestPixelFormat(&fmt);
+			for (auto& f : formats)
+			{
+				if (fmt != *f.wic) continue;
+				px = std::make_shared<PixelBuffer>(sw, sh, f.gdi);
+				if (f.gdi == PixelFormat8bppIndexed)
+				{
+					px->palette.resize(256);
+					for (UINT i = 0; i < 256; ++i) px->palette[i] = 0xFF000000 | (i << 16) | (i << 8) | i;
+				}
+				if (FAILED(transform->CopyPixels(nullptr, sw, sh, &fmt, WICBitmapTransformRotate0, px->stride, (UINT)px->data.size(), px->data.data())))
+					px.reset();
+				break;
+			}
+		}
+		IWICFormatConverter* converter = nullptr;
+		if (!px && SUCCEEDED(WicFactory()->CreateFormatConverter(&converter)) &&
+			SUCCEEDED(converter->Initialize(frame, GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, nullptr, 0, WICBitmapPaletteTypeCustom)))
+		{
+			px = std::make_shared<PixelBuffer>(w, h);
+			if (FAILED(converter->CopyPixels(nullptr, px->stride, (UINT)px->data.size(), px->data.data()))) px.reset();
+		}
+		if (converter) converter->Release();
+	}
+	if (transform) transform->Release();
+	if (frame) frame->Release();
+	decoder->Release();
+	if (px) ChargePixels((uint64_t)px->width * px->height);
+	return px;
+}
+
+static bool ExportFile(const ExportBatch& batch, const std::wstring& path)
+{
+	const ExportOptions& opt = batch.options;
+	UsageScope usage(Subsystem::Read);
+	std::vector<BYTE> bytes = ReadFileBytes(path);
+	int orient = 1;
+	usage.Switch(DecodeSubsystemFor(bytes));
+	auto src = DecodeReduced(bytes, opt.maxEdge, orient);
+	if (!src) return false;
+	bytes = {};
+
+	// fit the oriented image within maxEdge, never enlarging
+	UINT ow = IsTransposed(orient) ? src->height : src->width;
+	UINT oh = IsTransposed(orient) ? src->width : src->height;
+	UINT dw = ow, dh = oh;
+	if (opt.maxEdge && (std::max)(ow, oh) > opt.maxEdge)
+	{
+		double s = (double)opt.maxEdge / (std::max)(ow, oh);
+		dw = (std::max)(1u, (UINT)(ow * s + 0.5));
+		dh = (std::max)(1u, (UINT)(oh * s + 0.5));
+	}
+	usage.Switch(Subsystem::Scale);
+	PixelBuffer dst(dw, dh);
+	RenderOriented(*src, orient, dw, dh, 0, 0, dst, opt.qos, opt.linearLight);
+	src.reset();
+
+	usage.Switch(Subsystem::Encode);
+	static const wchar_t* exts[] = { L".jpg", L".png", L".bmp" };
+	std::wstring out = (fs::path(opt.outDir) / fs::path(path).stem()).wstring() + exts[(int)opt.format];
+	if (opt.format == ExportFormat::Png) return WriteFileBytes(out, EncodePng(dst, opt.pngPreset, opt.qos));
+
+	Bitmap bmp((INT)dst.width, (INT)dst.height, (INT)dst.stride, dst.format, dst.data.data());
+	CLSID enc = GetEncoderClsid(opt.format == ExportFormat::Jpeg ? L"image/jpeg" : L"image/bmp");
+	ULONG quality = opt.jpegQuality;
+	EncoderParameters params = {};
+	params.Count = 1;
+	params.Parameter[0].Guid = EncoderQuality;
+	params.Parameter[0].Type = EncoderParameterValueTypeLong;
+	params.Parameter[0].NumberOfValues = 1;
+	params.Parameter[0].Value = &quality;
+	return SaveBitmap(bmp, out, enc, opt.format == ExportFormat::Jpeg ? &params : nullptr);
+}
+
+static Job ExportPipeline(std::shared_ptr<ExportBatch> batch, std::wstring path)
+{
+	co_await batch->slots.Acquire(batch->options.qos);
+	co_await g_pool.Schedule(batch->options.qos);
+	bool ok = !g_stopThreads && ExportFile(*batch, path);
+	batch->slots.Release();
+	++(ok ? batch->done : batch->failed);
+	if (batch->progress) batch->progress(*batch, path, ok);
+	++batch->finished;
+	batch->finished.notify_all();
+}
+
+static std::shared_ptr<ExportBatch> StartExport(const std::vector<std::wstring>& files, const ExportOptions& options,
+	std::function<void(const ExportBatch&, const std::wstring&, bool)> progress)
+{
+	// a few files per core: enough to overlap reads with decoding, few enough to bound memory
+	auto batch = std::make_shared<ExportBatch>((std::max)(2, (int)std::thread::hardware_concurrency()));
+	batch->options = options;
+	batch->total = (int)files.size();
+	batch->progress = std::move(progress);
+	SHCreateDirectoryExW(nullptr, options.outDir.c_str(), nullptr);
+	for (auto& f : files) ExportPipeline(batch, f);
+	return batch;
+}
+
+// ---------------------------------------------------------------------------
+// Paint: the panel is drawn into a back buffer whose pixels live in a DIB
+// section, and blitted to the window from its memory DC. The Graphics on the
+// back buffer and every font, brush and pen the paint uses are made once and
+// kept across paints, so a paint that only redraws cached frames and tiles
+// creates no GDI+ objects and allocates nothing.
+
+struct PaintTools
+{
+	Gdiplus::Font label{ L"Segoe UI", 18.0f };
+	Gdiplus::Font cropHint{ L"Segoe UI", 12.0f };
+	Gdiplus::Font gotoPrompt{ L"Segoe UI", 14.0f };
+	Gdiplus::Font loupeZoom{ L"Segoe UI", 9.0f };
+	Gdiplus::Font stats{ L"Consolas", 10.0f };
+	Gdiplus::SolidBrush checkerLight{ Gdiplus::Color(255, 30, 30, 30) };
+	Gdiplus::SolidBrush checkerDark{ Gdiplus::Color(255, 40, 40, 40) };
+	Gdiplus::SolidBrush labelText{ Gdiplus::Color(255, 255, 0, 0) };
+	Gdiplus::SolidBrush text{ Gdiplus::Color(255, 255, 255, 255) };
+	Gdiplus::SolidBrush shade{ Gdiplus::Color(160, 0, 0, 0) }; // outside the crop, under the stats
+	Gdiplus::SolidBrush promptBack{ Gdiplus::Color(200, 0, 0, 0) };
+	Gdiplus::SolidBrush loupeBack{ Gdiplus::Color(255, 32, 32, 32) };
+	Gdiplus::Pen edge{ Gdiplus::Color(255, 255, 255, 255), 1.0f };
+	Gdiplus::Matrix orientation; // of the image on screen, set per draw
+};
+
+static std::unique_ptr<PaintTools> g_paintTools; // freed before GDI+ shuts down
+static std::shared_ptr<Gdiplus::Bitmap> g_backBuffer;
+static std::unique_ptr<Gdiplus::Graphics> g_backGraphics;
+static HDC g_backDc = nullptr;
+static HBITMAP g_backDib = nullptr; // g_backBuffer's pixels
+static UINT g_backDpi = 0;
+
+static PaintTools& Tools()
+{
+	if (!g_paintTools) g_paintTools = std::make_unique<PaintTools>();
+	return *g_paintTools;
+}
+
+// The back buffer's Graphics with no transform or clip and the default
+// modes, as a new one would be.
+static Gdiplus::Graphics& BackGraphics()
+{
+	Gdiplus::Graphics& g = *g_backGraphics;
+	g.ResetTransform();
+	g.ResetClip();
+	g.SetSmoothingMode(SmoothingModeDefault);
+	g.SetInterpolationMode(InterpolationModeDefault);
+	g.SetPixelOffsetMode(PixelOffsetModeDefault);
+	return g;
+}
+
+// for a panel of w x h on a display of g_dpi; false if there is nothing to draw into
+static bool PrepareBackBuffer(int w, int h)
+{
+	if (g_backBuffer && (int)g_backBuffer->GetWidth() == w && (int)g_backBuffer->GetHeight() == h && g_backDpi == g_dpi) return true;
+	g_backGraphics.reset();
+	g_backBuffer.reset();
+	if (w <= 0 || h <= 0) return false;
+
+	BITMAPINFO bmi = {};
+	bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+	bmi.bmiHeader.biWidth = w;
+	bmi.bmiHeader.biHeight = -h; // top-down, as GDI+ lays out rows
+	bmi.bmiHeader.biPlanes = 1;
+	bmi.bmiHeader.biBitCount = 32;
+	bmi.bmiHeader.biCompression = BI_RGB;
+	void* bits = nullptr;
+	HBITMAP dib = CreateDIBSection(nullptr, &bmi, DIB_RGB_COLORS, &bits, nullptr, 0);
+	if (!dib) return false;
+	if (!g_backDc) g_backDc = CreateCompatibleDC(nullptr);
+	HGDIOBJ old = SelectObject(g_backDc, dib);
+	if (g_backDib) DeleteObject(old);
+	g_backDib = dib;
+
+	g_backBuffer = std::make_shared<Gdiplus::Bitmap>(w, h, w * 4, PixelFormat32bppARGB, (BYTE*)bits);
+	g_backBuffer->SetResolution((REAL)g_dpi, (REAL)g_dpi); // overlay text in points scales with the display
+	g_backGraphics = std::make_unique<Gdiplus::Graphics>(g_backBuffer.get());
+	g_backDpi = g_dpi;
+	return true;
+}
+
+void ClearCheckeredBackground(Gdiplus::Graphics& g, RECT rc, int tileSize = 16)
+{
+	PaintTools& tools = Tools();
+	for (int y = rc.top; y < rc.bottom; y += tileSize)
+	{
+		for (int x = rc.left; x < rc.right; x += tileSize)
+		{
+			bool isLight = ((x / tileSize) + (y / tileSize)) % 2 == 0;
+			g.FillRectangle(isLight ? &tools.checkerLight : &tools.checkerDark, x, y, tileSize + 1, tileSize + 1);
+		}
+	}
+}
+
+// what a paint put on screen for the current image
+enum class Drawn { Nothing, Preview, Full };
+
+static Drawn DrawImageOntoBackbuffer(RECT rc)
+{
+	Gdiplus::Graphics& g = BackGraphics();
+	g.SetSmoothingMode(SmoothingModeHighQuality);
+	g.SetInterpolationMode(InterpolationModeHighQualityBicubic);
+
+	// clear background
+	ClearCheckeredBackground(g, rc);
+
+	// Utility label
+	PaintTools& tools = Tools();
+	Gdiplus::Font& font = tools.label;
+	Gdiplus::SolidBrush& brush = tools.labelText;
+	Gdiplus::RectF layout((REAL)rc.left, (REAL)rc.top, (REAL)(rc.right - rc.left), (REAL)(rc.bottom - rc.top));
+
+	if (g_files.empty())
+	{
+		// no files found
+		g.DrawString(L"No image found", -1, &font, layout, nullptr, &brush);
+		return Drawn::Nothing;
+	}
+
+	// a hit allocates nothing; only misses and rescales copy the path
+	std::shared_ptr<CacheInfo> info = GetCachedAt(g_index);
+	if (!info)
+	{
+		// still in the pipeline; DrainCompletions repaints when it lands
+		RequestLoad(PathAt(g_index));
+		g.DrawString(L"Loading...", -1, &font, layout, nullptr, &brush);
+		return Drawn::Nothing;
+	}
+
+	if (!info->bitmap)
+	{
+		// file exists but failed to load
+		g.DrawString(L"Error loading image", -1, &font, layout, nullptr, &brush);
+		return Drawn::Full; // as good as it gets
+	}
+
+	Matrix& mx = tools.orientation;
+	Rect dst;
+	CalcRectAndMatrix(info->width, info->height, info->orientation, rc, mx, dst);
+	if (Bitmap* frame = PlayingFrame(*info))
+	{
+		// frames change too often to rescale each; GDI+ scales the canvas
+		g.SetInterpolationMode(InterpolationModeBilinear);
+		g.SetTransform(&mx);
+		g.DrawImage(frame, dst);
+		return Drawn::Full;
+	}
+	if (info->preview)
+	{
+		// a reduced decode while the full one runs
+		RequestLoad(PathAt(g_index));
+		g.SetInterpolationMode(InterpolationModeBilinear);
+		g.SetTransform(&mx);
+		g.DrawImage(info->bitmap.get(), dst);
+		return Drawn::Preview;
+	}
+
+	bool preview = false;
+	DisplayTarget target;
+	if (GetDisplayTarget(*info, target))
+	{
+		if (info->scaled && info->scaledFor == target)
+		{
+			// already oriented and at display size: a plain 1:1 copy
+			bool transposed = IsTransposed(info->orientation);
+			Rect disp = CalcDisplayRect(transposed ? info->height : info->width, transposed ? info->width : info->height, rc);
+			g.SetInterpolationMode(InterpolationModeNearestNeighbor);
+			g.SetPixelOffsetMode(PixelOffsetModeHalf);
+			g.DrawImage(info->scaled.get(), Rect(disp.X + target.clipX, disp.Y + target.clipY, (INT)target.clipW, (INT)target.clipH));
+			return Drawn::Full;
+		}
+
+		// panel or zoom changed: quick preview now, the high quality frame follows
+		g.SetInterpolationMode(InterpolationModeBilinear);
+		RequestRescale(PathAt(g_index), info, target);
+		preview = true;
+	}
+
+	g.SetTransform(&mx);
+	g.DrawImage(info->bitmap.get(), dst);
+	return preview ? Drawn::Preview : Drawn::Full;
+}
+
+// Crop mode: drag a rectangle on the panel, Enter applies it, Esc leaves.
+static bool g_cropMode = false;
+static bool g_cropDragging = false;
+static POINT g_cropFrom = {};
+static POINT g_cropTo = {}; // panel coordinates
+
+// The dragged rectangle in stored pixels of info, its origin snapped down to
+// the crop grid. False if it is empty or the whole image.
+static bool CropRectFromDrag(const CacheInfo& info, RECT rc, Rect& crop)
+{
+	LayoutRect r;
+	LayoutMatrix m;
+	OrientedLayout(info.width, info.height, info.orientation, { rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top }, g_zoom, r, m);
+	Rect dst(r.x, r.y, r.width, r.height);
+	float det = m.m11 * m.m22 - m.m21 * m.m12;
+	if (dst.Width <= 0 || dst.Height <= 0 || det == 0) return false;
+	// panel points back to where they are on the unrotated rect
+	PointF pts[2] = { PointF((REAL)g_cropFrom.x, (REAL)g_cropFrom.y), PointF((REAL)g_cropTo.x, (REAL)g_cropTo.y) };
+	for (PointF& p : pts)
+	{
+		REAL x = p.X - m.dx, y = p.Y - m.dy;
+		p = PointF((m.m22 * x - m.m21 * y) / det, (m.m11 * y - m.m12 * x) / det);
+	}
+	auto toX = [&](REAL v) { return (INT)std::clamp(std::lround((v - dst.X) * (double)info.width / dst.Width), 0L, (long)info.width); };
+	auto toY = [&](REAL v) { return (INT)std::clamp(std::lround((v - dst.Y) * (double)info.height / dst.Height), 0L, (long)info.height); };
+	INT x0 = (std::min)(toX(pts[0].X), toX(pts[1].X)), x1 = (std::max)(toX(pts[0].X), toX(pts[1].X));
+	INT y0 = (std::min)(toY(pts[0].Y), toY(pts[1].Y)), y1 = (std::max)(toY(pts[0].Y), toY(pts[1].Y));
+	x0 -= x0 % (INT)info.cropGridW;
+	y0 -= y0 % (INT)info.cropGridH;
+	if (x1 <= x0 || y1 <= y0 || (x1 - x0 == (INT)info.width && y1 - y0 == (INT)info.height)) return false;
+	crop = Rect(x0, y0, x1 - x0, y1 - y0);
+	return true;
+}
+
+// Dims the image outside the crop, as it will be written, and says how.
+static void DrawCropOverlay(RECT rc)
+{
+	if (!g_cropMode) return;
+	std::shared_ptr<CacheInfo> info = GetCachedAt(g_index);
+	if (!info || !info->pixels || info->preview) return;
+
+	Gdiplus::Graphics& g = BackGraphics();
+	PaintTools& tools = Tools();
+	bool lossless = info->rawFormat != ImageFormatJPEG || info->cropGridW > 1;
+	g.DrawString(lossless ? L"Crop: drag, Enter to apply, Esc to cancel" : L"Crop (re-encodes this JPEG): drag, Enter to apply, Esc to cancel",
+		-1, &tools.cropHint, PointF((REAL)rc.left + 4, (REAL)rc.top + 4), &tools.text);
+
+	Rect crop;
+	if (!CropRectFromDrag(*info, rc, crop)) return;
+	Matrix& mx = tools.orientation;
+	Rect dst;
+	CalcRectAndMatrix(info->width, info->height, info->orientation, rc, mx, dst);
+	REAL sx = (REAL)dst.Width / info->width, sy = (REAL)dst.Height / info->height;
+	RectF keep(dst.X + crop.X * sx, dst.Y + crop.Y * sy, crop.Width * sx, crop.Height * sy);
+	// the bands above, below, left and right of what is kept
+	const REAL right = (REAL)dst.GetRight(), bottom = (REAL)dst.GetBottom();
+	RectF outside[4] = {
+		RectF((REAL)dst.X, (REAL)dst.Y, (REAL)dst.Width, keep.Y - dst.Y),
+		RectF((REAL)dst.X, keep.GetBottom(), (REAL)dst.Width, bottom - keep.GetBottom()),
+		RectF((REAL)dst.X, keep.Y, keep.X - dst.X, keep.Height),
+		RectF(keep.GetRight(), keep.Y, right - keep.GetRight(), keep.Height),
+	};
+	g.SetTransform(&mx);
+	g.FillRectangles(&tools.shade, outside, 4);
+	g.DrawRectangle(&tools.edge, keep);
+}
+
+// ---------------------------------------------------------------------------
+// Loupe: a magnified view of the image under the cursor, drawn from 256 x 256
+// tiles of the oriented image at 100%. Tiles are rendered on demand, only the
+// ones the loupe touches plus a ring around them, from the cached full
+// resolution pixels, else the pyramid, else (while the entry is a preview)
+// a region decode of the file; they are kept in a small LRU, so moving the
+// loupe mostly redraws cached tiles. Navigating away or closing the loupe
+// cancels the tiles still queued.
+
+static const UINT LoupeTileSize = 256;
+static const size_t LoupeTileCount = 64; // 16 MB
+static const int LoupeRadius = 140;      // half the loupe's side, in 96-DPI pixels
+
+struct LoupeTile
+{
+	std::shared_ptr<PixelBuffer> pixels;
+	std::shared_ptr<Bitmap> bitmap;
+};
+
+static bool g_loupe = false;
+static bool g_loupeInside = false;  // cursor over the panel
+static POINT g_loupePos = {};       // panel coordinates
+static int g_loupeZoom = 4;         // 1, 2, 4, 8 or 16 screen pixels per image pixel
+
+static std::mutex g_loupeMutex;
+static LoupeTileCache<LoupeTile> g_loupeTiles{ LoupeTileCount };
+static CancelToken g_loupeWork;                    // of the queued tiles; UI thread only
+
+static RECT LoupeRect()
+{
+	const int r = Px(LoupeRadius);
+	return { g_loupePos.x - r, g_loupePos.y - r, g_loupePos.x + r, g_loupePos.y + r };
+}
+
+static void InvalidateLoupe()
+{
+	if (!g_loupe || !g_loupeInside) return;
+	RECT r = LoupeRect();
+	InflateRect(&r, 2, 2);
+	InvalidateRect(g_hPanel, &r, FALSE);
+}
+
+static void MoveLoupe(HWND hWnd, POINT pt)
+{
+	InvalidateLoupe();
+	if (!g_loupeInside)
+	{
+		TRACKMOUSEEVENT tme = { sizeof(tme), TME_LEAVE, hWnd, 0 };
+		TrackMouseEvent(&tme);
+	}
+	g_loupeInside = true;
+	g_loupePos = pt;
+	InvalidateLoupe();
+}
+
+// drops the tiles not yet rendered, e.g. of the image navigated away from
+static void CancelLoupeTiles()
+{
+	g_loupeWork.Cancel();
+	g_loupeWork = CancelToken();
+	std::lock_guard<std::mutex> lk(g_loupeMutex);
+	g_loupeTiles.ClearPending();
+}
+
+static void ToggleLoupe()
+{
+	InvalidateLoupe();
+	g_loupe = !g_loupe;
+	g_loupeInside = false;
+	if (!g_loupe) CancelLoupeTiles();
+	POINT pt;
+	RECT rc;
+	GetCursorPos(&pt);
+	ScreenToClient(g_hPanel, &pt);
+	GetClientRect(g_hPanel, &rc);
+	if (g_loupe && PtInRect(&rc, pt)) MoveLoupe(g_hPanel, pt);
+}
+
+// What a tile is rendered from: the full pixels, the pyramid, or for a
+// preview the entry itself, the file being decoded a region at a time; null
+// if none. Tiles of a preview are not kept once the full decode replaces it.
+static std::shared_ptr<const void> LoupeSource(const std::shared_ptr<CacheInfo>& info)
+{
+	if (info->pixels && !info->preview) return info->pixels;
+	if (info->pyramid) return info->pyramid;
+	if (info->preview) return info;
+	return nullptr;
+}
+
+static LoupeTileKey LoupeKey(const std::shared_ptr<CacheInfo>& info, UINT tx, UINT ty)
+{
+	bool deep = info->pixels && !info->preview && info->pixels->format == PixelFormat64bppARGB;
+	return { LoupeSource(info).get(), info->orientation, info->colorLut.get(), deep ? g_tone : ToneAdjust{}, tx, ty };
+}
+
+// The rect r of the stored image in path, as premultiplied BGRA, with the
+// file's ICC profile. WIC decodes only as far as the rect reaches, and
+// converts only the rect.
+static std::shared_ptr<PixelBuffer> DecodeRegion(const std::wstring& path, const Rect& r, std::vector<BYTE>& icc)
+{
+	IWICImagingFactory* factory = WicFactory();
+	IWICBitmapDecoder* decoder = nullptr;
+	if (!factory || FAILED(factory->CreateDecoderFromFilename(path.c_str(), nullptr, GENERIC_READ, WICDecodeMetadataCacheOnDemand, &decoder))) return nullptr;
+	std::shared_ptr<PixelBuffer> px;
+	IWICBitmapFrameDecode* frame = nullptr;
+	IWICFormatConverter* converter = nullptr;
+	GUID container = {};
+	decoder->GetContainerFormat(&container);
+	UsageScope usage(container == GUID_ContainerFormatJpeg ? Subsystem::DecodeJpeg : container == GUID_ContainerFormatPng ? Subsystem::DecodePng : Subsystem::DecodeOther);
+	if (SUCCEEDED(decoder->GetFrame(0, &frame)) && SUCCEEDED(factory->CreateFormatConverter(&converter)) &&
+		SUCCEEDED(converter->Initialize(frame, GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, nullptr, 0, WICBitmapPaletteTypeCustom)))
+	{
+		icc = GetWicIcc(frame);
+		WICRect rect = { r.X, r.Y, r.Width, r.Height };
+		px = std::make_shared<PixelBuffer>((UINT)r.Width, (UINT)r.Height);
+		if (SUCCEEDED(converter->CopyPixels(&rect, px->stride, (UINT)px->data.size(), px->data.data()))) ChargePixels((uint64_t)r.Width * r.Height);
+		else px.reset();
+	}
+	if (converter) converter->Release();
+	if (frame) frame->Release();
+	decoder->Release();
+	return px;
+}
+
+static Job LoupeTilePipeline(std::shared_ptr<CacheInfo> info, std::wstring path, LoupeTileKey key, CancelToken token, QoS qos)
+{
+	co_await g_pool.Schedule(qos);
+	if (token.Cancelled()) co_return; // the pending list was cleared with it
+	UINT ow = IsTransposed(info->orientation) ? info->height : info->width;
+	UINT oh = IsTransposed(info->orientation) ? info->width : info->height;
+	UINT x = key.tx * LoupeTileSize, y = key.ty * LoupeTileSize;
+	auto px = std::make_shared<PixelBuffer>((std::min)(LoupeTileSize, ow - x), (std::min)(LoupeTileSize, oh - y));
+	std::shared_ptr<const void> source = LoupeSource(info);
+	std::shared_ptr<const ColorLut> colorLut = info->colorLut;
+	bool ok = true;
+	if (source == info->pixels)
+	{
+		UsageScope usage(Subsystem::Scale);
+		RenderOriented(*info->pixels, info->orientation, ow, oh, x, y, *px, qos, false, key.tone);
+	}
+	else if (source == info->pyramid)
+	{
+		UsageScope usage(Subsystem::Scale);
+		RenderFromPyramid(*info->pyramid, info->orientation, ow, oh, x, y, *px, qos);
+	}
+	else
+	{
+		// the stored pixels under the tile, decoded from the file
+		Rect need = OrientedSourceRect(info->width, info->height, info->orientation, ow, oh, x, y, px->width, px->height);
+		std::vector<BYTE> icc;
+		std::shared_ptr<PixelBuffer> part = DecodeRegion(path, need, icc);
+		ok = part && !token.Cancelled();
+		if (ok)
+		{
+			colorLut = DisplayColorLut(icc);
+			UsageScope usage(Subsystem::Scale);
+			RenderOrientedPart(*part, info->width, info->height, need.X, need.Y, info->orientation, ow, oh, x, y, *px, qos);
+		}
+	}
+	if (ok && colorLut)
+	{
+		UsageScope usage(Subsystem::Scale);
+		ApplyColorLut(*colorLut, *px, qos);
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(g_loupeMutex);
+		if (token.Cancelled()) co_return;
+		g_loupeTiles.EndPending(key);
+		if (!ok) co_return;
+		g_loupeTiles.Add(key, source, { px, WrapPixels(px) });
+	}
+	Complete(Completion::LoupeTile, std::wstring(), nullptr, CancelToken());
+}
+
+// The cached tile for key, or null after starting to render it.
+static std::shared_ptr<Bitmap> LoupeTileBitmap(const std::shared_ptr<CacheInfo>& info, const LoupeTileKey& key, QoS qos)
+{
+	std::lock_guard<std::mutex> lk(g_loupeMutex);
+	if (const LoupeTile* tile = g_loupeTiles.Find(key)) return tile->bitmap;
+	if (g_loupeTiles.StartPending(key)) LoupeTilePipeline(info, PathAt(g_index), key, g_loupeWork, qos);
+	return nullptr;
+}
+
+static void DrawLoupe(RECT rc)
+{
+	if (!g_loupe || !g_loupeInside) return;
+	std::shared_ptr<CacheInfo> info = GetCachedAt(g_index);
+	if (!info || !info->bitmap || !LoupeSource(info)) return;
+	UINT ow = IsTransposed(info->orientation) ? info->height : info->width;
+	UINT oh = IsTransposed(info->orientation) ? info->width : info->height;
+	Rect disp = CalcDisplayRect(ow, oh, rc);
+	if (disp.Width <= 0 || disp.Height <= 0 || !disp.Contains(g_loupePos.x, g_loupePos.y)) return;
+
+	// the image pixels the loupe covers, centred on the one under the cursor
+	double cx = (g_loupePos.x - disp.X + 0.5) * ow / disp.Width, cy = (g_loupePos.y - disp.Y + 0.5) * oh / disp.Height;
+	double half = (double)Px(LoupeRadius) / g_loupeZoom;
+	double x0 = cx - half, y0 = cy - half;
+	int tx0 = (int)std::floor(x0 / LoupeTileSize), tx1 = (int)std::floor((cx + half) / LoupeTileSize);
+	int ty0 = (int)std::floor(y0 / LoupeTileSize), ty1 = (int)std::floor((cy + half) / LoupeTileSize);
+	const int tilesX = (int)((ow + LoupeTileSize - 1) / LoupeTileSize), tilesY = (int)((oh + LoupeTileSize - 1) / LoupeTileSize);
+
+	RECT lr = LoupeRect();
+	Gdiplus::Graphics& g = BackGraphics();
+	PaintTools& tools = Tools();
+	Rect frame(lr.left, lr.top, lr.right - lr.left, lr.bottom - lr.top);
+	g.FillRectangle(&tools.loupeBack, frame);
+	g.SetClip(frame);
+	g.SetInterpolationMode(InterpolationModeNearestNeighbor);
+	g.SetPixelOffsetMode(PixelOffsetModeHalf);
+	for (int ty = ty0 - 1; ty <= ty1 + 1; ++ty)
+	{
+		for (int tx = tx0 - 1; tx <= tx1 + 1; ++tx)
+		{
+			if (tx < 0 || ty < 0 || tx >= tilesX || ty >= tilesY) continue;
+			// the ring outside the loupe is only prefetched
+			bool visible = tx >= tx0 && tx <= tx1 && ty >= ty0 && ty <= ty1;
+			auto tile = LoupeTileBitmap(info, LoupeKey(info, tx, ty), visible ? QoS::Interactive : QoS::Prefetch);
+			if (!tile || !visible) continue;
+			RectF dst((REAL)(lr.left + (tx * (double)LoupeTileSize - x0) * g_loupeZoom), (REAL)(lr.top + (ty * (double)LoupeTileSize - y0) * g_loupeZoom),
+				(REAL)tile->GetWidth() * g_loupeZoom, (REAL)tile->GetHeight() * g_loupeZoom);
+			g.DrawImage(tile.get(), dst);
+		}
+	}
+	g.ResetClip();
+
+	g.DrawRectangle(&tools.edge, frame);
+	wchar_t label[16];
+	swprintf(label, 16, L"%d%%", g_loupeZoom * 100);
+	g.DrawString(label, -1, &tools.loupeZoom, PointF((REAL)lr.left + 3, (REAL)lr.top + 2), &tools.text);
+}
+
+// ---------------------------------------------------------------------------
+// Navigation latency: from the input that changed the image to the first
+// present that shows the new one, as a preview or at full quality, and to the
+// present that shows it at full quality. UI thread only.
+
+static LatencyHistogram g_navFirst; // to the first present of the new image
+static LatencyHistogram g_navFull;  // to its present at full quality
+static std::chrono::steady_clock::time_point g_inputTime; // of the input message being handled
+
+// Stamps g_inputTime while an input message is handled.
+struct InputStamp
+{
+	explicit InputStamp(bool input) : active(input) { if (active) g_inputTime = std::chrono::steady_clock::now(); }
+	~InputStamp() { if (active) g_inputTime = {}; }
+	bool active;
+};
+
+struct PendingNavigation
+{
+	std::wstring path; // empty when nothing is pending
+	std::chrono::steady_clock::time_point start;
+	bool shown = false;
+};
+
+static PendingNavigation g_nav;
+
+// the image changed; a newer navigation replaces one that was never shown
+static void BeginNavigation()
+{
+	g_nav.path = PathAt(g_index);
+	g_nav.start = g_inputTime != std::chrono::steady_clock::time_point() ? g_inputTime : std::chrono::steady_clock::now();
+	g_nav.shown = false;
+}
+
+// after a present
+static void EndNavigation(Drawn drawn)
+{
+	if (g_nav.path.empty() || drawn == Drawn::Nothing || PathAt(g_index) != g_nav.path) return;
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - g_nav.start).count();
+	if (!g_nav.shown) g_navFirst.Add(ms);
+	g_nav.shown = true;
+	if (drawn != Drawn::Full) return;
+	g_navFull.Add(ms);
+	g_nav.path.clear();
+}
+
+static std::string LatencyJson(const LatencyHistogram& h)
+{
+	char buf[160];
+	snprintf(buf, sizeof(buf), "{ \"count\": %u, \"p50Ms\": %.1f, \"p95Ms\": %.1f, \"p99Ms\": %.1f, \"maxMs\": %.1f }",
+		h.total, h.Percentile(0.5), h.Percentile(0.95), h.Percentile(0.99), h.maxMs);
+	return buf;
 }
 
-static void CalcRectAndMatrix(UINT w, UINT h, int orient, RECT rc, Matrix& mx, Rect& rect)
+// A timed --export batch: how many pool threads it ran on, and its wall time.
+struct ExportRun
+{
+	int threads = 0;
+	double seconds = 0;
+};
+
+// Session totals as JSON, per subsystem and for the whole process as
+// Windows counts it, and the navigation latencies. For an export run also
+// the decode throughput per format against the batch's wall time, which is
+// what a sweep of --threads compares; one format per run keeps them apart.
+static std::string UsageJson(const ExportRun* run = nullptr)
 {
-	// compute displayed size
-	rect.Width = w;
-	rect.Height = h;
-	double imgAspect = (double)w / h;
-	double ww = rc.right - rc.left;
-	double wh = rc.bottom - rc.top;
-	rect.X = rc.left;
-	rect.Y = rc.top;
-	if (g_zoom == 0 || (g_zoom == 2 && (w <= ww && h <= wh)))
+	FILETIME created, exited, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+	auto ms = [](FILETIME t) { return (((uint64_t)t.dwHighDateTime << 32) | t.dwLowDateTime) / 10000.0; };
+	IO_COUNTERS io = {};
+	GetProcessIoCounters(GetCurrentProcess(), &io);
+
+	char buf[256];
+	snprintf(buf, sizeof(buf), "{\n  \"sessionSeconds\": %.3f,\n  \"process\": { \"cpuMs\": %.1f, \"bytesRead\": %llu, \"bytesWritten\": %llu },\n  \"subsystems\": {\n",
+		SessionSeconds(), ms(kernel) + ms(user), io.ReadTransferCount, io.WriteTransferCount);
+	std::string json = buf;
+	for (int i = 0; i < (int)Subsystem::Count; ++i)
 	{
-		rect.X += (int)((ww - rect.Width) / 2.0);
-		rect.Y += (int)((wh - rect.Height) / 2.0);
+		const SubsystemUsage& u = g_usage[i];
+		double cpuMs = CyclesToMs(u.cycles), mp = u.pixels / 1e6;
+		snprintf(buf, sizeof(buf), "    \"%s\": { \"cpuMs\": %.1f, \"bytesRead\": %llu, \"bytesWritten\": %llu, \"megapixels\": %.2f, \"mpPerCpuSecond\": %.1f }%s\n",
+			SubsystemNames[i], cpuMs, (unsigned long long)u.bytesRead, (unsigned long long)u.bytesWritten, mp, cpuMs > 0 ? mp * 1000 / cpuMs : 0.0,
+			i + 1 < (int)Subsystem::Count ? "," : "");
+		json += buf;
 	}
-	else
+	json += "  },\n  \"navigation\": {\n    \"firstShown\": " + LatencyJson(g_navFirst) + ",\n    \"fullQuality\": " + LatencyJson(g_navFull) + "\n  }";
+	if (run)
 	{
-		double wAR = ww / wh;
-		if (imgAspect > wAR)
-		{
-			rect.Width = (int)ww;
-			rect.Height = (int)(wh / imgAspect);
-			rect.Y += (int)((wh - rect.Height) / 2.0);
-		}
-		else
+		snprintf(buf, sizeof(buf), ",\n  \"export\": {\n    \"threads\": %d,\n    \"seconds\": %.3f,\n    \"formats\": {", run->threads, run->seconds);
+		json += buf;
+		const char* sep = "\n";
+		for (int i = (int)Subsystem::DecodeJpeg; i <= (int)Subsystem::DecodeOther; ++i)
 		{
-			rect.Height = (int)wh;
-			rect.Width = (int)(wh * imgAspect);
-			rect.X += (int)((ww - rect.Width) / 2.0);
+			double mp = g_usage[i].pixels / 1e6;
+			if (mp <= 0) continue;
+			snprintf(buf, sizeof(buf), "%s      \"%s\": { \"megapixels\": %.2f, \"mpPerSecond\": %.1f }",
+				sep, SubsystemNames[i], mp, run->seconds > 0 ? mp / run->seconds : 0.0);
+			json += buf;
+			sep = ",\n";
 		}
+		json += "\n    }\n  }";
 	}
-
-	// draw with orientation applied
-	// convert to rotated matrix if needed
-	switch (orient)
-	{
-	case 2: mx.Scale(-1.0f, 1.0f); mx.Translate((float)rect.Width, 0); break;
-	case 3: mx.RotateAt(180.0f, PointF((float)(rect.X + rect.Width / 2.0f), (float)(rect.Y + rect.Height / 2.0f))); break;
-	case 4: mx.Scale(1.0f, -1.0f); mx.Translate(0, (float)rect.Height); break;
-	case 5: mx.RotateAt(90.0f, PointF((float)(rect.X + rect.Width / 2.0f), (float)(rect.Y + rect.Height / 2.0f))); mx.Scale(1.0f, -1.0f); break;
-	case 6: mx.RotateAt(90.0f, PointF((float)(rect.X + rect.Width / 2.0f), (float)(rect.Y + rect.Height / 2.0f))); break;
-	case 7: mx.RotateAt(270.0f, PointF((float)(rect.X + rect.Width / 2.0f), (float)(rect.Y + rect.Height / 2.0f))); mx.Scale(1.0f, -1.0f); break;
-	case 8: mx.RotateAt(270.0f, PointF((float)(rect.X + rect.Width / 2.0f), (float)(rect.Y + rect.Height / 2.0f))); break;
-	default: break;
-	}
+	json += "\n}\n";
+	return json;
 }
 
-void ClearCheckeredBackground(Gdiplus::Graphics& g, RECT rc, int tileSize = 16)
+static bool WriteUsageJson(const std::wstring& path, const ExportRun* run = nullptr)
 {
-	Gdiplus::SolidBrush light(Gdiplus::Color(255, 30, 30, 30));
-	Gdiplus::SolidBrush dark(Gdiplus::Color(255, 40, 40, 40));
-
-	for (int y = rc.top; y < rc.bottom; y += tileSize)
-	{
-		for (int x = rc.left; x < rc.right; x += tileSize)
-		{
-			bool isLight = ((x / tileSize) + (y / tileSize)) % 2 == 0;
-			g.FillRectangle(isLight ? &light : &dark, x, y, tileSize + 1, tileSize + 1);
-		}
-	}
+	std::string json = UsageJson(run);
+	return WriteFileBytes(path, std::vector<BYTE>(json.begin(), json.end()));
 }
 
-static std::shared_ptr<Gdiplus::Bitmap> g_backBuffer;
-
-static void DrawImageOntoBackbuffer(RECT rc)
+// What the image on screen cost to get there, top right.
+static void DrawStatsOverlay(RECT rc)
 {
-	Gdiplus::Graphics g(g_backBuffer.get());
-	g.SetSmoothingMode(SmoothingModeHighQuality);
-	g.SetInterpolationMode(InterpolationModeHighQualityBicubic);
-
-	// clear background
-	ClearCheckeredBackground(g, rc);
-
-	// Utility label
-	Gdiplus::Font font(L"Segoe UI", 18);
-	Gdiplus::SolidBrush brush(Gdiplus::Color(255, 255, 0, 0));
-	Gdiplus::RectF layout((REAL)rc.left, (REAL)rc.top, (REAL)(rc.right - rc.left), (REAL)(rc.bottom - rc.top));
-
-	if (g_files.empty())
-	{
-		// no files found
-		g.DrawString(L"No image found", -1, &font, layout, nullptr, &brush);
-		return;
-	}
+	if (!g_showStats) return;
+	std::shared_ptr<CacheInfo> info = GetCachedAt(g_index);
 
-	std::shared_ptr<Bitmap> bmp = GetBitmapAt(g_index);
-	if (!bmp)
+	FrameCost cost;
+	if (info)
 	{
-		// file exists but failed to load
-		g.DrawString(L"Error loading image", -1, &font, layout, nullptr, &brush);
-		return;
+		cost.decodeMs = info->decodeMs;
+		cost.scaled = info->scaled != nullptr;
+		cost.scaleMs = info->scaleMs;
+		cost.scaledW = info->scaledFor.clipW;
+		cost.scaledH = info->scaledFor.clipH;
+		cost.sharpened = info->scaledFor.sharpen;
+		cost.sharpenMs = info->sharpenMs;
 	}
-
-	Matrix mx;
-	Rect dst;
-	CalcRectAndMatrix(bmp->GetWidth(), bmp->GetHeight(), GetExifOrientation(bmp.get()), rc, mx, dst);
-	g.SetTransform(&mx);
-	g.DrawImage(bmp.get(), dst);
+	wchar_t text[1024];
+	FormatStatsText(info ? &cost : nullptr, g_navFirst, g_navFull, text, 1024);
+
+	Gdiplus::Graphics& g = BackGraphics();
+	PaintTools& tools = Tools();
+	RectF box;
+	g.MeasureString(text, -1, &tools.stats, PointF(0, 0), &box);
+	box.X = rc.right - box.Width - 8;
+	box.Y = (REAL)rc.top + 4;
+	g.FillRectangle(&tools.shade, box);
+	g.DrawString(text, -1, &tools.stats, PointF(box.X, box.Y), &tools.text);
 }
 
 static void DrawBackbufferOntoScreen(HWND hWnd, RECT rc)
 {
 	PAINTSTRUCT ps;
 	HDC hdc = BeginPaint(hWnd, &ps);
-	Gdiplus::Graphics gdc(hdc);
-	gdc.DrawImage(g_backBuffer.get(), 0, 0, rc.right - rc.left, rc.bottom - rc.top);
+	g_backGraphics->Flush(FlushIntentionSync);
+	BitBlt(hdc, 0, 0, rc.right - rc.left, rc.bottom - rc.top, g_backDc, 0, 0, SRCCOPY);
 	EndPaint(hWnd, &ps);
 }
 
@@ -420,84 +5017,57 @@ static void PaintImage(HWND hWnd)
 	RECT rc;
 	GetClientRect(hWnd, &rc);
 
-	if (!g_backBuffer || g_backBuffer->GetWidth() != (UINT)(rc.right - rc.left) || g_backBuffer->GetHeight() != (UINT)(rc.bottom - rc.top))
+	g_panelW = rc.right - rc.left;
+	g_panelH = rc.bottom - rc.top;
+	if (!PrepareBackBuffer(rc.right - rc.left, rc.bottom - rc.top))
 	{
-		g_backBuffer = std::make_shared<Gdiplus::Bitmap>(rc.right - rc.left, rc.bottom - rc.top, PixelFormat32bppARGB);
+		ValidateRect(hWnd, nullptr);
+		return;
 	}
 
-	DrawImageOntoBackbuffer(rc);
+	Drawn drawn = DrawImageOntoBackbuffer(rc);
+	DrawCropOverlay(rc);
+	DrawLoupe(rc);
+	DrawStatsOverlay(rc);
+	DrawGotoPrompt(rc);
 	DrawBackbufferOntoScreen(hWnd, rc);
+	EndNavigation(drawn);
 }
 
-static void GetFileTimes(const std::wstring& p, std::wstring& created, std::wstring& modified)
+static void LoadNextBitmap(const std::shared_ptr<CacheInfo>& info)
 {
-	FILETIME ftCreate, ftWrite;
-	HANDLE hf = CreateFileW(p.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	if (hf != INVALID_HANDLE_VALUE)
+	// everything shown was gathered by the load pipeline, no I/O here
+	static const CacheInfo missing;
+	const CacheInfo& ci = info ? *info : missing;
+
+	wchar_t buf[1024];
 	{
-		if (GetFileTime(hf, &ftCreate, NULL, &ftWrite))
-		{
-			SYSTEMTIME ct = { 0 }, mt = { 0 };
-			FileTimeToSystemTime(&ftCreate, &ct);
-			FileTimeToSystemTime(&ftWrite, &mt);
-			wchar_t buf[64];
-			swprintf(buf, 64, L"%04d-%02d-%02d %02d:%02d:%02d", ct.wYear, ct.wMonth, ct.wDay, ct.wHour, ct.wMinute, ct.wSecond);
-			created = buf;
-			swprintf(buf, 64, L"%04d-%02d-%02d %02d:%02d:%02d", mt.wYear, mt.wMonth, mt.wDay, mt.wHour, mt.wMinute, mt.wSecond);
-			modified = buf;
-		}
-		CloseHandle(hf);
+		// format straight from g_files, without copying the path
+		std::lock_guard<std::mutex> lk(g_filesMutex);
+		if (g_files.empty()) return;
+		const wchar_t* p = g_files[g_index % g_files.size()].c_str();
+		swprintf(buf, 1024,
+			L"Name: %s\r\nType: %s\r\nSize: %I64u bytes\r\nDimensions: %u x %u\r\nBPP: %u\r\nFull path: %s\r\nCurrent root: %s\r\nCreated: %s\r\nModified: %s\r\nEXIF captured: %s",
+			PathFindFileNameW(p),
+			ci.type.c_str(),
+			ci.fileSize,
+			ci.width, ci.height, ci.bpp,
+			p,
+			g_rootPath[0] ? g_rootPath : L".",
+			ci.created.c_str(),
+			ci.modified.c_str(),
+			ci.exifDate.c_str()
+		);
 	}
-}
-
-static void GetBitmapInfo(const std::wstring& p, UINT& w, UINT& h, UINT& bpp, std::wstring& type, ULONGLONG& fsize, std::wstring& exifDate)
-{
-	auto bmp = GetBitmapAt(g_index);
-	if (bmp)
+	if (ci.pixels && ci.pixels->format == PixelFormat64bppARGB)
 	{
-		w = bmp->GetWidth();
-		h = bmp->GetHeight();
-		PixelFormat pf = bmp->GetPixelFormat();
-		bpp = (pf & PixelFormatIndexed) ? 8 : GetPixelFormatSize(pf);
-		GUID g;
-		bmp->GetRawFormat(&g);
-		type = RawFormatToType(g);
-		exifDate = GetPropertyString(bmp.get(), PropertyTagDateTime);
+		size_t n = wcslen(buf);
+		swprintf(buf + n, 1024 - n, L"\r\nTone: %+.2f EV, gamma %.1f ([ ] and Shift, \\ resets)", g_tone.exposure, g_tone.gamma);
 	}
-	try { fsize = fs::file_size(p); }
-	catch (...) {}
-}
-
-static void LoadNextBitmap()
-{
-	auto p = g_files[g_index];
-
-	UINT w = 0, h = 0, bpp = 0;
-	std::wstring type = L"-";
-	ULONGLONG fsize = 0;
-	std::wstring exifDate = L"-";
-	GetBitmapInfo(p, w, h, bpp, type, fsize, exifDate);
-
-	std::wstring created = L"-", modified = L"-";
-	GetFileTimes(p, created, modified);
-
-	wchar_t buf[1024];
-	swprintf(buf, 1024,
-		L"Name: %s\r\nType: %s\r\nSize: %I64u bytes\r\nDimensions: %u x %u\r\nBPP: %u\r\nFull path: %s\r\nCurrent root: %s\r\nCreated: %s\r\nModified: %s\r\nEXIF captured: %s",
-		p.filename().wstring().c_str(),
-		type.c_str(),
-		fsize,
-		w, h, bpp,
-		p.wstring().c_str(),
-		g_rootPath[0] ? g_rootPath : L".",
-		created.c_str(),
-		modified.c_str(),
-		exifDate.c_str()
-	);
 	SetWindowTextW(g_hInfo, buf);
 }
 
-static void UpdateInfoLabel()
+static void UpdateInfoLabel(const std::shared_ptr<CacheInfo>& info)
 {
 	{
 		std::lock_guard<std::mutex> lk(g_filesMutex);
@@ -507,7 +5077,7 @@ static void UpdateInfoLabel()
 			return;
 		}
 	}
-	LoadNextBitmap();
+	LoadNextBitmap(info ? info : GetCachedAt(g_index));
 }
 
 struct PhotoshopInstall
@@ -679,8 +5249,9 @@ static void CopyToClipboard()
 		file = g_files[g_index];
 	}
 
-	std::shared_ptr<Gdiplus::Bitmap> bmp = GetBitmapAt(g_index);
-	if (!bmp) return;
+	auto info = GetCachedAt(g_index);
+	if (!info || !info->bitmap || info->preview) return;
+	std::shared_ptr<Gdiplus::Bitmap> bmp = info->bitmap;
 
 	const std::wstring originalPath = file.wstring();
 	size_t requiredPathCharacterCopyCount = originalPath.size() + 1; // includes null terminator
@@ -745,40 +5316,135 @@ static void DeleteCurrent()
 	}
 }
 
-static void Rotate90AndResave(bool clockwise)
+static std::shared_ptr<ExportBatch> g_export; // UI thread only
+
+static void UpdateExportTitle()
+{
+	if (!g_export) return;
+	WCHAR buf[512];
+	if (g_export->finished < g_export->total)
+		swprintf(buf, 512, L"Minimal Image Viewer - exporting %d/%d", (int)g_export->finished, g_export->total);
+	else if (g_export->failed)
+		swprintf(buf, 512, L"Minimal Image Viewer - exported %d, %d failed", (int)g_export->done, (int)g_export->failed);
+	else
+		swprintf(buf, 512, L"Minimal Image Viewer - exported %d to %s", (int)g_export->done, g_export->options.outDir.c_str());
+	SetWindowTextW(g_hMain, buf);
+}
+
+// Exports the whole list, or only the image on screen, as 2048px JPEGs into
+// an "export" folder under the root.
+static void ExportImages(bool all)
 {
+	if (g_export && g_export->finished < g_export->total)
+	{
+		MessageBeep(MB_ICONWARNING);
+		return;
+	}
+	std::vector<std::wstring> files;
 	{
 		std::lock_guard<std::mutex> lk(g_filesMutex);
 		if (g_files.empty()) return;
+		if (all) for (auto& f : g_files) files.push_back(f.wstring());
+		else files.push_back(g_files[g_index].wstring());
+	}
+	ExportOptions opt;
+	opt.outDir = (fs::path(g_rootPath) / L"export").wstring();
+	g_export = StartExport(files, opt, [](const ExportBatch&, const std::wstring& path, bool)
+	{
+		Complete(Completion::ExportProgress, path, nullptr, CancelToken());
+	});
+	UpdateExportTitle();
+}
+
+// Shows the rotation at once from the cached pixels; the file is rewritten
+// on a worker and the entry stays valid, so nothing is decoded again.
+static void Rotate90AndResave(bool clockwise)
+{
+	std::shared_ptr<CacheInfo> info = GetCachedAt(g_index);
+	if (!info || !info->bitmap || info->preview) return; // nothing on screen to rotate yet
+	if (info->rawFormat == GUID())
+	{
+		MessageBeep(MB_ICONWARNING); // decoded through WIC, GDI+ cannot write it back
+		return;
+	}
+	std::wstring path = PathAt(g_index);
+
+	// the same pixels with the orientation turned a quarter
+	static const int cw[] = { 6, 6, 7, 8, 5, 2, 3, 4, 1 };
+	static const int ccw[] = { 8, 8, 5, 6, 7, 4, 1, 2, 3 };
+	int orient = (info->orientation >= 1 && info->orientation <= 8) ? info->orientation : 1;
+	auto rotated = std::make_shared<CacheInfo>(*info);
+	rotated->orientation = (clockwise ? cw : ccw)[orient];
+	rotated->scaled = nullptr;
+	rotated->scaledPixels = nullptr;
+	rotated->scaledFor = {};
+
+	auto it = g_inflight.find(path);
+	if (it != g_inflight.end())
+	{
+		// a rescale for the old orientation
+		it->second.token.Cancel();
+		g_inflight.erase(it);
+	}
+	{
+		std::lock_guard<std::mutex> clk(g_cacheMutex);
+		g_cache[path] = rotated;
 	}
 
-	std::shared_ptr<Bitmap> bmp = GetBitmapAt(g_index);
-	if (!bmp) return;
+	PendingSave& save = g_saves[path];
+	save.token.Cancel(); // superseded by this rotation
+	save = { CancelToken(), info->pixels };
+	++g_pendingSaves;
+	SavePipeline(path, [path, rotated]() { return WriteRotated(path, rotated); }, save.token);
 
-	// rotate
-	bmp->RotateFlip(clockwise ? Rotate90FlipNone : Rotate270FlipNone);
-	// write back to file (attempt to preserve metadata by saving as same format)
-	GUID rf; bmp->GetRawFormat(&rf);
-	CLSID enc = ImageFormatJPEG;
-	if (rf == ImageFormatPNG) enc = GetEncoderClsid(L"image/png");
-	else if (rf == ImageFormatBMP) enc = GetEncoderClsid(L"image/bmp");
-	else if (rf == ImageFormatGIF) enc = GetEncoderClsid(L"image/gif");
-	else enc = GetEncoderClsid(L"image/jpeg");
+	InvalidateRect(g_hPanel, NULL, FALSE);
+}
 
+// Crops the image on screen to the dragged rectangle. The crop shows at once
+// from the cached pixels; the file is rewritten on a worker.
+static void ApplyCrop()
+{
+	std::shared_ptr<CacheInfo> info = GetCachedAt(g_index);
+	std::wstring path = PathAt(g_index);
+	RECT rc;
+	GetClientRect(g_hPanel, &rc);
+	Rect crop;
+	bool writable = info && info->pixels && !info->preview &&
+		(info->rawFormat == ImageFormatJPEG || info->rawFormat == ImageFormatPNG || info->rawFormat == ImageFormatBMP);
+	if (!writable || g_saves.count(path) || !CropRectFromDrag(*info, rc, crop))
 	{
-		std::lock_guard<std::mutex> lk(g_filesMutex);
-		auto p = g_files[g_index];
-		std::wstring tmp = p.wstring() + L".tmp";
-		if (bmp->Save(tmp.c_str(), &enc, nullptr) == Ok)
-		{
-			MoveFileExW(tmp.c_str(), p.wstring().c_str(), MOVEFILE_REPLACE_EXISTING);
-			// update exif orientation to 1 (normal)
-			SetExifOrientation(p.wstring(), 1);
-			// reload cache for this file
-			std::lock_guard<std::mutex> clk(g_cacheMutex);
-			g_cache.erase(p.wstring());
-		}
+		MessageBeep(MB_ICONWARNING); // nothing to crop, or the file is still being rewritten
+		return;
+	}
+	g_cropMode = false;
+
+	auto cropped = std::make_shared<CacheInfo>(*info);
+	cropped->pixels = CropPixels(*info->pixels, crop.X, crop.Y, crop.Width, crop.Height);
+	cropped->bitmap = BitmapForPixels(cropped->pixels);
+	cropped->width = crop.Width;
+	cropped->height = crop.Height;
+	cropped->scaled = nullptr;
+	cropped->scaledPixels = nullptr;
+	cropped->scaledFor = {};
+
+	auto it = g_inflight.find(path);
+	if (it != g_inflight.end())
+	{
+		it->second.token.Cancel();
+		g_inflight.erase(it);
 	}
+	{
+		std::lock_guard<std::mutex> clk(g_cacheMutex);
+		g_cache[path] = cropped;
+	}
+
+	PendingSave& save = g_saves[path];
+	save = { CancelToken(), cropped->pixels };
+	++g_pendingSaves;
+	SavePipeline(path, [path, cropped, crop]() { return WriteCropped(path, cropped, crop); }, save.token);
+
+	UpdateInfoLabel();
+	InvalidateRect(g_hPanel, NULL, FALSE);
 }
 
 static void OpenInExplorer()
@@ -793,68 +5459,220 @@ static void OpenInExplorer()
 	ShellExecuteW(NULL, L"open", L"explorer.exe", params.c_str(), NULL, SW_SHOWNORMAL);
 }
 
-UINT GetFrameDelay(std::shared_ptr<Gdiplus::Bitmap> bmp, UINT frameIndex)
-{
-	if (!bmp) return 100; // default 100ms
+UINT_PTR g_gifTimerId = 10288; // any unique ID
+UINT_PTR g_fileChangeTimerId = 10289; // any unique ID
+
+// The animation on screen. The UI thread composites on timer ticks; frames
+// come decoded from a worker that stays AnimAhead frames in front.
+static const size_t AnimAhead = 4;
+static const UINT AnimStallMs = 10; // retry interval while the next frame is not decoded yet
 
-	UINT size = bmp->GetPropertyItemSize(PropertyTagFrameDelay);
-	if (!size) return 100;
+struct AnimPlayback
+{
+	std::shared_ptr<const Animation> anim;
+	std::shared_ptr<PixelBuffer> canvas; // premultiplied, what the panel shows
+	std::shared_ptr<Bitmap> bitmap;      // wraps canvas
+	size_t next = 0;                     // frame the next tick draws
+	UINT played = 0;                     // loops completed
+	bool shown = false;                  // canvas holds a frame
+	const AnimFrame* last = nullptr;     // disposed before the next frame is drawn
+	std::vector<uint32_t> saved;         // canvas under last, for AnimDispose::Previous
+	std::chrono::steady_clock::time_point due;
+
+	std::mutex mutex; // guards the rest, shared with the worker
+	std::deque<std::pair<size_t, std::shared_ptr<PixelBuffer>>> ready; // null if a frame failed to decode
+	size_t decodeNext = 0;
+	bool decoding = false;
+	CancelToken token;
+};
 
-	PropertyItem* pItem = (PropertyItem*)malloc(size);
-	if (!pItem) return 100;
+static std::shared_ptr<AnimPlayback> g_anim; // UI thread only
 
-	UINT delayMs = 100; // default 100ms
+static Job DecodeFramesAhead(std::shared_ptr<AnimPlayback> p)
+{
+	co_await g_pool.Schedule(QoS::Prefetch);
+	UsageScope usage(p->anim->decoder);
+	const size_t count = p->anim->frames.size();
+	while (!p->token.Cancelled())
+	{
+		size_t i;
+		{
+			std::lock_guard<std::mutex> lk(p->mutex);
+			if (p->ready.size() >= AnimAhead)
+			{
+				p->decoding = false;
+				co_return;
+			}
+			i = p->decodeNext;
+			p->decodeNext = (i + 1) % count;
+		}
+		int orient = 1;
+		std::shared_ptr<PixelBuffer> px = DecodeReduced(p->anim->frames[i].image, 0, orient);
+		std::lock_guard<std::mutex> lk(p->mutex);
+		p->ready.emplace_back(i, std::move(px));
+	}
+}
 
-	if (bmp->GetPropertyItem(PropertyTagFrameDelay, size, pItem) == Ok)
+static void DecodeAhead(const std::shared_ptr<AnimPlayback>& p)
+{
 	{
-		UINT frameCount = pItem->length / sizeof(UINT);
-		UINT* vals = (UINT*)pItem->value;
-		if (frameIndex < frameCount)
-			delayMs = vals[frameIndex] * 10; // convert 1/100s -> ms
+		std::lock_guard<std::mutex> lk(p->mutex);
+		if (p->decoding || p->ready.size() >= AnimAhead) return;
+		p->decoding = true;
 	}
+	DecodeFramesAhead(p);
+}
 
-	free(pItem);
-	return delayMs;
+// the canvas to draw for info, or null while its first frame is still showing
+static Bitmap* PlayingFrame(const CacheInfo& info)
+{
+	return g_anim && g_anim->shown && g_anim->anim == info.animation ? g_anim->bitmap.get() : nullptr;
 }
 
-UINT_PTR g_gifTimerId = 10288; // any unique ID
-UINT_PTR g_fileChangeTimerId = 10289; // any unique ID
-void QueueNextFrame()
+static void AdvanceAnimation()
 {
-	if (!g_files.empty())
+	std::shared_ptr<AnimPlayback> p = g_anim;
+	if (!p)
+	{
+		KillTimer(g_hMain, g_gifTimerId);
+		return;
+	}
+
+	std::shared_ptr<PixelBuffer> px;
 	{
-		std::shared_ptr<Gdiplus::Bitmap> bmp = GetBitmapAt(g_index);
-		int fc = bmp ? bmp->GetFrameCount(&FrameDimensionTime) : 1;
-		if (fc > 1)
+		std::lock_guard<std::mutex> lk(p->mutex);
+		if (p->ready.empty() || p->ready.front().first != p->next)
 		{
-			g_frameIndex = (g_frameIndex + 1) % fc;
-			bmp->SelectActiveFrame(&FrameDimensionTime, g_frameIndex);
-			InvalidateRect(g_hPanel, nullptr, FALSE);
+			SetTimer(g_hMain, g_gifTimerId, AnimStallMs, NULL);
+			return;
+		}
+		px = std::move(p->ready.front().second);
+		p->ready.pop_front();
+	}
+	DecodeAhead(p);
 
-			UINT delay = GetFrameDelay(bmp, g_frameIndex);
-			SetTimer(g_hMain, g_gifTimerId, delay, NULL);
+	// the last frame's dispose, then this one over what is left; each loop
+	// starts from a clear canvas
+	const AnimFrame& f = p->anim->frames[p->next];
+	if (p->next == 0) std::fill(p->canvas->data.begin(), p->canvas->data.end(), (BYTE)0);
+	else if (p->last && p->last->dispose != AnimDispose::None)
+	{
+		if (p->last->dispose == AnimDispose::Background) p->saved.clear();
+		FrameRect(*p->canvas, *p->last, p->saved, true); // with nothing saved, clears
+	}
+	if (f.dispose == AnimDispose::Previous) FrameRect(*p->canvas, f, p->saved, false);
+	if (px) CompositeFrame(*p->canvas, f, *px);
+	p->last = &f;
+	p->shown = true;
+	InvalidateRect(g_hPanel, nullptr, FALSE);
+
+	// delays run from when each frame was due, so timer slack does not add up;
+	// after a stall the animation continues rather than catching up
+	auto now = std::chrono::steady_clock::now();
+	p->due += std::chrono::milliseconds(f.delayMs);
+	if (p->due < now) p->due = now;
+	if (++p->next == p->anim->frames.size())
+	{
+		p->next = 0;
+		if (p->anim->loops && ++p->played >= p->anim->loops)
+		{
+			// the last frame stays up
+			KillTimer(g_hMain, g_gifTimerId);
 			return;
 		}
 	}
+	UINT wait = (UINT)std::chrono::duration_cast<std::chrono::milliseconds>(p->due - now).count();
+	SetTimer(g_hMain, g_gifTimerId, (std::max)(1u, wait), NULL);
+}
 
+// Plays the current image's animation, if it has one and is not playing yet;
+// rescaled entries share the animation, so they leave playback running.
+static void PlayCurrentAnimation()
+{
+	auto info = GetCachedAt(g_index);
+	if (g_anim && info && g_anim->anim == info->animation) return;
 	KillTimer(g_hMain, g_gifTimerId);
+	if (g_anim) g_anim->token.Cancel();
+	g_anim = nullptr;
+	if (!info || !info->animation) return;
+
+	auto p = std::make_shared<AnimPlayback>();
+	p->anim = info->animation;
+	p->canvas = std::make_shared<PixelBuffer>(p->anim->width, p->anim->height);
+	p->bitmap = WrapPixels(p->canvas);
+	p->due = std::chrono::steady_clock::now();
+	g_anim = p;
+	DecodeAhead(p);
+	SetTimer(g_hMain, g_gifTimerId, AnimStallMs, NULL);
 }
 
-static void ShowImageAtIndex(int index)
+static void ShowImageAtIndex(int index, bool scrubbing = false)
 {
 	if (g_files.empty()) return;
 	if (index < 0) index = (int)g_files.size() - 1;
 	if (index >= g_files.size()) index = 0;
 	g_index = index;
-	g_frameIndex = 0;
-	QueueNextFrame();
+	g_cropMode = false;
+	BeginNavigation();
+	CancelLoupeTiles();
+
+	// transient buffers of this navigation all come from one arena; work for
+	// the old window is cancelled before anything for the new one is queued
+	ScopedArena<16384> arena;
+	PlayCurrentAnimation();
 	UpdateInfoLabel();
+	PreloadAround(index, &arena, scrubbing);
 	InvalidateRect(g_hPanel, NULL, TRUE);
+
+	SyncSlider();
 }
 
 static void PrevImage() { ShowImageAtIndex(g_index - 1); }
 static void NextImage() { ShowImageAtIndex(g_index + 1); }
 
+// Jumps stop at the ends of the list instead of wrapping.
+static void JumpBy(int delta)
+{
+	int last = (int)g_files.size() - 1;
+	if (last < 0) return;
+	ShowImageAtIndex(std::clamp(g_index + delta, 0, last));
+}
+
+// Ctrl+G, then the 1-based number and Enter.
+static bool g_goto = false;
+static std::wstring g_gotoDigits;
+
+// true if the key went to the go-to prompt
+static bool GotoKey(WPARAM key)
+{
+	if (!g_goto) return false;
+	if (key >= '0' && key <= '9' && g_gotoDigits.size() < 9) g_gotoDigits += (wchar_t)key;
+	else if (key >= VK_NUMPAD0 && key <= VK_NUMPAD9 && g_gotoDigits.size() < 9) g_gotoDigits += (wchar_t)('0' + key - VK_NUMPAD0);
+	else if (key == VK_BACK && !g_gotoDigits.empty()) g_gotoDigits.pop_back();
+	else if (key == VK_RETURN || key == VK_ESCAPE)
+	{
+		g_goto = false;
+		if (key == VK_RETURN && !g_gotoDigits.empty()) JumpBy(_wtoi(g_gotoDigits.c_str()) - 1 - g_index);
+	}
+	InvalidateRect(g_hPanel, NULL, FALSE);
+	return true;
+}
+
+static void DrawGotoPrompt(RECT rc)
+{
+	if (!g_goto) return;
+	wchar_t text[64];
+	swprintf(text, 64, L"Go to: %s_ of %zu", g_gotoDigits.c_str(), g_files.size());
+	Gdiplus::Graphics& g = BackGraphics();
+	PaintTools& tools = Tools();
+	RectF box;
+	g.MeasureString(text, -1, &tools.gotoPrompt, PointF(0, 0), &box);
+	box.X = (rc.left + rc.right - box.Width) / 2;
+	box.Y = (rc.top + rc.bottom - box.Height) / 2;
+	g.FillRectangle(&tools.promptBack, box);
+	g.DrawString(text, -1, &tools.gotoPrompt, PointF(box.X, box.Y), &tools.text);
+}
+
 WNDPROC g_oldPanelProc;
 LRESULT CALLBACK PanelProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 {
@@ -865,6 +5683,46 @@ LRESULT CALLBACK PanelProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 			PaintImage(hWnd);
 			return 0;
 		}
+
+		// the static control lets the mouse through to the parent, except while cropping
+		// or using the loupe
+		case WM_NCHITTEST:
+			if (g_cropMode || g_loupe) return HTCLIENT;
+			break;
+
+		case WM_SETCURSOR:
+			if (g_cropMode || g_loupe)
+			{
+				SetCursor(LoadCursor(NULL, IDC_CROSS));
+				return TRUE;
+			}
+			break;
+
+		case WM_LBUTTONDOWN:
+			if (!g_cropMode) break;
+			SetCapture(hWnd);
+			g_cropDragging = true;
+			g_cropFrom = g_cropTo = { (short)LOWORD(lParam), (short)HIWORD(lParam) };
+			InvalidateRect(hWnd, NULL, FALSE);
+			return 0;
+
+		case WM_MOUSELEAVE:
+			InvalidateLoupe();
+			g_loupeInside = false;
+			return 0;
+
+		case WM_MOUSEMOVE:
+		case WM_LBUTTONUP:
+			if (msg == WM_MOUSEMOVE && g_loupe) MoveLoupe(hWnd, { (short)LOWORD(lParam), (short)HIWORD(lParam) });
+			if (!g_cropDragging) break;
+			g_cropTo = { (short)LOWORD(lParam), (short)HIWORD(lParam) };
+			if (msg == WM_LBUTTONUP)
+			{
+				g_cropDragging = false;
+				ReleaseCapture();
+			}
+			InvalidateRect(hWnd, NULL, FALSE);
+			return 0;
 	}
 	return CallWindowProc(g_oldPanelProc, hWnd, msg, wParam, lParam);
 }
@@ -891,8 +5749,9 @@ void UpdateRootPath(const fs::path& p)
 {
 	wcsncpy_s(g_rootPath, p.wstring().c_str(), _TRUNCATE);
 	RegSetKeyValueW(HKEY_CURRENT_USER, L"Software\\ImageViewer", L"RootPath", REG_SZ, g_rootPath, (DWORD)((wcslen(g_rootPath) + 1) * sizeof(wchar_t)));
-	EnumFiles();
+	EnumFiles(true);
 	g_index = 0;
+	StartFolderScan();
 }
 
 void SetCurrentRootPath(const std::wstring& path)
@@ -951,8 +5810,28 @@ static void ChooseRootDirectory()
 	CoUninitialize();
 }
 
+// the previous or next folder with images, once the folders are listed
+static void ShowFolder(int step)
+{
+	fs::path dir = SiblingFolder(step);
+	if (dir.empty()) return;
+	UpdateRootPath(dir);
+	ShowImageAtIndex(0);
+}
+
+// Segoe UI at the window's DPI for every control; the stock font does not scale.
+static void UpdateUiFont(HWND hWnd)
+{
+	HFONT old = g_uiFont;
+	g_uiFont = CreateFontW(-MulDiv(9, (int)g_dpi, 72), 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE, DEFAULT_CHARSET,
+		OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS, CLEARTYPE_QUALITY, DEFAULT_PITCH, L"Segoe UI");
+	EnumChildWindows(hWnd, [](HWND child, LPARAM font) { SendMessageW(child, WM_SETFONT, (WPARAM)font, TRUE); return TRUE; }, (LPARAM)g_uiFont);
+	if (old) DeleteObject(old);
+}
+
 LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 {
+	InputStamp input(msg == WM_KEYDOWN || msg == WM_COMMAND || msg == WM_HSCROLL);
 	switch (msg)
 	{
 	case WM_CREATE:
@@ -971,16 +5850,27 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 		g_hCopy = CreateWindowW(L"BUTTON", L"Copy", WS_CHILD | WS_VISIBLE | BS_NOTIFY, 310, 660, 100, 28, hWnd, (HMENU)109, g_hInst, NULL);
 		g_hDelete = CreateWindowW(L"BUTTON", L"Delete", WS_CHILD | WS_VISIBLE | BS_NOTIFY, 420, 660, 80, 28, hWnd, (HMENU)110, g_hInst, NULL);
 		g_hChangeRoot = CreateWindowW(L"BUTTON", L"Change folder...", WS_CHILD | WS_VISIBLE | BS_NOTIFY, 250, 660, 120, 28, hWnd, (HMENU)111, g_hInst, NULL);
+		g_hSlider = CreateWindowW(TRACKBAR_CLASSW, NULL, WS_CHILD | WS_VISIBLE | TBS_HORZ | TBS_NOTICKS, 10, 580, 780, 30, hWnd, (HMENU)112, g_hInst, NULL);
 
 		g_hInfo = CreateWindowW(L"EDIT", NULL, WS_CHILD | WS_VISIBLE | ES_MULTILINE | WS_VSCROLL | WS_BORDER | BS_NOTIFY, 520, 660, 260, 160, hWnd, NULL, g_hInst, NULL);
 
+		g_hMain = hWnd;
+		g_dpi = GetDpiForWindow(hWnd);
+		UpdateUiFont(hWnd);
+		LoadDisplayProfile(hWnd);
 		UpdateInfoLabel();
-		g_loading = true;
 		StartBackground();
+		StartFolderScan();
+		PreloadAround(g_index);
+		SyncSlider();
 		InvalidateRect(g_hPanel, NULL, TRUE);
 		return 0;
 	}
 
+	case WM_APP_PIPELINE:
+		DrainCompletions();
+		return 0;
+
 	case WM_PAINT:
 	{
 		PAINTSTRUCT ps;
@@ -1023,15 +5913,13 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 			SetWindowTextW(g_hToggleRec, g_recursive ? L"Recursive: On" : L"Recursive: Off");
 			EnumFiles();
 			UpdateInfoLabel();
+			PreloadAround(g_index);
 			InvalidateRect(g_hPanel, NULL, TRUE);
 			break;
 		}
 
 		case 108: // rotate + resave exif
 			Rotate90AndResave(true);
-			EnumFiles();
-			UpdateInfoLabel();
-			InvalidateRect(g_hPanel, NULL, TRUE);
 			break;
 
 		case 109: // copy gif
@@ -1041,13 +5929,14 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 		case 110: // delete
 			DeleteCurrent();
 			UpdateInfoLabel();
+			PreloadAround(g_index);
 			InvalidateRect(g_hPanel, NULL, TRUE);
 			break;
 
 		case 111: // change root
 			ChooseRootDirectory();
-			EnumFiles();
 			UpdateInfoLabel();
+			PreloadAround(g_index);
 			InvalidateRect(g_hPanel, NULL, TRUE);
 			break;
 		}
@@ -1057,7 +5946,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 	case WM_TIMER:
 		if (wParam == g_gifTimerId)
 		{
-			QueueNextFrame();
+			AdvanceAnimation();
 		}
 		else if (wParam == g_fileChangeTimerId)
 		{
@@ -1077,27 +5966,144 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 		}
 		break;
 
+	case WM_HSCROLL:
+		if ((HWND)lParam == g_hSlider)
+		{
+			// dragging loads only the image under the thumb; letting go fills in its neighbours
+			int pos = (int)SendMessageW(g_hSlider, TBM_GETPOS, 0, 0);
+			WORD code = LOWORD(wParam);
+			if (code == TB_ENDTRACK) PreloadAround(g_index);
+			else if (pos != g_index) ShowImageAtIndex(pos, code == TB_THUMBTRACK);
+			return 0;
+		}
+		break;
+
+	case WM_MOUSEWHEEL:
+		if (!g_loupe) break;
+		g_loupeZoom = std::clamp(GET_WHEEL_DELTA_WPARAM(wParam) > 0 ? g_loupeZoom * 2 : g_loupeZoom / 2, 1, 16);
+		InvalidateLoupe();
+		return 0;
+
 	case WM_KEYDOWN:
 	{
 		bool ctrl = (GetKeyState(VK_CONTROL) & 0x8000) != 0;
+		bool shift = (GetKeyState(VK_SHIFT) & 0x8000) != 0;
+		if (GotoKey(wParam)) break;
+		int tenth = (std::max)(1, (int)g_files.size() / 10);
 		switch (wParam)
 		{
 		case 'C':
 			if (ctrl) CopyToClipboard();
 			break;
 
+		case 'E':
+			if (ctrl) ExportImages((GetKeyState(VK_SHIFT) & 0x8000) == 0); // Ctrl+Shift+E: current image only
+			break;
+
+		case 'X': // crop mode
+			g_cropMode = !g_cropMode;
+			g_cropFrom = g_cropTo = {};
+			InvalidateRect(g_hPanel, NULL, FALSE);
+			break;
+
+		case VK_RETURN:
+			if (g_cropMode) ApplyCrop();
+			break;
+
+		case 'U': // unsharp mask after downscaling
+		{
+			g_sharpen = !g_sharpen;
+			DWORD v = g_sharpen;
+			RegSetKeyValueW(HKEY_CURRENT_USER, L"Software\\ImageViewer", L"Sharpen", REG_DWORD, &v, sizeof(DWORD));
+			InvalidateRect(g_hPanel, NULL, FALSE);
+			break;
+		}
+
+		case 'S': // stats overlay, Shift: write the session's usage to %TEMP%
+			if (shift)
+			{
+				wchar_t dir[MAX_PATH];
+				GetTempPathW(MAX_PATH, dir);
+				std::wstring path = (fs::path(dir) / L"ImageViewer-usage.json").wstring();
+				bool ok = WriteUsageJson(path);
+				std::wstring msg = (ok ? L"Usage written to " : L"Could not write ") + path;
+				MessageBoxW(hWnd, msg.c_str(), L"Usage", MB_OK | (ok ? MB_ICONINFORMATION : MB_ICONWARNING));
+				break;
+			}
+			g_showStats = !g_showStats;
+			InvalidateRect(g_hPanel, NULL, FALSE);
+			break;
+
+		case 'Z': // loupe, the mouse wheel sets its zoom
+			ToggleLoupe();
+			break;
+
+		case 'L': // linear-light scaling
+		{
+			g_linearLight = !g_linearLight;
+			DWORD v = g_linearLight;
+			RegSetKeyValueW(HKEY_CURRENT_USER, L"Software\\ImageViewer", L"LinearLight", REG_DWORD, &v, sizeof(DWORD));
+			InvalidateRect(g_hPanel, NULL, FALSE);
+			break;
+		}
+
+		case VK_OEM_4: // '[' darker, Shift: less gamma (16-bit images)
+		case VK_OEM_6: // ']' brighter, Shift: more gamma
+		case VK_OEM_5: // backslash resets
+		{
+			float step = wParam == VK_OEM_4 ? -1.0f : wParam == VK_OEM_6 ? 1.0f : 0.0f;
+			if (!step) g_tone = {};
+			else if (GetKeyState(VK_SHIFT) & 0x8000) g_tone.gamma = std::clamp(g_tone.gamma + step * 0.1f, 0.2f, 5.0f);
+			else g_tone.exposure = std::clamp(g_tone.exposure + step / 3, -8.0f, 8.0f);
+			UpdateInfoLabel();
+			InvalidateRect(g_hPanel, NULL, FALSE);
+			break;
+		}
+
+		case VK_ESCAPE:
+			g_cropMode = false;
+			InvalidateRect(g_hPanel, NULL, FALSE);
+			break;
+
 		case VK_DELETE:
 			DeleteCurrent();
 			break;
 
-		case VK_LEFT:
-		case VK_PRIOR: // Page Up
-			PrevImage();
+		case VK_LEFT: // Ctrl: previous folder
+			if (ctrl) ShowFolder(-1);
+			else PrevImage();
 			break;
 
 		case VK_RIGHT:
+			if (ctrl) ShowFolder(1);
+			else NextImage();
+			break;
+
+		case VK_PRIOR: // Page Up; Ctrl: 10% of the list, Shift: 100 images
+			if (ctrl) JumpBy(-tenth);
+			else if (shift) JumpBy(-100);
+			else PrevImage();
+			break;
+
 		case VK_NEXT: // Page Down
-			NextImage();
+			if (ctrl) JumpBy(tenth);
+			else if (shift) JumpBy(100);
+			else NextImage();
+			break;
+
+		case VK_HOME:
+			JumpBy(-g_index);
+			break;
+
+		case VK_END:
+			JumpBy((int)g_files.size());
+			break;
+
+		case 'G':
+			if (!ctrl) break;
+			g_goto = true;
+			g_gotoDigits.clear();
+			InvalidateRect(g_hPanel, NULL, FALSE);
 			break;
 
 		case VK_OEM_COMMA: Rotate90AndResave(false); break; // '<' rotate left
@@ -1110,30 +6116,43 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 		SaveWindowPlacement();
 		break;
 
+	case WM_DPICHANGED:
+	{
+		// the window moved to a monitor with another scale; Windows suggests the new rect
+		g_dpi = HIWORD(wParam);
+		UpdateUiFont(hWnd);
+		const RECT* r = (const RECT*)lParam;
+		SetWindowPos(hWnd, NULL, r->left, r->top, r->right - r->left, r->bottom - r->top, SWP_NOZORDER | SWP_NOACTIVATE);
+		return 0;
+	}
+
 	case WM_SIZE:
 	{
+		// physical pixels: the layout is in 96-DPI units, the panel fills the rest
 		RECT r; GetClientRect(hWnd, &r);
-		MoveWindow(g_hPanel, 10, 10, r.right - 20, r.bottom - 220, TRUE);
-		MoveWindow(g_hPrev, 10, r.bottom - 200, 80, 28, TRUE);
-		MoveWindow(g_hNext, 100, r.bottom - 200, 80, 28, TRUE);
-		MoveWindow(g_hOpenPS, 200, r.bottom - 200, 160, 28, TRUE);
-		MoveWindow(g_hOpenPN, 370, r.bottom - 200, 160, 28, TRUE);
-		MoveWindow(g_hShowInExplorer, 540, r.bottom - 200, 130, 28, TRUE);
-		MoveWindow(g_hToggle100, 680, r.bottom - 200, 100, 28, TRUE);
-		MoveWindow(g_hToggleRec, 10, r.bottom - 160, 120, 28, TRUE);
-		MoveWindow(g_hRotate, 140, r.bottom - 160, 160, 28, TRUE);
-		MoveWindow(g_hCopy, 310, r.bottom - 160, 100, 28, TRUE);
-		MoveWindow(g_hDelete, 420, r.bottom - 160, 80, 28, TRUE);
-		MoveWindow(g_hInfo, 520, r.bottom - 160, r.right - 540, 150, TRUE);
-		MoveWindow(g_hChangeRoot, 250, r.bottom - 120, 120, 28, TRUE);
+		const int row0 = r.bottom - Px(200), row1 = r.bottom - Px(160), row2 = r.bottom - Px(120);
+		MoveWindow(g_hPanel, Px(10), Px(10), r.right - Px(20), r.bottom - Px(250), TRUE);
+		MoveWindow(g_hSlider, Px(10), r.bottom - Px(236), r.right - Px(20), Px(30), TRUE);
+		MoveWindow(g_hPrev, Px(10), row0, Px(80), Px(28), TRUE);
+		MoveWindow(g_hNext, Px(100), row0, Px(80), Px(28), TRUE);
+		MoveWindow(g_hOpenPS, Px(200), row0, Px(160), Px(28), TRUE);
+		MoveWindow(g_hOpenPN, Px(370), row0, Px(160), Px(28), TRUE);
+		MoveWindow(g_hShowInExplorer, Px(540), row0, Px(130), Px(28), TRUE);
+		MoveWindow(g_hToggle100, Px(680), row0, Px(100), Px(28), TRUE);
+		MoveWindow(g_hToggleRec, Px(10), row1, Px(120), Px(28), TRUE);
+		MoveWindow(g_hRotate, Px(140), row1, Px(160), Px(28), TRUE);
+		MoveWindow(g_hCopy, Px(310), row1, Px(100), Px(28), TRUE);
+		MoveWindow(g_hDelete, Px(420), row1, Px(80), Px(28), TRUE);
+		MoveWindow(g_hInfo, Px(520), row1, r.right - Px(540), Px(150), TRUE);
+		MoveWindow(g_hChangeRoot, Px(250), row2, Px(120), Px(28), TRUE);
 		InvalidateRect(g_hPanel, NULL, TRUE);
 		SaveWindowPlacement();
 		return 0;
 	}
 
 	case WM_DESTROY:
-		g_loading = false;
 		StopBackground();
+		SaveDecodeRates();
 		PostQuitMessage(0);
 		return 0;
 	}
@@ -1150,13 +6169,112 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 	return r;
 }
 
+// Headless batch export, also the benchmark entry point:
+//   ImageViewer --export <outdir> [--size N] [--format jpeg|png|bmp] [--quality Q]
+//               [--png fast|balanced|small] [--linear] [--recursive] [--threads N] [--usage file.json]
+//               <file or folder>...
+// Prints one line per file and a summary to the calling console; the exit
+// code is the number of files that failed. --threads sizes the pool, default
+// one per core.
+static int RunExportCli(int argc, PWSTR* argv)
+{
+	if (AttachConsole(ATTACH_PARENT_PROCESS))
+	{
+		FILE* f = nullptr;
+		freopen_s(&f, "CONOUT$", "w", stdout);
+	}
+	if (argc < 4)
+	{
+		wprintf(L"usage: --export <outdir> [--size N] [--format jpeg|png|bmp] [--quality Q] [--png fast|balanced|small] [--linear] [--recursive] [--threads N] [--usage file.json] <file or folder>...\n");
+		return -1;
+	}
+
+	ExportOptions opt;
+	opt.outDir = fs::absolute(argv[2]).wstring();
+	opt.qos = QoS::Prefetch; // nothing to keep responsive
+	bool recursive = false;
+	int threads = 0;
+	std::wstring usagePath;
+	std::vector<fs::path> inputs;
+	for (int i = 3; i < argc; ++i)
+	{
+		std::wstring_view a = argv[i];
+		bool more = i + 1 < argc;
+		if (a == L"--size" && more) opt.maxEdge = (UINT)_wtoi(argv[++i]);
+		else if (a == L"--quality" && more) opt.jpegQuality = (ULONG)_wtoi(argv[++i]);
+		else if (a == L"--format" && more)
+		{
+			std::wstring_view v = argv[++i];
+			opt.format = v == L"png" ? ExportFormat::Png : v == L"bmp" ? ExportFormat::Bmp : ExportFormat::Jpeg;
+		}
+		else if (a == L"--png" && more)
+		{
+			std::wstring_view v = argv[++i];
+			opt.pngPreset = v == L"fast" ? PngPreset::Fast : v == L"small" ? PngPreset::Small : PngPreset::Balanced;
+		}
+		else if (a == L"--recursive") recursive = true;
+		else if (a == L"--linear") opt.linearLight = true;
+		else if (a == L"--threads" && more) threads = _wtoi(argv[++i]);
+		else if (a == L"--usage" && more) usagePath = argv[++i];
+		else inputs.push_back(argv[i]);
+	}
+
+	std::vector<std::wstring> files;
+	try
+	{
+		for (auto& in : inputs)
+		{
+			if (!fs::is_directory(in))
+			{
+				files.push_back(in.wstring());
+			}
+			else if (recursive)
+			{
+				for (auto& p : fs::recursive_directory_iterator(in, fs::directory_options::skip_permission_denied))
+				{
+					if (p.is_regular_file() && has_ext(p.path())) files.push_back(p.path().wstring());
+				}
+			}
+			else
+			{
+				for (auto& p : fs::directory_iterator(in))
+				{
+					if (p.is_regular_file() && has_ext(p.path())) files.push_back(p.path().wstring());
+				}
+			}
+		}
+	}
+	catch (...) {}
+	if (files.empty()) return 0;
+
+	StartBackground(threads);
+	std::mutex printMutex;
+	auto start = std::chrono::steady_clock::now();
+	auto batch = StartExport(files, opt, [&printMutex](const ExportBatch& b, const std::wstring& path, bool ok)
+	{
+		std::lock_guard<std::mutex> lk(printMutex);
+		wprintf(L"[%d/%d] %s %s\n", b.done + b.failed, b.total, ok ? L"ok    " : L"FAILED", path.c_str());
+	});
+	for (int n; (n = batch->finished) < batch->total;) batch->finished.wait(n);
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	wprintf(L"%d exported, %d failed in %.2f s (%.1f files/s) on %d threads\n", (int)batch->done, (int)batch->failed, secs, batch->total / (std::max)(secs, 1e-6), g_pool.Threads());
+	ExportRun run = { g_pool.Threads(), secs };
+	if (!usagePath.empty() && !WriteUsageJson(usagePath, &run)) wprintf(L"could not write %s\n", usagePath.c_str());
+	fflush(stdout);
+	StopBackground();
+	return batch->failed;
+}
+
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, PWSTR pCmdLine, int nCmdShow)
 {
 	g_hInst = hInstance;
+	// everything is laid out and rendered in physical pixels, so Windows never
+	// stretches the panel a second time on scaled displays
+	SetProcessDpiAwarenessContext(DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2);
 	// GDI+
 	GdiplusStartupInput gdiplusStartupInput;
 	GdiplusStartup(&g_gdiplusToken, &gdiplusStartupInput, NULL);
-	INITCOMMONCONTROLSEX icce = { sizeof(icce), ICC_STANDARD_CLASSES };
+	INITCOMMONCONTROLSEX icce = { sizeof(icce), ICC_STANDARD_CLASSES | ICC_BAR_CLASSES };
 	InitCommonControlsEx(&icce);
 
 	{
@@ -1166,6 +6284,10 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, PWSTR pCmdLine, int nCmdShow
 			g_recursive = val != 0;
 		if (RegGetValueW(HKEY_CURRENT_USER, L"Software\\ImageViewer", L"Zoom100", RRF_RT_REG_DWORD, nullptr, &val, &size) == ERROR_SUCCESS)
 			g_zoom = val;
+		if (RegGetValueW(HKEY_CURRENT_USER, L"Software\\ImageViewer", L"LinearLight", RRF_RT_REG_DWORD, nullptr, &val, &size) == ERROR_SUCCESS)
+			g_linearLight = val != 0;
+		if (RegGetValueW(HKEY_CURRENT_USER, L"Software\\ImageViewer", L"Sharpen", RRF_RT_REG_DWORD, nullptr, &val, &size) == ERROR_SUCCESS)
+			g_sharpen = val != 0;
 	}
 
 	// handle command-line arg: accept a single path
@@ -1173,6 +6295,13 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, PWSTR pCmdLine, int nCmdShow
 	PWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
 	if (argv)
 	{
+		if (argc > 1 && wcscmp(argv[1], L"--export") == 0)
+		{
+			int failed = RunExportCli(argc, argv);
+			LocalFree(argv);
+			GdiplusShutdown(g_gdiplusToken);
+			return failed;
+		}
 		if (argc > 1)
 		{
 			SetCurrentRootPath(argv[1]);
@@ -1205,8 +6334,9 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, PWSTR pCmdLine, int nCmdShow
 	wc.hIcon = LoadIconW(hInstance, MAKEINTRESOURCE(IDI_APP));
 	RegisterClassExW(&wc);
 
+	LoadDecodeRates(); // before WM_CREATE starts the first loads
 	g_hMain = CreateWindowExW(0, wc.lpszClassName, L"Minimal Image Viewer", WS_OVERLAPPEDWINDOW,
-		CW_USEDEFAULT, CW_USEDEFAULT, 1000, 820, NULL, NULL, hInstance, NULL);
+		CW_USEDEFAULT, CW_USEDEFAULT, MulDiv(1000, GetDpiForSystem(), 96), MulDiv(820, GetDpiForSystem(), 96), NULL, NULL, hInstance, NULL);
 
 	WINDOWPLACEMENT wp = { sizeof(wp) };
 	wp.showCmd = nCmdShow;
@@ -1235,7 +6365,11 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, PWSTR pCmdLine, int nCmdShow
 
 	// Teardown
 	{
+		g_backGraphics.reset();
 		g_backBuffer.reset();
+		g_paintTools.reset();
+		if (g_backDc) DeleteDC(g_backDc);
+		if (g_backDib) DeleteObject(g_backDib);
 
 		std::lock_guard<std::mutex> lk(g_cacheMutex);
 		g_cache.clear(); // destroys all shared_ptr<Bitmap> while GDI+ is still alive
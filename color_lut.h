@@ -0,0 +1,394 @@
+#pragma once
+
+// Color conversion between matrix/TRC RGB profiles through a 3D LUT with
+// tetrahedral interpolation, with SSE4.1 and AVX2 paths. Reading the profiles
+// and caching the LUTs is up to the caller.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "pixel_kernels.h"
+#include "simd.h"
+
+// ICC tone curve in the parametric type 4 form; sampled curves use table
+struct ToneCurve
+{
+	std::vector<uint16_t> table;
+	double g = 1, a = 1, b = 0, c = 0, d = 0, e = 0, f = 0;
+
+	double Eval(double x) const
+	{
+		if (!table.empty())
+		{
+			double p = std::clamp(x, 0.0, 1.0) * (table.size() - 1);
+			size_t i = (std::min)((size_t)p, table.size() - 2);
+			return (table[i] + (p - i) * (table[i + 1] - table[i])) / 65535.0;
+		}
+		return x >= d ? std::pow((std::max)(0.0, a * x + b), g) + e : c * x + f;
+	}
+
+	double Inverse(double y) const
+	{
+		double lo = 0, hi = 1;
+		for (int i = 0; i < 20; ++i)
+		{
+			double mid = (lo + hi) / 2;
+			(Eval(mid) < y ? lo : hi) = mid;
+		}
+		return (lo + hi) / 2;
+	}
+};
+
+struct ColorProfile
+{
+	double toXyz[3][3]; // rows X, Y, Z; columns the r, g, b colorants (D50)
+	ToneCurve trc[3];
+};
+
+inline const ColorProfile& SrgbProfile()
+{
+	static const ColorProfile srgb = []()
+	{
+		ColorProfile p = { { { 0.4361, 0.3851, 0.1431 }, { 0.2225, 0.7169, 0.0606 }, { 0.0139, 0.0971, 0.7141 } } };
+		for (auto& t : p.trc)
+		{
+			t.g = 2.4;
+			t.a = 1 / 1.055;
+			t.b = 0.055 / 1.055;
+			t.c = 1 / 12.92;
+			t.d = 0.04045;
+		}
+		return p;
+	}();
+	return srgb;
+}
+
+// The grid's axes are the source's linear channels, so the input curves are
+// applied exactly through per-channel tables before interpolation, and gamut
+// clipping and the display's curve exactly after it.
+struct ColorLut
+{
+	static constexpr int N = 17; // grid points per axis
+
+	struct Entry
+	{
+		int32_t r, g, b, pad; // linear output, 16-bit fraction, unclamped
+	};
+	std::vector<Entry> grid;   // index (r * N + g) * N + b
+	BYTE cell[3][256];         // per channel and 8-bit input, its grid cell
+	uint32_t frac[3][256];     // and the position in it, 0..65536
+	uint32_t packed[3][256];   // both for the gathers: the cell's grid offset << 17 | frac
+	BYTE toDisplay[3][16384];  // per channel, linear >> 2 to the display's encoding
+	BYTE toDisplayPad[3];      // the gathers read toDisplay 4 bytes at a time
+};
+
+inline bool Invert3x3(const double m[3][3], double inv[3][3])
+{
+	double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	if (std::abs(det) < 1e-9) return false;
+	for (int r = 0; r < 3; ++r)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			// cofactor of (c, r), transposed into place
+			int r0 = (c + 1) % 3, r1 = (c + 2) % 3, c0 = (r + 1) % 3, c1 = (r + 2) % 3;
+			inv[r][c] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+		}
+	}
+	return true;
+}
+
+// null if the two profiles are the same to within half a level
+inline std::shared_ptr<const ColorLut> BuildColorLut(const ColorProfile& src, const ColorProfile& dst)
+{
+	double fromXyz[3][3], m[3][3];
+	if (!Invert3x3(dst.toXyz, fromXyz)) return nullptr;
+	bool identity = true;
+	for (int r = 0; r < 3; ++r)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			m[r][c] = fromXyz[r][0] * src.toXyz[0][c] + fromXyz[r][1] * src.toXyz[1][c] + fromXyz[r][2] * src.toXyz[2][c];
+			identity = identity && std::abs(m[r][c] - (r == c)) < 1e-3;
+		}
+	}
+
+	const int N = ColorLut::N;
+	auto lut = std::make_shared<ColorLut>();
+	memset(lut->toDisplayPad, 0, sizeof(lut->toDisplayPad));
+	lut->grid.resize(N * N * N);
+	for (int i = 0; i < N * N * N; ++i)
+	{
+		double lin[3] = { (double)(i / (N * N)) / (N - 1), (double)(i / N % N) / (N - 1), (double)(i % N) / (N - 1) };
+		int32_t out[3];
+		// within +-4, so the SIMD paths' differences of corners fit 20 bits
+		for (int ch = 0; ch < 3; ++ch) out[ch] = (int32_t)std::clamp<long>(std::lround((m[ch][0] * lin[0] + m[ch][1] * lin[1] + m[ch][2] * lin[2]) * 65536), -(1 << 18), 1 << 18);
+		lut->grid[i] = { out[0], out[1], out[2], 0 };
+	}
+
+	for (int ch = 0; ch < 3; ++ch)
+	{
+		for (int v = 0; v < 256; ++v)
+		{
+			double lin = std::clamp(src.trc[ch].Eval(v / 255.0), 0.0, 1.0);
+			identity = identity && std::abs(dst.trc[ch].Inverse(lin) * 255 - v) < 0.5;
+			uint32_t pos = (uint32_t)std::lround(lin * (N - 1) * 65536);
+			uint32_t c = (std::min)(pos >> 16, (uint32_t)N - 2);
+			lut->cell[ch][v] = (BYTE)c;
+			lut->frac[ch][v] = pos - (c << 16);
+			static const uint32_t stride[3] = { N * N, N, 1 };
+			lut->packed[ch][v] = c * stride[ch] << 17 | lut->frac[ch][v];
+		}
+		for (int v = 0; v < 16384; ++v) lut->toDisplay[ch][v] = (BYTE)(dst.trc[ch].Inverse((v + 0.5) / 16384) * 255 + 0.5);
+	}
+	return identity ? nullptr : lut;
+}
+
+inline uint32_t ColorLutLookup(const ColorLut& lut, uint32_t r, uint32_t g, uint32_t b)
+{
+	const int N = ColorLut::N;
+	const int64_t fr = lut.frac[0][r], fg = lut.frac[1][g], fb = lut.frac[2][b];
+	const ColorLut::Entry* c0 = &lut.grid[(lut.cell[0][r] * N + lut.cell[1][g]) * N + lut.cell[2][b]];
+	const ColorLut::Entry* c3 = c0 + N * N + N + 1;
+
+	// walk from c0 to c3 along the axes in order of decreasing fraction; the
+	// four corners visited span the tetrahedron holding the point
+	const ColorLut::Entry *c1, *c2;
+	int64_t f0, f1, f2;
+	if (fr >= fg)
+	{
+		if (fg >= fb) { c1 = c0 + N * N; c2 = c1 + N; f0 = fr; f1 = fg; f2 = fb; }
+		else if (fr >= fb) { c1 = c0 + N * N; c2 = c1 + 1; f0 = fr; f1 = fb; f2 = fg; }
+		else { c1 = c0 + 1; c2 = c1 + N * N; f0 = fb; f1 = fr; f2 = fg; }
+	}
+	else
+	{
+		if (fr >= fb) { c1 = c0 + N; c2 = c1 + N * N; f0 = fg; f1 = fr; f2 = fb; }
+		else if (fg >= fb) { c1 = c0 + N; c2 = c1 + 1; f0 = fg; f1 = fb; f2 = fr; }
+		else { c1 = c0 + 1; c2 = c1 + N; f0 = fb; f1 = fg; f2 = fr; }
+	}
+	const int64_t w0 = 65536 - f0, w1 = f0 - f1, w2 = f1 - f2, w3 = f2;
+	auto mix = [&](int32_t ColorLut::Entry::* ch, int i) -> uint32_t
+	{
+		int64_t v = (w0 * (c0->*ch) + w1 * (c1->*ch) + w2 * (c2->*ch) + w3 * (c3->*ch)) >> 18;
+		return lut.toDisplay[i][std::clamp<int64_t>(v, 0, 16383)];
+	};
+	return (mix(&ColorLut::Entry::r, 0) << 16) | (mix(&ColorLut::Entry::g, 1) << 8) | mix(&ColorLut::Entry::b, 2);
+}
+
+// The SIMD paths split the interpolation the scalar code does in 64 bits:
+// with d1..d3 the differences between consecutive corners and f0..f2 the
+// sorted fractions, the sum is (c0 << 16) + sum(f * d), and each f * d is
+// (f >> 8) * d * 256 + (f & 255) * d, so it stays within 32 bits and is
+// shifted down to the same result.
+
+#if SIMD_X86
+// one channel of four pixels, from the corners' values to the linear output
+SIMD_SSE41 inline __m128i ColorLutChannelSse41(__m128i e0, __m128i e1, __m128i e2, __m128i e3, __m128i f0, __m128i f1, __m128i f2)
+{
+	__m128i d1 = _mm_sub_epi32(e1, e0), d2 = _mm_sub_epi32(e2, e1), d3 = _mm_sub_epi32(e3, e2);
+	const __m128i byte = _mm_set1_epi32(255);
+	__m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(d1, _mm_srli_epi32(f0, 8)), _mm_mullo_epi32(d2, _mm_srli_epi32(f1, 8))), _mm_mullo_epi32(d3, _mm_srli_epi32(f2, 8)));
+	__m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(d1, _mm_and_si128(f0, byte)), _mm_mullo_epi32(d2, _mm_and_si128(f1, byte))), _mm_mullo_epi32(d3, _mm_and_si128(f2, byte)));
+	__m128i v = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(e0, 8), hi), _mm_srai_epi32(lo, 8)), 10);
+	return _mm_min_epi32(_mm_max_epi32(v, _mm_setzero_si128()), _mm_set1_epi32(16383));
+}
+
+// four grid entries, one per pixel, turned into r, g and b vectors
+SIMD_SSE41 inline void ColorLutCornerSse41(const ColorLut& lut, const int32_t* index, __m128i& r, __m128i& g, __m128i& b)
+{
+	const ColorLut::Entry* grid = lut.grid.data();
+	__m128i p0 = _mm_loadu_si128((const __m128i*)(grid + index[0])), p1 = _mm_loadu_si128((const __m128i*)(grid + index[1]));
+	__m128i p2 = _mm_loadu_si128((const __m128i*)(grid + index[2])), p3 = _mm_loadu_si128((const __m128i*)(grid + index[3]));
+	__m128i rg01 = _mm_unpacklo_epi32(p0, p1), rg23 = _mm_unpacklo_epi32(p2, p3), b01 = _mm_unpackhi_epi32(p0, p1), b23 = _mm_unpackhi_epi32(p2, p3);
+	r = _mm_unpacklo_epi64(rg01, rg23);
+	g = _mm_unpackhi_epi64(rg01, rg23);
+	b = _mm_unpacklo_epi64(b01, b23);
+}
+
+// Four opaque pixels at a time, the tetrahedron picked by compares and the
+// corners loaded whole and transposed; a group with a translucent pixel is
+// left to ColorLutPixel. Returns where that takes over.
+SIMD_SSE41 inline UINT ColorLutRowSse41(const ColorLut& lut, uint32_t* row, UINT x, UINT n)
+{
+	const int N = ColorLut::N;
+	const __m128i byte = _mm_set1_epi32(255), fracMask = _mm_set1_epi32(0x1FFFF), ones = _mm_set1_epi32(-1);
+	for (; x + 4 <= n; x += 4)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i*)(row + x));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(c, 24), byte)) != 0xFFFF) break;
+		const uint32_t* px = row + x;
+		__m128i pr = _mm_setr_epi32(lut.packed[0][px[0] >> 16 & 255], lut.packed[0][px[1] >> 16 & 255], lut.packed[0][px[2] >> 16 & 255], lut.packed[0][px[3] >> 16 & 255]);
+		__m128i pg = _mm_setr_epi32(lut.packed[1][px[0] >> 8 & 255], lut.packed[1][px[1] >> 8 & 255], lut.packed[1][px[2] >> 8 & 255], lut.packed[1][px[3] >> 8 & 255]);
+		__m128i pb = _mm_setr_epi32(lut.packed[2][px[0] & 255], lut.packed[2][px[1] & 255], lut.packed[2][px[2] & 255], lut.packed[2][px[3] & 255]);
+		__m128i fr = _mm_and_si128(pr, fracMask), fg = _mm_and_si128(pg, fracMask), fb = _mm_and_si128(pb, fracMask);
+		__m128i i0 = _mm_add_epi32(_mm_add_epi32(_mm_srli_epi32(pr, 17), _mm_srli_epi32(pg, 17)), _mm_srli_epi32(pb, 17));
+
+		// the walk ColorLutLookup takes, ties included; the fractions fit 17
+		// bits, so signed compares do
+		__m128i rLtG = _mm_cmpgt_epi32(fg, fr), rLtB = _mm_cmpgt_epi32(fb, fr), gLtB = _mm_cmpgt_epi32(fb, fg);
+		__m128i maxR = _mm_andnot_si128(_mm_or_si128(rLtG, rLtB), ones);
+		__m128i maxG = _mm_andnot_si128(_mm_or_si128(maxR, gLtB), ones);
+		__m128i minB = _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi32(fb, fg), _mm_cmpgt_epi32(fb, fr)), ones);
+		__m128i minG = _mm_andnot_si128(_mm_or_si128(minB, rLtG), ones);
+		__m128i f0 = _mm_blendv_epi8(_mm_blendv_epi8(fb, fg, maxG), fr, maxR);
+		__m128i f2 = _mm_blendv_epi8(_mm_blendv_epi8(fr, fg, minG), fb, minB);
+		__m128i f1 = _mm_sub_epi32(_mm_add_epi32(fr, _mm_add_epi32(fg, fb)), _mm_add_epi32(f0, f2));
+		__m128i o1 = _mm_blendv_epi8(_mm_blendv_epi8(_mm_set1_epi32(1), _mm_set1_epi32(N), maxG), _mm_set1_epi32(N * N), maxR);
+		__m128i oMin = _mm_blendv_epi8(_mm_blendv_epi8(_mm_set1_epi32(N * N), _mm_set1_epi32(N), minG), _mm_set1_epi32(1), minB);
+		__m128i i3 = _mm_add_epi32(i0, _mm_set1_epi32(N * N + N + 1));
+		alignas(16) int32_t index[4][4];
+		_mm_store_si128((__m128i*)index[0], i0);
+		_mm_store_si128((__m128i*)index[1], _mm_add_epi32(i0, o1));
+		_mm_store_si128((__m128i*)index[2], _mm_sub_epi32(i3, oMin));
+		_mm_store_si128((__m128i*)index[3], i3);
+
+		__m128i r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k) ColorLutCornerSse41(lut, index[k], r[k], g[k], b[k]);
+		alignas(16) int32_t v[3][4];
+		_mm_store_si128((__m128i*)v[0], ColorLutChannelSse41(r[0], r[1], r[2], r[3], f0, f1, f2));
+		_mm_store_si128((__m128i*)v[1], ColorLutChannelSse41(g[0], g[1], g[2], g[3], f0, f1, f2));
+		_mm_store_si128((__m128i*)v[2], ColorLutChannelSse41(b[0], b[1], b[2], b[3], f0, f1, f2));
+		for (int i = 0; i < 4; ++i) row[x + i] = 0xFF000000 | ((uint32_t)lut.toDisplay[0][v[0][i]] << 16) | ((uint32_t)lut.toDisplay[1][v[1][i]] << 8) | lut.toDisplay[2][v[2][i]];
+	}
+	return x;
+}
+
+// one channel of eight pixels, as ColorLutChannelSse41
+SIMD_AVX2 inline __m256i ColorLutChannelAvx2(__m256i e0, __m256i e1, __m256i e2, __m256i e3, __m256i f0, __m256i f1, __m256i f2)
+{
+	__m256i d1 = _mm256_sub_epi32(e1, e0), d2 = _mm256_sub_epi32(e2, e1), d3 = _mm256_sub_epi32(e3, e2);
+	const __m256i byte = _mm256_set1_epi32(255);
+	__m256i hi = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(d1, _mm256_srli_epi32(f0, 8)), _mm256_mullo_epi32(d2, _mm256_srli_epi32(f1, 8))), _mm256_mullo_epi32(d3, _mm256_srli_epi32(f2, 8)));
+	__m256i lo = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(d1, _mm256_and_si256(f0, byte)), _mm256_mullo_epi32(d2, _mm256_and_si256(f1, byte))), _mm256_mullo_epi32(d3, _mm256_and_si256(f2, byte)));
+	__m256i v = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(e0, 8), hi), _mm256_srai_epi32(lo, 8)), 10);
+	return _mm256_min_epi32(_mm256_max_epi32(v, _mm256_setzero_si256()), _mm256_set1_epi32(16383));
+}
+
+// eight grid entries, pixels 0 to 3 in the low half and 4 to 7 in the high
+SIMD_AVX2 inline void ColorLutCornerAvx2(const ColorLut& lut, const int32_t* index, __m256i& r, __m256i& g, __m256i& b)
+{
+	const ColorLut::Entry* grid = lut.grid.data();
+	__m256i p[4];
+	for (int i = 0; i < 4; ++i) p[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(grid + index[i]))), _mm_loadu_si128((const __m128i*)(grid + index[i + 4])), 1);
+	__m256i rg01 = _mm256_unpacklo_epi32(p[0], p[1]), rg23 = _mm256_unpacklo_epi32(p[2], p[3]), b01 = _mm256_unpackhi_epi32(p[0], p[1]), b23 = _mm256_unpackhi_epi32(p[2], p[3]);
+	r = _mm256_unpacklo_epi64(rg01, rg23);
+	g = _mm256_unpackhi_epi64(rg01, rg23);
+	b = _mm256_unpacklo_epi64(b01, b23);
+}
+
+// ApplyColorLut's unpremultiply; the float quotient truncates to the integer
+// one, since it is at least 1/a from the next whole number. Lanes with a 0
+// come out as 255.
+SIMD_AVX2 inline __m256i ColorLutUnmulAvx2(__m256i v, __m256i a, __m256 af)
+{
+	__m256i q = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_mullo_epi32(v, _mm256_set1_epi32(255)), _mm256_srli_epi32(a, 1))), af));
+	return _mm256_min_epu32(q, _mm256_set1_epi32(255));
+}
+
+// Eight pixels at a time, the tables read by gathers, the tetrahedron picked
+// by compares and the corners loaded whole and transposed. Translucent
+// pixels are unpremultiplied and premultiplied again as ColorLutPixel does.
+SIMD_AVX2 inline UINT ColorLutRowAvx2(const ColorLut& lut, uint32_t* row, UINT x, UINT n)
+{
+	const int N = ColorLut::N;
+	const __m256i byte = _mm256_set1_epi32(255), fracMask = _mm256_set1_epi32(0x1FFFF);
+	for (; x + 8 <= n; x += 8)
+	{
+		__m256i c = _mm256_loadu_si256((const __m256i*)(row + x));
+		__m256i a = _mm256_srli_epi32(c, 24);
+		__m256i r8 = _mm256_and_si256(_mm256_srli_epi32(c, 16), byte), g8 = _mm256_and_si256(_mm256_srli_epi32(c, 8), byte), b8 = _mm256_and_si256(c, byte);
+		const bool opaque = _mm256_movemask_epi8(_mm256_cmpeq_epi32(a, byte)) == -1;
+		if (!opaque)
+		{
+			__m256 af = _mm256_cvtepi32_ps(a);
+			r8 = ColorLutUnmulAvx2(r8, a, af);
+			g8 = ColorLutUnmulAvx2(g8, a, af);
+			b8 = ColorLutUnmulAvx2(b8, a, af);
+		}
+		__m256i pr = _mm256_i32gather_epi32((const int*)lut.packed[0], r8, 4);
+		__m256i pg = _mm256_i32gather_epi32((const int*)lut.packed[1], g8, 4);
+		__m256i pb = _mm256_i32gather_epi32((const int*)lut.packed[2], b8, 4);
+		__m256i fr = _mm256_and_si256(pr, fracMask), fg = _mm256_and_si256(pg, fracMask), fb = _mm256_and_si256(pb, fracMask);
+		__m256i i0 = _mm256_add_epi32(_mm256_add_epi32(_mm256_srli_epi32(pr, 17), _mm256_srli_epi32(pg, 17)), _mm256_srli_epi32(pb, 17));
+
+		// as in ColorLutRowSse41
+		__m256i rLtG = _mm256_cmpgt_epi32(fg, fr), rLtB = _mm256_cmpgt_epi32(fb, fr), gLtB = _mm256_cmpgt_epi32(fb, fg);
+		__m256i maxR = _mm256_andnot_si256(_mm256_or_si256(rLtG, rLtB), _mm256_set1_epi32(-1));
+		__m256i maxG = _mm256_andnot_si256(_mm256_or_si256(maxR, gLtB), _mm256_set1_epi32(-1));
+		__m256i minB = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi32(fb, fg), _mm256_cmpgt_epi32(fb, fr)), _mm256_set1_epi32(-1));
+		__m256i minG = _mm256_andnot_si256(_mm256_or_si256(minB, rLtG), _mm256_set1_epi32(-1));
+		__m256i f0 = _mm256_blendv_epi8(_mm256_blendv_epi8(fb, fg, maxG), fr, maxR);
+		__m256i f2 = _mm256_blendv_epi8(_mm256_blendv_epi8(fr, fg, minG), fb, minB);
+		__m256i f1 = _mm256_sub_epi32(_mm256_add_epi32(fr, _mm256_add_epi32(fg, fb)), _mm256_add_epi32(f0, f2));
+		__m256i o1 = _mm256_blendv_epi8(_mm256_blendv_epi8(_mm256_set1_epi32(1), _mm256_set1_epi32(N), maxG), _mm256_set1_epi32(N * N), maxR);
+		__m256i oMin = _mm256_blendv_epi8(_mm256_blendv_epi8(_mm256_set1_epi32(N * N), _mm256_set1_epi32(N), minG), _mm256_set1_epi32(1), minB);
+		__m256i i3 = _mm256_add_epi32(i0, _mm256_set1_epi32(N * N + N + 1));
+
+		alignas(32) int32_t index[4][8];
+		_mm256_store_si256((__m256i*)index[0], i0);
+		_mm256_store_si256((__m256i*)index[1], _mm256_add_epi32(i0, o1));
+		_mm256_store_si256((__m256i*)index[2], _mm256_sub_epi32(i3, oMin));
+		_mm256_store_si256((__m256i*)index[3], i3);
+
+		__m256i r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k) ColorLutCornerAvx2(lut, index[k], r[k], g[k], b[k]);
+		const __m256i rv = ColorLutChannelAvx2(r[0], r[1], r[2], r[3], f0, f1, f2);
+		const __m256i gv = ColorLutChannelAvx2(g[0], g[1], g[2], g[3], f0, f1, f2);
+		const __m256i bv = ColorLutChannelAvx2(b[0], b[1], b[2], b[3], f0, f1, f2);
+		__m256i rd = _mm256_and_si256(_mm256_i32gather_epi32((const int*)lut.toDisplay[0], rv, 1), byte);
+		__m256i gd = _mm256_and_si256(_mm256_i32gather_epi32((const int*)lut.toDisplay[1], gv, 1), byte);
+		__m256i bd = _mm256_and_si256(_mm256_i32gather_epi32((const int*)lut.toDisplay[2], bv, 1), byte);
+		__m256i out = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(rd, 16), _mm256_slli_epi32(gd, 8)), _mm256_or_si256(bd, _mm256_slli_epi32(a, 24)));
+		if (!opaque)
+		{
+			const __m256i zero = _mm256_setzero_si256();
+			out = _mm256_packus_epi16(PremultiplyLanes(_mm256_unpacklo_epi8(out, zero)), PremultiplyLanes(_mm256_unpackhi_epi8(out, zero)));
+			out = _mm256_blendv_epi8(out, c, _mm256_cmpeq_epi32(a, zero));
+		}
+		_mm256_storeu_si256((__m256i*)(row + x), out);
+	}
+	return x;
+}
+#endif
+
+// one premultiplied BGRA pixel; fully transparent ones stay as they are
+inline uint32_t ColorLutPixel(const ColorLut& lut, uint32_t c)
+{
+	uint32_t a = c >> 24;
+	if (a == 255) return 0xFF000000 | ColorLutLookup(lut, (c >> 16) & 255, (c >> 8) & 255, c & 255);
+	if (!a) return c;
+	auto unmul = [a](uint32_t v) { return (std::min)(255u, (v * 255 + a / 2) / a); };
+	return Premultiply((a << 24) | ColorLutLookup(lut, unmul((c >> 16) & 255), unmul((c >> 8) & 255), unmul(c & 255)));
+}
+
+// converts a premultiplied BGRA frame in place
+inline void ApplyColorLut(const ColorLut& lut, PixelBuffer& px, QoS qos)
+{
+	ParallelFor(px.height, 32, qos, [&](UINT y0, UINT y1)
+	{
+		for (UINT y = y0; y < y1; ++y)
+		{
+			uint32_t* row = (uint32_t*)px.Row(y);
+			for (UINT x = 0; x < px.width;)
+			{
+				UINT end = px.width;
+#if SIMD_X86
+				// SSE4.1 stops at the next group of four with a translucent
+				// pixel, which goes pixel by pixel
+				if (g_simd >= SimdLevel::Avx2) x = ColorLutRowAvx2(lut, row, x, px.width);
+				else if (g_simd >= SimdLevel::Sse41)
+				{
+					x = ColorLutRowSse41(lut, row, x, px.width);
+					end = (std::min)(x + 4, px.width);
+				}
+#endif
+				for (; x < end; ++x) row[x] = ColorLutPixel(lut, row[x]);
+			}
+		}
+	});
+}
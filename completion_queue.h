@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+// Lock-free MPSC queue of completions, any Node with a Node* next. Producers
+// push onto an intrusive stack; the UI thread takes the whole stack with one
+// exchange and replays it in arrival order. Only the push that finds the
+// stack empty sends the wake-up, so a burst of completions costs one message
+// and one repaint, and the UI thread never waits on a worker's lock.
+template<class Node>
+class CompletionQueue
+{
+public:
+	void SetWake(std::function<void()> wake) { m_wake = std::move(wake); }
+
+	void Push(Node* c)
+	{
+		Node* head = m_head.load(std::memory_order_relaxed);
+		do
+		{
+			c->next = head;
+		} while (!m_head.compare_exchange_weak(head, c, std::memory_order_release, std::memory_order_relaxed));
+		if (!head && m_wake) m_wake();
+	}
+
+	template<class F>
+	void Drain(F&& handle)
+	{
+		Node* list = m_head.exchange(nullptr, std::memory_order_acquire);
+		Node* fifo = nullptr;
+		while (list)
+		{
+			Node* next = list->next;
+			list->next = fifo;
+			fifo = list;
+			list = next;
+		}
+		while (fifo)
+		{
+			Node* next = fifo->next;
+			handle(*fifo);
+			delete fifo;
+			fifo = next;
+		}
+	}
+
+private:
+	std::atomic<Node*> m_head{ nullptr };
+	std::function<void()> m_wake;
+};
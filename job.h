@@ -0,0 +1,98 @@
+#pragma once
+
+// Coroutine plumbing of the load pipeline: each image is one fire-and-forget
+// Job hopping between executors (co_await g_pool.Schedule(qos), the UI
+// thread through the completion queue), decode slots bounding how many are
+// in flight, and the token that cancels one.
+
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#include "thread_pool.h"
+
+// set at exit; every token then reads as cancelled
+inline std::atomic<bool> g_stopThreads{ false };
+
+// Fire-and-forget coroutine; the frame frees itself when the body returns.
+struct Job
+{
+	struct promise_type
+	{
+		Job get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() {}
+	};
+};
+
+// Bounds how many images are being decoded at once; excess loads wait
+// suspended instead of piling decoded pixels up in memory. A freed slot goes
+// to the waiter with the highest QoS.
+class AsyncSemaphore
+{
+public:
+	explicit AsyncSemaphore(int count) : m_count(count) {}
+
+	struct Awaiter
+	{
+		AsyncSemaphore& sem;
+		QoS qos;
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			std::lock_guard<std::mutex> lk(sem.m_mutex);
+			if (sem.m_count > 0)
+			{
+				--sem.m_count;
+				return false;
+			}
+			sem.m_waiters[(int)qos].push_back(h);
+			return true;
+		}
+		void await_resume() const noexcept {}
+	};
+
+	Awaiter Acquire(QoS qos) { return { *this, qos }; }
+
+	void Release()
+	{
+		std::coroutine_handle<> next;
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			for (auto& q : m_waiters)
+			{
+				if (q.empty()) continue;
+				next = q.front();
+				q.pop_front();
+				break;
+			}
+			if (!next)
+			{
+				++m_count;
+				return;
+			}
+		}
+		next.resume(); // the slot passes straight to the waiter
+	}
+
+private:
+	std::mutex m_mutex;
+	std::deque<std::coroutine_handle<>> m_waiters[(int)QoS::Count];
+	int m_count;
+};
+
+class CancelToken
+{
+public:
+	CancelToken() : m_flag(std::make_shared<std::atomic<bool>>(false)) {}
+	void Cancel() const { *m_flag = true; }
+	bool Cancelled() const { return *m_flag || g_stopThreads; }
+	bool SameAs(const CancelToken& other) const { return m_flag == other.m_flag; }
+
+private:
+	std::shared_ptr<std::atomic<bool>> m_flag;
+};
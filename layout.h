@@ -0,0 +1,80 @@
+#pragma once
+
+// Layout math of the image panel, free of Windows types so it can be tested
+// anywhere. All in physical pixels.
+
+#include <cstdint>
+
+struct LayoutRect
+{
+	int x = 0;
+	int y = 0;
+	int width = 0;
+	int height = 0;
+
+	bool operator==(const LayoutRect&) const = default;
+};
+
+// An affine transform in the order GDI+'s Matrix::SetElements takes it:
+// (x, y) goes to (m11 x + m21 y + dx, m12 x + m22 y + dy).
+struct LayoutMatrix
+{
+	float m11 = 1, m12 = 0, m21 = 0, m22 = 1, dx = 0, dy = 0;
+};
+
+// EXIF orientations 5 to 8 swap width and height
+inline bool IsTransposed(int orient) { return orient >= 5 && orient <= 8; }
+
+// Where an image of w x h (as displayed, i.e. after orientation) lands in
+// panel. zoom as g_zoom: 0 actual size, 1 fit, 2 fit only images larger than
+// the panel.
+inline LayoutRect FitRect(unsigned w, unsigned h, LayoutRect panel, unsigned zoom)
+{
+	// integer math, so the rect is the same whole physical pixels every time
+	// it is computed and the display frame is rendered at exactly its size
+	const int ww = panel.width;
+	const int wh = panel.height;
+	LayoutRect rect = { panel.x, panel.y, (int)w, (int)h };
+	if (!(zoom == 0 || (zoom == 2 && (int)w <= ww && (int)h <= wh)) && w && h)
+	{
+		if ((int64_t)w * wh > (int64_t)h * ww)
+		{
+			rect.width = ww;
+			rect.height = (int)((int64_t)ww * h / w);
+		}
+		else
+		{
+			rect.height = wh;
+			rect.width = (int)((int64_t)wh * w / h);
+		}
+	}
+	rect.x += (ww - rect.width) / 2;
+	rect.y += (wh - rect.height) / 2;
+	return rect;
+}
+
+// Draws the stored w x h image with its EXIF orientation applied: rect is
+// where the unrotated image goes, mx turns it about the display rect's centre.
+inline void OrientedLayout(unsigned w, unsigned h, int orient, LayoutRect panel, unsigned zoom, LayoutRect& rect, LayoutMatrix& mx)
+{
+	bool transposed = IsTransposed(orient);
+	LayoutRect disp = FitRect(transposed ? h : w, transposed ? w : h, panel, zoom);
+	float cx = disp.x + disp.width / 2.0f;
+	float cy = disp.y + disp.height / 2.0f;
+	rect = disp;
+	if (transposed)
+	{
+		rect.width = disp.height;
+		rect.height = disp.width;
+		rect.x = (int)(cx - rect.width / 2.0f);
+		rect.y = (int)(cy - rect.height / 2.0f);
+	}
+
+	// (x, y) relative to the centre goes to (a x + b y, c x + d y)
+	static const float m[9][4] = {
+		{ 1, 0, 0, 1 }, { 1, 0, 0, 1 }, { -1, 0, 0, 1 }, { -1, 0, 0, -1 }, { 1, 0, 0, -1 },
+		{ 0, 1, 1, 0 }, { 0, -1, 1, 0 }, { 0, -1, -1, 0 }, { 0, 1, -1, 0 },
+	};
+	const float* e = m[(orient >= 1 && orient <= 8) ? orient : 1];
+	mx = { e[0], e[2], e[1], e[3], cx - e[0] * cx - e[1] * cy, cy - e[2] * cx - e[3] * cy };
+}
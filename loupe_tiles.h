@@ -0,0 +1,81 @@
+#pragma once
+
+// The loupe's tile cache: rendered 256 x 256 tiles of the oriented image at
+// 100%, most recently used first, and the keys of the tiles being rendered.
+// A paint that finds its tiles only relinks list nodes; nothing is allocated
+// until a tile is missing. Callers hold their own lock.
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <vector>
+
+#include "pixel_kernels.h"
+
+struct ColorLut;
+
+struct LoupeTileKey
+{
+	const void* source; // the entry's pixels, its pyramid, or a preview entry
+	int orientation;
+	const ColorLut* colorLut;
+	ToneAdjust tone;
+	UINT tx, ty;
+
+	bool operator==(const LoupeTileKey&) const = default;
+};
+
+template<class Tile>
+class LoupeTileCache
+{
+public:
+	explicit LoupeTileCache(size_t capacity) : m_capacity(capacity) { m_pending.reserve(capacity); }
+
+	// the tile for key, moved to the front; null if none or its source is gone
+	const Tile* Find(const LoupeTileKey& key)
+	{
+		for (auto it = m_tiles.begin(); it != m_tiles.end(); ++it)
+		{
+			if (!(it->key == key) || it->source.expired()) continue;
+			m_tiles.splice(m_tiles.begin(), m_tiles, it);
+			return &it->tile;
+		}
+		return nullptr;
+	}
+
+	// true if key was not being rendered yet, and now is
+	bool StartPending(const LoupeTileKey& key)
+	{
+		if (std::find(m_pending.begin(), m_pending.end(), key) != m_pending.end()) return false;
+		m_pending.push_back(key);
+		return true;
+	}
+
+	void EndPending(const LoupeTileKey& key)
+	{
+		m_pending.erase(std::remove(m_pending.begin(), m_pending.end(), key), m_pending.end());
+	}
+
+	void ClearPending() { m_pending.clear(); }
+
+	// a rendered tile, kept until its source is freed or it falls off the end
+	void Add(const LoupeTileKey& key, std::weak_ptr<const void> source, Tile tile)
+	{
+		m_tiles.push_front({ key, std::move(source), std::move(tile) });
+		if (m_tiles.size() > m_capacity) m_tiles.pop_back();
+	}
+
+	size_t Size() const { return m_tiles.size(); }
+
+private:
+	struct Entry
+	{
+		LoupeTileKey key;
+		std::weak_ptr<const void> source; // a key whose source is gone never matches
+		Tile tile;
+	};
+
+	std::list<Entry> m_tiles; // most recently used first
+	std::vector<LoupeTileKey> m_pending;
+	size_t m_capacity;
+};
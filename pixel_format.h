@@ -0,0 +1,33 @@
+#pragma once
+
+// The GDI+ pixel types the pixel code is written against. Elsewhere than
+// Windows, the same names with GDI+'s values, for the tests.
+
+#ifdef _WIN32
+#include <windows.h>
+#include <gdiplus.h>
+#else
+#include <cstdint>
+
+typedef unsigned char BYTE;
+typedef unsigned int UINT;
+typedef int INT;
+typedef uint32_t ARGB;
+typedef int PixelFormat;
+
+#define PixelFormatIndexed   0x00010000
+#define PixelFormatGDI       0x00020000
+#define PixelFormatAlpha     0x00040000
+#define PixelFormatPAlpha    0x00080000
+#define PixelFormatExtended  0x00100000
+#define PixelFormatCanonical 0x00200000
+
+#define PixelFormat8bppIndexed (3 | (8 << 8) | PixelFormatIndexed | PixelFormatGDI)
+#define PixelFormat24bppRGB    (8 | (24 << 8) | PixelFormatGDI)
+#define PixelFormat32bppRGB    (9 | (32 << 8) | PixelFormatGDI)
+#define PixelFormat32bppARGB   (10 | (32 << 8) | PixelFormatAlpha | PixelFormatGDI | PixelFormatCanonical)
+#define PixelFormat32bppPARGB  (11 | (32 << 8) | PixelFormatAlpha | PixelFormatPAlpha | PixelFormatGDI)
+#define PixelFormat64bppARGB   (13 | (64 << 8) | PixelFormatAlpha | PixelFormatCanonical | PixelFormatExtended)
+
+inline UINT GetPixelFormatSize(PixelFormat pf) { return (pf >> 8) & 0xff; }
+#endif
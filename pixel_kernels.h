@@ -0,0 +1,998 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include "pixel_format.h"
+#include "layout.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+// Decoded pixels in one of the formats the pixel kernels read directly
+// (see IsKernelFormat); display frames are always 32bpp premultiplied BGRA.
+struct PixelBuffer
+{
+	PixelBuffer(UINT w, UINT h, PixelFormat fmt = PixelFormat32bppPARGB)
+		: width(w), height(h), format(fmt), stride(((w * (GetPixelFormatSize(fmt) / 8)) + 3) & ~3u), data((size_t)stride * h) {}
+	BYTE* Row(UINT y) { return data.data() + (size_t)y * stride; }
+	const BYTE* Row(UINT y) const { return data.data() + (size_t)y * stride; }
+
+	UINT width;
+	UINT height;
+	PixelFormat format;
+	UINT stride;
+	std::vector<BYTE> data;
+	std::vector<ARGB> palette; // for PixelFormat8bppIndexed
+};
+
+// GDI+ formats kept as decoded; 16-bit PNGs come from DecodeDeepPng instead
+inline bool IsKernelFormat(PixelFormat pf)
+{
+	return pf == PixelFormat32bppPARGB || pf == PixelFormat32bppARGB || pf == PixelFormat32bppRGB ||
+		pf == PixelFormat24bppRGB || pf == PixelFormat8bppIndexed;
+}
+
+// exposure and gamma for high-bit-depth sources, applied as they are reduced to 8 bits
+struct ToneAdjust
+{
+	float exposure = 0; // stops
+	float gamma = 1;
+
+	bool operator==(const ToneAdjust&) const = default;
+};
+
+// Pixel kernels: one fused loop per (source format, orientation, filter) that
+// reads the decoded source, applies the EXIF orientation and resamples
+// straight into the premultiplied display frame, with no intermediate
+// buffers. The combination is picked once per frame by SelectKernel.
+
+inline uint32_t Premultiply(uint32_t c)
+{
+	uint32_t a = c >> 24;
+	if (a == 255) return c;
+	if (a == 0) return 0;
+	auto mul = [a](uint32_t v) { uint32_t t = v * a + 128; return (t + (t >> 8)) >> 8; };
+	return (a << 24) | (mul((c >> 16) & 255) << 16) | (mul((c >> 8) & 255) << 8) | mul(c & 255);
+}
+
+struct AxisTaps;
+
+struct KernelJob
+{
+	const PixelBuffer* src;
+	const uint32_t* palette; // premultiplied, for indexed sources
+	const BYTE* tone;        // 16-bit level to 8-bit, for 64bpp sources
+	PixelBuffer* dst;
+	const AxisTaps* xs;      // along the oriented x axis
+	const AxisTaps* ys;
+};
+
+// source readers: pixel x of a row as premultiplied BGRA
+struct SrcPARGB
+{
+	static uint32_t Load(const BYTE* row, int x, const KernelJob&) { return ((const uint32_t*)row)[x]; }
+};
+
+struct SrcARGB
+{
+	static uint32_t Load(const BYTE* row, int x, const KernelJob&) { return Premultiply(((const uint32_t*)row)[x]); }
+};
+
+struct SrcRGB32
+{
+	static uint32_t Load(const BYTE* row, int x, const KernelJob&) { return ((const uint32_t*)row)[x] | 0xFF000000; }
+};
+
+struct SrcRGB24
+{
+	static uint32_t Load(const BYTE* row, int x, const KernelJob&)
+	{
+		const BYTE* p = row + x * 3;
+		return 0xFF000000 | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+	}
+};
+
+struct SrcIndexed8
+{
+	static uint32_t Load(const BYTE* row, int x, const KernelJob& job) { return job.palette[row[x]]; }
+};
+
+// 16-bit RGBA in PNG channel order, straight alpha; see DecodeDeepPng
+struct SrcRGBA64
+{
+	static uint32_t Load(const BYTE* row, int x, const KernelJob& job)
+	{
+		const uint16_t* p = (const uint16_t*)row + x * 4;
+		return Premultiply(((uint32_t)(p[3] >> 8) << 24) | ((uint32_t)job.tone[p[0]] << 16) | ((uint32_t)job.tone[p[1]] << 8) | job.tone[p[2]]);
+	}
+};
+
+// EXIF orientation: which source pixel ends up at (ox, oy) of the oriented image
+template<int Orient>
+struct Orientation
+{
+	static void Map(int ox, int oy, int w, int h, int& sx, int& sy)
+	{
+		if constexpr (Orient == 2) { sx = w - 1 - ox; sy = oy; }
+		else if constexpr (Orient == 3) { sx = w - 1 - ox; sy = h - 1 - oy; }
+		else if constexpr (Orient == 4) { sx = ox; sy = h - 1 - oy; }
+		else if constexpr (Orient == 5) { sx = oy; sy = ox; }
+		else if constexpr (Orient == 6) { sx = oy; sy = h - 1 - ox; }
+		else if constexpr (Orient == 7) { sx = w - 1 - oy; sy = h - 1 - ox; }
+		else if constexpr (Orient == 8) { sx = w - 1 - oy; sy = ox; }
+		else { sx = ox; sy = oy; }
+	}
+};
+
+enum class FilterKind { Nearest, Bilinear, Box };
+
+// filters fix the number of taps per axis at compile time (0 = variable)
+struct FilterNearest { static constexpr int taps = 1; };
+struct FilterBilinear { static constexpr int taps = 2; };
+struct FilterBox { static constexpr int taps = 0; };
+
+// Resampling taps along one axis, for output pixels [from, from + count).
+struct AxisTaps
+{
+	std::vector<int> first;  // per output pixel, index of its first tap; one extra at the end
+	std::vector<int> pos;    // source coordinate along the oriented axis
+	std::vector<int> weight; // 8-bit fixed point, sums to 256 per output pixel
+};
+
+inline AxisTaps BuildTaps(FilterKind kind, UINT srcLen, UINT dstLen, UINT from, UINT count)
+{
+	AxisTaps t;
+	t.first.reserve(count + 1);
+	double scale = (double)srcLen / dstLen;
+	int last = (int)srcLen - 1;
+	for (UINT i = from; i < from + count; ++i)
+	{
+		t.first.push_back((int)t.pos.size());
+		if (kind == FilterKind::Nearest)
+		{
+			t.pos.push_back((std::min)(last, (int)((i + 0.5) * scale)));
+			t.weight.push_back(256);
+		}
+		else if (kind == FilterKind::Bilinear)
+		{
+			double p = (i + 0.5) * scale - 0.5;
+			int p0 = (int)std::floor(p);
+			int w1 = (int)((p - p0) * 256 + 0.5);
+			t.pos.push_back((std::max)(0, (std::min)(last, p0)));
+			t.pos.push_back((std::max)(0, (std::min)(last, p0 + 1)));
+			t.weight.push_back(256 - w1);
+			t.weight.push_back(w1);
+		}
+		else
+		{
+			// area average, edge pixels weighted by coverage; rounding is
+			// done on the running sum so the weights add up to exactly 256
+			double start = i * scale, end = (std::min)((double)srcLen, (i + 1) * scale);
+			int s0 = (int)start, s1 = (std::min)(last, (int)std::ceil(end) - 1);
+			double cum = 0;
+			int given = 0;
+			for (int s = s0; s <= s1; ++s)
+			{
+				cum += ((std::min)(end, s + 1.0) - (std::max)(start, (double)s)) / (end - start);
+				int w = (int)(cum * 256 + 0.5) - given;
+				given += w;
+				if (!w) continue;
+				t.pos.push_back(s);
+				t.weight.push_back(w);
+			}
+		}
+	}
+	t.first.push_back((int)t.pos.size());
+	return t;
+}
+
+// sRGB <-> linear light. Linear values are 16 bit, so the darkest sRGB steps
+// stay distinct and a 256-weight x 256-weight sum still fits 32 bits.
+struct LinearLight
+{
+	uint16_t toLinear[256];
+	BYTE toSrgb[65536];
+};
+
+inline const LinearLight& LinearLightTables()
+{
+	static const std::unique_ptr<LinearLight> lut = []()
+	{
+		auto t = std::make_unique<LinearLight>();
+		for (int i = 0; i < 256; ++i)
+		{
+			double v = i / 255.0;
+			v = v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4);
+			t->toLinear[i] = (uint16_t)(v * 65535 + 0.5);
+		}
+		for (int i = 0; i < 65536; ++i)
+		{
+			double v = i / 65535.0;
+			v = v <= 0.0031308 ? v * 12.92 : 1.055 * std::pow(v, 1 / 2.4) - 0.055;
+			t->toSrgb[i] = (BYTE)(v * 255 + 0.5);
+		}
+		return t;
+	}();
+	return *lut;
+}
+
+// premultiplied sRGB to premultiplied linear; translucent pixels are
+// unpremultiplied first, since sRGB premultiplies after encoding
+inline void LoadLinear(uint32_t c, const LinearLight& lut, uint32_t& b, uint32_t& g, uint32_t& r)
+{
+	uint32_t a = c >> 24;
+	if (a == 255)
+	{
+		b = lut.toLinear[c & 255];
+		g = lut.toLinear[(c >> 8) & 255];
+		r = lut.toLinear[(c >> 16) & 255];
+		return;
+	}
+	auto lin = [&](uint32_t v) { return a ? lut.toLinear[(std::min)(255u, (v * 255 + a / 2) / a)] * a / 255 : 0u; };
+	b = lin(c & 255);
+	g = lin((c >> 8) & 255);
+	r = lin((c >> 16) & 255);
+}
+
+// 16-bit premultiplied linear with 8-bit alpha back to premultiplied sRGB
+inline uint32_t StoreLinear(uint32_t b, uint32_t g, uint32_t r, uint32_t a, const LinearLight& lut)
+{
+	if (a == 255) return 0xFF000000 | (lut.toSrgb[r] << 16) | (lut.toSrgb[g] << 8) | lut.toSrgb[b];
+	auto srgb = [&](uint32_t v) { return a ? (lut.toSrgb[(std::min)(65535u, v * 255 / a)] * a + 127) / 255 : 0u; };
+	return (a << 24) | (srgb(r) << 16) | (srgb(g) << 8) | srgb(b);
+}
+
+using KernelFn = void (*)(const KernelJob&, UINT y0, UINT y1);
+
+template<class Src, int Orient, class Filter, bool Linear>
+void PixelKernel(const KernelJob& job, UINT y0, UINT y1)
+{
+	const LinearLight& lut = LinearLightTables();
+	const PixelBuffer& src = *job.src;
+	const AxisTaps& xs = *job.xs;
+	const AxisTaps& ys = *job.ys;
+	const int w = (int)src.width, h = (int)src.height;
+	const UINT dw = job.dst->width;
+
+	for (UINT y = y0; y < y1; ++y)
+	{
+		uint32_t* out = (uint32_t*)job.dst->Row(y);
+		const int ty0 = ys.first[y], ty1 = ys.first[y + 1];
+		for (UINT x = 0; x < dw; ++x)
+		{
+			const int tx0 = xs.first[x], tx1 = Filter::taps ? tx0 + Filter::taps : xs.first[x + 1];
+			if constexpr (Filter::taps == 1)
+			{
+				int sx, sy;
+				Orientation<Orient>::Map(xs.pos[tx0], ys.pos[ty0], w, h, sx, sy);
+				out[x] = Src::Load(src.Row(sy), sx, job);
+			}
+			else
+			{
+				uint32_t b = 0, g = 0, r = 0, a = 0;
+				for (int j = ty0; j < ty1; ++j)
+				{
+					const uint32_t wy = ys.weight[j];
+					for (int i = tx0; i < tx1; ++i)
+					{
+						int sx, sy;
+						Orientation<Orient>::Map(xs.pos[i], ys.pos[j], w, h, sx, sy);
+						uint32_t c = Src::Load(src.Row(sy), sx, job);
+						uint32_t wt = wy * xs.weight[i];
+						if constexpr (Linear)
+						{
+							uint32_t lb, lg, lr;
+							LoadLinear(c, lut, lb, lg, lr);
+							b += lb * wt;
+							g += lg * wt;
+							r += lr * wt;
+						}
+						else
+						{
+							b += (c & 255) * wt;
+							g += ((c >> 8) & 255) * wt;
+							r += ((c >> 16) & 255) * wt;
+						}
+						a += (c >> 24) * wt;
+					}
+				}
+				if constexpr (Linear)
+					out[x] = StoreLinear((b + 32768) >> 16, (g + 32768) >> 16, (r + 32768) >> 16, (a + 32768) >> 16, lut);
+				else
+					out[x] = ((a + 32768) >> 16 << 24) | ((r + 32768) >> 16 << 16) | ((g + 32768) >> 16 << 8) | ((b + 32768) >> 16);
+			}
+		}
+	}
+}
+
+#if SIMD_X86
+// The AVX2 kernel is separable: each oriented source row is converted once,
+// to 16-bit linear light or to 16-bit lanes of its premultiplied bytes,
+// blended along the horizontal taps into a row of 32-bit sums, and output
+// rows blend those along the vertical taps. The integer sums are
+// PixelKernel's in another order, so the pixels are the same. It runs in
+// linear light, and for 16-bit sources, whose tone lookups it does a row at
+// a time. Otherwise, and without AVX2, the fused kernel above stays: with
+// the table lookups done one by one, the extra passes cost more than they
+// save.
+
+// 16-bit lanes of b, g, r, a per pixel, premultiplied as Premultiply does
+SIMD_AVX2 inline __m256i PremultiplyLanes(__m256i v)
+{
+	__m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, 0xFF), 0xFF);
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(v, a), _mm256_set1_epi16(128));
+	return _mm256_blend_epi16(_mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8), v, 0x88);
+}
+
+// straight BGRA to premultiplied, 8 pixels at a time
+SIMD_AVX2 inline int PremultiplyAvx2(const uint32_t* p, int x, int n, uint32_t* out)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	for (; x + 8 <= n; x += 8)
+	{
+		__m256i c = _mm256_loadu_si256((const __m256i*)(p + x));
+		_mm256_storeu_si256((__m256i*)(out + x), _mm256_packus_epi16(PremultiplyLanes(_mm256_unpacklo_epi8(c, zero)), PremultiplyLanes(_mm256_unpackhi_epi8(c, zero))));
+	}
+	return x;
+}
+
+// 24-bit pixels to 32-bit, 8 per shuffle; the loads read a pixel and a byte
+// past the 8 they use
+SIMD_AVX2 inline int ExpandRgb24Avx2(const BYTE* p, int x, int n, uint32_t* out)
+{
+	const __m256i shuf = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+	for (; x + 10 <= n; x += 8)
+	{
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(p + x * 3))), _mm_loadu_si128((const __m128i*)(p + x * 3 + 12)), 1);
+		_mm256_storeu_si256((__m256i*)(out + x), _mm256_or_si256(_mm256_shuffle_epi8(v, shuf), alpha));
+	}
+	return x;
+}
+
+// 16-bit RGBA through the tone table to premultiplied BGRA, 8 pixels at a
+// time; the table is read 4 bytes at a time, so it needs 3 to spare
+SIMD_AVX2 inline int ToneRgba64Avx2(const uint16_t* p, int x, int n, const BYTE* tone, uint32_t* out)
+{
+	const __m256i low = _mm256_set1_epi32(0xFFFF), byte = _mm256_set1_epi32(255), zero = _mm256_setzero_si256();
+	const int* table = (const int*)tone;
+	for (; x + 8 <= n; x += 8)
+	{
+		// r | g << 16 and b | a << 16 of pixels 0, 1, 4, 5, 2, 3, 6, 7
+		__m256 v0 = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)(p + x * 4)));
+		__m256 v1 = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)(p + x * 4 + 16)));
+		__m256i rg = _mm256_castps_si256(_mm256_shuffle_ps(v0, v1, 0x88)), ba = _mm256_castps_si256(_mm256_shuffle_ps(v0, v1, 0xDD));
+		__m256i r = _mm256_and_si256(_mm256_i32gather_epi32(table, _mm256_and_si256(rg, low), 1), byte);
+		__m256i g = _mm256_and_si256(_mm256_i32gather_epi32(table, _mm256_srli_epi32(rg, 16), 1), byte);
+		__m256i b = _mm256_and_si256(_mm256_i32gather_epi32(table, _mm256_and_si256(ba, low), 1), byte);
+		__m256i c = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(_mm256_srli_epi32(ba, 24), 24), _mm256_slli_epi32(r, 16)), _mm256_or_si256(_mm256_slli_epi32(g, 8), b));
+		c = _mm256_packus_epi16(PremultiplyLanes(_mm256_unpacklo_epi8(c, zero)), PremultiplyLanes(_mm256_unpackhi_epi8(c, zero)));
+		_mm256_storeu_si256((__m256i*)(out + x), _mm256_permute4x64_epi64(c, 0xD8));
+	}
+	return x;
+}
+
+// n pixels of a stored row from x on, as Src::Load reads them
+template<class Src>
+void LoadSpan(const BYTE* row, int x, int n, const KernelJob& job, uint32_t* out)
+{
+	int i = 0;
+	if constexpr (std::is_same_v<Src, SrcRGB24>) i = ExpandRgb24Avx2(row + x * 3, i, n, out);
+	if constexpr (std::is_same_v<Src, SrcARGB>) i = PremultiplyAvx2((const uint32_t*)row + x, i, n, out);
+	if constexpr (std::is_same_v<Src, SrcRGBA64>) i = ToneRgba64Avx2((const uint16_t*)row + x * 4, i, n, job.tone, out);
+	for (; i < n; ++i) out[i] = Src::Load(row, x + i, job);
+}
+
+// premultiplied sRGB pixels to linear b, g, r, a
+inline void LinearConvertScalar(const uint32_t* px, size_t from, size_t n, uint16_t* line, const LinearLight& lut)
+{
+	for (size_t x = from; x < n; ++x)
+	{
+		uint32_t b, g, r, c = px[x];
+		LoadLinear(c, lut, b, g, r);
+		uint16_t* p = line + x * 4;
+		p[0] = (uint16_t)b;
+		p[1] = (uint16_t)g;
+		p[2] = (uint16_t)r;
+		p[3] = (uint16_t)(c >> 24);
+	}
+}
+
+// One channel of LoadLinear for 8 translucent pixels. The integer divisions
+// are done in float, which is exact here: the quotients' fractions are
+// multiples of 1/a, further from the next integer than float rounds.
+SIMD_AVX2 inline __m256i LinearChannelAvx2(__m256i v, __m256i a, __m256 af, const int* table)
+{
+	__m256i q = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_mullo_epi32(v, _mm256_set1_epi32(255)), _mm256_srli_epi32(a, 1))), af));
+	__m256i lin = _mm256_and_si256(_mm256_i32gather_epi32(table, _mm256_min_epu32(q, _mm256_set1_epi32(255)), 2), _mm256_set1_epi32(0xFFFF));
+	__m256i res = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(_mm256_mullo_epi32(lin, a)), _mm256_set1_ps(255)));
+	return _mm256_andnot_si256(_mm256_cmpeq_epi32(a, _mm256_setzero_si256()), res);
+}
+
+// 8 pixels at a time, the table lookups as gathers
+SIMD_AVX2 inline size_t LinearConvertAvx2(const uint32_t* px, size_t x, size_t n, uint16_t* line, const LinearLight& lut)
+{
+	const __m256i byte = _mm256_set1_epi32(255);
+	const int* table = (const int*)lut.toLinear; // 32-bit reads of 16-bit entries, high halves dropped
+	for (; x + 8 <= n; x += 8)
+	{
+		__m256i c = _mm256_loadu_si256((const __m256i*)(px + x));
+		__m256i a = _mm256_srli_epi32(c, 24);
+		__m256i b, g, r;
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, byte)) == -1)
+		{
+			b = _mm256_i32gather_epi32(table, _mm256_and_si256(c, byte), 2);
+			g = _mm256_i32gather_epi32(table, _mm256_and_si256(_mm256_srli_epi32(c, 8), byte), 2);
+			r = _mm256_i32gather_epi32(table, _mm256_and_si256(_mm256_srli_epi32(c, 16), byte), 2);
+		}
+		else
+		{
+			__m256 af = _mm256_cvtepi32_ps(a);
+			b = LinearChannelAvx2(_mm256_and_si256(c, byte), a, af, table);
+			g = LinearChannelAvx2(_mm256_and_si256(_mm256_srli_epi32(c, 8), byte), a, af, table);
+			r = LinearChannelAvx2(_mm256_and_si256(_mm256_srli_epi32(c, 16), byte), a, af, table);
+		}
+		// b | g << 16 and r | a << 16, then interleaved back into pixel order
+		__m256i bg = _mm256_blend_epi16(b, _mm256_slli_epi32(g, 16), 0xAA);
+		__m256i ra = _mm256_blend_epi16(r, _mm256_slli_epi32(a, 16), 0xAA);
+		__m256i lo = _mm256_unpacklo_epi32(bg, ra), hi = _mm256_unpackhi_epi32(bg, ra);
+		_mm256_storeu_si256((__m256i*)(line + x * 4), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(line + x * 4 + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	return x;
+}
+
+// premultiplied pixels to 16-bit b, g, r, a as they are, 4 pixels at a time
+SIMD_AVX2 inline size_t ExpandBytesAvx2(const uint32_t* px, size_t x, size_t n, uint16_t* line)
+{
+	for (; x + 4 <= n; x += 4) _mm256_storeu_si256((__m256i*)(line + x * 4), _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(px + x))));
+	for (; x < n; ++x)
+	{
+		for (int k = 0; k < 4; ++k) line[x * 4 + k] = (uint16_t)((px[x] >> (8 * k)) & 255);
+	}
+	return x;
+}
+
+// The horizontal taps two source pixels at a time: a pair is a pixel and its
+// right neighbour, with 8 weights (the left pixel's 4 times, then the right
+// one's, 0 if only the left one is a tap).
+struct LinearPairs
+{
+	std::vector<int> first; // per output pixel, one extra at the end
+	std::vector<int> pos;
+	std::vector<uint32_t> weight;
+};
+
+inline LinearPairs BuildLinearPairs(const AxisTaps& xs, UINT dw)
+{
+	LinearPairs pairs;
+	for (UINT x = 0; x < dw; ++x)
+	{
+		pairs.first.push_back((int)pairs.pos.size());
+		for (int i = xs.first[x]; i < xs.first[x + 1]; ++i)
+		{
+			const bool both = i + 1 < xs.first[x + 1] && xs.pos[i + 1] == xs.pos[i] + 1;
+			pairs.pos.push_back(xs.pos[i]);
+			pairs.weight.insert(pairs.weight.end(), 4, (uint32_t)xs.weight[i]);
+			pairs.weight.insert(pairs.weight.end(), 4, both ? (uint32_t)xs.weight[i + 1] : 0u);
+			if (both) ++i;
+		}
+	}
+	pairs.first.push_back((int)pairs.pos.size());
+	return pairs;
+}
+
+// a converted row through the horizontal taps into sums, 4 per output pixel;
+// the line has a spare pixel at the end for the last pair
+SIMD_AVX2 inline void LinearRowAvx2(const uint16_t* line, const LinearPairs& pairs, UINT dw, uint32_t* sums)
+{
+	for (UINT x = 0; x < dw; ++x)
+	{
+		__m256i s = _mm256_setzero_si256();
+		for (int i = pairs.first[x]; i < pairs.first[x + 1]; ++i)
+		{
+			__m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(line + pairs.pos[i] * 4)));
+			s = _mm256_add_epi32(s, _mm256_mullo_epi32(v, _mm256_loadu_si256((const __m256i*)&pairs.weight[i * 8])));
+		}
+		_mm_storeu_si128((__m128i*)(sums + x * 4), _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1)));
+	}
+}
+
+// count rows of sums through the vertical taps and back to sRGB, two output
+// pixels per vector
+SIMD_AVX2 inline void LinearColumnsAvx2(const uint32_t* const* rows, const int* weights, int count, UINT dw, uint32_t* out, const LinearLight& lut)
+{
+	for (UINT x = 0; x < dw; x += 2)
+	{
+		__m256i s = _mm256_set1_epi32(32768);
+		for (int j = 0; j < count; ++j)
+			s = _mm256_add_epi32(s, _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(rows[j] + x * 4)), _mm256_set1_epi32(weights[j])));
+		alignas(32) uint32_t v[8];
+		_mm256_store_si256((__m256i*)v, _mm256_srli_epi32(s, 16));
+		out[x] = StoreLinear(v[0], v[1], v[2], v[3], lut);
+		if (x + 1 < dw) out[x + 1] = StoreLinear(v[4], v[5], v[6], v[7], lut);
+	}
+}
+
+// count rows of sums of premultiplied bytes through the vertical taps, two
+// output pixels per vector
+SIMD_AVX2 inline void ByteColumnsAvx2(const uint32_t* const* rows, const int* weights, int count, UINT dw, uint32_t* out)
+{
+	for (UINT x = 0; x < dw; x += 2)
+	{
+		__m256i s = _mm256_set1_epi32(32768);
+		for (int j = 0; j < count; ++j)
+			s = _mm256_add_epi32(s, _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(rows[j] + x * 4)), _mm256_set1_epi32(weights[j])));
+		__m256i v = _mm256_srli_epi32(s, 16);
+		v = _mm256_packus_epi16(_mm256_packus_epi32(v, v), v);
+		out[x] = (uint32_t)_mm256_cvtsi256_si32(v);
+		if (x + 1 < dw) out[x + 1] = (uint32_t)_mm_cvtsi128_si32(_mm256_extracti128_si256(v, 1));
+	}
+}
+
+template<class Src, int Orient, bool Linear>
+void SeparableKernelAvx2(const KernelJob& job, UINT y0, UINT y1)
+{
+	const LinearLight& lut = LinearLightTables();
+	const PixelBuffer& src = *job.src;
+	const AxisTaps& ys = *job.ys;
+	const int w = (int)src.width, h = (int)src.height;
+	const UINT dw = job.dst->width;
+
+	// the part of each source row the horizontal taps reach, from lo on
+	const int lo = job.xs->pos.front(), n = job.xs->pos.back() - lo + 1;
+	AxisTaps xs = *job.xs;
+	for (int& p : xs.pos) p -= lo;
+	const LinearPairs pairs = BuildLinearPairs(xs, dw);
+
+	// rows of sums by source row, enough for one output row's taps, so a
+	// row shared with the next output row is blended once; the spare pixel
+	// at the end lets the columns pass read two at a time
+	int slots = 1;
+	for (UINT y = y0; y < y1; ++y) slots = (std::max)(slots, ys.pos[ys.first[y + 1] - 1] - ys.pos[ys.first[y]] + 1);
+	const size_t rowSums = ((size_t)dw + 1) * 4;
+	std::vector<uint32_t> sums(slots * rowSums);
+	std::vector<int> slotRow(slots, -1);
+	std::vector<uint16_t> line(((size_t)n + 1) * 4);
+	std::vector<const uint32_t*> rows;
+
+	// source pixels of the oriented rows from pxFirst on; rotated images
+	// are read a block of rows at a time, which runs along the stored rows.
+	// 16-bit sources measured best with longer blocks than 8-bit ones.
+	const int block = Orient >= 5 ? (std::is_same_v<Src, SrcRGBA64> ? 128 : 32) : 1, lastRow = ys.pos[ys.first[y1] - 1];
+	std::vector<uint32_t> px((size_t)block * n), run(block);
+	int pxFirst = 0, pxCount = 0;
+
+	for (UINT y = y0; y < y1; ++y)
+	{
+		rows.clear();
+		for (int j = ys.first[y]; j < ys.first[y + 1]; ++j)
+		{
+			const int oy = ys.pos[j], slot = oy % slots;
+			uint32_t* row = &sums[slot * rowSums];
+			rows.push_back(row);
+			if (slotRow[slot] == oy) continue;
+			slotRow[slot] = oy;
+
+			if (oy < pxFirst || oy >= pxFirst + pxCount)
+			{
+				pxFirst = oy;
+				pxCount = (std::min)(block, lastRow - oy + 1);
+				if constexpr (Orient <= 4)
+				{
+					// the oriented row runs along a stored one, forwards or back
+					int sx0, sx1, sy;
+					Orientation<Orient>::Map(lo, oy, w, h, sx0, sy);
+					Orientation<Orient>::Map(lo + n - 1, oy, w, h, sx1, sy);
+					LoadSpan<Src>(src.Row(sy), (std::min)(sx0, sx1), n, job, px.data());
+					if (sx1 < sx0) std::reverse(px.begin(), px.begin() + n);
+				}
+				else
+				{
+					// each oriented column of the block is a run of a stored row
+					for (int x = 0; x < n; ++x)
+					{
+						int sx0, sx1, sy;
+						Orientation<Orient>::Map(lo + x, oy, w, h, sx0, sy);
+						Orientation<Orient>::Map(lo + x, oy + pxCount - 1, w, h, sx1, sy);
+						LoadSpan<Src>(src.Row(sy), (std::min)(sx0, sx1), pxCount, job, run.data());
+						for (int k = 0; k < pxCount; ++k) px[(size_t)k * n + x] = run[sx1 < sx0 ? pxCount - 1 - k : k];
+					}
+				}
+			}
+			const uint32_t* p = &px[(size_t)(oy - pxFirst) * n];
+			if constexpr (Linear)
+			{
+				size_t x = LinearConvertAvx2(p, 0, n, line.data(), lut);
+				LinearConvertScalar(p, x, n, line.data(), lut);
+			}
+			else
+			{
+				ExpandBytesAvx2(p, 0, n, line.data());
+			}
+			LinearRowAvx2(line.data(), pairs, dw, row);
+		}
+		if constexpr (Linear)
+			LinearColumnsAvx2(rows.data(), &ys.weight[ys.first[y]], (int)rows.size(), dw, (uint32_t*)job.dst->Row(y), lut);
+		else
+			ByteColumnsAvx2(rows.data(), &ys.weight[ys.first[y]], (int)rows.size(), dw, (uint32_t*)job.dst->Row(y));
+	}
+}
+
+template<class Src, bool Linear>
+KernelFn SelectSeparableAvx2(int orient)
+{
+	switch (orient)
+	{
+	case 2: return &SeparableKernelAvx2<Src, 2, Linear>;
+	case 3: return &SeparableKernelAvx2<Src, 3, Linear>;
+	case 4: return &SeparableKernelAvx2<Src, 4, Linear>;
+	case 5: return &SeparableKernelAvx2<Src, 5, Linear>;
+	case 6: return &SeparableKernelAvx2<Src, 6, Linear>;
+	case 7: return &SeparableKernelAvx2<Src, 7, Linear>;
+	case 8: return &SeparableKernelAvx2<Src, 8, Linear>;
+	default: return &SeparableKernelAvx2<Src, 1, Linear>;
+	}
+}
+#endif
+
+template<class Src, class Filter, bool Linear>
+KernelFn SelectOrientation(int orient)
+{
+	switch (orient)
+	{
+	case 2: return &PixelKernel<Src, 2, Filter, Linear>;
+	case 3: return &PixelKernel<Src, 3, Filter, Linear>;
+	case 4: return &PixelKernel<Src, 4, Filter, Linear>;
+	case 5: return &PixelKernel<Src, 5, Filter, Linear>;
+	case 6: return &PixelKernel<Src, 6, Filter, Linear>;
+	case 7: return &PixelKernel<Src, 7, Filter, Linear>;
+	case 8: return &PixelKernel<Src, 8, Filter, Linear>;
+	default: return &PixelKernel<Src, 1, Filter, Linear>;
+	}
+}
+
+template<class Src>
+KernelFn SelectFilter(FilterKind filter, int orient, bool linear)
+{
+#if SIMD_X86
+	if (filter != FilterKind::Nearest && g_simd >= SimdLevel::Avx2)
+	{
+		if (linear) return SelectSeparableAvx2<Src, true>(orient);
+		if constexpr (std::is_same_v<Src, SrcRGBA64>) return SelectSeparableAvx2<Src, false>(orient);
+	}
+#endif
+	switch (filter)
+	{
+	case FilterKind::Nearest: return SelectOrientation<Src, FilterNearest, false>(orient); // copies, nothing to blend
+	case FilterKind::Bilinear: return linear ? SelectOrientation<Src, FilterBilinear, true>(orient) : SelectOrientation<Src, FilterBilinear, false>(orient);
+	default: return linear ? SelectOrientation<Src, FilterBox, true>(orient) : SelectOrientation<Src, FilterBox, false>(orient);
+	}
+}
+
+inline KernelFn SelectKernel(PixelFormat format, int orient, FilterKind filter, bool linear)
+{
+	switch (format)
+	{
+	case PixelFormat32bppARGB: return SelectFilter<SrcARGB>(filter, orient, linear);
+	case PixelFormat32bppRGB: return SelectFilter<SrcRGB32>(filter, orient, linear);
+	case PixelFormat24bppRGB: return SelectFilter<SrcRGB24>(filter, orient, linear);
+	case PixelFormat8bppIndexed: return SelectFilter<SrcIndexed8>(filter, orient, linear);
+	case PixelFormat64bppARGB: return SelectFilter<SrcRGBA64>(filter, orient, linear);
+	default: return SelectFilter<SrcPARGB>(filter, orient, linear);
+	}
+}
+
+// 16-bit levels to 8-bit display levels. Exposure scales linear light; gamma
+// above 1 lifts the midtones.
+struct DeepTone
+{
+	BYTE level[65536];
+	BYTE pad[3]; // ToneRgba64Avx2 reads level 4 bytes at a time
+};
+
+inline std::shared_ptr<const DeepTone> DeepToneTable(const ToneAdjust& adjust)
+{
+	// one table at a time: adjusting re-renders the same image
+	static std::mutex mutex;
+	static ToneAdjust last;
+	static std::shared_ptr<const DeepTone> table;
+	std::lock_guard<std::mutex> lk(mutex);
+	if (table && last == adjust) return table;
+
+	auto t = std::make_shared<DeepTone>();
+	memset(t->pad, 0, sizeof(t->pad));
+	double scale = std::exp2(adjust.exposure), invGamma = 1 / (std::max)(0.1f, adjust.gamma);
+	for (int v = 0; v < 65536; ++v)
+	{
+		double x = v / 65535.0;
+		if (adjust.exposure != 0)
+		{
+			double lin = (x <= 0.04045 ? x / 12.92 : std::pow((x + 0.055) / 1.055, 2.4)) * scale;
+			x = lin >= 1 ? 1 : lin <= 0.0031308 ? lin * 12.92 : 1.055 * std::pow(lin, 1 / 2.4) - 0.055;
+		}
+		if (invGamma != 1) x = std::pow(x, invGamma);
+		t->level[v] = (BYTE)(x * 255 + 0.5);
+	}
+	last = adjust;
+	return table = t;
+}
+
+// The stored pixel under oriented pixel (ox, oy) of an image stored as w x h.
+inline void OrientedToStored(int orient, int ox, int oy, int w, int h, int& sx, int& sy)
+{
+	switch (orient)
+	{
+	case 2: Orientation<2>::Map(ox, oy, w, h, sx, sy); break;
+	case 3: Orientation<3>::Map(ox, oy, w, h, sx, sy); break;
+	case 4: Orientation<4>::Map(ox, oy, w, h, sx, sy); break;
+	case 5: Orientation<5>::Map(ox, oy, w, h, sx, sy); break;
+	case 6: Orientation<6>::Map(ox, oy, w, h, sx, sy); break;
+	case 7: Orientation<7>::Map(ox, oy, w, h, sx, sy); break;
+	case 8: Orientation<8>::Map(ox, oy, w, h, sx, sy); break;
+	default: Orientation<1>::Map(ox, oy, w, h, sx, sy); break;
+	}
+}
+
+// and back: where stored pixel (sx, sy) lands once oriented
+inline void StoredToOriented(int orient, int sx, int sy, int w, int h, int& ox, int& oy)
+{
+	bool transposed = IsTransposed(orient);
+	OrientedToStored(orient == 6 ? 8 : orient == 8 ? 6 : orient, sx, sy, transposed ? h : w, transposed ? w : h, ox, oy);
+}
+
+// RenderOriented where src is only the part of a fullW x fullH (stored)
+// image from (srcX, srcY) on, covering at least OrientedSourceRect.
+inline void RenderOrientedPart(const PixelBuffer& src, UINT fullW, UINT fullH, UINT srcX, UINT srcY, int orient, UINT dispW, UINT dispH, int clipX, int clipY,
+	PixelBuffer& dst, QoS qos, bool linearLight = false, const ToneAdjust& tone = {})
+{
+	UINT ow = IsTransposed(orient) ? fullH : fullW;
+	UINT oh = IsTransposed(orient) ? fullW : fullH;
+	FilterKind filter = (ow == dispW && oh == dispH) ? FilterKind::Nearest : (dispW < ow || dispH < oh) ? FilterKind::Box : FilterKind::Bilinear;
+
+	AxisTaps xs = BuildTaps(filter, ow, dispW, clipX, dst.width);
+	AxisTaps ys = BuildTaps(filter, oh, dispH, clipY, dst.height);
+	if (src.width != fullW || src.height != fullH)
+	{
+		// the taps are along the whole image; the kernel reads them in src,
+		// from its corner that comes first once oriented
+		int ax, ay, bx, by;
+		StoredToOriented(orient, srcX, srcY, fullW, fullH, ax, ay);
+		StoredToOriented(orient, srcX + src.width - 1, srcY + src.height - 1, fullW, fullH, bx, by);
+		for (int& p : xs.pos) p -= (std::min)(ax, bx);
+		for (int& p : ys.pos) p -= (std::min)(ay, by);
+	}
+
+	std::vector<uint32_t> palette;
+	for (ARGB c : src.palette) palette.push_back(Premultiply(c));
+
+	std::shared_ptr<const DeepTone> deep;
+	if (src.format == PixelFormat64bppARGB) deep = DeepToneTable(tone);
+
+	KernelJob job = { &src, palette.data(), deep ? deep->level : nullptr, &dst, &xs, &ys };
+	KernelFn kernel = SelectKernel(src.format, orient, filter, linearLight);
+	ParallelFor(dst.height, 32, qos, [&](UINT y0, UINT y1) { kernel(job, y0, y1); });
+}
+
+// Renders the visible part of src, oriented and resampled to a dispW x dispH
+// display rect, into dst (clipW x clipH, premultiplied BGRA). linearLight
+// blends in linear light, so fine high-contrast detail keeps its brightness;
+// tone reduces 16-bit sources.
+inline void RenderOriented(const PixelBuffer& src, int orient, UINT dispW, UINT dispH, int clipX, int clipY, PixelBuffer& dst, QoS qos, bool linearLight = false, const ToneAdjust& tone = {})
+{
+	RenderOrientedPart(src, src.width, src.height, 0, 0, orient, dispW, dispH, clipX, clipY, dst, qos, linearLight, tone);
+}
+
+template<int Orient>
+void OrientRows(const PixelBuffer& src, PixelBuffer& dst, UINT y0, UINT y1)
+{
+	const UINT bytes = GetPixelFormatSize(src.format) / 8;
+	for (UINT y = y0; y < y1; ++y)
+	{
+		BYTE* out = dst.Row(y);
+		for (UINT x = 0; x < dst.width; ++x)
+		{
+			int sx, sy;
+			Orientation<Orient>::Map((int)x, (int)y, (int)src.width, (int)src.height, sx, sy);
+			memcpy(out + x * bytes, src.Row(sy) + sx * bytes, bytes);
+		}
+	}
+}
+
+// Returns src with the orientation baked in, in the same pixel format; used
+// when an image is written back upright.
+inline std::shared_ptr<PixelBuffer> ApplyOrientation(const PixelBuffer& src, int orient, QoS qos)
+{
+	using RowsFn = void (*)(const PixelBuffer&, PixelBuffer&, UINT, UINT);
+	static const RowsFn rows[] = {
+		&OrientRows<1>, &OrientRows<1>, &OrientRows<2>, &OrientRows<3>, &OrientRows<4>,
+		&OrientRows<5>, &OrientRows<6>, &OrientRows<7>, &OrientRows<8>,
+	};
+	bool transposed = IsTransposed(orient);
+	auto dst = std::make_shared<PixelBuffer>(transposed ? src.height : src.width, transposed ? src.width : src.height, src.format);
+	dst->palette = src.palette;
+	RowsFn fn = rows[(orient >= 1 && orient <= 8) ? orient : 1];
+	ParallelFor(dst->height, 64, qos, [&](UINT y0, UINT y1) { fn(src, *dst, y0, y1); });
+	return dst;
+}
+
+// the w x h pixels at (x, y), in the source's format
+inline std::shared_ptr<PixelBuffer> CropPixels(const PixelBuffer& src, UINT x, UINT y, UINT w, UINT h)
+{
+	auto dst = std::make_shared<PixelBuffer>(w, h, src.format);
+	dst->palette = src.palette;
+	size_t bpp = GetPixelFormatSize(src.format) / 8;
+	for (UINT row = 0; row < h; ++row) memcpy(dst->Row(row), src.Row(y + row) + x * bpp, w * bpp);
+	return dst;
+}
+
+// The unsharp mask's fixed-point kernel: 5 taps, sigma 0.8 px, summing to
+// 256, symmetric, so the SIMD paths add mirrored pairs before multiplying
+inline constexpr uint32_t UnsharpTaps[3] = { 6, 58, 128 };
+inline constexpr int UnsharpAmount = 150; // 8-bit fixed point, about 0.6
+
+// horizontal pass of bytes p[from, n) into 8.8 fixed point; p has 8 bytes
+// to spare at each end
+inline void UnsharpBlurScalar(const BYTE* p, int from, int n, uint16_t* out)
+{
+	const uint32_t* t = UnsharpTaps;
+	for (int i = from; i < n; ++i) out[i] = (uint16_t)(t[0] * (p[i - 8] + p[i + 8]) + t[1] * (p[i - 4] + p[i + 4]) + t[2] * p[i]);
+}
+
+// vertical pass over rows r[0..4] of the horizontal one, and the difference
+// from the blur added back to row bytes [from, n) in place; alpha is kept,
+// colors stay within it
+inline void UnsharpRowScalar(const uint16_t* const* r, int from, int n, BYTE* row)
+{
+	const uint32_t* t = UnsharpTaps;
+	for (int x = from; x < n; x += 4)
+	{
+		const int a = row[x + 3];
+		for (int i = x; i < x + 3; ++i)
+		{
+			int blur = (int)((t[0] * (r[0][i] + r[4][i]) + t[1] * (r[1][i] + r[3][i]) + t[2] * r[2][i] + 32768) >> 16);
+			row[i] = (BYTE)std::clamp(row[i] + ((row[i] - blur) * UnsharpAmount >> 8), 0, a);
+		}
+	}
+}
+
+#if SIMD_X86
+// The SIMD paths give the scalar results: the horizontal sums fit 16 bits,
+// so they are taken modulo 2^16; the vertical ones are done in 32 bits; and
+// d * 150 >> 8 is d * 75 >> 7, which fits 16 bits.
+
+SIMD_SSE41 inline __m128i LoadBytes8(const BYTE* p) { return _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)p)); }
+
+// 8 bytes at a time; returns where the scalar tail starts
+SIMD_SSE41 inline int UnsharpBlurSse41(const BYTE* p, int i, int n, uint16_t* out)
+{
+	for (; i + 8 <= n; i += 8)
+	{
+		__m128i outer = _mm_add_epi16(LoadBytes8(p + i - 8), LoadBytes8(p + i + 8)), inner = _mm_add_epi16(LoadBytes8(p + i - 4), LoadBytes8(p + i + 4));
+		__m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(outer, _mm_set1_epi16(6)), _mm_mullo_epi16(inner, _mm_set1_epi16(58))), _mm_slli_epi16(LoadBytes8(p + i), 7));
+		_mm_storeu_si128((__m128i*)(out + i), sum);
+	}
+	return i;
+}
+
+SIMD_AVX2 inline __m256i LoadBytes16(const BYTE* p) { return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p)); }
+
+// 16 bytes at a time
+SIMD_AVX2 inline int UnsharpBlurAvx2(const BYTE* p, int i, int n, uint16_t* out)
+{
+	for (; i + 16 <= n; i += 16)
+	{
+		__m256i outer = _mm256_add_epi16(LoadBytes16(p + i - 8), LoadBytes16(p + i + 8)), inner = _mm256_add_epi16(LoadBytes16(p + i - 4), LoadBytes16(p + i + 4));
+		__m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(outer, _mm256_set1_epi16(6)), _mm256_mullo_epi16(inner, _mm256_set1_epi16(58)));
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi16(sum, _mm256_slli_epi16(LoadBytes16(p + i), 7)));
+	}
+	return i;
+}
+
+SIMD_SSE41 inline __m128i LoadWords4(const uint16_t* p) { return _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)p)); }
+
+// the vertical blur of 4 values at i
+SIMD_SSE41 inline __m128i UnsharpColumnSse41(const uint16_t* const* r, int i)
+{
+	__m128i sum = _mm_add_epi32(_mm_mullo_epi32(_mm_add_epi32(LoadWords4(r[0] + i), LoadWords4(r[4] + i)), _mm_set1_epi32(6)), _mm_mullo_epi32(_mm_add_epi32(LoadWords4(r[1] + i), LoadWords4(r[3] + i)), _mm_set1_epi32(58)));
+	sum = _mm_add_epi32(_mm_add_epi32(sum, _mm_slli_epi32(LoadWords4(r[2] + i), 7)), _mm_set1_epi32(32768));
+	return _mm_srli_epi32(sum, 16);
+}
+
+// 2 pixels at a time
+SIMD_SSE41 inline int UnsharpRowSse41(const uint16_t* const* r, int x, int n, BYTE* row)
+{
+	for (; x + 8 <= n; x += 8)
+	{
+		__m128i in = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(row + x)));
+		__m128i blur = _mm_packus_epi32(UnsharpColumnSse41(r, x), UnsharpColumnSse41(r, x + 4));
+		__m128i sharp = _mm_add_epi16(in, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(in, blur), _mm_set1_epi16(UnsharpAmount / 2)), 7));
+		__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(in, 0xFF), 0xFF);
+		sharp = _mm_blend_epi16(_mm_min_epi16(_mm_max_epi16(sharp, _mm_setzero_si128()), a), in, 0x88);
+		_mm_storel_epi64((__m128i*)(row + x), _mm_packus_epi16(sharp, sharp));
+	}
+	return x;
+}
+
+SIMD_AVX2 inline __m256i LoadWords8(const uint16_t* p) { return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p)); }
+
+// the vertical blur of 8 values at i
+SIMD_AVX2 inline __m256i UnsharpColumnAvx2(const uint16_t* const* r, int i)
+{
+	__m256i sum = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(LoadWords8(r[0] + i), LoadWords8(r[4] + i)), _mm256_set1_epi32(6)), _mm256_mullo_epi32(_mm256_add_epi32(LoadWords8(r[1] + i), LoadWords8(r[3] + i)), _mm256_set1_epi32(58)));
+	sum = _mm256_add_epi32(_mm256_add_epi32(sum, _mm256_slli_epi32(LoadWords8(r[2] + i), 7)), _mm256_set1_epi32(32768));
+	return _mm256_srli_epi32(sum, 16);
+}
+
+// 4 pixels at a time; the packs work per 128-bit lane, the permutes put the
+// values back in order
+SIMD_AVX2 inline int UnsharpRowAvx2(const uint16_t* const* r, int x, int n, BYTE* row)
+{
+	for (; x + 16 <= n; x += 16)
+	{
+		__m256i in = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + x)));
+		__m256i blur = _mm256_permute4x64_epi64(_mm256_packus_epi32(UnsharpColumnAvx2(r, x), UnsharpColumnAvx2(r, x + 8)), 0xD8);
+		__m256i sharp = _mm256_add_epi16(in, _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(in, blur), _mm256_set1_epi16(UnsharpAmount / 2)), 7));
+		__m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(in, 0xFF), 0xFF);
+		sharp = _mm256_blend_epi16(_mm256_min_epi16(_mm256_max_epi16(sharp, _mm256_setzero_si256()), a), in, 0x88);
+		_mm_storeu_si128((__m128i*)(row + x), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(sharp, sharp), 0x08)));
+	}
+	return x;
+}
+#endif
+
+// Unsharp mask for downscaled frames: out = in + amount * (in - gaussian(in)),
+// premultiplied BGRA in place.
+inline void UnsharpMask(PixelBuffer& px, QoS qos)
+{
+	const int w = (int)px.width, h = (int)px.height, n = w * 4;
+	if (w < 5 || h < 5) return;
+
+	// horizontal pass into 8.8 fixed point; the two pixels at each end repeat the edge
+	std::vector<uint16_t> blurX((size_t)n * h);
+	ParallelFor(h, 32, qos, [&](UINT y0, UINT y1)
+	{
+		std::vector<BYTE> padded(n + 16);
+		for (UINT y = y0; y < y1; ++y)
+		{
+			const BYTE* row = px.Row(y);
+			memcpy(padded.data() + 8, row, n);
+			for (int i = 0; i < 8; ++i)
+			{
+				padded[i] = row[i & 3];
+				padded[n + 8 + i] = row[n - 4 + (i & 3)];
+			}
+			const BYTE* p = padded.data() + 8;
+			uint16_t* out = &blurX[(size_t)y * n];
+			int i = 0;
+#if SIMD_X86
+			if (g_simd >= SimdLevel::Avx2) i = UnsharpBlurAvx2(p, i, n, out);
+			if (g_simd >= SimdLevel::Sse41) i = UnsharpBlurSse41(p, i, n, out);
+#endif
+			UnsharpBlurScalar(p, i, n, out);
+		}
+	});
+
+	// vertical pass, then the difference is added back to each row
+	ParallelFor(h, 32, qos, [&](UINT y0, UINT y1)
+	{
+		for (int y = (int)y0; y < (int)y1; ++y)
+		{
+			const uint16_t* r[5];
+			for (int k = 0; k < 5; ++k) r[k] = &blurX[(size_t)std::clamp(y + k - 2, 0, h - 1) * n];
+			BYTE* row = px.Row(y);
+			int x = 0;
+#if SIMD_X86
+			if (g_simd >= SimdLevel::Avx2) x = UnsharpRowAvx2(r, x, n, row);
+			if (g_simd >= SimdLevel::Sse41) x = UnsharpRowSse41(r, x, n, row);
+#endif
+			UnsharpRowScalar(r, x, n, row);
+		}
+	});
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+// The five PNG row filters and the cost the adaptive presets pick them by,
+// with SSE4.1 and AVX2 paths.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "pixel_format.h"
+#include "simd.h"
+
+// Filters cur into out from index from on; bytes before from are done.
+inline void PngFilterScalar(int type, const BYTE* cur, const BYTE* prev, size_t from, size_t n, int bpp, BYTE* out)
+{
+	switch (type)
+	{
+	case 1:
+		for (size_t i = from; i < n; ++i) out[i] = (BYTE)(cur[i] - cur[i - bpp]);
+		break;
+	case 2:
+		for (size_t i = from; i < n; ++i) out[i] = (BYTE)(cur[i] - prev[i]);
+		break;
+	case 3:
+		for (size_t i = from; i < n; ++i) out[i] = (BYTE)(cur[i] - ((cur[i - bpp] + prev[i]) >> 1));
+		break;
+	default:
+		for (size_t i = from; i < n; ++i)
+		{
+			int a = cur[i - bpp], b = prev[i], c = prev[i - bpp];
+			int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+			int pred = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+			out[i] = (BYTE)(cur[i] - pred);
+		}
+		break;
+	}
+}
+
+inline uint64_t PngFilterCostScalar(const BYTE* p, size_t from, size_t n)
+{
+	uint64_t sum = 0;
+	for (size_t i = from; i < n; ++i) sum += (BYTE)std::abs((signed char)p[i]);
+	return sum;
+}
+
+#if SIMD_X86
+// Paeth's predictor on 16-bit lanes: whichever of a, b, c is nearest a + b - c,
+// preferring a, then b
+SIMD_SSE41 inline __m128i PaethPredict(__m128i a, __m128i b, __m128i c)
+{
+	__m128i bc = _mm_sub_epi16(b, c), ac = _mm_sub_epi16(a, c);
+	__m128i pa = _mm_abs_epi16(bc), pb = _mm_abs_epi16(ac), pc = _mm_abs_epi16(_mm_add_epi16(bc, ac));
+	__m128i m = _mm_min_epi16(pa, _mm_min_epi16(pb, pc));
+	__m128i pred = _mm_blendv_epi8(c, b, _mm_cmpeq_epi16(pb, m));
+	return _mm_blendv_epi8(pred, a, _mm_cmpeq_epi16(pa, m));
+}
+
+SIMD_AVX2 inline __m256i PaethPredict(__m256i a, __m256i b, __m256i c)
+{
+	__m256i bc = _mm256_sub_epi16(b, c), ac = _mm256_sub_epi16(a, c);
+	__m256i pa = _mm256_abs_epi16(bc), pb = _mm256_abs_epi16(ac), pc = _mm256_abs_epi16(_mm256_add_epi16(bc, ac));
+	__m256i m = _mm256_min_epi16(pa, _mm256_min_epi16(pb, pc));
+	__m256i pred = _mm256_blendv_epi8(c, b, _mm256_cmpeq_epi16(pb, m));
+	return _mm256_blendv_epi8(pred, a, _mm256_cmpeq_epi16(pa, m));
+}
+
+// 16 bytes at a time; returns where the scalar tail starts
+SIMD_SSE41 inline size_t PngFilterSse41(int type, const BYTE* cur, const BYTE* prev, size_t i, size_t n, int bpp, BYTE* out)
+{
+	const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(cur + i));
+		__m128i a = _mm_loadu_si128((const __m128i*)(cur + i - bpp));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+		__m128i pred;
+		if (type == 1)
+		{
+			pred = a;
+		}
+		else if (type == 2)
+		{
+			pred = b;
+		}
+		else if (type == 3)
+		{
+			// _mm_avg_epu8 rounds up, PNG rounds down
+			pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+		}
+		else
+		{
+			__m128i c = _mm_loadu_si128((const __m128i*)(prev + i - bpp));
+			__m128i lo = PaethPredict(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+			__m128i hi = PaethPredict(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+			pred = _mm_packus_epi16(lo, hi);
+		}
+		_mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, pred));
+	}
+	return i;
+}
+
+// 32 bytes at a time; the unpacks and the pack work per 128-bit lane, so
+// the bytes come back in order
+SIMD_AVX2 inline size_t PngFilterAvx2(int type, const BYTE* cur, const BYTE* prev, size_t i, size_t n, int bpp, BYTE* out)
+{
+	const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i*)(cur + i));
+		__m256i a = _mm256_loadu_si256((const __m256i*)(cur + i - bpp));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(prev + i));
+		__m256i pred;
+		if (type == 1)
+		{
+			pred = a;
+		}
+		else if (type == 2)
+		{
+			pred = b;
+		}
+		else if (type == 3)
+		{
+			pred = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+		}
+		else
+		{
+			__m256i c = _mm256_loadu_si256((const __m256i*)(prev + i - bpp));
+			__m256i lo = PaethPredict(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero));
+			__m256i hi = PaethPredict(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero));
+			pred = _mm256_packus_epi16(lo, hi);
+		}
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_sub_epi8(x, pred));
+	}
+	return i;
+}
+
+// absolute values of the signed bytes, summed by psadbw
+SIMD_SSE41 inline size_t PngFilterCostSse41(const BYTE* p, size_t i, size_t n, uint64_t& sum)
+{
+	__m128i acc = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_abs_epi8(_mm_loadu_si128((const __m128i*)(p + i))), _mm_setzero_si128()));
+	alignas(16) uint64_t lanes[2];
+	_mm_store_si128((__m128i*)lanes, acc);
+	sum += lanes[0] + lanes[1];
+	return i;
+}
+
+SIMD_AVX2 inline size_t PngFilterCostAvx2(const BYTE* p, size_t i, size_t n, uint64_t& sum)
+{
+	__m256i acc = _mm256_setzero_si256();
+	for (; i + 32 <= n; i += 32) acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_abs_epi8(_mm256_loadu_si256((const __m256i*)(p + i))), _mm256_setzero_si256()));
+	alignas(16) uint64_t lanes[2];
+	_mm_store_si128((__m128i*)lanes, _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+	sum += lanes[0] + lanes[1];
+	return i;
+}
+#endif
+
+// Filters the n bytes of row cur (prev is the row above, zeros for the
+// first) with filter type into out; bpp is the bytes per pixel.
+inline void PngFilter(int type, const BYTE* cur, const BYTE* prev, size_t n, int bpp, BYTE* out)
+{
+	if (type == 0)
+	{
+		memcpy(out, cur, n);
+		return;
+	}
+
+	// the first pixel has no left neighbour
+	size_t i = (std::min)((size_t)bpp, n);
+	for (size_t k = 0; k < i; ++k) out[k] = (BYTE)(cur[k] - (type == 1 ? 0 : type == 3 ? prev[k] >> 1 : prev[k]));
+#if SIMD_X86
+	if (g_simd >= SimdLevel::Avx2) i = PngFilterAvx2(type, cur, prev, i, n, bpp, out);
+	if (g_simd >= SimdLevel::Sse41) i = PngFilterSse41(type, cur, prev, i, n, bpp, out);
+#endif
+	PngFilterScalar(type, cur, prev, i, n, bpp, out);
+}
+
+// sum of the filtered bytes as signed magnitudes; lowest picks the filter
+inline uint64_t PngFilterCost(const BYTE* p, size_t n)
+{
+	uint64_t sum = 0;
+	size_t i = 0;
+#if SIMD_X86
+	if (g_simd >= SimdLevel::Avx2) i = PngFilterCostAvx2(p, i, n, sum);
+	if (g_simd >= SimdLevel::Sse41) i = PngFilterCostSse41(p, i, n, sum);
+#endif
+	return sum + PngFilterCostScalar(p, i, n);
+}
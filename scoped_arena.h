@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+
+// Bump allocator for the transient buffers of one navigation or decode.
+// Allocations are carved out of an inline block and released all at once
+// when the arena goes out of scope; only oversized requests reach the heap.
+template<size_t Size>
+class ScopedArena : public std::pmr::monotonic_buffer_resource
+{
+public:
+	ScopedArena() : std::pmr::monotonic_buffer_resource(m_block, Size, std::pmr::new_delete_resource()) {}
+
+private:
+	alignas(std::max_align_t) std::byte m_block[Size];
+};
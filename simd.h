@@ -0,0 +1,50 @@
+#pragma once
+
+// Run-time dispatch for the hand-written SIMD paths. SSE4.1 and AVX2 variants
+// are compiled for their instruction set whatever the build's baseline, and
+// the best one the CPU runs is picked once. Every path has a scalar fallback
+// with the same results; elsewhere than x86 and x64 only that is built.
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SIMD_SSE41
+#define SIMD_AVX2
+#else
+#define SIMD_SSE41 __attribute__((target("sse4.1")))
+#define SIMD_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define SIMD_X86 0
+#endif
+
+enum class SimdLevel { Scalar, Sse41, Avx2 };
+
+inline SimdLevel DetectSimd()
+{
+#if SIMD_X86 && defined(_MSC_VER)
+	int r[4];
+	__cpuid(r, 0);
+	const int maxLeaf = r[0];
+	__cpuid(r, 1);
+	const bool sse41 = (r[2] >> 19) & 1;
+	const bool avx = ((r[2] >> 27) & 1) && ((r[2] >> 28) & 1) && (_xgetbv(0) & 6) == 6; // OS saves the YMM registers
+	bool avx2 = false;
+	if (avx && maxLeaf >= 7)
+	{
+		__cpuidex(r, 7, 0);
+		avx2 = (r[1] >> 5) & 1;
+	}
+	return avx2 ? SimdLevel::Avx2 : sse41 ? SimdLevel::Sse41 : SimdLevel::Scalar;
+#elif SIMD_X86
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? SimdLevel::Avx2 : __builtin_cpu_supports("sse4.1") ? SimdLevel::Sse41 : SimdLevel::Scalar;
+#else
+	return SimdLevel::Scalar;
+#endif
+}
+
+// what the dispatchers go by; the benchmarks lower it to time the fallbacks
+inline SimdLevel g_simd = DetectSimd();
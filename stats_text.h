@@ -0,0 +1,98 @@
+#pragma once
+
+// Navigation latency histograms and the stats overlay's text. The text is
+// formatted into the caller's buffer, so drawing the overlay allocates
+// nothing.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cwchar>
+
+#include "usage.h"
+
+struct LatencyHistogram
+{
+	static constexpr int PerDoubling = 8;
+	static constexpr int Buckets = 16 * PerDoubling; // 0.25 ms to 16 s, about 9% wide
+	static constexpr double MinMs = 0.25;
+
+	void Add(double ms)
+	{
+		int i = ms > MinMs ? (int)(std::log2(ms / MinMs) * PerDoubling) : 0;
+		++counts[(std::min)(i, Buckets - 1)];
+		++total;
+		maxMs = (std::max)(maxMs, ms);
+	}
+
+	// upper edge of the bucket holding the p-th fraction of the samples
+	double Percentile(double p) const
+	{
+		uint64_t rank = (std::max)((uint64_t)1, (uint64_t)std::ceil(p * total)), seen = 0;
+		for (int i = 0; i < Buckets && total; ++i)
+		{
+			seen += counts[i];
+			if (seen >= rank) return (std::min)(maxMs, MinMs * std::exp2((i + 1.0) / PerDoubling));
+		}
+		return maxMs;
+	}
+
+	std::array<uint32_t, Buckets> counts{};
+	uint32_t total = 0;
+	double maxMs = 0;
+};
+
+// what the image on screen cost to get there
+struct FrameCost
+{
+	double decodeMs = 0;
+	bool scaled = false; // else drawn as decoded
+	double scaleMs = 0;
+	unsigned scaledW = 0, scaledH = 0;
+	bool sharpened = false;
+	double sharpenMs = 0;
+};
+
+// The overlay's text into text[size]: the frame's costs if there is one, the
+// navigation latencies, and the session's time per subsystem.
+inline void FormatStatsText(const FrameCost* frame, const LatencyHistogram& first, const LatencyHistogram& full, wchar_t* text, int size)
+{
+	int n = 0;
+	auto add = [&](int written)
+	{
+		n = written < 0 ? size - 1 : (std::min)(n + written, size - 1); // full: keep what fit
+		text[n] = 0;
+	};
+	text[0] = 0;
+	if (frame)
+	{
+		add(swprintf(text + n, size - n, L"Decode %.1f ms\n", frame->decodeMs));
+		if (frame->scaled)
+		{
+			add(swprintf(text + n, size - n, L"Scale %.1f ms (%u x %u)\n", frame->scaleMs, frame->scaledW, frame->scaledH));
+			add(frame->sharpened ? swprintf(text + n, size - n, L"Sharpen %.1f ms\n\n", frame->sharpenMs) : swprintf(text + n, size - n, L"Sharpen off\n\n"));
+		}
+		else
+		{
+			add(swprintf(text + n, size - n, L"Drawn as decoded\n\n"));
+		}
+	}
+
+	add(swprintf(text + n, size - n, L"Navigation ms  p50 / p95 / p99\n"));
+	add(swprintf(text + n, size - n, L"  shown    %6.0f / %4.0f / %4.0f\n", first.Percentile(0.5), first.Percentile(0.95), first.Percentile(0.99)));
+	add(swprintf(text + n, size - n, L"  full     %6.0f / %4.0f / %4.0f\n\n", full.Percentile(0.5), full.Percentile(0.95), full.Percentile(0.99)));
+
+	// where the session's time went
+	add(swprintf(text + n, size - n, L"%-12ls %9ls %9ls %9ls", L"", L"CPU ms", L"read MB", L"write MB"));
+	for (int i = 0; i < (int)Subsystem::Count; ++i)
+	{
+		const SubsystemUsage& u = g_usage[i];
+		if (!u.cycles && !u.bytesRead && !u.bytesWritten) continue;
+		wchar_t name[16]; // the names are ASCII; %hs is not portable
+		int k = 0;
+		for (const char* c = SubsystemNames[i]; *c && k < 15; ++c) name[k++] = (wchar_t)*c;
+		name[k] = 0;
+		add(swprintf(text + n, size - n, L"\n%-12ls %9.0f %9.1f %9.1f", name, CyclesToMs(u.cycles), u.bytesRead / 1048576.0, u.bytesWritten / 1048576.0));
+	}
+}
@@ -0,0 +1,179 @@
+// Counts heap allocations around the viewer's own steady-state code: the
+// loupe's tile cache finding the tiles a paint draws, the stats overlay's
+// text and the latency histograms behind it, and ScopedArena serving small
+// requests from its block. None of them may allocate once warm; the checks
+// on the counter itself must.
+//
+// With glibc every malloc is counted, so allocations inside the C library
+// (swprintf) count too; elsewhere only operator new is.
+
+#include "loupe_tiles.h"
+#include "scoped_arena.h"
+#include "stats_text.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+static std::atomic<long> g_allocs{ 0 };
+
+#ifdef __GLIBC__
+extern "C"
+{
+	void* __libc_malloc(size_t);
+	void* __libc_calloc(size_t, size_t);
+	void* __libc_realloc(void*, size_t);
+	void* __libc_memalign(size_t, size_t);
+
+	void* malloc(size_t size) { ++g_allocs; return __libc_malloc(size); }
+	void* calloc(size_t n, size_t size) { ++g_allocs; return __libc_calloc(n, size); }
+	void* realloc(void* p, size_t size) { ++g_allocs; return __libc_realloc(p, size); }
+	void* aligned_alloc(size_t align, size_t size) { ++g_allocs; return __libc_memalign(align, size); }
+	void* memalign(size_t align, size_t size) { ++g_allocs; return __libc_memalign(align, size); }
+	int posix_memalign(void** p, size_t align, size_t size)
+	{
+		++g_allocs;
+		*p = __libc_memalign(align, size);
+		return *p ? 0 : 12; // ENOMEM
+	}
+}
+#else
+void* operator new(size_t size)
+{
+	++g_allocs;
+	if (void* p = malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+	++g_allocs;
+	size_t a = (std::max)((size_t)align, sizeof(void*));
+	if (void* p = aligned_alloc(a, (size + a - 1) / a * a)) return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { free(p); }
+#endif
+
+static int g_failures = 0;
+
+static void Expect(const char* what, long allocations, long expected)
+{
+	printf("%-48s %ld heap allocations (expected %ld)\n", what, allocations, expected);
+	if (allocations != expected) ++g_failures;
+}
+
+template<class F>
+static long CountAllocs(int iterations, F&& body)
+{
+	long before = g_allocs;
+	for (int i = 0; i < iterations; ++i) body(i);
+	return g_allocs - before;
+}
+
+// stands in for the app's LoupeTile, which holds GDI+ objects
+struct Tile
+{
+	std::shared_ptr<std::vector<BYTE>> pixels;
+};
+
+int main()
+{
+	const int iterations = 10000;
+
+	// DrawLoupe: the 3 x 3 tiles under the loupe and the ring around them,
+	// all rendered, out of a full cache of an image 16 x 16 tiles large
+	auto source = std::make_shared<int>(0);
+	LoupeTileCache<Tile> tiles(64);
+	auto key = [&](UINT tx, UINT ty) { return LoupeTileKey{ source.get(), 6, nullptr, ToneAdjust{}, tx, ty }; };
+	for (UINT ty = 0; ty < 8; ++ty)
+	{
+		for (UINT tx = 0; tx < 8; ++tx) tiles.Add(key(tx, ty), source, { std::make_shared<std::vector<BYTE>>(16) });
+	}
+	int found = 0;
+	long n = CountAllocs(iterations, [&](int i)
+	{
+		UINT cx = 1 + i % 5, cy = 1 + (i / 5) % 5; // the loupe wanders
+		for (UINT ty = cy - 1; ty <= cy + 1; ++ty)
+		{
+			for (UINT tx = cx - 1; tx <= cx + 1; ++tx) found += tiles.Find(key(tx, ty)) != nullptr;
+		}
+	});
+	Expect("loupe paint, tiles cached", n, 0);
+	if (found != iterations * 9 || tiles.Size() != 64)
+	{
+		printf("FAIL loupe: %d of %d tiles found, %zu cached\n", found, iterations * 9, tiles.Size());
+		++g_failures;
+	}
+
+	// a tile still being rendered is asked for again on every paint
+	tiles.StartPending(key(12, 12));
+	n = CountAllocs(iterations, [&](int) { tiles.StartPending(key(12, 12)); tiles.Find(key(12, 12)); });
+	Expect("loupe paint, tile pending", n, 0);
+
+	// DrawStatsOverlay: the text, with a session's worth of samples
+	LatencyHistogram first, full;
+	for (int i = 0; i < 500; ++i)
+	{
+		first.Add(5 + i % 40);
+		full.Add(40 + i % 300);
+	}
+	g_usage[(int)Subsystem::DecodeJpeg].cycles = 123456789;
+	g_usage[(int)Subsystem::Read].bytesRead = 987654321;
+	g_usage[(int)Subsystem::Scale].cycles = 45678901;
+	FrameCost cost;
+	cost.decodeMs = 81.5;
+	cost.scaled = true;
+	cost.scaleMs = 9.25;
+	cost.scaledW = 1920;
+	cost.scaledH = 1280;
+	cost.sharpened = true;
+	cost.sharpenMs = 3.5;
+	wchar_t text[1024];
+	n = CountAllocs(iterations, [&](int i)
+	{
+		first.Add(5 + i % 40);
+		FormatStatsText(i % 2 ? &cost : nullptr, first, full, text, 1024);
+	});
+	Expect("stats overlay text", n, 0);
+	if (!wcsstr(text, L"decode.jpeg") || !wcsstr(text, L"Navigation ms"))
+	{
+		printf("FAIL stats text: %ls\n", text);
+		++g_failures;
+	}
+
+	// ScopedArena: a navigation's small transient buffers stay in its block
+	n = CountAllocs(iterations, [&](int i)
+	{
+		ScopedArena<16384> arena;
+		std::pmr::vector<std::pmr::wstring> window(&arena);
+		window.reserve(9);
+		for (int k = 0; k < 9; ++k) window.emplace_back(80 + (i + k) % 40, L'x');
+		std::pmr::vector<BYTE> property(64 + i % 64, &arena);
+		property[0] = 1;
+	});
+	Expect("arena, small requests", n, 0);
+
+	// checks on the counter: a buffer bigger than the block goes to the heap,
+	// once, and so does a tile that was not cached
+	n = CountAllocs(1, [&](int)
+	{
+		ScopedArena<4096> arena;
+		std::pmr::vector<BYTE> big(64 * 1024, &arena);
+		big[0] = 1;
+	});
+	Expect("arena, oversized request (64 KB from 4 KB)", n, 1);
+	n = CountAllocs(1, [&](int) { tiles.Add(key(15, 15), source, {}); });
+	Expect("loupe, a new tile's list node", n, 1);
+
+	printf(g_failures ? "%d failures\n" : "all passed\n", g_failures);
+	return g_failures ? 1 : 0;
+}
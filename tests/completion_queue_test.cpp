@@ -0,0 +1,91 @@
+// Stress test for CompletionQueue, meant to run under ThreadSanitizer:
+// producers push numbered completions while one consumer drains on wake-ups
+// the way the UI thread does. Checks that nothing is lost or duplicated, that
+// each producer's completions arrive in order, and that no wake-up is missed.
+//
+//   completion_queue_test [--quick]
+
+#include "completion_queue.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Node
+{
+	int producer;
+	int seq;
+	int payload; // plain data written before the push, read after the drain
+	Node* next = nullptr;
+};
+
+int main(int argc, char** argv)
+{
+	bool quick = argc > 1 && !strcmp(argv[1], "--quick");
+	const int producers = 8;
+	const int perProducer = quick ? 20000 : 200000;
+
+	CompletionQueue<Node> queue;
+	std::mutex mutex;
+	std::condition_variable cv;
+	int wakes = 0; // stands in for the posted message
+	queue.SetWake([&]()
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		++wakes;
+		cv.notify_one();
+	});
+
+	std::vector<int> nextSeq(producers, 0);
+	int received = 0, drains = 0, errors = 0;
+	std::thread consumer([&]()
+	{
+		while (received < producers * perProducer)
+		{
+			{
+				std::unique_lock<std::mutex> lk(mutex);
+				if (!cv.wait_for(lk, std::chrono::seconds(10), [&]() { return wakes > 0; }))
+				{
+					printf("FAIL: no wake-up with %d of %d completions received\n", received, producers * perProducer);
+					++errors;
+					return;
+				}
+				wakes = 0;
+			}
+			++drains;
+			queue.Drain([&](Node& n)
+			{
+				if (n.seq != nextSeq[n.producer] || n.payload != n.producer * 1000003 + n.seq)
+				{
+					if (errors++ < 10) printf("FAIL: producer %d sent %d, expected %d\n", n.producer, n.seq, nextSeq[n.producer]);
+				}
+				nextSeq[n.producer] = n.seq + 1;
+				++received;
+			});
+		}
+	});
+
+	std::vector<std::thread> threads;
+	for (int p = 0; p < producers; ++p)
+	{
+		threads.emplace_back([&queue, p, perProducer]()
+		{
+			for (int i = 0; i < perProducer; ++i)
+			{
+				Node* n = new Node{ p, i, p * 1000003 + i };
+				queue.Push(n);
+				if (i % 1024 == 0) std::this_thread::yield();
+			}
+		});
+	}
+	for (auto& t : threads) t.join();
+	consumer.join();
+
+	printf("%d completions from %d producers in %d drains\n", received, producers, drains);
+	if (received != producers * perProducer) ++errors;
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,206 @@
+// Unit tests for the load pipeline's coroutine plumbing in job.h: a job
+// hopping between QoS classes on the pool, a cancelled token dropping a
+// stage, the decode slots' backpressure, and a freed slot going to the
+// highest-QoS waiter first.
+
+#include "job.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static int g_failures = 0;
+
+static void Expect(const char* what, bool ok)
+{
+	if (ok) return;
+	printf("FAIL %s\n", what);
+	++g_failures;
+}
+
+// Holds the pool's only worker until opened, so everything posted meanwhile
+// queues up and the pool picks it by class.
+class Gate
+{
+public:
+	void Block(ThreadPool& pool)
+	{
+		pool.Post(QoS::Interactive, [this]()
+		{
+			std::unique_lock<std::mutex> lk(m_mutex);
+			m_blocked = true;
+			m_cv.notify_all();
+			m_cv.wait(lk, [this]() { return m_open; });
+		});
+		std::unique_lock<std::mutex> lk(m_mutex);
+		m_cv.wait(lk, [this]() { return m_blocked; });
+	}
+
+	void Open()
+	{
+		std::lock_guard<std::mutex> lk(m_mutex);
+		m_open = true;
+		m_cv.notify_all();
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_blocked = false, m_open = false;
+};
+
+// what the jobs of one test did, in order
+struct Trace
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<int> events;
+	int finished = 0;
+
+	void Add(int e)
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		events.push_back(e);
+	}
+
+	void Finish()
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		++finished;
+		cv.notify_all();
+	}
+
+	bool WaitFinished(int n)
+	{
+		std::unique_lock<std::mutex> lk(mutex);
+		return cv.wait_for(lk, std::chrono::seconds(10), [&]() { return finished >= n; });
+	}
+};
+
+static Job Hopper(ThreadPool& pool, int id, QoS first, QoS second, std::thread::id main, Trace& t, bool& offMain)
+{
+	co_await pool.Schedule(first);
+	offMain = std::this_thread::get_id() != main;
+	t.Add(id);
+	co_await pool.Schedule(second);
+	offMain = offMain && std::this_thread::get_id() != main;
+	t.Add(id + 10);
+	t.Finish();
+}
+
+static void TestHop()
+{
+	ThreadPool pool;
+	pool.Start(1);
+	Gate gate;
+	gate.Block(pool);
+	Trace t;
+	bool offMainA = false, offMainB = false;
+	std::thread::id main = std::this_thread::get_id();
+	// queued behind the gate: the interactive stage overtakes the background
+	// one, and so does its hop to prefetch; the background stage then hops
+	// up to interactive
+	Hopper(pool, 1, QoS::Background, QoS::Interactive, main, t, offMainA);
+	Hopper(pool, 2, QoS::Interactive, QoS::Prefetch, main, t, offMainB);
+	gate.Open();
+	Expect("hop: both jobs finish", t.WaitFinished(2));
+	pool.Stop();
+	Expect("hop: every stage runs on the pool", offMainA && offMainB);
+	Expect("hop: stages run by class", t.events == std::vector<int>({ 2, 12, 1, 11 }));
+}
+
+static Job Stage(ThreadPool& pool, int id, CancelToken token, Trace& t)
+{
+	co_await pool.Schedule(QoS::Prefetch);
+	if (!token.Cancelled()) t.Add(id);
+	t.Finish();
+}
+
+static void TestCancel()
+{
+	ThreadPool pool;
+	pool.Start(1);
+	Gate gate;
+	gate.Block(pool);
+	Trace t;
+	CancelToken keep, drop;
+	Stage(pool, 1, keep, t);
+	Stage(pool, 2, drop, t);
+	drop.Cancel(); // after the job was queued, before its stage runs
+	gate.Open();
+	Expect("cancel: both jobs finish", t.WaitFinished(2));
+	pool.Stop();
+	Expect("cancel: only the live token's stage runs", t.events == std::vector<int>({ 1 }));
+
+	CancelToken copy = drop;
+	Expect("cancel: copies share the flag", copy.SameAs(drop) && copy.Cancelled() && !copy.SameAs(keep));
+	g_stopThreads = true;
+	Expect("cancel: stopping cancels every token", keep.Cancelled());
+	g_stopThreads = false;
+	Expect("cancel: a token is live again after the stop is lifted", !keep.Cancelled());
+}
+
+static Job Decode(ThreadPool& pool, AsyncSemaphore& slots, std::atomic<int>& active, std::atomic<int>& peak, Trace& t)
+{
+	co_await slots.Acquire(QoS::Prefetch);
+	int now = ++active;
+	for (int p = peak; now > p && !peak.compare_exchange_weak(p, now);) {}
+	co_await pool.Schedule(QoS::Prefetch);
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	--active;
+	slots.Release();
+	t.Finish();
+}
+
+static void TestBackpressure()
+{
+	ThreadPool pool;
+	pool.Start(4);
+	AsyncSemaphore slots(2);
+	std::atomic<int> active{ 0 }, peak{ 0 };
+	Trace t;
+	const int jobs = 16;
+	for (int i = 0; i < jobs; ++i) Decode(pool, slots, active, peak, t);
+	Expect("backpressure: every job finishes", t.WaitFinished(jobs));
+	pool.Stop();
+	Expect("backpressure: never more jobs past the semaphore than slots", peak <= 2);
+	Expect("backpressure: the slots are used", peak == 2);
+}
+
+static Job Waiter(AsyncSemaphore& slots, QoS qos, int id, Trace& t)
+{
+	co_await slots.Acquire(qos);
+	t.Add(id);
+}
+
+static void TestPriority()
+{
+	AsyncSemaphore slots(1);
+	Trace t;
+	Waiter(slots, QoS::Background, 0, t); // takes the slot without waiting
+	Waiter(slots, QoS::Background, 1, t);
+	Waiter(slots, QoS::Prefetch, 2, t);
+	Waiter(slots, QoS::Background, 3, t);
+	Waiter(slots, QoS::Interactive, 4, t);
+	Waiter(slots, QoS::Prefetch, 5, t);
+	Expect("priority: only the first acquires", t.events == std::vector<int>({ 0 }));
+	// each release resumes the next waiter on this thread
+	for (int i = 0; i < 5; ++i) slots.Release();
+	Expect("priority: highest class first, in arrival order within a class", t.events == std::vector<int>({ 0, 4, 2, 5, 1, 3 }));
+	slots.Release(); // no waiter: the slot is free again
+	Waiter(slots, QoS::Background, 6, t);
+	Expect("priority: a free slot is taken without waiting", t.events.back() == 6);
+}
+
+int main()
+{
+	TestHop();
+	TestCancel();
+	TestBackpressure();
+	TestPriority();
+	printf(g_failures ? "%d failures\n" : "all passed\n", g_failures);
+	return g_failures ? 1 : 0;
+}
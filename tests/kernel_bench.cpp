@@ -0,0 +1,556 @@
+// Benchmarks for the pixel kernels. Each section also checks its fast path
+// against a reference, so the ctest run (--quick, small frames) is a test.
+//
+//   kernel_bench [--quick] [section...]
+//
+// fused: RenderOriented against the staged pipeline it replaces, convert to
+// PARGB, then ApplyOrientation, then resample, per source format.
+// linear: linear-light downscaling against a double-precision area average,
+// and its cost next to the sRGB path, per SIMD level.
+// unsharp: the post-scale sharpening per SIMD level, against a direct
+// implementation of its fixed-point formula.
+// png: the adaptive PNG filter pass, scalar against SSE4.1 and AVX2.
+// tone: re-rendering a 16-bit frame for a new exposure, per SIMD level.
+// colorlut: the display color conversion per SIMD level, against the scalar
+// lookup and a double-precision conversion.
+
+#include "color_lut.h"
+#include "pixel_kernels.h"
+#include "png_filter.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+
+static bool g_quick = false;
+static int g_failures = 0;
+
+// median wall time of fn over a few runs, in ms
+static double TimeMs(const std::function<void()>& fn)
+{
+	const int runs = g_quick ? 3 : 7;
+	std::vector<double> ms;
+	for (int i = 0; i < runs; ++i)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		fn();
+		ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+	}
+	std::sort(ms.begin(), ms.end());
+	return ms[runs / 2];
+}
+
+static void Expect(bool ok, const char* what)
+{
+	if (ok) return;
+	printf("FAIL: %s\n", what);
+	++g_failures;
+}
+
+static bool SamePixels(const PixelBuffer& a, const PixelBuffer& b)
+{
+	if (a.width != b.width || a.height != b.height) return false;
+	const size_t rowBytes = (size_t)a.width * (GetPixelFormatSize(a.format) / 8);
+	for (UINT y = 0; y < a.height; ++y)
+	{
+		if (memcmp(a.Row(y), b.Row(y), rowBytes)) return false;
+	}
+	return true;
+}
+
+// photo-like noise: smooth gradients with grain, and some translucency
+static PixelBuffer MakeSource(UINT w, UINT h, PixelFormat format)
+{
+	PixelBuffer px(w, h, format);
+	std::mt19937 rng(1234);
+	for (UINT y = 0; y < h; ++y)
+	{
+		BYTE* row = px.Row(y);
+		for (UINT x = 0; x < w; ++x)
+		{
+			const uint32_t grain = rng() & 15;
+			const uint32_t r = (x * 255 / w + grain) & 255, g = (y * 255 / h + grain) & 255, b = ((x + y) * 127 / (w + h) + grain) & 255;
+			const uint32_t a = (x / 64 + y / 64) % 5 ? 255 : (rng() & 255);
+			switch (format)
+			{
+			case PixelFormat24bppRGB:
+				row[x * 3] = (BYTE)b;
+				row[x * 3 + 1] = (BYTE)g;
+				row[x * 3 + 2] = (BYTE)r;
+				break;
+			case PixelFormat8bppIndexed:
+				row[x] = (BYTE)(r ^ g);
+				break;
+			case PixelFormat64bppARGB:
+			{
+				uint16_t* p = (uint16_t*)row + x * 4;
+				p[0] = (uint16_t)(r * 257 + grain * 13);
+				p[1] = (uint16_t)(g * 257 + grain * 7);
+				p[2] = (uint16_t)(b * 257);
+				p[3] = (uint16_t)(a * 257);
+				break;
+			}
+			default:
+				((uint32_t*)row)[x] = (a << 24) | (r << 16) | (g << 8) | b;
+				break;
+			}
+		}
+	}
+	if (format == PixelFormat8bppIndexed)
+	{
+		for (uint32_t i = 0; i < 256; ++i) px.palette.push_back(((i % 7 ? 255u : 128u) << 24) | (i << 16) | ((255 - i) << 8) | (i * 3 & 255));
+	}
+	return px;
+}
+
+static void BenchFused()
+{
+	const UINT w = g_quick ? 1200 : 4000, h = g_quick ? 900 : 3000;
+	const LayoutRect panel = { 0, 0, g_quick ? 480 : 1920, g_quick ? 360 : 1080 };
+	struct Format
+	{
+		const char* name;
+		PixelFormat format;
+	};
+	static const Format formats[] = {
+		{ "RGB24 (JPEG)", PixelFormat24bppRGB },
+		{ "ARGB (PNG)", PixelFormat32bppARGB },
+		{ "Indexed8 (GIF)", PixelFormat8bppIndexed },
+		{ "RGBA64 (16-bit PNG)", PixelFormat64bppARGB },
+	};
+
+	printf("fused vs staged, %ux%u source to a %dx%d panel, median ms\n", w, h, panel.width, panel.height);
+	printf("  %-20s %6s %10s %10s %8s\n", "format", "orient", "staged", "fused", "speedup");
+	for (const Format& f : formats)
+	{
+		PixelBuffer src = MakeSource(w, h, f.format);
+		for (int orient : { 1, 6 })
+		{
+			LayoutRect disp = FitRect(IsTransposed(orient) ? h : w, IsTransposed(orient) ? w : h, panel, 2);
+			PixelBuffer staged(disp.width, disp.height), fused(disp.width, disp.height);
+			double stagedMs = TimeMs([&]()
+			{
+				PixelBuffer converted(w, h);
+				RenderOriented(src, 1, w, h, 0, 0, converted, QoS::Interactive);
+				auto oriented = ApplyOrientation(converted, orient, QoS::Interactive);
+				RenderOriented(*oriented, 1, disp.width, disp.height, 0, 0, staged, QoS::Interactive);
+			});
+			double fusedMs = TimeMs([&]() { RenderOriented(src, orient, disp.width, disp.height, 0, 0, fused, QoS::Interactive); });
+			printf("  %-20s %6d %10.2f %10.2f %7.2fx\n", f.name, orient, stagedMs, fusedMs, stagedMs / fusedMs);
+			Expect(SamePixels(staged, fused), "fused and staged frames differ");
+		}
+	}
+}
+
+static const char* const SimdNames[] = { "scalar", "SSE4.1", "AVX2" };
+
+// the levels this CPU runs, scalar first
+static std::vector<SimdLevel> SimdLevels()
+{
+	std::vector<SimdLevel> levels;
+	for (int l = 0; l <= (int)DetectSimd(); ++l) levels.push_back((SimdLevel)l);
+	return levels;
+}
+
+static double SrgbToLinear(double v) { return v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4); }
+static double LinearToSrgb(double v) { return v <= 0.0031308 ? v * 12.92 : 1.055 * std::pow(v, 1 / 2.4) - 0.055; }
+
+// Box-downscales src (32bpp ARGB, straight alpha) to dw x dh in linear light
+// with exact coverage, premultiplied BGRA out.
+static PixelBuffer LinearReference(const PixelBuffer& src, UINT dw, UINT dh)
+{
+	PixelBuffer dst(dw, dh);
+	const double sx = (double)src.width / dw, sy = (double)src.height / dh;
+	for (UINT y = 0; y < dh; ++y)
+	{
+		for (UINT x = 0; x < dw; ++x)
+		{
+			double sum[4] = {};
+			const double x0 = x * sx, x1 = (x + 1) * sx, y0 = y * sy, y1 = (y + 1) * sy;
+			for (int j = (int)y0; j < (int)std::ceil(y1); ++j)
+			{
+				const double wy = (std::min)(y1, j + 1.0) - (std::max)(y0, (double)j);
+				for (int i = (int)x0; i < (int)std::ceil(x1); ++i)
+				{
+					const double wt = wy * ((std::min)(x1, i + 1.0) - (std::max)(x0, (double)i));
+					const uint32_t c = ((const uint32_t*)src.Row(j))[i];
+					const double a = (c >> 24) / 255.0;
+					for (int k = 0; k < 3; ++k) sum[k] += wt * a * SrgbToLinear(((c >> (8 * k)) & 255) / 255.0);
+					sum[3] += wt * a;
+				}
+			}
+			const double a = sum[3] / (sx * sy);
+			uint32_t out = (uint32_t)(a * 255 + 0.5) << 24;
+			for (int k = 0; k < 3; ++k)
+			{
+				if (a > 0) out |= (uint32_t)((std::min)(1.0, LinearToSrgb(sum[k] / sum[3])) * (out >> 24) + 0.5) << (8 * k);
+			}
+			((uint32_t*)dst.Row(y))[x] = out;
+		}
+	}
+	return dst;
+}
+
+static void BenchLinear()
+{
+	// accuracy against the exact result: opaque pixels within one level;
+	// translucent ones are unpremultiplied and premultiplied again on both
+	// sides of the table, which can add a level. Alpha below 16 is left out,
+	// where one level of premultiplied color is a large step.
+	{
+		PixelBuffer src = MakeSource(1000, 750, PixelFormat32bppARGB);
+		PixelBuffer fast(293, 220), exact = LinearReference(src, 293, 220);
+		RenderOriented(src, 1, 293, 220, 0, 0, fast, QoS::Interactive, true);
+		int worst[2] = {};
+		for (UINT y = 0; y < fast.height; ++y)
+		{
+			for (UINT x = 0; x < fast.width; ++x)
+			{
+				const uint32_t a = ((const uint32_t*)fast.Row(y))[x], b = ((const uint32_t*)exact.Row(y))[x];
+				int& bound = worst[(b >> 24) == 255];
+				for (int k = (b >> 24) < 16 ? 3 : 0; k < 4; ++k) bound = (std::max)(bound, std::abs((int)((a >> (8 * k)) & 255) - (int)((b >> (8 * k)) & 255)));
+			}
+		}
+		printf("linear-light box filter, levels from the exact area average: opaque %d, translucent %d\n", worst[1], worst[0]);
+		Expect(worst[1] <= 1, "opaque linear-light pixels more than one level off");
+		Expect(worst[0] <= 2, "translucent linear-light pixels more than two levels off");
+	}
+
+	// the AVX2 kernel against the scalar one, for every source format and
+	// some orientations, down, up and clipped
+	if (DetectSimd() >= SimdLevel::Avx2)
+	{
+		for (PixelFormat format : { PixelFormat24bppRGB, PixelFormat32bppARGB, PixelFormat32bppRGB, PixelFormat32bppPARGB, PixelFormat8bppIndexed, PixelFormat64bppARGB })
+		{
+			PixelBuffer src = MakeSource(301, 207, format);
+			for (int orient : { 1, 3, 4, 6, 8 })
+			{
+				// a third of the size, or a 213 x 171 part of a frame 3.7x as large
+				for (bool down : { true, false })
+				{
+					const UINT ow = IsTransposed(orient) ? 207 : 301, oh = IsTransposed(orient) ? 301 : 207;
+					const UINT dispW = down ? ow / 3 : ow * 37 / 10, dispH = down ? oh / 3 : oh * 37 / 10;
+					const int clipX = down ? 0 : 95, clipY = down ? 0 : 120;
+					PixelBuffer scalar(down ? dispW : 213, down ? dispH : 171), avx2(scalar.width, scalar.height);
+					g_simd = SimdLevel::Scalar;
+					RenderOriented(src, orient, dispW, dispH, clipX, clipY, scalar, QoS::Interactive, true);
+					g_simd = SimdLevel::Avx2;
+					RenderOriented(src, orient, dispW, dispH, clipX, clipY, avx2, QoS::Interactive, true);
+					Expect(SamePixels(scalar, avx2), "AVX2 linear-light frame differs from the scalar one");
+				}
+			}
+		}
+		g_simd = DetectSimd();
+	}
+
+	const UINT w = g_quick ? 1920 : 7680, h = g_quick ? 1080 : 4320;
+	const UINT dw = g_quick ? 480 : 1920, dh = g_quick ? 270 : 1080;
+	printf("%ux%u to %ux%u, box filter, median ms\n", w, h, dw, dh);
+	printf("  %-8s %6s %8s %8s %8s\n", "format", "orient", "sRGB", "linear", "AVX2");
+	for (PixelFormat format : { PixelFormat24bppRGB, PixelFormat32bppARGB })
+	{
+		PixelBuffer src = MakeSource(w, h, format);
+		for (int orient : { 1, 6 })
+		{
+			const UINT fw = IsTransposed(orient) ? dh : dw, fh = IsTransposed(orient) ? dw : dh;
+			PixelBuffer out(fw, fh);
+			printf("  %-8s %6d", format == PixelFormat24bppRGB ? "RGB24" : "ARGB", orient);
+			printf(" %8.2f", TimeMs([&]() { RenderOriented(src, orient, fw, fh, 0, 0, out, QoS::Interactive); }));
+			g_simd = SimdLevel::Scalar;
+			printf(" %8.2f", TimeMs([&]() { RenderOriented(src, orient, fw, fh, 0, 0, out, QoS::Interactive, true); }));
+			g_simd = DetectSimd();
+			if (g_simd >= SimdLevel::Avx2) printf(" %8.2f", TimeMs([&]() { RenderOriented(src, orient, fw, fh, 0, 0, out, QoS::Interactive, true); }));
+			printf("\n");
+		}
+	}
+}
+
+static void BenchTone()
+{
+	// the AVX2 kernel against the scalar one, every orientation, down, up
+	// and clipped, with and without a tone adjustment
+	if (DetectSimd() >= SimdLevel::Avx2)
+	{
+		PixelBuffer src = MakeSource(301, 207, PixelFormat64bppARGB);
+		for (ToneAdjust tone : { ToneAdjust{}, ToneAdjust{ 1.5f, 0.8f } })
+		{
+			for (int orient = 1; orient <= 8; ++orient)
+			{
+				for (bool down : { true, false })
+				{
+					const UINT ow = IsTransposed(orient) ? 207 : 301, oh = IsTransposed(orient) ? 301 : 207;
+					const UINT dispW = down ? ow / 3 : ow * 37 / 10, dispH = down ? oh / 3 : oh * 37 / 10;
+					const int clipX = down ? 0 : 95, clipY = down ? 0 : 120;
+					PixelBuffer scalar(down ? dispW : 213, down ? dispH : 171), avx2(scalar.width, scalar.height);
+					g_simd = SimdLevel::Scalar;
+					RenderOriented(src, orient, dispW, dispH, clipX, clipY, scalar, QoS::Interactive, false, tone);
+					g_simd = SimdLevel::Avx2;
+					RenderOriented(src, orient, dispW, dispH, clipX, clipY, avx2, QoS::Interactive, false, tone);
+					Expect(SamePixels(scalar, avx2), "AVX2 16-bit frame differs from the scalar one");
+				}
+			}
+		}
+		g_simd = DetectSimd();
+	}
+
+	// an exposure change: a new tone table and the frame rendered again
+	const UINT w = g_quick ? 1920 : 7680, h = g_quick ? 1080 : 4320;
+	const UINT dw = g_quick ? 480 : 1920, dh = g_quick ? 270 : 1080;
+	PixelBuffer src = MakeSource(w, h, PixelFormat64bppARGB);
+	printf("16-bit %ux%u to %ux%u, new exposure, median ms\n", w, h, dw, dh);
+	printf("  %6s", "orient");
+	for (SimdLevel level : SimdLevels()) printf(" %8s", SimdNames[(int)level]);
+	printf("\n");
+	float exposure = 0;
+	for (int orient : { 1, 6 })
+	{
+		const UINT fw = IsTransposed(orient) ? dh : dw, fh = IsTransposed(orient) ? dw : dh;
+		PixelBuffer out(fw, fh);
+		printf("  %6d", orient);
+		for (SimdLevel level : SimdLevels())
+		{
+			g_simd = level;
+			printf(" %8.2f", TimeMs([&]()
+			{
+				exposure += 0.25f;
+				RenderOriented(src, orient, fw, fh, 0, 0, out, QoS::Interactive, false, { exposure, 1 });
+			}));
+		}
+		printf("\n");
+	}
+	g_simd = DetectSimd();
+}
+
+// UnsharpMask's arithmetic written out per pixel, edges clamped
+static PixelBuffer UnsharpReference(const PixelBuffer& src)
+{
+	static const uint32_t taps[5] = { 6, 58, 128, 58, 6 };
+	const int w = (int)src.width, h = (int)src.height;
+	auto at = [&](int x, int y, int k) { return (uint32_t)src.Row(std::clamp(y, 0, h - 1))[std::clamp(x, 0, w - 1) * 4 + k]; };
+	PixelBuffer dst = src;
+	for (int y = 0; y < h; ++y)
+	{
+		for (int x = 0; x < w; ++x)
+		{
+			const int a = (int)at(x, y, 3);
+			for (int k = 0; k < 3; ++k)
+			{
+				uint32_t sum = 32768;
+				for (int j = 0; j < 5; ++j)
+				{
+					uint32_t row = 0;
+					for (int i = 0; i < 5; ++i) row += taps[i] * at(x + i - 2, y + j - 2, k);
+					sum += taps[j] * row;
+				}
+				const int in = (int)at(x, y, k), blur = (int)(sum >> 16);
+				dst.Row(y)[x * 4 + k] = (BYTE)std::clamp(in + ((in - blur) * 150 >> 8), 0, a);
+			}
+		}
+	}
+	return dst;
+}
+
+static void BenchUnsharp()
+{
+	// odd sizes, so every level has a scalar tail
+	{
+		PixelBuffer src = MakeSource(203, 61, PixelFormat32bppPARGB);
+		for (UINT y = 0; y < src.height; ++y)
+		{
+			for (UINT x = 0; x < src.width; ++x) ((uint32_t*)src.Row(y))[x] = Premultiply(((uint32_t*)src.Row(y))[x]);
+		}
+		PixelBuffer want = UnsharpReference(src);
+		for (SimdLevel level : SimdLevels())
+		{
+			g_simd = level;
+			PixelBuffer got = src;
+			UnsharpMask(got, QoS::Interactive);
+			Expect(SamePixels(got, want), "sharpened frame differs from the reference");
+		}
+		g_simd = DetectSimd();
+	}
+
+	const UINT w = 1920, h = 1080;
+	PixelBuffer src = MakeSource(w, h, PixelFormat32bppPARGB);
+	printf("unsharp mask, %ux%u, median ms\n", w, h);
+	for (SimdLevel level : SimdLevels())
+	{
+		g_simd = level;
+		PixelBuffer work = src;
+		printf("  %-8s %8.2f\n", SimdNames[(int)level], TimeMs([&]() { UnsharpMask(work, QoS::Interactive); }));
+	}
+	g_simd = DetectSimd();
+}
+
+static void BenchPngFilter()
+{
+	// rows of a photo-like RGBA image, as EncodePng filters them
+	const UINT w = g_quick ? 640 : 4000, h = g_quick ? 480 : 3000;
+	PixelBuffer src = MakeSource(w, h, PixelFormat32bppARGB);
+	const size_t rowBytes = (size_t)w * 4;
+	std::vector<BYTE> filtered((rowBytes + 1) * h), reference;
+
+	// every filter and pixel size, odd lengths included, against the scalar code
+	std::mt19937 rng(99);
+	for (int bpp : { 1, 3, 4, 6, 8 })
+	{
+		for (size_t n : { (size_t)1, (size_t)bpp, (size_t)47, (size_t)1000, (size_t)4099 })
+		{
+			std::vector<BYTE> cur(n), prev(n), want(n), got(n);
+			for (size_t i = 0; i < n; ++i) cur[i] = (BYTE)rng(), prev[i] = (BYTE)rng();
+			for (int type = 0; type < 5; ++type)
+			{
+				SimdLevel saved = g_simd;
+				g_simd = SimdLevel::Scalar;
+				PngFilter(type, cur.data(), prev.data(), n, bpp, want.data());
+				uint64_t wantCost = PngFilterCost(want.data(), n);
+				g_simd = saved;
+				PngFilter(type, cur.data(), prev.data(), n, bpp, got.data());
+				Expect(want == got, "PNG filter differs from the scalar one");
+				Expect(PngFilterCost(got.data(), n) == wantCost, "PNG filter cost differs from the scalar one");
+			}
+		}
+	}
+
+	printf("adaptive PNG filtering, %ux%u RGBA, median ms on one thread\n", w, h);
+	for (SimdLevel level : SimdLevels())
+	{
+		g_simd = level;
+		double ms = TimeMs([&]()
+		{
+			std::vector<BYTE> prev(rowBytes, 0), trial(rowBytes);
+			for (UINT y = 0; y < h; ++y)
+			{
+				const BYTE* cur = src.Row(y);
+				uint64_t bestSum = ~0ull;
+				int best = 0;
+				for (int type = 0; type < 5; ++type)
+				{
+					PngFilter(type, cur, prev.data(), rowBytes, 4, trial.data());
+					uint64_t sum = PngFilterCost(trial.data(), rowBytes);
+					if (sum < bestSum) bestSum = sum, best = type;
+				}
+				filtered[y * (rowBytes + 1)] = (BYTE)best;
+				PngFilter(best, cur, prev.data(), rowBytes, 4, &filtered[y * (rowBytes + 1) + 1]);
+				memcpy(prev.data(), cur, rowBytes);
+			}
+		});
+		if (level == SimdLevel::Scalar) reference = filtered;
+		printf("  %-8s %8.2f\n", SimdNames[(int)level], ms);
+		Expect(filtered == reference, "filtered image differs from the scalar one");
+	}
+	g_simd = DetectSimd();
+}
+
+// D50 matrix/TRC profiles as cameras and wide-gamut displays embed them
+static ColorProfile AdobeRgbProfile()
+{
+	ColorProfile p = { { { 0.60974, 0.20528, 0.14919 }, { 0.31111, 0.62567, 0.06322 }, { 0.01947, 0.06087, 0.74457 } } };
+	for (auto& t : p.trc) t.g = 2.19921875;
+	return p;
+}
+
+static ColorProfile DisplayP3Profile()
+{
+	ColorProfile p = SrgbProfile();
+	const double m[3][3] = { { 0.515102, 0.291965, 0.157153 }, { 0.241182, 0.692236, 0.0665819 }, { -0.00104941, 0.0418818, 0.784378 } };
+	memcpy(p.toXyz, m, sizeof(m));
+	return p;
+}
+
+static void BenchColorLut()
+{
+	const ColorProfile adobe = AdobeRgbProfile(), p3 = DisplayP3Profile();
+	struct Pair
+	{
+		const char* name;
+		const ColorProfile *src, *dst;
+	};
+	const Pair pairs[] = { { "Adobe RGB to sRGB", &adobe, &SrgbProfile() }, { "sRGB to Display P3", &SrgbProfile(), &p3 } };
+	const UINT w = 1920, h = 1080;
+	PixelBuffer frame = MakeSource(w, h, PixelFormat32bppPARGB);
+	for (UINT y = 0; y < h; ++y)
+	{
+		for (UINT x = 0; x < w; ++x) ((uint32_t*)frame.Row(y))[x] = Premultiply(((uint32_t*)frame.Row(y))[x]);
+	}
+
+	// every opaque color (a sample with --quick)
+	PixelBuffer colors(4096, g_quick ? 64 : 4096);
+	std::mt19937 rng(5);
+	for (UINT i = 0; i < colors.width * colors.height; ++i) ((uint32_t*)colors.data.data())[i] = 0xFF000000 | (g_quick ? (uint32_t)rng() : i);
+
+	printf("display color conversion, %ux%u, median ms\n", w, h);
+	for (const Pair& pair : pairs)
+	{
+		auto lut = BuildColorLut(*pair.src, *pair.dst);
+		Expect(lut != nullptr, "profiles taken for the same");
+		if (!lut) continue;
+
+		// within a level of converting in doubles, where nothing is clipped
+		double inv[3][3], m[3][3];
+		Invert3x3(pair.dst->toXyz, inv);
+		for (int r = 0; r < 3; ++r)
+		{
+			for (int c = 0; c < 3; ++c) m[r][c] = inv[r][0] * pair.src->toXyz[0][c] + inv[r][1] * pair.src->toXyz[1][c] + inv[r][2] * pair.src->toXyz[2][c];
+		}
+		int worst = 0;
+		for (int i = 0; i < 20000; ++i)
+		{
+			uint32_t in[3] = { (uint32_t)rng() & 255, (uint32_t)rng() & 255, (uint32_t)rng() & 255 };
+			double lin[3], out[3];
+			for (int ch = 0; ch < 3; ++ch) lin[ch] = pair.src->trc[ch].Eval(in[ch] / 255.0);
+			for (int ch = 0; ch < 3; ++ch) out[ch] = m[ch][0] * lin[0] + m[ch][1] * lin[1] + m[ch][2] * lin[2];
+			if ((std::min)({ out[0], out[1], out[2] }) < 0 || (std::max)({ out[0], out[1], out[2] }) > 1) continue;
+			uint32_t got = ColorLutLookup(*lut, in[0], in[1], in[2]);
+			for (int ch = 0; ch < 3; ++ch)
+			{
+				int want = (int)std::lround(pair.dst->trc[ch].Inverse(out[ch]) * 255);
+				worst = (std::max)(worst, std::abs((int)((got >> (16 - 8 * ch)) & 255) - want));
+			}
+		}
+		Expect(worst <= 1, "color conversion off by more than a level");
+
+		printf("  %s, worst error %d\n", pair.name, worst);
+		PixelBuffer wantColors(0, 0), wantFrame(0, 0);
+		for (SimdLevel level : SimdLevels())
+		{
+			g_simd = level;
+			PixelBuffer gotColors = colors, gotFrame = frame;
+			ApplyColorLut(*lut, gotColors, QoS::Interactive);
+			ApplyColorLut(*lut, gotFrame, QoS::Interactive);
+			if (level == SimdLevel::Scalar) wantColors = gotColors, wantFrame = gotFrame;
+			Expect(SamePixels(gotColors, wantColors), "converted colors differ from the scalar ones");
+			Expect(SamePixels(gotFrame, wantFrame), "converted frame differs from the scalar one");
+
+			PixelBuffer work = frame;
+			double ms = TimeMs([&]() { ApplyColorLut(*lut, work, QoS::Interactive); });
+			printf("    %-8s %8.2f\n", SimdNames[(int)level], ms);
+		}
+		g_simd = DetectSimd();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<std::string> sections;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--quick")) g_quick = true;
+		else sections.push_back(argv[i]);
+	}
+	auto wanted = [&](const char* name) { return sections.empty() || std::find(sections.begin(), sections.end(), name) != sections.end(); };
+
+	g_pool.Start((std::max)(2, (int)std::thread::hardware_concurrency()));
+	if (wanted("fused")) BenchFused();
+	if (wanted("linear")) BenchLinear();
+	if (wanted("tone")) BenchTone();
+	if (wanted("unsharp")) BenchUnsharp();
+	if (wanted("png")) BenchPngFilter();
+	if (wanted("colorlut")) BenchColorLut();
+	g_pool.Stop();
+	return g_failures ? 1 : 0;
+}
@@ -0,0 +1,95 @@
+// Unit tests for the panel layout math in layout.h.
+
+#include "layout.h"
+
+#include <cmath>
+#include <cstdio>
+
+static int g_failures = 0;
+
+static void ExpectRect(const char* what, LayoutRect got, LayoutRect want)
+{
+	if (got == want) return;
+	printf("FAIL %s: got %d,%d %dx%d, expected %d,%d %dx%d\n", what, got.x, got.y, got.width, got.height, want.x, want.y, want.width, want.height);
+	++g_failures;
+}
+
+static void TestFit()
+{
+	const LayoutRect panel = { 0, 0, 1000, 800 };
+
+	// regression: a wide image takes the panel's width, and its height follows
+	// from that width, not from the panel's height
+	ExpectRect("wide image, fit", FitRect(4000, 1000, panel, 1), { 0, 275, 1000, 250 });
+	ExpectRect("wide image, fit if larger", FitRect(4000, 1000, panel, 2), { 0, 275, 1000, 250 });
+	ExpectRect("wide, just wider than the panel", FitRect(3000, 2000, panel, 2), { 0, 67, 1000, 666 });
+	ExpectRect("panorama", FitRect(30000, 1000, panel, 2), { 0, 383, 1000, 33 });
+
+	ExpectRect("tall image", FitRect(1000, 4000, panel, 2), { 400, 0, 200, 800 });
+	ExpectRect("same aspect as the panel", FitRect(2000, 1600, panel, 2), { 0, 0, 1000, 800 });
+
+	// small images stay at their size unless zoom fits them
+	ExpectRect("small, fit if larger", FitRect(100, 50, panel, 2), { 450, 375, 100, 50 });
+	ExpectRect("small, fit", FitRect(100, 50, panel, 1), { 0, 150, 1000, 500 });
+	ExpectRect("large, actual size", FitRect(4000, 1000, panel, 0), { -1500, -100, 4000, 1000 });
+
+	// taller than the panel only, though narrower
+	ExpectRect("narrow but too tall", FitRect(500, 1600, panel, 2), { 375, 0, 250, 800 });
+
+	// the panel's origin carries over
+	ExpectRect("offset panel", FitRect(4000, 1000, { 20, 40, 1000, 800 }, 2), { 20, 315, 1000, 250 });
+
+	// nothing to scale
+	ExpectRect("empty image", FitRect(0, 0, panel, 1), { 500, 400, 0, 0 });
+}
+
+static void Transform(const LayoutMatrix& m, float x, float y, float& ox, float& oy)
+{
+	ox = m.m11 * x + m.m21 * y + m.dx;
+	oy = m.m12 * x + m.m22 * y + m.dy;
+}
+
+// the stored image's top-left and top-right corners end up at these corners
+// of the display rect (0 top-left, 1 top-right, 2 bottom-right, 3 bottom-left)
+static const int g_corners[9][2] = { {}, { 0, 1 }, { 1, 0 }, { 2, 3 }, { 3, 2 }, { 0, 3 }, { 1, 2 }, { 2, 1 }, { 3, 0 } };
+
+static void TestOrientation()
+{
+	const LayoutRect panel = { 10, 20, 1200, 900 };
+	const unsigned w = 3000, h = 2000;
+	for (int orient = 1; orient <= 8; ++orient)
+	{
+		LayoutRect rect;
+		LayoutMatrix mx;
+		OrientedLayout(w, h, orient, panel, 2, rect, mx);
+		LayoutRect disp = FitRect(IsTransposed(orient) ? h : w, IsTransposed(orient) ? w : h, panel, 2);
+		if (IsTransposed(orient) ? (rect.width != disp.height || rect.height != disp.width) : !(rect == disp))
+		{
+			printf("FAIL orientation %d: unrotated rect %dx%d for display rect %dx%d\n", orient, rect.width, rect.height, disp.width, disp.height);
+			++g_failures;
+		}
+
+		const float cornerX[4] = { (float)disp.x, (float)(disp.x + disp.width), (float)(disp.x + disp.width), (float)disp.x };
+		const float cornerY[4] = { (float)disp.y, (float)disp.y, (float)(disp.y + disp.height), (float)(disp.y + disp.height) };
+		const float fromX[2] = { (float)rect.x, (float)(rect.x + rect.width) };
+		for (int k = 0; k < 2; ++k)
+		{
+			float x, y;
+			Transform(mx, fromX[k], (float)rect.y, x, y);
+			int want = g_corners[orient][k];
+			if (std::abs(x - cornerX[want]) > 1 || std::abs(y - cornerY[want]) > 1)
+			{
+				printf("FAIL orientation %d: stored corner %d lands at %.1f,%.1f, expected %.1f,%.1f\n", orient, k, x, y, cornerX[want], cornerY[want]);
+				++g_failures;
+			}
+		}
+	}
+}
+
+int main()
+{
+	TestFit();
+	TestOrientation();
+	printf(g_failures ? "%d failures\n" : "all passed\n", g_failures);
+	return g_failures ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+// Scheduling benchmark for ThreadPool: how long interactive work waits for a
+// worker while the pool is flooded with background work, against the same
+// pool idle. Fails if more background tasks ever run at once than the cap.
+//
+//   thread_pool_bench [--quick] [--threads N]
+
+#include "thread_pool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using Clock = std::chrono::steady_clock;
+
+static void Spin(std::chrono::microseconds d)
+{
+	auto end = Clock::now() + d;
+	while (Clock::now() < end) {}
+}
+
+struct Latency
+{
+	double p50, p99, max; // microseconds
+};
+
+// posts samples interactive tasks, one every gap, and measures post to start
+static Latency MeasureInteractive(int samples, std::chrono::microseconds gap)
+{
+	std::vector<double> waits(samples);
+	std::atomic<int> done{ 0 };
+	for (int i = 0; i < samples; ++i)
+	{
+		auto posted = Clock::now();
+		g_pool.Post(QoS::Interactive, [&waits, &done, i, posted]()
+		{
+			waits[i] = std::chrono::duration<double, std::micro>(Clock::now() - posted).count();
+			++done;
+		});
+		Spin(gap);
+	}
+	while (done < samples) std::this_thread::yield();
+	std::sort(waits.begin(), waits.end());
+	return { waits[samples / 2], waits[samples * 99 / 100], waits.back() };
+}
+
+int main(int argc, char** argv)
+{
+	bool quick = false;
+	int threads = (std::max)(2, (int)std::thread::hardware_concurrency());
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--quick")) quick = true;
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc) threads = (std::max)(1, atoi(argv[++i]));
+	}
+	const int backgroundTasks = quick ? 400 : 4000;
+	const int samples = quick ? 100 : 1000;
+	const auto taskTime = std::chrono::microseconds(quick ? 500 : 2000);
+	const auto gap = std::chrono::microseconds(quick ? 1000 : 2000);
+
+	g_pool.Start(threads);
+	Latency idle = MeasureInteractive(samples, gap);
+
+	// the flood: every task checks how many background tasks run with it
+	std::atomic<int> running{ 0 }, peak{ 0 }, finished{ 0 };
+	for (int i = 0; i < backgroundTasks; ++i)
+	{
+		g_pool.Post(QoS::Background, [&, taskTime]()
+		{
+			int now = ++running;
+			for (int p = peak; now > p && !peak.compare_exchange_weak(p, now);) {}
+			Spin(taskTime);
+			--running;
+			++finished;
+		});
+	}
+	Latency loaded = MeasureInteractive(samples, gap);
+	int finishedWhileMeasuring = finished;
+
+	// many tiny tasks race for the background slots
+	for (int i = 0; i < backgroundTasks * 10; ++i)
+	{
+		g_pool.Post(QoS::Background, [&]()
+		{
+			int now = ++running;
+			for (int p = peak; now > p && !peak.compare_exchange_weak(p, now);) {}
+			--running;
+			++finished;
+		});
+	}
+	while (finished < backgroundTasks * 11) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	g_pool.Stop();
+
+	printf("threads %d, background cap %d, %u hardware threads\n", threads, g_pool.MaxBackground(), std::thread::hardware_concurrency());
+	printf("interactive wait, idle pool:    p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", idle.p50, idle.p99, idle.max);
+	printf("interactive wait, flooded pool: p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", loaded.p50, loaded.p99, loaded.max);
+	printf("background tasks done while measuring: %d of %d; peak concurrent %d\n", finishedWhileMeasuring, backgroundTasks, (int)peak);
+
+	if (peak > g_pool.MaxBackground())
+	{
+		printf("FAIL: %d background tasks ran at once, cap is %d\n", (int)peak, g_pool.MaxBackground());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+// Thread pool shared by every subsystem that runs work off the UI thread.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <objbase.h>
+#endif
+
+#include "usage.h"
+
+// Quality of service of pool work, highest priority first.
+enum class QoS
+{
+	Interactive, // the image on screen
+	Prefetch,    // neighbours of the image on screen
+	Background,  // scanning, indexing; runs at lowered OS priority
+	Count
+};
+
+// Process-wide work-stealing pool. Each worker owns a deque per QoS class;
+// work posted from a worker goes to its own deque (LIFO, cache-warm), other
+// work to a shared injection queue. An idle worker always takes the highest
+// class available anywhere (own deque, then shared queue, then stealing), so
+// interactive work overtakes everything queued behind it. Background work is
+// capped at all-but-one worker so interactive work never waits for a thread.
+class ThreadPool
+{
+public:
+	void Start(int threads)
+	{
+		m_stop = false;
+		m_maxBackground = (std::max)(1, threads - 1);
+		for (int i = 0; i < threads; ++i) m_workers.push_back(std::make_unique<Worker>());
+		for (int i = 0; i < threads; ++i) m_workers[i]->thread = std::thread([this, i]() { Run(i); });
+	}
+
+	void Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lk(m_sleepMutex);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		for (auto& w : m_workers) w->thread.join();
+		m_workers.clear(); // suspended stages are abandoned, only happens at exit
+		for (auto& q : m_shared) q.clear();
+	}
+
+	void Post(QoS qos, std::function<void()> fn)
+	{
+		if (m_stop) return;
+		if (t_pool == this)
+		{
+			Worker& w = *m_workers[t_worker];
+			std::lock_guard<std::mutex> lk(w.mutex);
+			w.queues[(int)qos].push_back(std::move(fn));
+		}
+		else
+		{
+			std::lock_guard<std::mutex> lk(m_sharedMutex);
+			m_shared[(int)qos].push_back(std::move(fn));
+		}
+		{
+			std::lock_guard<std::mutex> lk(m_sleepMutex);
+			++m_pending[(int)qos];
+		}
+		m_cv.notify_one();
+	}
+
+	struct Awaiter
+	{
+		ThreadPool& pool;
+		QoS qos;
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) { pool.Post(qos, [h]() { h.resume(); }); }
+		void await_resume() const noexcept {}
+	};
+
+	Awaiter Schedule(QoS qos) { return { *this, qos }; }
+
+	int Threads() const { return (int)m_workers.size(); }
+	int MaxBackground() const { return m_maxBackground; }
+
+private:
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> queues[(int)QoS::Count];
+		std::thread thread;
+	};
+
+	// takes the task out of one of the deques of class c
+	bool TryPopClass(int self, int c, std::function<void()>& fn)
+	{
+		int n = (int)m_workers.size();
+		{
+			Worker& w = *m_workers[self];
+			std::lock_guard<std::mutex> lk(w.mutex);
+			if (!w.queues[c].empty())
+			{
+				fn = std::move(w.queues[c].back());
+				w.queues[c].pop_back();
+				return true;
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lk(m_sharedMutex);
+			if (!m_shared[c].empty())
+			{
+				fn = std::move(m_shared[c].front());
+				m_shared[c].pop_front();
+				return true;
+			}
+		}
+		for (int k = 1; k < n; ++k)
+		{
+			Worker& victim = *m_workers[(self + k) % n];
+			std::lock_guard<std::mutex> lk(victim.mutex);
+			if (!victim.queues[c].empty())
+			{
+				fn = std::move(victim.queues[c].front());
+				victim.queues[c].pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// A background task is only taken with a background slot reserved first,
+	// so workers racing for the last slot cannot both get it.
+	bool TryPop(int self, std::function<void()>& fn, QoS& qos)
+	{
+		for (int c = 0; c < (int)QoS::Count; ++c)
+		{
+			if (c == (int)QoS::Background)
+			{
+				int running = m_runningBackground;
+				do
+				{
+					if (running >= m_maxBackground) return false;
+				} while (!m_runningBackground.compare_exchange_weak(running, running + 1));
+				if (!TryPopClass(self, c, fn))
+				{
+					ReleaseBackground();
+					return false;
+				}
+			}
+			else if (!TryPopClass(self, c, fn))
+			{
+				continue;
+			}
+			qos = (QoS)c;
+			return true;
+		}
+		return false;
+	}
+
+	// gives a background slot back; under the sleep mutex, so a worker that
+	// found every slot taken cannot miss the wake-up
+	void ReleaseBackground()
+	{
+		{
+			std::lock_guard<std::mutex> lk(m_sleepMutex);
+			--m_runningBackground;
+		}
+		if (m_pending[(int)QoS::Background] > 0) m_cv.notify_one();
+	}
+
+	bool HasRunnable() const
+	{
+		return m_pending[(int)QoS::Interactive] > 0 || m_pending[(int)QoS::Prefetch] > 0 ||
+			(m_pending[(int)QoS::Background] > 0 && m_runningBackground < m_maxBackground);
+	}
+
+	void Run(int self)
+	{
+		t_pool = this;
+		t_worker = self;
+#ifdef _WIN32
+		CoInitializeEx(nullptr, COINIT_MULTITHREADED); // WIC codecs run on workers
+#endif
+		bool background = false;
+		for (;;)
+		{
+			std::function<void()> fn;
+			QoS qos = QoS::Interactive;
+			if (!TryPop(self, fn, qos))
+			{
+				std::unique_lock<std::mutex> lk(m_sleepMutex);
+				m_cv.wait(lk, [this]() { return m_stop || HasRunnable(); });
+				if (m_stop) break;
+				continue;
+			}
+			--m_pending[(int)qos];
+
+			bool wantBackground = qos == QoS::Background;
+			if (wantBackground != background)
+			{
+#ifdef _WIN32
+				SetThreadPriority(GetCurrentThread(), wantBackground ? THREAD_MODE_BACKGROUND_BEGIN : THREAD_MODE_BACKGROUND_END);
+#endif
+				background = wantBackground;
+			}
+			fn();
+			if (wantBackground) ReleaseBackground();
+		}
+#ifdef _WIN32
+		if (background) SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+		CoUninitialize();
+#endif
+	}
+
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::mutex m_sharedMutex;
+	std::deque<std::function<void()>> m_shared[(int)QoS::Count];
+	std::mutex m_sleepMutex;
+	std::condition_variable m_cv;
+	std::atomic<int> m_pending[(int)QoS::Count] = {};
+	std::atomic<int> m_runningBackground{ 0 }; // slots reserved by TryPop
+	int m_maxBackground = 1;
+	std::atomic<bool> m_stop{ true };
+	static thread_local ThreadPool* t_pool;
+	static thread_local int t_worker;
+};
+
+inline thread_local ThreadPool* ThreadPool::t_pool = nullptr;
+inline thread_local int ThreadPool::t_worker = -1;
+
+inline ThreadPool g_pool;
+
+// Runs body(begin, end) over [0, count) in chunks of grain on the pool. The
+// calling thread takes chunks as well and only waits for chunks other workers
+// already started, so this is safe to call from inside a pool task.
+inline void ParallelFor(unsigned count, unsigned grain, QoS qos, const std::function<void(unsigned, unsigned)>& body)
+{
+	struct State
+	{
+		std::atomic<unsigned> next{ 0 };
+		std::atomic<unsigned> done{ 0 };
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+	unsigned chunks = (count + grain - 1) / grain;
+	if (chunks <= 1)
+	{
+		if (count) body(0, count);
+		return;
+	}
+
+	auto state = std::make_shared<State>();
+	auto work = [state, count, grain, chunks, &body]()
+	{
+		for (unsigned c; (c = state->next++) < chunks;)
+		{
+			body(c * grain, (std::min)(count, (c + 1) * grain));
+			if (++state->done == chunks)
+			{
+				std::lock_guard<std::mutex> lk(state->mutex);
+				state->cv.notify_all();
+			}
+		}
+	};
+
+	// helpers charge their share to the caller's subsystem
+	unsigned helpers = (std::min)(chunks, (std::max)(1u, std::thread::hardware_concurrency())) - 1;
+	Subsystem sub = t_usage.current;
+	for (unsigned i = 0; i < helpers; ++i) g_pool.Post(qos, [work, sub]() { UsageScope usage(sub); work(); });
+	work();
+
+	std::unique_lock<std::mutex> lk(state->mutex);
+	state->cv.wait(lk, [&]() { return state->done == chunks; });
+}
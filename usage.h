@@ -0,0 +1,116 @@
+#pragma once
+
+// Resource accounting: thread CPU time and file bytes per subsystem, for the
+// stats overlay and the usage dump. A UsageScope charges the cycles its
+// thread spends inside it to one subsystem; nested scopes take their share out
+// of the enclosing one, and ParallelFor carries the scope over to its helpers.
+// Scopes must not span a co_await, the coroutine may resume on another thread.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <time.h>
+#endif
+
+enum class Subsystem
+{
+	None, Scan, Read, Metadata,
+	DecodeJpeg, DecodePng, DecodeGif, DecodeBmp, DecodeWebp, DecodeAvif, DecodeJxl, DecodeSvg, DecodeOther,
+	Scale, Encode, Count
+};
+
+inline const char* const SubsystemNames[] = {
+	"other", "scan", "read", "metadata",
+	"decode.jpeg", "decode.png", "decode.gif", "decode.bmp", "decode.webp", "decode.avif", "decode.jxl", "decode.svg", "decode.other",
+	"scale", "encode",
+};
+
+struct SubsystemUsage
+{
+	std::atomic<uint64_t> cycles{ 0 };
+	std::atomic<uint64_t> bytesRead{ 0 };
+	std::atomic<uint64_t> bytesWritten{ 0 };
+	std::atomic<uint64_t> pixels{ 0 }; // decoded, for megapixels per CPU second
+};
+
+inline SubsystemUsage g_usage[(int)Subsystem::Count];
+
+struct ThreadUsage
+{
+	Subsystem current = Subsystem::None;
+	uint64_t mark = 0; // thread cycle count when current was last charged
+};
+
+inline thread_local ThreadUsage t_usage;
+
+// CPU time of the calling thread: cycles on Windows, nanoseconds elsewhere
+inline uint64_t ThreadCycles()
+{
+#ifdef _WIN32
+	ULONG64 now = 0;
+	QueryThreadCycleTime(GetCurrentThread(), &now);
+	return now;
+#else
+	timespec ts = {};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// charges the cycles since the last mark to the thread's current subsystem
+inline void ChargeThread()
+{
+	uint64_t now = ThreadCycles();
+	if (t_usage.current != Subsystem::None) g_usage[(int)t_usage.current].cycles += now - t_usage.mark;
+	t_usage.mark = now;
+}
+
+class UsageScope
+{
+public:
+	explicit UsageScope(Subsystem s) : m_outer(t_usage.current) { Switch(s); }
+	~UsageScope() { Switch(m_outer); }
+	UsageScope(const UsageScope&) = delete;
+	UsageScope& operator=(const UsageScope&) = delete;
+
+	// the rest of the scope counts towards s, e.g. once a file's format is known
+	void Switch(Subsystem s)
+	{
+		ChargeThread();
+		t_usage.current = s;
+	}
+
+private:
+	Subsystem m_outer;
+};
+
+inline void ChargeRead(size_t bytes) { g_usage[(int)t_usage.current].bytesRead += bytes; }
+inline void ChargeWrite(size_t bytes) { g_usage[(int)t_usage.current].bytesWritten += bytes; }
+inline void ChargePixels(uint64_t count) { g_usage[(int)t_usage.current].pixels += count; }
+
+inline const std::chrono::steady_clock::time_point g_usageStart = std::chrono::steady_clock::now();
+
+inline double SessionSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - g_usageStart).count();
+}
+
+#ifdef _WIN32
+// Thread cycle counts tick at the TSC rate; it is measured against the
+// session's wall time.
+inline const uint64_t g_usageStartTsc = __rdtsc();
+
+inline double CyclesToMs(uint64_t cycles)
+{
+	double secs = SessionSeconds();
+	uint64_t tsc = __rdtsc() - g_usageStartTsc;
+	return secs > 0 && tsc ? cycles * secs * 1000.0 / tsc : 0;
+}
+#else
+inline double CyclesToMs(uint64_t ns) { return ns / 1e6; }
+#endif